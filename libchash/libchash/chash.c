@@ -5,32 +5,524 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 #include "chash.h"
 
+// Optional USDT/SystemTap static probes (compiled in with --enable-usdt, each probe being guarded by a
+// semaphore so that probes arguments are only computed while a tracer is attached)
+#ifdef CHASH_USDT
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#define CHASH_PROBE_DECLARE(name)    unsigned short libchash_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+#define CHASH_PROBE_ENABLED(name)    __builtin_expect(libchash_##name##_semaphore, 0)
+#define CHASH_PROBE1(name, a1)       STAP_PROBE1(libchash, name, a1)
+#define CHASH_PROBE3(name, a1, a2, a3) STAP_PROBE3(libchash, name, a1, a2, a3)
+#define CHASH_PROBE4(name, a1, a2, a3, a4) STAP_PROBE4(libchash, name, a1, a2, a3, a4)
+CHASH_PROBE_DECLARE(lookup_entry);
+CHASH_PROBE_DECLARE(lookup_return);
+CHASH_PROBE_DECLARE(freeze_start);
+CHASH_PROBE_DECLARE(freeze_done);
+CHASH_PROBE_DECLARE(unserialize_start);
+CHASH_PROBE_DECLARE(unserialize_done);
+CHASH_PROBE_DECLARE(file_unserialize_start);
+CHASH_PROBE_DECLARE(file_unserialize_done);
+#else
+#define CHASH_PROBE_ENABLED(name)    (0)
+#define CHASH_PROBE1(name, a1)
+#define CHASH_PROBE3(name, a1, a2, a3) ((void)sizeof(a3))
+#define CHASH_PROBE4(name, a1, a2, a3, a4) ((void)sizeof(a4))
+#endif
+
 // Private defines
 #define CHASH_MAGIC     (0x48414843)
 #define CHASH_REPLICAS  (128)
+#define CHASH_BATCH     (16)
+#define CHASH_BALANCE   (64)
+
+// Lookups flags
+#define CHASH_LOOKUP_DOMAINS  (0x01)
+#define CHASH_LOOKUP_BALANCE  (0x02)
+
+// Batched lookups candidates states
+#define CHASH_BATCH_DONE    (0)
+#define CHASH_BATCH_SEARCH  (1)
+#define CHASH_BATCH_WRAP    (2)
+
+// Runtime statistics (lookups counters are sharded per thread, each shard in its own cache line)
+typedef struct
+{
+    u_int64_t lookups;
+    u_int64_t balance_lookups;
+    u_int64_t balance_fallbacks;
+    u_int64_t *selections;
+} __attribute__((aligned(64))) CHASH_STATS_SHARD;
+struct CHASH_STATS_STATE
+{
+    u_int16_t         shards_count;
+    u_int16_t         targets_count;
+    u_int64_t         freezes;
+    u_int64_t         freeze_time;
+    u_int64_t         freeze_histogram[CHASH_STATS_BUCKETS];
+    CHASH_STATS_SHARD *shards;
+    u_int64_t         *selections;
+};
+#define CHASH_STATS_ADD(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+
+// Lookups results cache (set-associative, each entry being guarded by its own sequence counter: readers never
+// block and retry nothing, concurrent writers simply skip busy entries)
+#define CHASH_CACHE_WAYS    (4)
+#define CHASH_CACHE_SETS    (1 << 20)
+#define CHASH_CACHE_SHARDS  (16)
+typedef struct
+{
+    u_int32_t sequence;
+    u_int32_t generation;
+    u_int32_t hash;
+    u_int32_t fingerprint;
+    u_char    count;
+    u_char    rank;
+    u_char    referenced;
+    u_char    reserved;
+    u_int16_t targets[CHASH_CACHE_TARGETS];
+} CHASH_CACHE_ENTRY;
+typedef struct
+{
+    u_int64_t hits;
+    u_int64_t misses;
+    u_int64_t evictions;
+} __attribute__((aligned(64))) CHASH_CACHE_SHARD;
+struct CHASH_CACHE_STATE
+{
+    CHASH_CACHE_SHARD shards[CHASH_CACHE_SHARDS];
+    u_int32_t         sets_count;
+    CHASH_CACHE_ENTRY *entries;
+};
+// Shared memory rings (a control segment holds the current generation number, each generation being published into
+// its own immutable segment holding a serialized context, which attached contexts borrow names and continuum from)
+#define CHASH_SHM_MAGIC     (0x4d534843)
+#define CHASH_SHM_NAME      (256)
+#define CHASH_SHM_RETRIES   (8)
+typedef struct
+{
+    u_int32_t magic;
+    u_int32_t reserved;
+    u_int64_t generation;
+} CHASH_SHM_HEADER;
+struct CHASH_SHM_STATE
+{
+    char             name[CHASH_SHM_NAME];
+    CHASH_SHM_HEADER *control;
+    u_int64_t        generation;
+    u_char           *mapping;
+    size_t           size;
+};
+
+#define CHASH_LOAD(value)         __atomic_load_n(&(value), __ATOMIC_RELAXED)
+#define CHASH_STORE(value, data)  __atomic_store_n(&(value), (data), __ATOMIC_RELAXED)
+
+// Parallel freeze (used from CHASH_FREEZE_MINIMUM continuum points, smaller rings being faster to build on one thread)
+#define CHASH_FREEZE_THREADS  (256)
+#define CHASH_FREEZE_MINIMUM  (1 << 16)
+typedef struct CHASH_FREEZE_STATE CHASH_FREEZE_STATE;
+typedef struct
+{
+    pthread_t          thread;
+    CHASH_FREEZE_STATE *state;
+    u_int16_t          index;
+    u_int16_t          first, last;
+    u_int32_t          start, end;
+    u_char             phase;
+    u_char             started;
+} CHASH_FREEZE_WORKER;
+struct CHASH_FREEZE_STATE
+{
+    CHASH_CONTEXT       *context;
+    CHASH_ITEM          *input;
+    CHASH_ITEM          *output;
+    u_int32_t           *bounds;
+    u_int16_t           count;
+    CHASH_FREEZE_WORKER *workers;
+};
+
+// Failure domains (targets sharing a domain label get the same identifier, unlabelled targets each getting their own)
+// and their serialized trailer (a magic followed by every target domain label, empty for unlabelled targets)
+#define CHASH_DOMAINS_MAGIC  (0x4d444843)
+typedef struct
+{
+    const char *domain;
+    u_int16_t  target;
+} CHASH_DOMAIN_ENTRY;
+struct CHASH_DOMAINS_STATE
+{
+    u_int16_t count;
+    u_int16_t *ids;
+};
+
+// Hot keys detection (a count-min sketch with conservative updates estimates every key lookups count, counters being
+// halved every window observations so that estimates follow the current traffic; keys estimated above the threshold
+// are hot and are tracked into a small top table for inspection)
+#define CHASH_HOTKEYS_DEPTH   (4)
+#define CHASH_HOTKEYS_WIDTH   (1 << 13)
+#define CHASH_HOTKEYS_WINDOW  (1 << 20)
+typedef struct
+{
+    u_int32_t hash;
+    u_int32_t fingerprint;
+    u_int16_t length;
+    char      key[CHASH_HOTKEYS_KEY];
+} CHASH_HOTKEYS_ENTRY;
+struct CHASH_HOTKEYS_STATE
+{
+    u_int32_t           threshold;
+    u_int32_t           window;
+    u_int16_t           spread;
+    u_int16_t           count;
+    u_int32_t           lock;
+    u_int64_t           observed;
+    u_int64_t           decay;
+    u_int64_t           spread_lookups;
+    CHASH_HOTKEYS_ENTRY top[CHASH_HOTKEYS_TOP];
+    u_int32_t           *counters;
+};
+
+// Targets points counts serialized trailer (a magic followed by every target points count, only written when some
+// target points count was set apart from its weight, see chash_target_points())
+#define CHASH_POINTS_MAGIC  (0x4d504843)
+
+// Ring deltas (see chash_delta()): a header (size, magic, base and result checksums, base and result targets counts),
+// the base index of every result target (CHASH_DELTA_NEW for added ones), the new or changed targets records (index,
+// weight, points count, name for added targets, domain label) then the removed and inserted continuum points
+#define CHASH_DELTA_MAGIC   (0x4c444843)
+#define CHASH_DELTA_NEW     (65535)
+#define CHASH_DELTA_HEADER  ((2 * sizeof(u_int32_t)) + (2 * sizeof(u_int64_t)) + (2 * sizeof(u_int16_t)))
+typedef struct
+{
+    const char *name;
+    u_int16_t  target;
+} CHASH_NAME_ENTRY;
+
+// Continuum pages (explicit huge pages size being the x86-64 and arm64 default one)
+#define CHASH_PAGES_SIZE       (4096)
+#define CHASH_PAGES_HUGE_SIZE  (2 * 1024 * 1024)
+
+// Single block contexts layout (targets, lookups scratch, continuum then names, see chash_compact())
+#define CHASH_ARENA_ALIGN(size) (((size) + 7) & ~((size_t)7))
+
+// Down targets bitmap (one bit per target index, allocated on first use)
+#define CHASH_DOWN_WORDS   (65536 / 64)
+#define CHASH_DOWN(down, target) ((down) && (CHASH_LOAD((down)[(target) / 64]) & (1ULL << ((target) % 64))))
+
+// Watched rings (a background thread reloads a serialized ring file whenever it changes, as notified by inotify or
+// noticed by polling its attributes, and publishes it into the slot readers don't use: readers pin the current slot
+// with a counter, retrying only when a publication raced them, and the thread waits for the previous slot readers to
+// drain before releasing its ring)
+#define CHASH_WATCH_INTERVAL  (1000)
+#define CHASH_WATCH_DRAIN     (100)
+#define CHASH_WATCH_RELOAD    ('r')
+#define CHASH_WATCH_STOP      ('s')
+typedef struct
+{
+    CHASH_CONTEXT *context;
+    u_int32_t     readers;
+} __attribute__((aligned(64))) CHASH_WATCH_SLOT;
+struct CHASH_WATCH_STATE
+{
+    CHASH_WATCH_SLOT  slots[2];
+    u_int32_t         current;
+    char              *path;
+    const char        *file;
+    u_int32_t         interval;
+    u_char            pages;
+    int               notify, control[2];
+    pthread_t         thread;
+    dev_t             device;
+    ino_t             inode;
+    struct timespec   mtime;
+    off_t             size;
+    u_char            notified, started;
+    int32_t           error;
+    u_int32_t         generation;
+    u_int64_t         reloads, failures, reload_time, reload_time_total;
+};
+
+// Rings registries (rings are subsets of an interned targets table, members being kept sorted by target identifier so
+// that rings with the same members and weights share a single frozen continuum, built on first acquisition and released
+// once no ring nor acquirer references it; continuums borrow the interned targets names, which they reference too)
+typedef struct
+{
+    u_int32_t    target;
+    u_char       weight;
+} CHASH_REGISTRY_MEMBER;
+typedef struct CHASH_REGISTRY_CONTINUUM
+{
+    CHASH_CONTEXT                   context;
+    u_int16_t                       count;
+    CHASH_REGISTRY_MEMBER           *members;
+    u_int32_t                       references;
+    struct CHASH_REGISTRY_CONTINUUM *next;
+} CHASH_REGISTRY_CONTINUUM;
+typedef struct
+{
+    char                     *name;
+    u_int16_t                count;
+    CHASH_REGISTRY_MEMBER    *members;
+    CHASH_REGISTRY_CONTINUUM *continuum;
+} CHASH_REGISTRY_RING;
+typedef struct
+{
+    char         *name;
+    u_int32_t    references;
+} CHASH_REGISTRY_TARGET;
+struct CHASH_REGISTRY_STATE
+{
+    pthread_mutex_t          lock;
+    CHASH_REGISTRY_TARGET    *targets;
+    u_int32_t                targets_size;
+    CHASH_REGISTRY_RING      *rings;
+    u_int32_t                rings_count;
+    CHASH_REGISTRY_CONTINUUM *continuums;
+    u_int64_t                builds, shares;
+};
 
 // Static variables
-static u_char chash_rand_initialized = 0;
+static u_char           chash_rand_initialized = 0;
+static u_int32_t        chash_threads = 0;
+static __thread int32_t chash_thread = -1;
+
+// Context memory allocation (through the context allocator hooks, or the C library by default)
+static void *chash_malloc(CHASH_CONTEXT *context, size_t size)
+{
+    return context->allocator.allocate ? context->allocator.allocate(size, context->allocator.opaque) : malloc(size);
+}
+static void *chash_calloc(CHASH_CONTEXT *context, size_t count, size_t size)
+{
+    void *pointer;
+
+    if (! context->allocator.allocate)
+    {
+        return calloc(count, size);
+    }
+    if ((size && count > ((size_t)-1) / size) || ! (pointer = context->allocator.allocate(count * size, context->allocator.opaque)))
+    {
+        return NULL;
+    }
+    return memset(pointer, 0, count * size);
+}
+static void *chash_realloc(CHASH_CONTEXT *context, void *pointer, size_t size)
+{
+    return context->allocator.reallocate ? context->allocator.reallocate(pointer, size, context->allocator.opaque) : realloc(pointer, size);
+}
+static char *chash_strdup(CHASH_CONTEXT *context, const char *string)
+{
+    size_t size = strlen(string) + 1;
+    char   *copy;
+
+    return (copy = (char *)chash_malloc(context, size)) ? (char *)memcpy(copy, string, size) : NULL;
+}
+static void chash_free(CHASH_CONTEXT *context, void *pointer)
+{
+    if (pointer)
+    {
+        if (context->allocator.release)
+        {
+            context->allocator.release(pointer, context->allocator.opaque);
+        }
+        else
+        {
+            free(pointer);
+        }
+    }
+}
+
+// Allocate the block holding the continuum: with continuum pages options, an anonymous mapping backed by huge pages
+// (explicit ones, or transparent ones as a fallback) and/or prefaulted and locked in memory (*mapped being set to the
+// mapping size), the context allocator otherwise
+static void *chash_pages_allocate(CHASH_CONTEXT *context, size_t size, u_int64_t *mapped)
+{
+    u_char *block = MAP_FAILED;
+    size_t length, offset = 0;
+    int    populate = 0;
+
+    *mapped = 0;
+    if (! context->pages)
+    {
+        return chash_malloc(context, size ? size : 1);
+    }
+#ifdef MAP_POPULATE
+    populate = (context->pages & CHASH_PAGES_LOCK) ? MAP_POPULATE : 0;
+#endif
+    if (context->pages & CHASH_PAGES_HUGE)
+    {
+        length = ((size ? size : 1) + CHASH_PAGES_HUGE_SIZE - 1) & ~((size_t)CHASH_PAGES_HUGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+        block = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+#endif
+        // transparent huge pages only back 2MB aligned ranges: the mapping is over-allocated then trimmed, and only
+        // prefaulted once advised (so that faults allocate huge pages)
+        if (block == MAP_FAILED &&
+            (block = mmap(NULL, length + CHASH_PAGES_HUGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED)
+        {
+            offset = (CHASH_PAGES_HUGE_SIZE - ((size_t)block & (CHASH_PAGES_HUGE_SIZE - 1))) & (CHASH_PAGES_HUGE_SIZE - 1);
+            if (offset)
+            {
+                munmap(block, offset);
+            }
+            munmap(block + offset + length, CHASH_PAGES_HUGE_SIZE - offset);
+            block += offset;
+#ifdef MADV_HUGEPAGE
+            madvise(block, length, MADV_HUGEPAGE);
+#endif
+            for (offset = 0; populate && offset < length; offset += CHASH_PAGES_SIZE)
+            {
+                block[offset] = 0;
+            }
+        }
+    }
+    else
+    {
+        length = ((size ? size : 1) + CHASH_PAGES_SIZE - 1) & ~((size_t)CHASH_PAGES_SIZE - 1);
+        block  = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | populate, -1, 0);
+    }
+    if (block == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    // locking may exceed RLIMIT_MEMLOCK, the pages being prefaulted anyway
+    if (context->pages & CHASH_PAGES_LOCK)
+    {
+        mlock(block, length);
+    }
+    *mapped = length;
+    return block;
+}
+static void chash_pages_release(CHASH_CONTEXT *context, void *block, u_int64_t mapped)
+{
+    if (mapped)
+    {
+        munmap(block, mapped);
+    }
+    else
+    {
+        chash_free(context, block);
+    }
+}
+
+// Monotonic clock in nanoseconds
+static u_int64_t chash_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((u_int64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+// Return the calling thread index (used to pick counters shards)
+static u_int32_t chash_thread_index(void)
+{
+    if (chash_thread < 0)
+    {
+        chash_thread = __atomic_fetch_add(&chash_threads, 1, __ATOMIC_RELAXED) & 0x7fffffff;
+    }
+    return chash_thread;
+}
+
+// Return the statistics shard of the calling thread
+static CHASH_STATS_SHARD *chash_stats_shard(struct CHASH_STATS_STATE *stats)
+{
+    return &(stats->shards[chash_thread_index() % stats->shards_count]);
+}
+
+// Resize per-target selections counters after the targets list changed (counters are reset)
+static void chash_stats_resize(CHASH_CONTEXT *context)
+{
+    struct CHASH_STATS_STATE *stats = context->stats;
+    u_int32_t                stride;
+    u_int16_t                shard;
+
+    if (! stats)
+    {
+        return;
+    }
+    stride = (context->targets_count + 7) & ~7;
+    if (stats->targets_count != context->targets_count || ! stats->selections)
+    {
+        free(stats->selections);
+        stats->selections    = stride ? (u_int64_t *)calloc(stats->shards_count * stride, sizeof(u_int64_t)) : NULL;
+        stats->targets_count = stats->selections ? context->targets_count : 0;
+    }
+    else
+    {
+        memset(stats->selections, 0, stats->shards_count * stride * sizeof(u_int64_t));
+    }
+    for (shard = 0; shard < stats->shards_count; shard ++)
+    {
+        stats->shards[shard].selections = stats->selections ? stats->selections + (shard * stride) : NULL;
+    }
+}
+
+// Account a lookup (and the selected targets) into the calling thread statistics shard
+static void chash_stats_lookup(CHASH_CONTEXT *context, const u_int16_t *targets, int count, int balance, int fallback)
+{
+    CHASH_STATS_SHARD *shard = chash_stats_shard(context->stats);
+    int               index;
+
+    CHASH_STATS_ADD(shard->lookups, 1);
+    if (balance)
+    {
+        CHASH_STATS_ADD(shard->balance_lookups, 1);
+        if (fallback)
+        {
+            CHASH_STATS_ADD(shard->balance_fallbacks, 1);
+        }
+    }
+    if (shard->selections)
+    {
+        for (index = 0; index < count; index ++)
+        {
+            if (targets[index] < context->stats->targets_count)
+            {
+                CHASH_STATS_ADD(shard->selections[targets[index]], 1);
+            }
+        }
+    }
+}
+
+// Account a continuum computation duration (in nanoseconds)
+static void chash_stats_freeze(CHASH_CONTEXT *context, u_int64_t duration)
+{
+    struct CHASH_STATS_STATE *stats = context->stats;
+    int                      bucket = 0;
+
+    duration /= 1000;
+    while (bucket < CHASH_STATS_BUCKETS - 1 && duration >= (1ULL << bucket))
+    {
+        bucket ++;
+    }
+    stats->freezes ++;
+    stats->freeze_time += duration;
+    stats->freeze_histogram[bucket] ++;
+}
 
-// MurmurHash2 light implementation
-static u_int32_t chash_mmhash2(const void *key, int key_size)
+// MurmurHash2 light implementation (the seed is kept as computed by the historical strlen()-based
+// version, so that hashes don't depend on how the key size is provided)
+static u_int32_t chash_mmhash2(const void *key, u_int32_t key_size)
 {
     const u_int32_t magic  = 0x5bd1e995;
     const int       rotate = 24;
     const u_char    *data  = (const u_char *)key;
-    u_int32_t       hash   = 0x4d4d4832 ^ key_size;
+    u_int32_t       hash   = 0x4d4d4832 ^ 0xffffffff;
 
-    if (key_size < 0)
-    {
-        key_size = strlen((char *)data);
-    }
     while (key_size >= 4)
     {
         u_int32_t value = *(u_int32_t *)data;
@@ -55,233 +547,4030 @@ static u_int32_t chash_mmhash2(const void *key, int key_size)
     return hash;
 }
 
-// Compute continuum and block future modifications
-static int chash_sort32(const void *element1, const void *element2)
+// FNV-1a key fingerprint (independent from the continuum hash, cached lookups being identified by both)
+static u_int32_t chash_fingerprint(const char *key, u_int32_t key_size)
 {
-    return (*(u_int32_t *)element1 > *(u_int32_t *)element2) ? 1 : -1;
+    u_int32_t hash = 0x811c9dc5 ^ key_size;
+
+    while (key_size --)
+    {
+        hash ^= (u_char)*(key ++);
+        hash *= 0x01000193;
+    }
+    return hash;
 }
-static int chash_freeze(CHASH_CONTEXT *context)
+
+// Fetch a cached lookup result (returns the number of targets copied into output, 0 on cache miss)
+static int chash_cache_get(CHASH_CONTEXT *context, u_int32_t generation, u_int32_t hash, u_int32_t fingerprint, u_int16_t count,
+                           u_int16_t *output)
 {
-    u_char weight, replica;
-    char   target[128];
-    int    index, position = 0;
+    struct CHASH_CACHE_STATE *cache = context->cache;
+    CHASH_CACHE_ENTRY        *entry = &(cache->entries[(hash & (cache->sets_count - 1)) * CHASH_CACHE_WAYS]);
+    u_int32_t                sequence;
+    int                      way, rank, index;
 
-    if (! context)
+    for (way = 0; way < CHASH_CACHE_WAYS; way ++, entry ++)
     {
-        return CHASH_ERROR_INVALID_PARAMETER;
+        sequence = __atomic_load_n(&(entry->sequence), __ATOMIC_ACQUIRE);
+        if ((sequence & 1) || CHASH_LOAD(entry->hash) != hash || CHASH_LOAD(entry->fingerprint) != fingerprint ||
+            CHASH_LOAD(entry->generation) != generation || CHASH_LOAD(entry->count) < count)
+        {
+            continue;
+        }
+        // a walk for count targets yields the first count targets of any longer walk
+        rank = CHASH_LOAD(entry->rank);
+        rank = rank < count ? rank : count;
+        for (index = 0; index < rank; index ++)
+        {
+            output[index] = CHASH_LOAD(entry->targets[index]);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (CHASH_LOAD(entry->sequence) != sequence)
+        {
+            continue;
+        }
+        if (! CHASH_LOAD(entry->referenced))
+        {
+            CHASH_STORE(entry->referenced, 1);
+        }
+        CHASH_STATS_ADD(cache->shards[chash_thread_index() % CHASH_CACHE_SHARDS].hits, 1);
+        return rank;
     }
-    if (context->magic != CHASH_MAGIC)
+    CHASH_STATS_ADD(cache->shards[chash_thread_index() % CHASH_CACHE_SHARDS].misses, 1);
+    return 0;
+}
+
+// Store a lookup result into the cache (the entry already holding the key is reused first, then any stale
+// entry, then the first entry not referenced since the set was last scanned, CLOCK-like), generation being the one
+// read before the walk so that a result computed against a changing down targets bitmap is never served
+static void chash_cache_put(CHASH_CONTEXT *context, u_int32_t generation, u_int32_t hash, u_int32_t fingerprint, u_int16_t count,
+                            u_int16_t rank, const u_int16_t *targets)
+{
+    struct CHASH_CACHE_STATE *cache = context->cache;
+    CHASH_CACHE_ENTRY        *set = &(cache->entries[(hash & (cache->sets_count - 1)) * CHASH_CACHE_WAYS]), *entry = NULL;
+    u_int32_t                sequence;
+    int                      way, index;
+
+    for (way = 0; way < CHASH_CACHE_WAYS; way ++)
     {
-        return CHASH_ERROR_NOT_INITIALIZED;
+        if (CHASH_LOAD(set[way].hash) == hash && CHASH_LOAD(set[way].fingerprint) == fingerprint)
+        {
+            entry = &(set[way]);
+            break;
+        }
+        if (! entry && (! CHASH_LOAD(set[way].count) || CHASH_LOAD(set[way].generation) != generation))
+        {
+            entry = &(set[way]);
+        }
     }
-    if (context->frozen)
+    if (! entry)
     {
-        return context->items_count;
+        for (way = 0; way < CHASH_CACHE_WAYS && ! entry; way ++)
+        {
+            index = (fingerprint + way) % CHASH_CACHE_WAYS;
+            if (! CHASH_LOAD(set[index].referenced))
+            {
+                entry = &(set[index]);
+            }
+            CHASH_STORE(set[index].referenced, 0);
+        }
+        entry = entry ? entry : &(set[fingerprint % CHASH_CACHE_WAYS]);
+        CHASH_STATS_ADD(cache->shards[chash_thread_index() % CHASH_CACHE_SHARDS].evictions, 1);
     }
-    if (! context->targets_count)
+    sequence = CHASH_LOAD(entry->sequence);
+    if ((sequence & 1) || ! __atomic_compare_exchange_n(&(entry->sequence), &sequence, sequence + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
     {
-        return CHASH_ERROR_NOT_FOUND;
+        return;
     }
-    if (context->continuum)
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    CHASH_STORE(entry->generation, generation);
+    CHASH_STORE(entry->hash, hash);
+    CHASH_STORE(entry->fingerprint, fingerprint);
+    CHASH_STORE(entry->count, count);
+    CHASH_STORE(entry->rank, rank);
+    CHASH_STORE(entry->referenced, 0);
+    for (index = 0; index < rank; index ++)
     {
-        free(context->continuum);
-        context->continuum = NULL;
+        CHASH_STORE(entry->targets[index], targets[index]);
     }
-    context->items_count = 0;
-    for (index = 0; index < context->targets_count; index ++)
+    __atomic_store_n(&(entry->sequence), sequence + 2, __ATOMIC_RELEASE);
+}
+
+// Estimate a key lookups count from the hot keys sketch
+static u_int32_t chash_hotkeys_estimate(struct CHASH_HOTKEYS_STATE *hotkeys, u_int32_t hash, u_int32_t fingerprint)
+{
+    u_int32_t estimate = 0xffffffff, value;
+    int       row;
+
+    for (row = 0; row < CHASH_HOTKEYS_DEPTH; row ++)
     {
-        context->items_count += (context->targets[index].weight * CHASH_REPLICAS);
+        value    = CHASH_LOAD(hotkeys->counters[(row * CHASH_HOTKEYS_WIDTH) + ((hash + (row * fingerprint)) & (CHASH_HOTKEYS_WIDTH - 1))]);
+        estimate = value < estimate ? value : estimate;
     }
-    if (! (context->continuum = (CHASH_ITEM *)calloc(context->items_count, sizeof(CHASH_ITEM))))
+    return estimate;
+}
+
+// Track a hot key into the top table (replacing the coldest tracked key if needed, lookups never waiting on the table
+// lock: a busy table simply delays tracking to the next lookup)
+static void chash_hotkeys_track(struct CHASH_HOTKEYS_STATE *hotkeys, u_int32_t hash, u_int32_t fingerprint, u_int32_t estimate,
+                                const char *candidate, u_int32_t length)
+{
+    u_int32_t coldest = estimate, value;
+    int       index, slot = -1;
+
+    for (index = 0; index < CHASH_LOAD(hotkeys->count); index ++)
     {
-        return CHASH_ERROR_MEMORY;
+        if (CHASH_LOAD(hotkeys->top[index].hash) == hash && CHASH_LOAD(hotkeys->top[index].fingerprint) == fingerprint)
+        {
+            return;
+        }
     }
-    for (index = 0; index < context->targets_count; index ++)
+    if (__atomic_exchange_n(&(hotkeys->lock), 1, __ATOMIC_ACQUIRE))
     {
-        for (weight = 0; weight < context->targets[index].weight; weight ++)
+        return;
+    }
+    for (index = 0; index < hotkeys->count; index ++)
+    {
+        if (hotkeys->top[index].hash == hash && hotkeys->top[index].fingerprint == fingerprint)
         {
-            for (replica = 0; replica < CHASH_REPLICAS; replica ++)
-            {
-                snprintf(target, sizeof(target) - 1, "%s%d%d", context->targets[index].name, weight, replica);
-                context->continuum[position].hash   = chash_mmhash2(target, -1);
-                context->continuum[position].target  = index;
-                position ++;
-            }
+            __atomic_store_n(&(hotkeys->lock), 0, __ATOMIC_RELEASE);
+            return;
+        }
+        if ((value = chash_hotkeys_estimate(hotkeys, hotkeys->top[index].hash, hotkeys->top[index].fingerprint)) < coldest)
+        {
+            coldest = value;
+            slot    = index;
         }
     }
-    qsort(context->continuum, context->items_count, sizeof(CHASH_ITEM), chash_sort32);
-    context->frozen = 1;
-    return context->items_count;
+    if (hotkeys->count < CHASH_HOTKEYS_TOP)
+    {
+        slot = hotkeys->count;
+    }
+    if (slot >= 0)
+    {
+        length = length > CHASH_HOTKEYS_KEY ? CHASH_HOTKEYS_KEY : length;
+        memcpy(hotkeys->top[slot].key, candidate, length);
+        hotkeys->top[slot].length = length;
+        CHASH_STORE(hotkeys->top[slot].hash, hash);
+        CHASH_STORE(hotkeys->top[slot].fingerprint, fingerprint);
+        if (slot == hotkeys->count)
+        {
+            CHASH_STORE(hotkeys->count, hotkeys->count + 1);
+        }
+    }
+    __atomic_store_n(&(hotkeys->lock), 0, __ATOMIC_RELEASE);
 }
 
-// Discard continuum and allow modifications back
-static int chash_unfreeze(CHASH_CONTEXT *context)
+// Count a key lookup into the hot keys sketch and return its updated estimate (counters are updated with relaxed
+// loads and stores rather than atomic increments: concurrent lookups may lose a few counts, never block each other)
+static u_int32_t chash_hotkeys_observe(struct CHASH_HOTKEYS_STATE *hotkeys, u_int32_t hash, u_int32_t fingerprint,
+                                       const char *candidate, u_int32_t length)
 {
-    if (! context)
+    u_int64_t observed, decay;
+    u_int32_t *counter, estimate = chash_hotkeys_estimate(hotkeys, hash, fingerprint) + 1, index;
+    int       row;
+
+    // conservative update: only the counters below the new estimate are raised
+    for (row = 0; row < CHASH_HOTKEYS_DEPTH; row ++)
     {
-        return CHASH_ERROR_INVALID_PARAMETER;
+        counter = &(hotkeys->counters[(row * CHASH_HOTKEYS_WIDTH) + ((hash + (row * fingerprint)) & (CHASH_HOTKEYS_WIDTH - 1))]);
+        if (CHASH_LOAD(*counter) < estimate)
+        {
+            CHASH_STORE(*counter, estimate);
+        }
     }
-    if (context->magic != CHASH_MAGIC)
+    observed = CHASH_LOAD(hotkeys->observed) + 1;
+    CHASH_STORE(hotkeys->observed, observed);
+    decay = CHASH_LOAD(hotkeys->decay);
+    if (observed >= decay && __atomic_compare_exchange_n(&(hotkeys->decay), &decay, observed + hotkeys->window, 0,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        for (index = 0; index < CHASH_HOTKEYS_DEPTH * CHASH_HOTKEYS_WIDTH; index ++)
+        {
+            CHASH_STORE(hotkeys->counters[index], CHASH_LOAD(hotkeys->counters[index]) / 2);
+        }
+    }
+    if (estimate >= hotkeys->threshold)
+    {
+        chash_hotkeys_track(hotkeys, hash, fingerprint, estimate, candidate, length);
+    }
+    return estimate;
+}
+
+// Continuum items total order (by hash then target, so that the continuum only depends on the targets set and not on
+// the sort algorithm or the number of threads it was built with)
+static int chash_compare(const CHASH_ITEM *item1, const CHASH_ITEM *item2)
+{
+    if (item1->hash != item2->hash)
+    {
+        return (item1->hash > item2->hash) ? 1 : -1;
+    }
+    return (item1->target > item2->target) ? 1 : ((item1->target < item2->target) ? -1 : 0);
+}
+static int chash_sort_items(const void *element1, const void *element2)
+{
+    return chash_compare((const CHASH_ITEM *)element1, (const CHASH_ITEM *)element2);
+}
+
+// Hash the given continuum point of a target (points being numbered by weight unit then replica, a target with
+// n points owning the first n points of its sequence, so that adding or removing points never moves the others)
+static u_int32_t chash_point(const char *name, u_int32_t point)
+{
+    char target[128];
+    int  length;
+
+    length = snprintf(target, sizeof(target) - 1, "%s%d%d", name, (int)(point / CHASH_REPLICAS), (int)(point % CHASH_REPLICAS));
+    length = length > (int)sizeof(target) - 2 ? (int)sizeof(target) - 2 : length;
+    return chash_mmhash2(target, length);
+}
+
+// Generate the continuum points of targets [first, last[
+static void chash_points(CHASH_CONTEXT *context, u_int16_t first, u_int16_t last, CHASH_ITEM *output)
+{
+    u_int32_t point;
+    int       index, position = 0;
+
+    for (index = first; index < last; index ++)
+    {
+        for (point = 0; point < context->targets[index].points; point ++)
+        {
+            output[position].hash   = chash_point(context->targets[index].name, point);
+            output[position].target = index;
+            position ++;
+        }
+    }
+}
+
+// First position of a sorted run [start, end[ whose hash is not lower than the given one
+static u_int32_t chash_bound(const CHASH_ITEM *items, u_int32_t start, u_int32_t end, u_int64_t hash)
+{
+    u_int32_t middle;
+
+    while (start < end)
+    {
+        middle = start + ((end - start) / 2);
+        if (items[middle].hash < hash)
+        {
+            start = middle + 1;
+        }
+        else
+        {
+            end = middle;
+        }
+    }
+    return start;
+}
+
+// Merge sorted runs [starts[i], ends[i][ of input into output (binary min-heap of runs indexes)
+static void chash_merge(const CHASH_ITEM *input, u_int32_t *starts, const u_int32_t *ends, u_int16_t count, CHASH_ITEM *output)
+{
+    u_int16_t heap[CHASH_FREEZE_THREADS], size = 0, run, parent, child;
+    u_int32_t position = 0;
+
+    for (run = 0; run < count; run ++)
+    {
+        if (starts[run] < ends[run])
+        {
+            for (child = size ++; child && chash_compare(&(input[starts[run]]), &(input[starts[heap[(child - 1) / 2]]])) < 0; child = parent)
+            {
+                parent      = (child - 1) / 2;
+                heap[child] = heap[parent];
+            }
+            heap[child] = run;
+        }
+    }
+    while (size)
+    {
+        run                = heap[0];
+        output[position ++] = input[starts[run] ++];
+        if (starts[run] >= ends[run])
+        {
+            run = heap[-- size];
+        }
+        for (parent = 0; (child = (parent * 2) + 1) < size; parent = child)
+        {
+            if (child + 1 < size && chash_compare(&(input[starts[heap[child + 1]]]), &(input[starts[heap[child]]])) < 0)
+            {
+                child ++;
+            }
+            if (chash_compare(&(input[starts[heap[child]]]), &(input[starts[run]])) >= 0)
+            {
+                break;
+            }
+            heap[parent] = heap[child];
+        }
+        if (size)
+        {
+            heap[parent] = run;
+        }
+    }
+}
+
+// Parallel freeze worker: generate and sort the points of a targets range into its own run, then (once all runs are
+// sorted) merge the slice of every run falling into its hashes range
+static void *chash_freeze_worker(void *argument)
+{
+    CHASH_FREEZE_WORKER *worker = (CHASH_FREEZE_WORKER *)argument;
+    CHASH_FREEZE_STATE  *state = worker->state;
+    u_int32_t           starts[CHASH_FREEZE_THREADS], ends[CHASH_FREEZE_THREADS], position = 0;
+    u_int16_t           run;
+
+    if (worker->phase == 0)
+    {
+        chash_points(state->context, worker->first, worker->last, state->input + worker->start);
+        qsort(state->input + worker->start, worker->end - worker->start, sizeof(CHASH_ITEM), chash_sort_items);
+        return NULL;
+    }
+    for (run = 0; run < state->count; run ++)
+    {
+        starts[run] = state->bounds[(worker->index * state->count) + run];
+        ends[run]   = state->bounds[((worker->index + 1) * state->count) + run];
+        position   += starts[run] - state->workers[run].start;
+    }
+    chash_merge(state->input, starts, ends, state->count, state->output + position);
+    return NULL;
+}
+
+// Run a parallel freeze phase on all workers (the calling thread taking the first one, and any worker whose thread
+// can't be started being run inline)
+static void chash_freeze_phase(CHASH_FREEZE_STATE *state, u_char phase)
+{
+    u_int16_t index;
+
+    for (index = 0; index < state->count; index ++)
+    {
+        state->workers[index].phase   = phase;
+        state->workers[index].started = 0;
+        if (index && ! pthread_create(&(state->workers[index].thread), NULL, chash_freeze_worker, &(state->workers[index])))
+        {
+            state->workers[index].started = 1;
+        }
+    }
+    for (index = 0; index < state->count; index ++)
+    {
+        if (! state->workers[index].started)
+        {
+            chash_freeze_worker(&(state->workers[index]));
+        }
+    }
+    for (index = 1; index < state->count; index ++)
+    {
+        if (state->workers[index].started)
+        {
+            pthread_join(state->workers[index].thread, NULL);
+        }
+    }
+}
+
+// Build the continuum with several threads: targets are split into ranges holding about the same number of points,
+// each range being generated and sorted as its own run, runs being then merged in parallel by hashes ranges (hashes
+// being uniformly distributed, each merge gets about the same number of points)
+static int chash_freeze_parallel(CHASH_CONTEXT *context, u_int16_t threads)
+{
+    CHASH_FREEZE_STATE  state;
+    CHASH_FREEZE_WORKER workers[CHASH_FREEZE_THREADS];
+    u_int64_t           mapped;
+    u_int32_t           points = 0;
+    u_int16_t           target = 0, index, run;
+
+    threads = (threads > context->targets_count) ? context->targets_count : threads;
+    memset(&state, 0, sizeof(state));
+    memset(workers, 0, sizeof(workers));
+    if (! (state.output = (CHASH_ITEM *)chash_pages_allocate(context, context->items_count * sizeof(CHASH_ITEM), &mapped)) ||
+        ! (state.bounds = (u_int32_t *)chash_malloc(context, (threads + 1) * threads * sizeof(u_int32_t))))
+    {
+        if (state.output)
+        {
+            chash_pages_release(context, state.output, mapped);
+        }
+        return CHASH_ERROR_MEMORY;
+    }
+    state.context = context;
+    state.input   = context->continuum;
+    state.workers = workers;
+    for (index = 0; index < threads && target < context->targets_count; index ++)
+    {
+        workers[index].state = &state;
+        workers[index].index = index;
+        workers[index].first = target;
+        workers[index].start = points;
+        while (target < context->targets_count &&
+               (index == threads - 1 || points < ((u_int64_t)context->items_count * (index + 1)) / threads))
+        {
+            points += context->targets[target ++].points;
+        }
+        workers[index].last = target;
+        workers[index].end  = points;
+    }
+    state.count = index;
+    chash_freeze_phase(&state, 0);
+    for (index = 0; index <= state.count; index ++)
+    {
+        for (run = 0; run < state.count; run ++)
+        {
+            state.bounds[(index * state.count) + run] = (index == state.count) ? workers[run].end :
+                chash_bound(state.input, workers[run].start, workers[run].end, ((u_int64_t)index << 32) / state.count);
+        }
+    }
+    chash_freeze_phase(&state, 1);
+    chash_free(context, state.bounds);
+    chash_pages_release(context, context->continuum, context->pages_size);
+    context->continuum  = state.output;
+    context->pages_size = mapped;
+    return CHASH_ERROR_DONE;
+}
+
+// Assign failure domains identifiers to targets (no domains state being kept when no target is labelled)
+static int chash_sort_domains(const void *element1, const void *element2)
+{
+    return strcmp(((const CHASH_DOMAIN_ENTRY *)element1)->domain, ((const CHASH_DOMAIN_ENTRY *)element2)->domain);
+}
+static void chash_domains_release(CHASH_CONTEXT *context)
+{
+    if (context->domains)
+    {
+        chash_free(context, context->domains->ids);
+        chash_free(context, context->domains);
+        context->domains = NULL;
+    }
+}
+static int chash_domains_index(CHASH_CONTEXT *context)
+{
+    struct CHASH_DOMAINS_STATE *domains;
+    CHASH_DOMAIN_ENTRY         *entries = NULL;
+    u_int16_t                  index, labelled = 0, count = 0;
+
+    chash_domains_release(context);
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        labelled += context->targets[index].domain ? 1 : 0;
+    }
+    if (! labelled)
+    {
+        return CHASH_ERROR_DONE;
+    }
+    if (! (domains = (struct CHASH_DOMAINS_STATE *)chash_calloc(context, 1, sizeof(struct CHASH_DOMAINS_STATE))) ||
+        ! (domains->ids = (u_int16_t *)chash_malloc(context, context->targets_count * sizeof(u_int16_t))) ||
+        ! (entries = (CHASH_DOMAIN_ENTRY *)chash_malloc(context, labelled * sizeof(CHASH_DOMAIN_ENTRY))))
+    {
+        if (domains)
+        {
+            chash_free(context, domains->ids);
+        }
+        chash_free(context, domains);
+        return CHASH_ERROR_MEMORY;
+    }
+    for (labelled = 0, index = 0; index < context->targets_count; index ++)
+    {
+        if (context->targets[index].domain)
+        {
+            entries[labelled].domain   = context->targets[index].domain;
+            entries[labelled ++].target = index;
+        }
+        else
+        {
+            domains->ids[index] = count ++;
+        }
+    }
+    qsort(entries, labelled, sizeof(CHASH_DOMAIN_ENTRY), chash_sort_domains);
+    for (index = 0; index < labelled; index ++)
+    {
+        if (index && strcmp(entries[index].domain, entries[index - 1].domain))
+        {
+            count ++;
+        }
+        domains->ids[entries[index].target] = count;
+    }
+    domains->count   = count + 1;
+    context->domains = domains;
+    chash_free(context, entries);
+    return CHASH_ERROR_DONE;
+}
+
+// Compute continuum and block future modifications
+static int chash_freeze(CHASH_CONTEXT *context)
+{
+    u_int64_t start = 0;
+    int       index, status;
+
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if (context->frozen)
+    {
+        return context->items_count;
+    }
+    if (! context->targets_count)
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    if (context->stats || CHASH_PROBE_ENABLED(freeze_done))
+    {
+        start = chash_now();
+    }
+    CHASH_PROBE1(freeze_start, context->targets_count);
+    if (context->continuum)
+    {
+        chash_pages_release(context, context->continuum, context->pages_size);
+        context->continuum = NULL;
+    }
+    context->items_count = 0;
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        context->items_count += context->targets[index].points;
+    }
+    if (! (context->continuum = (CHASH_ITEM *)chash_pages_allocate(context, context->items_count * sizeof(CHASH_ITEM), &(context->pages_size))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    if (context->freeze_threads > 1 && context->targets_count > 1 && context->items_count >= CHASH_FREEZE_MINIMUM)
+    {
+        if ((status = chash_freeze_parallel(context, context->freeze_threads)) < 0)
+        {
+            return status;
+        }
+    }
+    else
+    {
+        chash_points(context, 0, context->targets_count, context->continuum);
+        qsort(context->continuum, context->items_count, sizeof(CHASH_ITEM), chash_sort_items);
+    }
+    if ((status = chash_domains_index(context)) < 0)
+    {
+        return status;
+    }
+    context->frozen = 1;
+    context->generation ++;
+    if (context->stats)
+    {
+        chash_stats_resize(context);
+        chash_stats_freeze(context, chash_now() - start);
+    }
+    CHASH_PROBE3(freeze_done, context->targets_count, context->items_count, start ? chash_now() - start : 0);
+    return context->items_count;
+}
+
+// Stop borrowing targets names and continuum from a shared ring (names are copied when keep is set, the continuum
+// being computed again on next freeze)
+static int chash_shm_close(CHASH_CONTEXT *context, u_char keep)
+{
+    struct CHASH_SHM_STATE *shm = context->shm;
+    u_int16_t              index;
+    char                   **names = NULL;
+
+    if (keep && context->targets_count)
+    {
+        if (! (names = (char **)chash_calloc(context, 2 * context->targets_count, sizeof(char *))))
+        {
+            return CHASH_ERROR_MEMORY;
+        }
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            if (! (names[index] = chash_strdup(context, context->targets[index].name)) ||
+                (context->targets[index].domain &&
+                 ! (names[context->targets_count + index] = chash_strdup(context, context->targets[index].domain))))
+            {
+                for (index = 0; index < 2 * context->targets_count; index ++)
+                {
+                    chash_free(context, names[index]);
+                }
+                chash_free(context, names);
+                return CHASH_ERROR_MEMORY;
+            }
+        }
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        context->targets[index].name   = names ? names[index] : NULL;
+        context->targets[index].domain = names ? names[context->targets_count + index] : NULL;
+    }
+    chash_free(context, names);
+    context->frozen      = 0;
+    context->items_count = 0;
+    context->continuum   = NULL;
+    munmap(shm->mapping, shm->size);
+    if (shm->control)
+    {
+        munmap(shm->control, sizeof(CHASH_SHM_HEADER));
+    }
+    chash_free(context, shm);
+    context->shm = NULL;
+    return CHASH_ERROR_DONE;
+}
+
+// Move a single block context back to separately allocated targets, names and continuum (lookups scratch being
+// allocated again on next use)
+static int chash_arena_close(CHASH_CONTEXT *context)
+{
+    CHASH_TARGET *targets;
+    CHASH_ITEM   *continuum;
+    u_int64_t    mapped = 0;
+    u_int16_t    index, count;
+
+    targets   = (CHASH_TARGET *)chash_calloc(context, context->targets_count ? context->targets_count : 1, sizeof(CHASH_TARGET));
+    continuum = (CHASH_ITEM *)chash_pages_allocate(context, context->items_count * sizeof(CHASH_ITEM), &mapped);
+    for (count = 0; targets && continuum && count < context->targets_count; count ++)
+    {
+        targets[count]        = context->targets[count];
+        targets[count].domain = NULL;
+        if (! (targets[count].name = chash_strdup(context, context->targets[count].name)) ||
+            (context->targets[count].domain && ! (targets[count].domain = chash_strdup(context, context->targets[count].domain))))
+        {
+            break;
+        }
+    }
+    if (! targets || ! continuum || count < context->targets_count)
+    {
+        for (index = 0; targets && index < context->targets_count; index ++)
+        {
+            chash_free(context, targets[index].name);
+            chash_free(context, targets[index].domain);
+        }
+        chash_free(context, targets);
+        if (continuum)
+        {
+            chash_pages_release(context, continuum, mapped);
+        }
+        return CHASH_ERROR_MEMORY;
+    }
+    memcpy(continuum, context->continuum, context->items_count * sizeof(CHASH_ITEM));
+    chash_pages_release(context, context->arena, context->pages_size);
+    context->arena      = NULL;
+    context->pages_size = mapped;
+    context->targets    = targets;
+    context->continuum  = continuum;
+    context->lookups   = NULL;
+    context->lookup    = NULL;
+    return CHASH_ERROR_DONE;
+}
+
+// Discard continuum and allow modifications back
+static int chash_unfreeze(CHASH_CONTEXT *context)
+{
+    int status;
+
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if ((context->shm && (status = chash_shm_close(context, 1)) < 0) ||
+        (context->arena && (status = chash_arena_close(context)) < 0))
+    {
+        return status;
+    }
+    context->frozen = 0;
+    return CHASH_ERROR_DONE;
+}
+
+// Set or clear a target bit within the down targets bitmap (returns whether the bit changed)
+static int chash_down_set(u_int64_t *down, u_int16_t target, u_char value)
+{
+    u_int64_t mask = 1ULL << (target % 64);
+
+    if (value)
+    {
+        return ! (__atomic_fetch_or(&(down[target / 64]), mask, __ATOMIC_RELEASE) & mask);
+    }
+    return !! (__atomic_fetch_and(&(down[target / 64]), ~mask, __ATOMIC_RELEASE) & mask);
+}
+
+// Copy the names of the targets marked down, so that the marks can be restored by name once the targets table
+// has been replaced (by a reload or a shared ring refresh)
+static int chash_down_save(CHASH_CONTEXT *context, char ***output)
+{
+    u_int16_t index;
+    int       count = 0;
+
+    *output = NULL;
+    if (! context->down || context->magic != CHASH_MAGIC)
+    {
+        return 0;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        if (CHASH_DOWN(context->down, index))
+        {
+            if (! (*output = (char **)chash_realloc(context, *output, (count + 1) * sizeof(char *))) ||
+                ! ((*output)[count] = chash_strdup(context, context->targets[index].name)))
+            {
+                while (*output && count --)
+                {
+                    chash_free(context, (*output)[count]);
+                }
+                chash_free(context, *output);
+                *output = NULL;
+                return CHASH_ERROR_MEMORY;
+            }
+            count ++;
+        }
+    }
+    return count;
+}
+
+// Mark down the targets saved by chash_down_save() that still exist (and release the saved names)
+static void chash_down_restore(CHASH_CONTEXT *context, char **names, int count)
+{
+    u_int16_t index;
+    int       name;
+
+    if (context->down)
+    {
+        for (index = 0; index < CHASH_DOWN_WORDS; index ++)
+        {
+            __atomic_store_n(&(context->down[index]), 0, __ATOMIC_RELEASE);
+        }
+        for (name = 0; name < count; name ++)
+        {
+            for (index = 0; index < context->targets_count; index ++)
+            {
+                if (context->targets[index].name && ! strcmp(names[name], context->targets[index].name))
+                {
+                    chash_down_set(context->down, index, 1);
+                    break;
+                }
+            }
+        }
+    }
+    for (name = 0; name < count; name ++)
+    {
+        chash_free(context, names[name]);
+    }
+    chash_free(context, names);
+}
+
+// Initialize context
+int chash_initialize(CHASH_CONTEXT *context, u_char force)
+{
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic == CHASH_MAGIC && ! force)
+    {
+        return CHASH_ERROR_ALREADY_INITIALIZED;
+    }
+    memset(context, 0, sizeof(CHASH_CONTEXT));
+    context->magic = CHASH_MAGIC;
+    return CHASH_ERROR_DONE;
+}
+
+// Release targets and continuum (opt-in features state is kept)
+static void chash_release(CHASH_CONTEXT *context)
+{
+    u_int16_t index;
+
+    if (context->shm)
+    {
+        chash_shm_close(context, 0);
+    }
+    if (context->arena)
+    {
+        chash_pages_release(context, context->arena, context->pages_size);
+        context->arena = NULL;
+    }
+    else
+    {
+        if (context->targets)
+        {
+            for (index = 0; index < context->targets_count; index ++)
+            {
+                chash_free(context, context->targets[index].name);
+                chash_free(context, context->targets[index].domain);
+            }
+            chash_free(context, context->targets);
+        }
+        if (context->continuum)
+        {
+            chash_pages_release(context, context->continuum, context->pages_size);
+        }
+        chash_free(context, context->lookups);
+        chash_free(context, context->lookup);
+    }
+    context->pages_size    = 0;
+    chash_domains_release(context);
+    context->frozen        = 0;
+    context->targets_count = 0;
+    context->targets       = NULL;
+    context->items_count   = 0;
+    context->continuum     = NULL;
+    context->lookups       = NULL;
+    context->lookup        = NULL;
+}
+
+// Terminate context (free memory)
+int chash_terminate(CHASH_CONTEXT *context, u_char force)
+{
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC && ! force)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    chash_release(context);
+    chash_stats_enable(context, 0);
+    chash_cache_enable(context, 0);
+    chash_hotkeys_enable(context, 0, 0, 0);
+    chash_free(context, context->down);
+    memset(context, 0, sizeof(CHASH_CONTEXT));
+    return CHASH_ERROR_DONE;
+}
+
+// Set the memory allocator hooks of a context, which must not hold any target yet (the C library allocator being used
+// again when allocator is NULL)
+int chash_set_allocator(CHASH_CONTEXT *context, const CHASH_ALLOCATOR *allocator)
+{
+    if (! context || (allocator && (! allocator->allocate || ! allocator->reallocate || ! allocator->release)))
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if (context->targets || context->continuum || context->lookups || context->lookup || context->shm || context->domains ||
+        context->down)
+    {
+        return CHASH_ERROR_ALREADY_INITIALIZED;
+    }
+    if (allocator)
+    {
+        context->allocator = *allocator;
+    }
+    else
+    {
+        memset(&(context->allocator), 0, sizeof(CHASH_ALLOCATOR));
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Lay the frozen ring of source out in a single block allocated for context (targets, lookups scratch, continuum
+// then names), replacing the context ring (down marks being kept by name)
+static int chash_arena_build(CHASH_CONTEXT *context, CHASH_CONTEXT *source)
+{
+    CHASH_TARGET *targets;
+    size_t       size, offset, length;
+    u_int16_t    index, count = source->targets_count;
+    u_int32_t    items = source->items_count;
+    u_int64_t    mapped;
+    u_char       *arena;
+    char         **names = NULL;
+    int          status, marks = 0;
+
+    size = CHASH_ARENA_ALIGN(count * sizeof(CHASH_TARGET)) + CHASH_ARENA_ALIGN(count * sizeof(char *)) +
+           CHASH_ARENA_ALIGN(count * sizeof(CHASH_LOOKUP)) + CHASH_ARENA_ALIGN(items * sizeof(CHASH_ITEM));
+    for (index = 0; index < count; index ++)
+    {
+        size += strlen(source->targets[index].name) + 1;
+        size += source->targets[index].domain ? strlen(source->targets[index].domain) + 1 : 0;
+    }
+    if (! (arena = (u_char *)chash_pages_allocate(context, size, &mapped)))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    if (context != source && (marks = chash_down_save(context, &names)) < 0)
+    {
+        chash_pages_release(context, arena, mapped);
+        return marks;
+    }
+    targets = (CHASH_TARGET *)arena;
+    offset  = CHASH_ARENA_ALIGN(count * sizeof(CHASH_TARGET)) + CHASH_ARENA_ALIGN(count * sizeof(char *)) +
+              CHASH_ARENA_ALIGN(count * sizeof(CHASH_LOOKUP));
+    memcpy(arena + offset, source->continuum, items * sizeof(CHASH_ITEM));
+    offset += CHASH_ARENA_ALIGN(items * sizeof(CHASH_ITEM));
+    for (index = 0; index < count; index ++)
+    {
+        targets[index]      = source->targets[index];
+        length              = strlen(source->targets[index].name) + 1;
+        targets[index].name = (char *)memcpy(arena + offset, source->targets[index].name, length);
+        offset             += length;
+        if (source->targets[index].domain)
+        {
+            length                = strlen(source->targets[index].domain) + 1;
+            targets[index].domain = (char *)memcpy(arena + offset, source->targets[index].domain, length);
+            offset               += length;
+        }
+    }
+    chash_release(context);
+    offset                 = CHASH_ARENA_ALIGN(count * sizeof(CHASH_TARGET));
+    context->arena         = arena;
+    context->pages_size    = mapped;
+    context->targets       = targets;
+    context->targets_count = count;
+    context->lookup        = (char **)(arena + offset);
+    offset                += CHASH_ARENA_ALIGN(count * sizeof(char *));
+    context->lookups       = (CHASH_LOOKUP *)(arena + offset);
+    offset                += CHASH_ARENA_ALIGN(count * sizeof(CHASH_LOOKUP));
+    context->continuum     = (CHASH_ITEM *)(arena + offset);
+    context->items_count   = items;
+    if (context != source)
+    {
+        chash_down_restore(context, names, marks);
+    }
+    if ((status = chash_domains_index(context)) < 0)
+    {
+        return status;
+    }
+    context->frozen = 1;
+    context->generation ++;
+    chash_stats_resize(context);
+    return items;
+}
+
+// Lay a context out in a single block (freezing it if needed), so that releasing or cloning it is a single operation
+// (modifications move it back to separate blocks)
+int chash_compact(CHASH_CONTEXT *context)
+{
+    int status;
+
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if ((status = chash_freeze(context)) < 0 || context->arena)
+    {
+        return status;
+    }
+    return chash_arena_build(context, context);
+}
+
+// Copy the ring of a context into another one (laid out in a single block allocated with the destination allocator)
+int chash_clone(CHASH_CONTEXT *source, CHASH_CONTEXT *destination)
+{
+    int status;
+
+    if (! source || ! destination || source == destination)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (source->magic != CHASH_MAGIC || destination->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if ((status = chash_freeze(source)) < 0)
+    {
+        return status;
+    }
+    return chash_arena_build(destination, source);
+}
+
+// Add target to context
+int chash_add_target(CHASH_CONTEXT *context, const char *target, u_char weight)
+{
+    u_int16_t index = 0;
+    int       status;
+
+    if (! target)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_unfreeze(context)) < 0)
+    {
+        return status;
+    }
+    weight = weight > 100 ? 100 : weight;
+    if (context->targets)
+    {
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            if (! strcmp(target, context->targets[index].name))
+            {
+                context->targets[index].weight = weight;
+                context->targets[index].points = weight * CHASH_REPLICAS;
+                break;
+            }
+        }
+    }
+    if (index == context->targets_count)
+    {
+        if (! (context->targets = (CHASH_TARGET *)chash_realloc(context, context->targets,
+                                                          (context->targets_count + 1) * sizeof(CHASH_TARGET))))
+        {
+            context->targets_count = 0;
+            return CHASH_ERROR_MEMORY;
+        }
+        if (! (context->targets[context->targets_count].name = chash_strdup(context, target)))
+        {
+            return CHASH_ERROR_MEMORY;
+        }
+        context->targets[context->targets_count].weight = weight;
+        context->targets[context->targets_count].domain = NULL;
+        context->targets[context->targets_count].points = weight * CHASH_REPLICAS;
+        context->targets_count ++;
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Set (or clear, with a NULL or empty domain) the failure domain (e.g. zone or rack) of a target
+int chash_target_domain(CHASH_CONTEXT *context, const char *target, const char *domain)
+{
+    u_int16_t index;
+    char      *label = NULL;
+    int       status;
+
+    if (! target)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_unfreeze(context)) < 0)
+    {
+        return status;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        if (! strcmp(target, context->targets[index].name))
+        {
+            if (domain && *domain && ! (label = chash_strdup(context, domain)))
+            {
+                return CHASH_ERROR_MEMORY;
+            }
+            chash_free(context, context->targets[index].domain);
+            context->targets[index].domain = label;
+            return CHASH_ERROR_DONE;
+        }
+    }
+    return CHASH_ERROR_NOT_FOUND;
+}
+
+// Mark a target (by index) down or back up: lookups skip down targets while walking the continuum, their keys being
+// served by the next targets on the ring exactly as if they had been removed, without any rebuild (the context stays
+// frozen, shared rings included, and marks are kept across reloads for the targets that still exist)
+int chash_target_down_index(CHASH_CONTEXT *context, u_int16_t target, u_char down)
+{
+    u_int64_t *bitmap, *expected = NULL;
+
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if (target >= context->targets_count)
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    if (! (bitmap = __atomic_load_n(&(context->down), __ATOMIC_ACQUIRE)))
+    {
+        if (! down)
+        {
+            return CHASH_ERROR_DONE;
+        }
+        if (! (bitmap = (u_int64_t *)chash_calloc(context, CHASH_DOWN_WORDS, sizeof(u_int64_t))))
+        {
+            return CHASH_ERROR_MEMORY;
+        }
+        if (! __atomic_compare_exchange_n(&(context->down), &expected, bitmap, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            chash_free(context, bitmap);
+            bitmap = expected;
+        }
+    }
+    // cached lookups are invalidated by the generation change, once the bitmap is updated
+    if (chash_down_set(bitmap, target, down))
+    {
+        __atomic_add_fetch(&(context->generation), 1, __ATOMIC_RELEASE);
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Mark a target (by name) down or back up (see chash_target_down_index())
+int chash_target_down(CHASH_CONTEXT *context, const char *target, u_char down)
+{
+    u_int16_t index;
+
+    if (! context || ! target)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        if (! strcmp(target, context->targets[index].name))
+        {
+            return chash_target_down_index(context, index, down);
+        }
+    }
+    return CHASH_ERROR_NOT_FOUND;
+}
+
+// Apply new targets points counts (and the closest weights): a frozen continuum is patched instead of being built again,
+// the points removed from shrinking targets and the points added to growing ones being merged with it in a single pass
+static int chash_patch(CHASH_CONTEXT *context, const u_int32_t *points)
+{
+    CHASH_ITEM *added, *removed, *continuum;
+    u_int64_t  mapped;
+    u_int32_t  adds = 0, removes = 0, point, input = 0, add = 0, remove = 0, output = 0;
+    u_int16_t  index;
+    int        status;
+
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        if (points[index] > context->targets[index].points)
+        {
+            adds += points[index] - context->targets[index].points;
+        }
+        else
+        {
+            removes += context->targets[index].points - points[index];
+        }
+    }
+    if (context->frozen && (adds || removes))
+    {
+        if (context->arena && (status = chash_arena_close(context)) < 0)
+        {
+            return status;
+        }
+        added     = (CHASH_ITEM *)chash_malloc(context, (adds ? adds : 1) * sizeof(CHASH_ITEM));
+        removed   = (CHASH_ITEM *)chash_malloc(context, (removes ? removes : 1) * sizeof(CHASH_ITEM));
+        continuum = (CHASH_ITEM *)chash_pages_allocate(context, (context->items_count + adds - removes) * sizeof(CHASH_ITEM), &mapped);
+        if (! added || ! removed || ! continuum)
+        {
+            chash_free(context, added);
+            chash_free(context, removed);
+            if (continuum)
+            {
+                chash_pages_release(context, continuum, mapped);
+            }
+            return CHASH_ERROR_MEMORY;
+        }
+        for (adds = 0, removes = 0, index = 0; index < context->targets_count; index ++)
+        {
+            for (point = context->targets[index].points; point < points[index]; point ++, adds ++)
+            {
+                added[adds].hash   = chash_point(context->targets[index].name, point);
+                added[adds].target = index;
+            }
+            for (point = points[index]; point < context->targets[index].points; point ++, removes ++)
+            {
+                removed[removes].hash   = chash_point(context->targets[index].name, point);
+                removed[removes].target = index;
+            }
+        }
+        qsort(added, adds, sizeof(CHASH_ITEM), chash_sort_items);
+        qsort(removed, removes, sizeof(CHASH_ITEM), chash_sort_items);
+        while (input < context->items_count || add < adds)
+        {
+            if (input < context->items_count && remove < removes && ! chash_compare(&(context->continuum[input]), &(removed[remove])))
+            {
+                input ++;
+                remove ++;
+            }
+            else if (add < adds && (input >= context->items_count || chash_compare(&(added[add]), &(context->continuum[input])) < 0))
+            {
+                continuum[output ++] = added[add ++];
+            }
+            else
+            {
+                continuum[output ++] = context->continuum[input ++];
+            }
+        }
+        chash_free(context, added);
+        chash_free(context, removed);
+
+        // a continuum not matching its targets points counts (e.g. restored along with inconsistent counts) is built again
+        if (remove != removes)
+        {
+            chash_pages_release(context, continuum, mapped);
+            if ((status = chash_unfreeze(context)) < 0)
+            {
+                return status;
+            }
+        }
+        else
+        {
+            if (context->shm && (status = chash_shm_close(context, 1)) < 0)
+            {
+                chash_pages_release(context, continuum, mapped);
+                return status;
+            }
+            if (context->continuum)
+            {
+                chash_pages_release(context, context->continuum, context->pages_size);
+            }
+            context->continuum   = continuum;
+            context->pages_size  = mapped;
+            context->items_count = output;
+            context->frozen      = 1;
+            context->generation ++;
+        }
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        context->targets[index].points = points[index];
+        context->targets[index].weight = (points[index] + (CHASH_REPLICAS / 2)) / CHASH_REPLICAS;
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Set the exact number of continuum points of a target (its weight being CHASH_REPLICAS points per unit), a frozen
+// context being patched in place instead of built again
+int chash_target_points(CHASH_CONTEXT *context, const char *target, u_int32_t points)
+{
+    u_int32_t *counts;
+    u_int16_t index, found = 0;
+    int       status;
+
+    if (! context || ! target || points > CHASH_POINTS_MAXIMUM)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if (! (counts = (u_int32_t *)chash_malloc(context, (context->targets_count ? context->targets_count : 1) * sizeof(u_int32_t))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        counts[index] = context->targets[index].points;
+        if (! strcmp(target, context->targets[index].name))
+        {
+            counts[index] = points;
+            found         = 1;
+        }
+    }
+    status = found ? chash_patch(context, counts) : CHASH_ERROR_NOT_FOUND;
+    chash_free(context, counts);
+    return status;
+}
+
+// Adjust targets points counts toward equal utilization given their observed loads (utilization samples, negative
+// for targets without sample): every target moves by gain of its correction (mean load / target load), bounded to
+// step of its points count, all adjustments being scaled down so that at most movement of the continuum points (and
+// thus about the same fraction of keys) change per call (returns the number of points added or removed)
+int chash_rebalance(CHASH_CONTEXT *context, const double *loads, double gain, double step, double movement)
+{
+    u_int32_t *counts;
+    u_int16_t index, samples = 0;
+    double    mean = 0, factor, moved = 0, budget = 0, scale = 1, *deltas;
+    int       status, changed = 0;
+
+    if (! context || ! loads || gain <= 0 || gain > 1 || step <= 0 || step > 1 || movement <= 0 || movement > 1)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if (! context->targets_count)
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        budget += context->targets[index].points;
+        if (loads[index] >= 0 && context->targets[index].points)
+        {
+            mean += loads[index];
+            samples ++;
+        }
+    }
+    if (! samples || (mean /= samples) <= 0)
+    {
+        return 0;
+    }
+    counts = (u_int32_t *)chash_malloc(context, context->targets_count * sizeof(u_int32_t));
+    deltas = (double *)chash_calloc(context, context->targets_count, sizeof(double));
+    if (! counts || ! deltas)
+    {
+        chash_free(context, counts);
+        chash_free(context, deltas);
+        return CHASH_ERROR_MEMORY;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        if (loads[index] >= 0 && context->targets[index].points)
+        {
+            factor = 1 + (gain * ((loads[index] > 0 ? mean / loads[index] : 1 + step) - 1));
+            factor = factor < 1 - step ? 1 - step : (factor > 1 + step ? 1 + step : factor);
+            deltas[index] = context->targets[index].points * (factor - 1);
+            moved += deltas[index] < 0 ? - deltas[index] : deltas[index];
+        }
+    }
+    if (moved > budget * movement)
+    {
+        scale = (budget * movement) / moved;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        // truncated adjustments never exceed the movement budget (sub-point corrections waiting for larger imbalances),
+        // targets without points (disabled by the operator) staying out of the continuum
+        if (! context->targets[index].points)
+        {
+            counts[index] = 0;
+            continue;
+        }
+        counts[index] = context->targets[index].points + (int32_t)(deltas[index] * scale);
+        counts[index] = counts[index] < 1 ? 1 : (counts[index] > CHASH_POINTS_MAXIMUM ? CHASH_POINTS_MAXIMUM : counts[index]);
+        changed += abs((int)counts[index] - (int)context->targets[index].points);
+    }
+    chash_free(context, deltas);
+    status = chash_patch(context, counts);
+    chash_free(context, counts);
+    return status < 0 ? status : changed;
+}
+
+// Remove target from context
+int chash_remove_target(CHASH_CONTEXT *context, const char *target)
+{
+    u_int16_t index;
+    int       status;
+
+    if (! target)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_unfreeze(context)) < 0)
+    {
+        return status;
+    }
+    if (context->targets)
+    {
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            if (! strcmp(target, context->targets[index].name))
+            {
+                chash_free(context, context->targets[index].name);
+                chash_free(context, context->targets[index].domain);
+                memmove(&(context->targets[index]), &(context->targets[index + 1]),
+                        sizeof(CHASH_TARGET) * (context->targets_count - index - 1));
+                context->targets_count --;
+                for (; context->down && index <= context->targets_count; index ++)
+                {
+                    chash_down_set(context->down, index, index < context->targets_count && CHASH_DOWN(context->down, index + 1));
+                }
+                return CHASH_ERROR_DONE;
+            }
+        }
+    }
+    return CHASH_ERROR_NOT_FOUND;
+}
+
+// Clear all targets from context
+int chash_clear_targets(CHASH_CONTEXT *context)
+{
+    u_int16_t index;
+    int       status;
+
+    if ((status = chash_unfreeze(context)) < 0)
+    {
+        return status;
+    }
+    if (context->targets)
+    {
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            chash_free(context, context->targets[index].name);
+            chash_free(context, context->targets[index].domain);
+        }
+        chash_free(context, context->targets);
+        context->targets       = NULL;
+        context->targets_count = 0;
+    }
+    if (context->down)
+    {
+        memset(context->down, 0, CHASH_DOWN_WORDS * sizeof(u_int64_t));
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Return targets count within context
+int chash_targets_count(CHASH_CONTEXT *context)
+{
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    return context->targets_count;
+}
+
+// Mix a 64 bits value (splitmix64 finalizer), checksums summing mixed values so that they can be updated as continuum
+// points are removed or inserted
+static u_int64_t chash_mix(u_int64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+// Hash targets names (continuum points being checksummed along with their target name rather than their target index,
+// which changes as targets are removed)
+static u_int32_t *chash_checksum_names(CHASH_CONTEXT *context, const CHASH_TARGET *targets, u_int16_t count)
+{
+    u_int32_t *names;
+    u_int16_t index;
+
+    if ((names = (u_int32_t *)chash_malloc(context, (count ? count : 1) * sizeof(u_int32_t))))
+    {
+        for (index = 0; index < count; index ++)
+        {
+            names[index] = chash_mmhash2(targets[index].name, strlen(targets[index].name));
+        }
+    }
+    return names;
+}
+
+// Sum the checksums of continuum points
+static u_int64_t chash_checksum_items(const CHASH_ITEM *items, u_int32_t count, const u_int32_t *names)
+{
+    u_int64_t sum = 0;
+    u_int32_t index;
+
+    for (index = 0; index < count; index ++)
+    {
+        sum += chash_mix(((u_int64_t)names[items[index].target] << 32) | items[index].hash);
+    }
+    return sum;
+}
+
+// Combine a continuum points checksum with the targets table (order, weights, points counts and domains labels)
+static u_int64_t chash_checksum_final(const CHASH_TARGET *targets, u_int16_t count, const u_int32_t *names, u_int32_t items, u_int64_t sum)
+{
+    u_int64_t value = ((u_int64_t)count << 32) | items;
+    u_int32_t domain;
+    u_int16_t index;
+
+    for (index = 0; index < count; index ++)
+    {
+        domain = targets[index].domain ? chash_mmhash2(targets[index].domain, strlen(targets[index].domain)) : 0;
+        value += chash_mix(chash_mix(((u_int64_t)index << 48) | ((u_int64_t)targets[index].weight << 32) | targets[index].points) ^
+                           (((u_int64_t)names[index] << 32) | domain));
+    }
+    return chash_mix(value ^ chash_mix(sum));
+}
+
+// Sum the checksums of a frozen context continuum points (computed once per generation)
+static u_int64_t chash_checksum_continuum(CHASH_CONTEXT *context, const u_int32_t *names)
+{
+    if (! context->generation || context->checksum_generation != context->generation)
+    {
+        context->checksum            = chash_checksum_items(context->continuum, context->items_count, names);
+        context->checksum_generation = context->generation;
+    }
+    return context->checksum;
+}
+
+// Save context into a memory chunk (implicit freeze)
+int chash_serialize(CHASH_CONTEXT *context, u_char **output)
+{
+    int status, index, size, position = 0, length, points = 0;
+
+    if (! context || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_freeze(context)) < 0)
+    {
+        return status;
+    }
+    size = (2 * sizeof(u_int32_t)) + sizeof(u_int16_t);
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        size += strlen(context->targets[index].name) + 2;
+    }
+    size += sizeof(u_int32_t) + (context->items_count * sizeof(CHASH_ITEM));
+    if (context->domains)
+    {
+        size += sizeof(u_int32_t);
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            size += (context->targets[index].domain ? strlen(context->targets[index].domain) : 0) + 1;
+        }
+    }
+    for (index = 0; index < context->targets_count && ! points; index ++)
+    {
+        points = context->targets[index].points != context->targets[index].weight * CHASH_REPLICAS;
+    }
+    if (points)
+    {
+        size += sizeof(u_int32_t) + (context->targets_count * sizeof(u_int32_t));
+    }
+    if (! (*output = calloc(1, size)))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    *(u_int32_t *)((*output) + position) = size; position += sizeof(u_int32_t);
+    *(u_int32_t *)((*output) + position) = CHASH_MAGIC; position += sizeof(u_int32_t);
+    *(u_int16_t *)((*output) + position) = context->targets_count; position += sizeof(u_int16_t);
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        *((*output) + position) = context->targets[index].weight; position += sizeof(u_char);
+        length = strlen(context->targets[index].name) + 1;
+        memcpy((*output) + position, context->targets[index].name, length); position += length;
+    }
+    *(u_int32_t *)((*output) + position) = context->items_count; position += sizeof(u_int32_t);
+    memcpy((*output) + position, context->continuum, context->items_count * sizeof(CHASH_ITEM));
+    position += context->items_count * sizeof(CHASH_ITEM);
+    if (context->domains)
+    {
+        *(u_int32_t *)((*output) + position) = CHASH_DOMAINS_MAGIC; position += sizeof(u_int32_t);
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            if (context->targets[index].domain)
+            {
+                length = strlen(context->targets[index].domain);
+                memcpy((*output) + position, context->targets[index].domain, length); position += length;
+            }
+            position ++;
+        }
+    }
+    if (points)
+    {
+        *(u_int32_t *)((*output) + position) = CHASH_POINTS_MAGIC; position += sizeof(u_int32_t);
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            *(u_int32_t *)((*output) + position) = context->targets[index].points; position += sizeof(u_int32_t);
+        }
+    }
+    return size;
+}
+
+// Read the optional trailers of a serialized context: domains labels (copied, or borrowed from a shared ring) then
+// targets points counts (only present when they differ from their weights)
+static int chash_trailers_read(CHASH_CONTEXT *context, CHASH_TARGET *targets, u_int16_t count, const u_char *input, u_int32_t size,
+                               u_int32_t position, u_char borrow)
+{
+    const u_char *end;
+    u_int16_t    index;
+
+    if ((u_int64_t)position + sizeof(u_int32_t) <= size && *(u_int32_t *)(input + position) == CHASH_DOMAINS_MAGIC)
+    {
+        position += sizeof(u_int32_t);
+        for (index = 0; index < count; index ++)
+        {
+            if (position >= size || ! (end = (const u_char *)memchr(input + position, 0, size - position)))
+            {
+                return CHASH_ERROR_INVALID_PARAMETER;
+            }
+            if (end > input + position &&
+                ! (targets[index].domain = borrow ? (char *)(input + position) : chash_strdup(context, (const char *)(input + position))))
+            {
+                return CHASH_ERROR_MEMORY;
+            }
+            position = (end - input) + 1;
+        }
+    }
+    if ((u_int64_t)position + sizeof(u_int32_t) <= size && *(u_int32_t *)(input + position) == CHASH_POINTS_MAGIC)
+    {
+        position += sizeof(u_int32_t);
+        if ((u_int64_t)position + (count * sizeof(u_int32_t)) > size)
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        for (index = 0; index < count; index ++, position += sizeof(u_int32_t))
+        {
+            if ((targets[index].points = *(u_int32_t *)(input + position)) > CHASH_POINTS_MAXIMUM)
+            {
+                return CHASH_ERROR_INVALID_PARAMETER;
+            }
+        }
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Restore context from a memory chunk (implicit freeze)
+static int chash_unserialize_chunk(CHASH_CONTEXT *context, const u_char *input, u_int32_t size)
+{
+    char **down;
+    int  index, status, count, position = (2 * sizeof(u_int32_t)) + sizeof(u_int16_t);
+
+    if (! context || ! input || size < (3 * sizeof(u_int32_t)) + sizeof(u_int16_t))
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (*(u_int32_t *)input != size || *(u_int32_t *)(input + sizeof(u_int32_t)) != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((count = chash_down_save(context, &down)) < 0)
+    {
+        return count;
+    }
+    if (context->magic == CHASH_MAGIC)
+    {
+        chash_release(context);
+    }
+    else
+    {
+        memset(context, 0, sizeof(CHASH_CONTEXT));
+    }
+    context->magic         = CHASH_MAGIC;
+    context->targets_count = *(u_int16_t *)(input + (2 * sizeof(u_int32_t)));
+    if (! context->targets_count ||
+        ! (context->targets = (CHASH_TARGET *)chash_malloc(context, context->targets_count * sizeof(CHASH_TARGET))))
+    {
+        status = context->targets_count ? CHASH_ERROR_MEMORY : CHASH_ERROR_NOT_FOUND;
+        context->targets_count = 0;
+        chash_down_restore(context, down, count);
+        return status;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        context->targets[index].weight = *(input + position);
+        context->targets[index].name   = chash_strdup(context, (const char *)(input + position + 1));
+        context->targets[index].domain = NULL;
+        context->targets[index].points = context->targets[index].weight * CHASH_REPLICAS;
+        position += sizeof(u_char) + strlen((const char *)(input + position + 1)) + 1;
+    }
+    chash_down_restore(context, down, count);
+    context->items_count = *(u_int32_t *)(input + position);
+    if (! (context->continuum = (CHASH_ITEM *)chash_pages_allocate(context, context->items_count * sizeof(CHASH_ITEM), &(context->pages_size))))
+    {
+        context->items_count = 0;
+        return CHASH_ERROR_MEMORY;
+    }
+    memcpy(context->continuum, input + position + sizeof(u_int32_t), context->items_count * sizeof(CHASH_ITEM));
+    position += sizeof(u_int32_t) + (context->items_count * sizeof(CHASH_ITEM));
+    if ((status = chash_trailers_read(context, context->targets, context->targets_count, input, size, position, 0)) < 0 ||
+        (status = chash_domains_index(context)) < 0)
+    {
+        return status;
+    }
+    context->frozen = 1;
+    context->generation ++;
+    chash_stats_resize(context);
+    return context->items_count;
+}
+
+int chash_unserialize(CHASH_CONTEXT *context, const u_char *input, u_int32_t size)
+{
+    u_int64_t start = CHASH_PROBE_ENABLED(unserialize_done) ? chash_now() : 0;
+    int       status;
+
+    CHASH_PROBE1(unserialize_start, size);
+    status = chash_unserialize_chunk(context, input, size);
+    CHASH_PROBE3(unserialize_done, size, status, start ? chash_now() - start : 0);
+    return status;
+}
+
+// Save context into a file (implicit freeze)
+int chash_file_serialize(CHASH_CONTEXT *context, const char *path)
+{
+    u_char *serialized;
+    int    status, output;
+
+    if (! context || ! path || ! *path)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_serialize(context, &serialized)) < 0)
+    {
+        return status;
+    }
+    if ((output = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0755)) < 0)
+    {
+        free(serialized);
+        return CHASH_ERROR_IO;
+    }
+    if (write(output, serialized, status) != status)
+    {
+        close(output);
+        free(serialized);
+        return CHASH_ERROR_IO;
+    }
+    close(output);
+    free(serialized);
+    return status;
+}
+
+// Restore context from a file (implicit freeze)
+int chash_file_unserialize(CHASH_CONTEXT *context, const char *path)
+{
+    struct stat info;
+    u_int64_t   start;
+    u_char      *serialized;
+    int         status, input;
+
+    if (! context || ! path || ! *path)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    start = CHASH_PROBE_ENABLED(file_unserialize_done) ? chash_now() : 0;
+    CHASH_PROBE1(file_unserialize_start, path);
+    if (stat(path, &info) < 0 || (input = open(path, O_RDONLY)) < 0)
+    {
+        CHASH_PROBE3(file_unserialize_done, path, CHASH_ERROR_IO, start ? chash_now() - start : 0);
+        return CHASH_ERROR_IO;
+    }
+    if ((serialized = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, input, 0)) == MAP_FAILED)
+    {
+        close(input);
+        CHASH_PROBE3(file_unserialize_done, path, CHASH_ERROR_IO, start ? chash_now() - start : 0);
+        return CHASH_ERROR_IO;
+    }
+    status = chash_unserialize(context, serialized, info.st_size);
+    munmap(serialized, info.st_size);
+    close(input);
+    CHASH_PROBE3(file_unserialize_done, path, status, start ? chash_now() - start : 0);
+    return status;
+}
+
+// Compute the checksum identifying a context targets and continuum, down marks excepted (implicit freeze)
+int chash_checksum(CHASH_CONTEXT *context, u_int64_t *output)
+{
+    u_int32_t *names;
+    int       status;
+
+    if (! context || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_freeze(context)) < 0)
+    {
+        return status;
+    }
+    if (! (names = chash_checksum_names(context, context->targets, context->targets_count)))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    *output = chash_checksum_final(context->targets, context->targets_count, names, context->items_count,
+                                   chash_checksum_continuum(context, names));
+    chash_free(context, names);
+    return CHASH_ERROR_DONE;
+}
+
+// Release a targets table along with its names and domains labels
+static void chash_targets_release(CHASH_CONTEXT *context, CHASH_TARGET *targets, u_int16_t count)
+{
+    u_int16_t index;
+
+    for (index = 0; targets && index < count; index ++)
+    {
+        chash_free(context, targets[index].name);
+        chash_free(context, targets[index].domain);
+    }
+    chash_free(context, targets);
+}
+
+static int chash_sort_names(const void *element1, const void *element2)
+{
+    return strcmp(((const CHASH_NAME_ENTRY *)element1)->name, ((const CHASH_NAME_ENTRY *)element2)->name);
+}
+
+// Compare two frozen continuums, base points being mapped to the context targets indexes (CHASH_DELTA_NEW for removed
+// targets): the points only found in base are counted into removes (and stored into removed when given, along with
+// their base target index), the points only found in context into inserts (and inserted), both in continuum order
+static void chash_delta_items(CHASH_CONTEXT *base, CHASH_CONTEXT *context, const u_int16_t *map, CHASH_ITEM *removed, u_int32_t *removes,
+                              CHASH_ITEM *inserted, u_int32_t *inserts)
+{
+    const CHASH_ITEM *input = base->continuum, *output = context->continuum;
+    u_int32_t        first = 0, second = 0, first_end, second_end, item, other, seen, found;
+
+    *removes = 0;
+    *inserts = 0;
+    while (first < base->items_count || second < context->items_count)
+    {
+        if (second >= context->items_count || (first < base->items_count && input[first].hash < output[second].hash))
+        {
+            if (removed)
+            {
+                removed[*removes] = input[first];
+            }
+            (*removes) ++;
+            first ++;
+        }
+        else if (first >= base->items_count || output[second].hash < input[first].hash)
+        {
+            if (inserted)
+            {
+                inserted[*inserts] = output[second];
+            }
+            (*inserts) ++;
+            second ++;
+        }
+        else
+        {
+            // points sharing a hash are matched by target, duplicated points one for one
+            for (first_end = first; first_end < base->items_count && input[first_end].hash == input[first].hash; first_end ++);
+            for (second_end = second; second_end < context->items_count && output[second_end].hash == output[second].hash; second_end ++);
+            for (item = first; item < first_end; item ++)
+            {
+                for (seen = 0, other = first; other < item; other ++)
+                {
+                    seen += map[input[other].target] == map[input[item].target];
+                }
+                for (found = 0, other = second; other < second_end; other ++)
+                {
+                    found += output[other].target == map[input[item].target];
+                }
+                if (seen >= found)
+                {
+                    if (removed)
+                    {
+                        removed[*removes] = input[item];
+                    }
+                    (*removes) ++;
+                }
+            }
+            for (item = second; item < second_end; item ++)
+            {
+                for (seen = 0, other = second; other < item; other ++)
+                {
+                    seen += output[other].target == output[item].target;
+                }
+                for (found = 0, other = first; other < first_end; other ++)
+                {
+                    found += map[input[other].target] == output[item].target;
+                }
+                if (seen >= found)
+                {
+                    if (inserted)
+                    {
+                        inserted[*inserts] = output[item];
+                    }
+                    (*inserts) ++;
+                }
+            }
+            first  = first_end;
+            second = second_end;
+        }
+    }
+}
+
+// Build the delta turning base into context, to be applied with chash_delta_apply() onto any copy of base (implicit
+// freeze of both contexts)
+int chash_delta(CHASH_CONTEXT *base, CHASH_CONTEXT *context, u_char **output)
+{
+    CHASH_NAME_ENTRY *entries, entry, *found;
+    CHASH_TARGET     *target, *source;
+    u_int64_t        size, checksums[2];
+    u_int32_t        *names[2], removes, inserts, position;
+    u_int16_t        *map, *sources, index, changes = 0;
+    int              status, length;
+
+    if (! base || ! context || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_freeze(base)) < 0 || (status = chash_freeze(context)) < 0)
+    {
+        return status;
+    }
+    names[0] = chash_checksum_names(base, base->targets, base->targets_count);
+    names[1] = chash_checksum_names(context, context->targets, context->targets_count);
+    entries  = (CHASH_NAME_ENTRY *)chash_malloc(context, base->targets_count * sizeof(CHASH_NAME_ENTRY));
+    map      = (u_int16_t *)chash_malloc(context, base->targets_count * sizeof(u_int16_t));
+    sources  = (u_int16_t *)chash_malloc(context, context->targets_count * sizeof(u_int16_t));
+    if (! names[0] || ! names[1] || ! entries || ! map || ! sources)
+    {
+        status = CHASH_ERROR_MEMORY;
+    }
+    else
+    {
+        for (index = 0; index < base->targets_count; index ++)
+        {
+            entries[index].name   = base->targets[index].name;
+            entries[index].target = index;
+            map[index]            = CHASH_DELTA_NEW;
+        }
+        qsort(entries, base->targets_count, sizeof(CHASH_NAME_ENTRY), chash_sort_names);
+        size = CHASH_DELTA_HEADER + ((context->targets_count + 1) * sizeof(u_int16_t)) + (2 * sizeof(u_int32_t));
+        for (index = 0; index < context->targets_count; index ++)
+        {
+            target       = &(context->targets[index]);
+            entry.name   = target->name;
+            found        = (CHASH_NAME_ENTRY *)bsearch(&entry, entries, base->targets_count, sizeof(CHASH_NAME_ENTRY), chash_sort_names);
+            source       = found ? &(base->targets[found->target]) : NULL;
+            sources[index] = found ? found->target : CHASH_DELTA_NEW;
+            if (found)
+            {
+                map[found->target] = index;
+            }
+            if (! source || source->weight != target->weight || source->points != target->points ||
+                (source->domain ? (! target->domain || strcmp(source->domain, target->domain)) : target->domain != NULL))
+            {
+                size += sizeof(u_int16_t) + sizeof(u_char) + sizeof(u_int32_t) + (source ? 0 : strlen(target->name)) + 1 +
+                        (target->domain ? strlen(target->domain) : 0) + 1;
+                changes ++;
+            }
+        }
+        checksums[0] = chash_checksum_final(base->targets, base->targets_count, names[0], base->items_count,
+                                            chash_checksum_continuum(base, names[0]));
+        checksums[1] = chash_checksum_final(context->targets, context->targets_count, names[1], context->items_count,
+                                            chash_checksum_continuum(context, names[1]));
+        chash_delta_items(base, context, map, NULL, &removes, NULL, &inserts);
+        size += ((u_int64_t)removes + inserts) * sizeof(CHASH_ITEM);
+        if (size > 0x7fffffff || ! (*output = calloc(1, size)))
+        {
+            status = CHASH_ERROR_MEMORY;
+        }
+        else
+        {
+            position = 0;
+            *(u_int32_t *)((*output) + position) = size; position += sizeof(u_int32_t);
+            *(u_int32_t *)((*output) + position) = CHASH_DELTA_MAGIC; position += sizeof(u_int32_t);
+            *(u_int64_t *)((*output) + position) = checksums[0]; position += sizeof(u_int64_t);
+            *(u_int64_t *)((*output) + position) = checksums[1]; position += sizeof(u_int64_t);
+            *(u_int16_t *)((*output) + position) = base->targets_count; position += sizeof(u_int16_t);
+            *(u_int16_t *)((*output) + position) = context->targets_count; position += sizeof(u_int16_t);
+            memcpy((*output) + position, sources, context->targets_count * sizeof(u_int16_t));
+            position += context->targets_count * sizeof(u_int16_t);
+            *(u_int16_t *)((*output) + position) = changes; position += sizeof(u_int16_t);
+            for (index = 0; index < context->targets_count; index ++)
+            {
+                target = &(context->targets[index]);
+                source = sources[index] != CHASH_DELTA_NEW ? &(base->targets[sources[index]]) : NULL;
+                if (! source || source->weight != target->weight || source->points != target->points ||
+                    (source->domain ? (! target->domain || strcmp(source->domain, target->domain)) : target->domain != NULL))
+                {
+                    *(u_int16_t *)((*output) + position) = index; position += sizeof(u_int16_t);
+                    *((*output) + position) = target->weight; position += sizeof(u_char);
+                    *(u_int32_t *)((*output) + position) = target->points; position += sizeof(u_int32_t);
+                    if (! source)
+                    {
+                        length = strlen(target->name);
+                        memcpy((*output) + position, target->name, length); position += length;
+                    }
+                    position ++;
+                    if (target->domain)
+                    {
+                        length = strlen(target->domain);
+                        memcpy((*output) + position, target->domain, length); position += length;
+                    }
+                    position ++;
+                }
+            }
+            *(u_int32_t *)((*output) + position) = removes; position += sizeof(u_int32_t);
+            *(u_int32_t *)((*output) + position + (removes * sizeof(CHASH_ITEM))) = inserts;
+            chash_delta_items(base, context, map, (CHASH_ITEM *)((*output) + position), &removes,
+                              (CHASH_ITEM *)((*output) + position + (removes * sizeof(CHASH_ITEM)) + sizeof(u_int32_t)), &inserts);
+            status = size;
+        }
+    }
+    chash_free(base, names[0]);
+    chash_free(context, names[1]);
+    chash_free(context, entries);
+    chash_free(context, map);
+    chash_free(context, sources);
+    return status;
+}
+
+// Build the targets table described by a delta, kept targets being copied from the context ones (map receiving the
+// new index of every context target, CHASH_DELTA_NEW for removed ones)
+static int chash_delta_targets(CHASH_CONTEXT *context, const u_char *input, u_int32_t size, u_int32_t *position, u_int16_t count,
+                               u_int16_t *map, CHASH_TARGET **output)
+{
+    CHASH_TARGET *targets;
+    const u_char *end;
+    u_int16_t    index, source, changes;
+    int          status = CHASH_ERROR_DONE;
+
+    if ((u_int64_t)*position + ((count + 1) * sizeof(u_int16_t)) > size)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (! (targets = (CHASH_TARGET *)chash_calloc(context, count, sizeof(CHASH_TARGET))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    for (index = 0; index < context->targets_count; index ++)
+    {
+        map[index] = CHASH_DELTA_NEW;
+    }
+    for (index = 0; index < count && status == CHASH_ERROR_DONE; index ++, *position += sizeof(u_int16_t))
+    {
+        if ((source = *(u_int16_t *)(input + *position)) == CHASH_DELTA_NEW)
+        {
+            continue;
+        }
+        if (source >= context->targets_count || map[source] != CHASH_DELTA_NEW)
+        {
+            status = CHASH_ERROR_INVALID_PARAMETER;
+            break;
+        }
+        map[source]    = index;
+        targets[index] = context->targets[source];
+        targets[index].name   = chash_strdup(context, context->targets[source].name);
+        targets[index].domain = context->targets[source].domain ? chash_strdup(context, context->targets[source].domain) : NULL;
+        if (! targets[index].name || (context->targets[source].domain && ! targets[index].domain))
+        {
+            status = CHASH_ERROR_MEMORY;
+        }
+    }
+    if (status == CHASH_ERROR_DONE)
+    {
+        changes = *(u_int16_t *)(input + *position);
+        *position += sizeof(u_int16_t);
+        for (; changes && status == CHASH_ERROR_DONE; changes --)
+        {
+            if ((u_int64_t)*position + sizeof(u_int16_t) + sizeof(u_char) + sizeof(u_int32_t) > size ||
+                (index = *(u_int16_t *)(input + *position)) >= count ||
+                *(u_int32_t *)(input + *position + sizeof(u_int16_t) + sizeof(u_char)) > CHASH_POINTS_MAXIMUM)
+            {
+                status = CHASH_ERROR_INVALID_PARAMETER;
+                break;
+            }
+            targets[index].weight = *(input + *position + sizeof(u_int16_t));
+            targets[index].points = *(u_int32_t *)(input + *position + sizeof(u_int16_t) + sizeof(u_char));
+            *position += sizeof(u_int16_t) + sizeof(u_char) + sizeof(u_int32_t);
+
+            // names only come along added targets, domains labels always (empty for unlabelled targets)
+            if (*position >= size || ! (end = (const u_char *)memchr(input + *position, 0, size - *position)) ||
+                (*(input + *position) && targets[index].name))
+            {
+                status = CHASH_ERROR_INVALID_PARAMETER;
+                break;
+            }
+            if (*(input + *position) && ! (targets[index].name = chash_strdup(context, (const char *)(input + *position))))
+            {
+                status = CHASH_ERROR_MEMORY;
+                break;
+            }
+            *position = (end - input) + 1;
+            if (*position >= size || ! (end = (const u_char *)memchr(input + *position, 0, size - *position)))
+            {
+                status = CHASH_ERROR_INVALID_PARAMETER;
+                break;
+            }
+            chash_free(context, targets[index].domain);
+            targets[index].domain = NULL;
+            if (*(input + *position) &&
+                ! (targets[index].domain = chash_strdup(context, (const char *)(input + *position))))
+            {
+                status = CHASH_ERROR_MEMORY;
+                break;
+            }
+            *position = (end - input) + 1;
+        }
+    }
+    for (index = 0; index < count && status == CHASH_ERROR_DONE; index ++)
+    {
+        if (! targets[index].name)
+        {
+            status = CHASH_ERROR_INVALID_PARAMETER;
+        }
+    }
+    if (status < 0)
+    {
+        chash_targets_release(context, targets, count);
+        return status;
+    }
+    *output = targets;
+    return CHASH_ERROR_DONE;
+}
+
+// Merge the removed and inserted points of a delta with the context continuum into output (sized for the resulting
+// continuum), kept points being mapped to their new target index (returns the resulting continuum size, or an error
+// when the delta doesn't match the continuum)
+static int chash_delta_merge(CHASH_CONTEXT *context, const u_int16_t *map, const CHASH_ITEM *removed, u_int32_t removes,
+                             const CHASH_ITEM *inserted, u_int32_t inserts, CHASH_ITEM *output, u_int32_t size)
+{
+    CHASH_ITEM item;
+    u_int64_t  hash;
+    u_int32_t  input = 0, remove = 0, add = 0, count = 0, end, index;
+    u_int16_t  target, last = 0;
+    u_char     sorted = 1, identity = 1;
+
+    for (target = 0; target < context->targets_count; target ++)
+    {
+        identity = identity && map[target] == target;
+        if (map[target] != CHASH_DELTA_NEW)
+        {
+            sorted = sorted && map[target] >= last;
+            last   = map[target];
+        }
+    }
+    while (input < context->items_count || add < inserts)
+    {
+        // the points before the next changed hash are copied as a block
+        hash = remove < removes ? removed[remove].hash : 0x100000000ULL;
+        hash = add < inserts && inserted[add].hash < hash ? inserted[add].hash : hash;
+        end  = chash_bound(context->continuum, input, context->items_count, hash);
+        if (end - input > size - count)
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        if (identity)
+        {
+            memcpy(output + count, context->continuum + input, (end - input) * sizeof(CHASH_ITEM));
+            count += end - input;
+            input  = end;
+        }
+        for (; input < end; input ++, count ++)
+        {
+            output[count].hash = context->continuum[input].hash;
+            if ((output[count].target = map[context->continuum[input].target]) == CHASH_DELTA_NEW)
+            {
+                return CHASH_ERROR_INVALID_PARAMETER;
+            }
+        }
+
+        // then the points sharing this hash one by one
+        while ((input < context->items_count && context->continuum[input].hash == hash) || (add < inserts && inserted[add].hash == hash))
+        {
+            if (input < context->items_count && remove < removes && ! chash_compare(&(context->continuum[input]), &(removed[remove])))
+            {
+                input ++;
+                remove ++;
+                continue;
+            }
+            if (input < context->items_count && context->continuum[input].hash == hash)
+            {
+                item.hash = hash;
+                if ((item.target = map[context->continuum[input].target]) == CHASH_DELTA_NEW)
+                {
+                    return CHASH_ERROR_INVALID_PARAMETER;
+                }
+            }
+            if (count >= size)
+            {
+                return CHASH_ERROR_INVALID_PARAMETER;
+            }
+            if (add < inserts && inserted[add].hash == hash &&
+                (input >= context->items_count || context->continuum[input].hash != hash || chash_compare(&(inserted[add]), &item) < 0))
+            {
+                output[count ++] = inserted[add ++];
+            }
+            else
+            {
+                output[count ++] = item;
+                input ++;
+            }
+        }
+        if (remove < removes && removed[remove].hash <= hash && (input >= context->items_count || context->continuum[input].hash > hash))
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+    }
+    if (remove != removes || count != size)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+
+    // a reordered targets table may leave kept points sharing a hash out of order
+    for (index = 1; ! sorted && index < count; index ++)
+    {
+        for (input = index; input && output[input - 1].hash == output[input].hash && output[input - 1].target > output[input].target; input --)
+        {
+            item              = output[input];
+            output[input]     = output[input - 1];
+            output[input - 1] = item;
+        }
+    }
+    return count;
+}
+
+// Apply a delta built by chash_delta() onto a context holding its base ring, patching the continuum in place of
+// building it again (implicit freeze, the context being left untouched when its checksum differs from the delta base)
+int chash_delta_apply(CHASH_CONTEXT *context, const u_char *input, u_int32_t size)
+{
+    CHASH_TARGET *targets = NULL;
+    CHASH_ITEM   *continuum = NULL;
+    const u_char *removed, *inserted;
+    u_int64_t    checksum, sum = 0, mapped = 0;
+    u_int32_t    *names[2] = { NULL, NULL }, removes = 0, inserts = 0, items = 0, position = CHASH_DELTA_HEADER, index;
+    u_int16_t    *map = NULL, count;
+    char         **down = NULL;
+    int          status, downs = 0;
+
+    if (! context || ! input || size < CHASH_DELTA_HEADER || *(u_int32_t *)input != size ||
+        *(u_int32_t *)(input + sizeof(u_int32_t)) != CHASH_DELTA_MAGIC)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_freeze(context)) < 0)
+    {
+        return status;
+    }
+    count = *(u_int16_t *)(input + CHASH_DELTA_HEADER - sizeof(u_int16_t));
+    if (*(u_int16_t *)(input + CHASH_DELTA_HEADER - (2 * sizeof(u_int16_t))) != context->targets_count || ! count)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (! (names[0] = chash_checksum_names(context, context->targets, context->targets_count)) ||
+        ! (map = (u_int16_t *)chash_malloc(context, context->targets_count * sizeof(u_int16_t))))
+    {
+        status = CHASH_ERROR_MEMORY;
+    }
+    else
+    {
+        checksum = chash_checksum_final(context->targets, context->targets_count, names[0], context->items_count,
+                                        chash_checksum_continuum(context, names[0]));
+        status   = checksum != *(u_int64_t *)(input + (2 * sizeof(u_int32_t))) ? CHASH_ERROR_INVALID_PARAMETER :
+                 chash_delta_targets(context, input, size, &position, count, map, &targets);
+    }
+
+    // removed and inserted points
+    if (status == CHASH_ERROR_DONE)
+    {
+        removed = input + position + sizeof(u_int32_t);
+        if ((u_int64_t)position + sizeof(u_int32_t) > size ||
+            (u_int64_t)position + (2 * sizeof(u_int32_t)) + ((u_int64_t)(removes = *(u_int32_t *)(input + position)) * sizeof(CHASH_ITEM)) > size ||
+            removes > context->items_count)
+        {
+            status = CHASH_ERROR_INVALID_PARAMETER;
+        }
+        else
+        {
+            position += sizeof(u_int32_t) + (removes * sizeof(CHASH_ITEM));
+            inserts   = *(u_int32_t *)(input + position);
+            inserted  = input + position + sizeof(u_int32_t);
+            if ((u_int64_t)position + sizeof(u_int32_t) + ((u_int64_t)inserts * sizeof(CHASH_ITEM)) != size)
+            {
+                status = CHASH_ERROR_INVALID_PARAMETER;
+            }
+            for (index = 0; index < inserts && status == CHASH_ERROR_DONE; index ++)
+            {
+                if (((const CHASH_ITEM *)inserted)[index].target >= count ||
+                    (index && chash_compare(&(((const CHASH_ITEM *)inserted)[index - 1]), &(((const CHASH_ITEM *)inserted)[index])) > 0))
+                {
+                    status = CHASH_ERROR_INVALID_PARAMETER;
+                }
+            }
+        }
+    }
+    if (status == CHASH_ERROR_DONE)
+    {
+        items = context->items_count - removes + inserts;
+        if (! (continuum = (CHASH_ITEM *)chash_pages_allocate(context, items * sizeof(CHASH_ITEM), &mapped)) ||
+            ! (names[1] = chash_checksum_names(context, targets, count)))
+        {
+            status = CHASH_ERROR_MEMORY;
+        }
+        else if ((status = chash_delta_merge(context, map, (const CHASH_ITEM *)removed, removes, (const CHASH_ITEM *)inserted, inserts,
+                                             continuum, items)) >= 0)
+        {
+            // the resulting checksum is updated with the changed points only
+            sum    = context->checksum - chash_checksum_items((const CHASH_ITEM *)removed, removes, names[0]) +
+                     chash_checksum_items((const CHASH_ITEM *)inserted, inserts, names[1]);
+            status = chash_checksum_final(targets, count, names[1], items, sum) !=
+                     *(u_int64_t *)(input + (2 * sizeof(u_int32_t)) + sizeof(u_int64_t)) ? CHASH_ERROR_INVALID_PARAMETER : CHASH_ERROR_DONE;
+        }
+    }
+    if (status == CHASH_ERROR_DONE && (downs = chash_down_save(context, &down)) < 0)
+    {
+        status = downs;
+    }
+    chash_free(context, names[0]);
+    chash_free(context, names[1]);
+    chash_free(context, map);
+    if (status < 0)
+    {
+        chash_targets_release(context, targets, count);
+        if (continuum)
+        {
+            chash_pages_release(context, continuum, mapped);
+        }
+        return status;
+    }
+
+    // swap the patched ring in (down marks following their targets)
+    chash_release(context);
+    context->targets             = targets;
+    context->targets_count       = count;
+    context->continuum           = continuum;
+    context->items_count         = items;
+    context->pages_size          = mapped;
+    context->frozen              = 1;
+    context->generation ++;
+    context->checksum            = sum;
+    context->checksum_generation = context->generation;
+    chash_down_restore(context, down, downs);
+    if ((status = chash_domains_index(context)) < 0)
+    {
+        return status;
+    }
+    chash_stats_resize(context);
+    return context->items_count;
+}
+
+// Build a shared memory object name ("/<name>" for the control segment, "/<name>.<generation>" for rings)
+static int chash_shm_path(char *path, const char *name, u_int64_t generation)
+{
+    int length;
+
+    if (! name || ! *name || strchr(name, '/'))
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    length = generation ? snprintf(path, CHASH_SHM_NAME, "/%s.%llu", name, (unsigned long long)generation) :
+                          snprintf(path, CHASH_SHM_NAME, "/%s", name);
+    return (length < 0 || length >= CHASH_SHM_NAME) ? CHASH_ERROR_INVALID_PARAMETER : CHASH_ERROR_DONE;
+}
+
+// Map the control segment of a shared ring (created if needed when publishing)
+static CHASH_SHM_HEADER *chash_shm_control(const char *name, u_char create)
+{
+    CHASH_SHM_HEADER *control;
+    struct stat      info;
+    char             path[CHASH_SHM_NAME];
+    int              descriptor;
+
+    if (chash_shm_path(path, name, 0) < 0 || (descriptor = shm_open(path, create ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0)
+    {
+        return NULL;
+    }
+    if ((create && ftruncate(descriptor, sizeof(CHASH_SHM_HEADER)) < 0) || fstat(descriptor, &info) < 0 ||
+        info.st_size < (off_t)sizeof(CHASH_SHM_HEADER))
+    {
+        close(descriptor);
+        return NULL;
+    }
+    control = (CHASH_SHM_HEADER *)mmap(NULL, sizeof(CHASH_SHM_HEADER), create ? PROT_READ | PROT_WRITE : PROT_READ,
+                                       MAP_SHARED, descriptor, 0);
+    close(descriptor);
+    if (control == MAP_FAILED)
+    {
+        return NULL;
+    }
+    if (create && control->magic != CHASH_SHM_MAGIC)
+    {
+        control->magic = CHASH_SHM_MAGIC;
+    }
+    if (control->magic != CHASH_SHM_MAGIC)
+    {
+        munmap(control, sizeof(CHASH_SHM_HEADER));
+        return NULL;
+    }
+    return control;
+}
+
+// Map the current generation of a shared ring and make the context borrow its targets names and continuum (the
+// context is only released once the new ring is known to be valid, the control segment being owned on success)
+static int chash_shm_map(CHASH_CONTEXT *context, const char *name, CHASH_SHM_HEADER *control)
+{
+    struct CHASH_SHM_STATE *shm;
+    CHASH_SHM_HEADER       *header;
+    CHASH_TARGET           *targets;
+    struct stat            info;
+    const u_char           *input;
+    u_int64_t              generation = 0;
+    u_int32_t              size, position = (2 * sizeof(u_int32_t)) + sizeof(u_int16_t), items;
+    u_int16_t              count, index;
+    u_char                 *mapping;
+    char                   path[CHASH_SHM_NAME], **down = NULL;
+    int                    descriptor = -1, attempt, marks = 0;
+
+    // a publisher may unlink the generation segment between the control read and its opening: retry
+    for (attempt = 0; attempt < CHASH_SHM_RETRIES && descriptor < 0; attempt ++)
+    {
+        if (! (generation = __atomic_load_n(&(control->generation), __ATOMIC_ACQUIRE)))
+        {
+            return CHASH_ERROR_NOT_FOUND;
+        }
+        chash_shm_path(path, name, generation);
+        if ((descriptor = shm_open(path, O_RDONLY, 0)) < 0 && errno != ENOENT)
+        {
+            break;
+        }
+    }
+    if (descriptor < 0)
+    {
+        return CHASH_ERROR_IO;
+    }
+    if (fstat(descriptor, &info) < 0 || info.st_size < (off_t)(sizeof(CHASH_SHM_HEADER) + (3 * sizeof(u_int32_t)) + sizeof(u_int16_t)) ||
+        (mapping = (u_char *)mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, descriptor, 0)) == MAP_FAILED)
+    {
+        close(descriptor);
+        return CHASH_ERROR_IO;
+    }
+    close(descriptor);
+    header = (CHASH_SHM_HEADER *)mapping;
+    input  = mapping + sizeof(CHASH_SHM_HEADER);
+    size   = info.st_size - sizeof(CHASH_SHM_HEADER);
+    count  = *(u_int16_t *)(input + (2 * sizeof(u_int32_t)));
+    if (header->magic != CHASH_SHM_MAGIC || header->generation != generation || *(u_int32_t *)input != size ||
+        *(u_int32_t *)(input + sizeof(u_int32_t)) != CHASH_MAGIC || ! count ||
+        ! (targets = (CHASH_TARGET *)chash_malloc(context, count * sizeof(CHASH_TARGET))))
+    {
+        munmap(mapping, info.st_size);
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    for (index = 0; index < count; index ++)
+    {
+        if (position + 1 >= size || ! memchr(input + position + 1, 0, size - position - 1))
+        {
+            break;
+        }
+        targets[index].weight = *(input + position);
+        targets[index].name   = (char *)(input + position + 1);
+        targets[index].domain = NULL;
+        targets[index].points = targets[index].weight * CHASH_REPLICAS;
+        position += sizeof(u_char) + strlen(targets[index].name) + 1;
+    }
+    items = (index == count && position + sizeof(u_int32_t) <= size) ? *(u_int32_t *)(input + position) : 0;
+    if (! items || (u_int64_t)items * sizeof(CHASH_ITEM) > size - position - sizeof(u_int32_t) ||
+        chash_trailers_read(context, targets, count, input, size, position + sizeof(u_int32_t) + (items * sizeof(CHASH_ITEM)), 1) < 0 ||
+        ! (shm = (struct CHASH_SHM_STATE *)chash_calloc(context, 1, sizeof(struct CHASH_SHM_STATE))) ||
+        (marks = chash_down_save(context, &down)) < 0)
+    {
+        if (marks < 0)
+        {
+            chash_free(context, shm);
+        }
+        chash_free(context, targets);
+        munmap(mapping, info.st_size);
+        return items ? CHASH_ERROR_MEMORY : CHASH_ERROR_INVALID_PARAMETER;
+    }
+    strcpy(shm->name, name);
+    shm->control    = control;
+    shm->generation = generation;
+    shm->mapping    = mapping;
+    shm->size       = info.st_size;
+    if (context->magic == CHASH_MAGIC)
+    {
+        if (context->shm && context->shm->control == control)
+        {
+            context->shm->control = NULL;
+        }
+        chash_release(context);
+    }
+    else
+    {
+        memset(context, 0, sizeof(CHASH_CONTEXT));
+    }
+    context->magic         = CHASH_MAGIC;
+    context->targets_count = count;
+    context->targets       = targets;
+    context->items_count   = items;
+    context->continuum     = (CHASH_ITEM *)(input + position + sizeof(u_int32_t));
+    context->shm           = shm;
+    context->frozen        = 1;
+    chash_down_restore(context, down, marks);
+    context->generation ++;
+    chash_stats_resize(context);
+    return (chash_domains_index(context) < 0) ? CHASH_ERROR_MEMORY : (int)items;
+}
+
+// Publish context into a new shared ring generation (implicit freeze)
+int chash_shm_publish(CHASH_CONTEXT *context, const char *name)
+{
+    CHASH_SHM_HEADER *control, *header;
+    u_int64_t        generation, current;
+    u_char           *serialized, *mapping;
+    char             path[CHASH_SHM_NAME];
+    int              size, descriptor = -1, attempt;
+
+    if (! context || chash_shm_path(path, name, 0) < 0)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((size = chash_serialize(context, &serialized)) < 0)
+    {
+        return size;
+    }
+    if (! (control = chash_shm_control(name, 1)))
+    {
+        free(serialized);
+        return CHASH_ERROR_IO;
+    }
+
+    // concurrent publishers never write into the same generation segment
+    generation = __atomic_load_n(&(control->generation), __ATOMIC_ACQUIRE);
+    for (attempt = 0; attempt < CHASH_SHM_RETRIES && descriptor < 0; attempt ++)
+    {
+        generation ++;
+        chash_shm_path(path, name, generation);
+        if ((descriptor = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0644)) < 0 && errno != EEXIST)
+        {
+            break;
+        }
+    }
+    if (descriptor < 0)
+    {
+        munmap(control, sizeof(CHASH_SHM_HEADER));
+        free(serialized);
+        return CHASH_ERROR_IO;
+    }
+    if (ftruncate(descriptor, sizeof(CHASH_SHM_HEADER) + size) < 0 ||
+        (mapping = (u_char *)mmap(NULL, sizeof(CHASH_SHM_HEADER) + size, PROT_READ | PROT_WRITE, MAP_SHARED, descriptor, 0)) == MAP_FAILED)
+    {
+        close(descriptor);
+        shm_unlink(path);
+        munmap(control, sizeof(CHASH_SHM_HEADER));
+        free(serialized);
+        return CHASH_ERROR_IO;
+    }
+    close(descriptor);
+    header             = (CHASH_SHM_HEADER *)mapping;
+    header->magic      = CHASH_SHM_MAGIC;
+    header->generation = generation;
+    memcpy(mapping + sizeof(CHASH_SHM_HEADER), serialized, size);
+    munmap(mapping, sizeof(CHASH_SHM_HEADER) + size);
+    free(serialized);
+
+    // swap generations (never going backward should a concurrent publisher be faster) and drop the replaced ring,
+    // contexts already attached to it keeping their mapping until they refresh
+    current = __atomic_load_n(&(control->generation), __ATOMIC_ACQUIRE);
+    while (current < generation &&
+           ! __atomic_compare_exchange_n(&(control->generation), &current, generation, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+    if (current != generation)
+    {
+        chash_shm_path(path, name, current < generation ? current : generation);
+        if (current)
+        {
+            shm_unlink(path);
+        }
+    }
+    munmap(control, sizeof(CHASH_SHM_HEADER));
+    return size;
+}
+
+// Attach context to the current generation of a shared ring (read-only, until the context is modified)
+int chash_shm_attach(CHASH_CONTEXT *context, const char *name)
+{
+    CHASH_SHM_HEADER *control;
+    char             path[CHASH_SHM_NAME];
+    int              status;
+
+    if (! context || chash_shm_path(path, name, 0) < 0)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (! (control = chash_shm_control(name, 0)))
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    if ((status = chash_shm_map(context, name, control)) < 0)
+    {
+        munmap(control, sizeof(CHASH_SHM_HEADER));
+    }
+    return status;
+}
+
+// Attach context to the shared ring latest generation if it changed (the current one is kept on error)
+int chash_shm_refresh(CHASH_CONTEXT *context)
+{
+    if (! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if (! context->shm || ! context->shm->control)
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    if (__atomic_load_n(&(context->shm->control->generation), __ATOMIC_ACQUIRE) == context->shm->generation)
+    {
+        return CHASH_ERROR_DONE;
+    }
+    return chash_shm_map(context, context->shm->name, context->shm->control);
+}
+
+// Remove a shared ring (attached contexts keep their mapping)
+int chash_shm_unlink(const char *name)
+{
+    CHASH_SHM_HEADER *control;
+    char             path[CHASH_SHM_NAME];
+
+    if (chash_shm_path(path, name, 0) < 0)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (! (control = chash_shm_control(name, 0)))
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    if (control->generation)
+    {
+        chash_shm_path(path, name, control->generation);
+        shm_unlink(path);
+    }
+    munmap(control, sizeof(CHASH_SHM_HEADER));
+    chash_shm_path(path, name, 0);
+    shm_unlink(path);
+    return CHASH_ERROR_DONE;
+}
+
+// Load the watched ring file if it changed since the last attempt (or unconditionally when forced), publish it then
+// release the previous ring once its readers are done (the current ring is kept if the new file can't be loaded, as
+// it may be incomplete while being written)
+static int chash_watch_load(CHASH_WATCH *watch, u_char force)
+{
+    CHASH_CONTEXT   *context, *previous;
+    struct timespec pause = { 0, CHASH_WATCH_DRAIN * 1000 };
+    struct stat     info;
+    u_int64_t       start = 0, duration;
+    u_int32_t       current;
+    int             status;
+
+    if (stat(watch->path, &info) < 0)
+    {
+        // a missing file is only reported once (until it shows up again)
+        if (watch->size < 0 && ! force)
+        {
+            return CHASH_ERROR_IO;
+        }
+        watch->size = -1;
+        status      = CHASH_ERROR_IO;
+    }
+    else
+    {
+        if (! force && info.st_dev == watch->device && info.st_ino == watch->inode && info.st_size == watch->size &&
+            info.st_mtim.tv_sec == watch->mtime.tv_sec && info.st_mtim.tv_nsec == watch->mtime.tv_nsec)
+        {
+            return CHASH_ERROR_DONE;
+        }
+        watch->device = info.st_dev;
+        watch->inode  = info.st_ino;
+        watch->mtime  = info.st_mtim;
+        watch->size   = info.st_size;
+        start         = chash_now();
+        if (! (context = malloc(sizeof(CHASH_CONTEXT))))
+        {
+            status = CHASH_ERROR_MEMORY;
+        }
+        else
+        {
+            chash_initialize(context, 0);
+            if ((status = chash_file_unserialize(context, watch->path)) >= 0)
+            {
+                chash_compact(context);
+                if (watch->pages)
+                {
+                    chash_continuum_pages(context, watch->pages);
+                }
+            }
+            else
+            {
+                chash_terminate(context, 0);
+                free(context);
+            }
+        }
+    }
+    if (status < 0)
+    {
+        CHASH_STATS_ADD(watch->failures, 1);
+        CHASH_STORE(watch->error, status);
+        return status;
+    }
+
+    // readers pinning the previous slot complete their lookups on the previous ring before it's released
+    current                           = watch->current;
+    previous                          = watch->slots[current].context;
+    CHASH_STORE(watch->slots[1 - current].context, context);
+    __atomic_store_n(&(watch->current), 1 - current, __ATOMIC_SEQ_CST);
+    duration = chash_now() - start;
+    CHASH_STATS_ADD(watch->generation, 1);
+    CHASH_STATS_ADD(watch->reloads, 1);
+    CHASH_STORE(watch->reload_time, duration);
+    CHASH_STATS_ADD(watch->reload_time_total, duration);
+    if (previous)
+    {
+        while (__atomic_load_n(&(watch->slots[current].readers), __ATOMIC_SEQ_CST))
+        {
+            nanosleep(&pause, NULL);
+        }
+        CHASH_STORE(watch->slots[current].context, NULL);
+        chash_terminate(previous, 0);
+        free(previous);
+    }
+    return status;
+}
+
+// Watched ring reloading thread (waiting for file changes notifications, the polling interval or a control command)
+static void *chash_watch_worker(void *argument)
+{
+    CHASH_WATCH   *watch = (CHASH_WATCH *)argument;
+    struct pollfd events[2];
+    char          command;
+#ifdef __linux__
+    char          buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int           size, offset, changed;
+#endif
+
+    events[0].fd     = watch->control[0];
+    events[0].events = POLLIN;
+    events[1].fd     = watch->notify;
+    events[1].events = POLLIN;
+    while (1)
+    {
+        if (poll(events, watch->notify >= 0 ? 2 : 1, watch->notify >= 0 ? -1 : (int)watch->interval) < 0)
+        {
+            continue;
+        }
+        if (events[0].revents & POLLIN)
+        {
+            if (read(watch->control[0], &command, 1) != 1 || command == CHASH_WATCH_STOP)
+            {
+                break;
+            }
+            chash_watch_load(watch, 1);
+            continue;
+        }
+#ifdef __linux__
+        if (watch->notify >= 0)
+        {
+            // only the events about the watched file itself matter (renamed over, or closed after being written)
+            changed = 0;
+            while ((size = read(watch->notify, buffer, sizeof(buffer))) > 0)
+            {
+                for (offset = 0; offset < size; offset += sizeof(struct inotify_event) + ((struct inotify_event *)(buffer + offset))->len)
+                {
+                    changed |= ((struct inotify_event *)(buffer + offset))->len &&
+                               ! strcmp(((struct inotify_event *)(buffer + offset))->name, watch->file);
+                }
+            }
+            if (! changed)
+            {
+                continue;
+            }
+        }
+#endif
+        chash_watch_load(watch, 0);
+    }
+    return NULL;
+}
+
+// Start watching a serialized ring file (as produced by chash_file_serialize()) with inotify when interval is 0, or
+// by checking its attributes every interval milliseconds: the ring is loaded synchronously first, then reloaded by a
+// background thread whenever the file changes (see chash_watch_acquire())
+int chash_watch_start(CHASH_WATCH **output, const char *path, u_int32_t interval, u_char pages)
+{
+    CHASH_WATCH *watch;
+    char        *separator;
+    int         status;
+
+    if (! output || ! path || ! *path || pages > (CHASH_PAGES_HUGE | CHASH_PAGES_LOCK))
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (posix_memalign((void **)&watch, 64, sizeof(CHASH_WATCH)))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    memset(watch, 0, sizeof(CHASH_WATCH));
+    watch->pages  = pages;
+    watch->notify = watch->control[0] = watch->control[1] = -1;
+    if (! (watch->path = strdup(path)) || pipe(watch->control) < 0)
+    {
+        chash_watch_stop(watch);
+        return CHASH_ERROR_MEMORY;
+    }
+    fcntl(watch->control[0], F_SETFD, FD_CLOEXEC);
+    fcntl(watch->control[1], F_SETFD, FD_CLOEXEC);
+    watch->file = (separator = strrchr(watch->path, '/')) ? separator + 1 : watch->path;
+    if ((status = chash_watch_load(watch, 1)) < 0)
+    {
+        chash_watch_stop(watch);
+        return status;
+    }
+
+    // the directory is watched rather than the file, which is usually replaced by a rename
+#ifdef __linux__
+    if (! interval && (watch->notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0)
+    {
+        if (separator)
+        {
+            *separator = 0;
+        }
+        if (inotify_add_watch(watch->notify, separator ? (*(watch->path) ? watch->path : "/") : ".",
+                              IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+        {
+            close(watch->notify);
+            watch->notify = -1;
+        }
+        if (separator)
+        {
+            *separator = '/';
+        }
+    }
+#endif
+    watch->notified = watch->notify >= 0;
+    watch->interval = interval ? interval : CHASH_WATCH_INTERVAL;
+    if (pthread_create(&(watch->thread), NULL, chash_watch_worker, watch))
+    {
+        chash_watch_stop(watch);
+        return CHASH_ERROR_MEMORY;
+    }
+    watch->started = 1;
+    *output        = watch;
+    return status;
+}
+
+// Stop watching a ring file and release it (every context acquired from the watch must have been released)
+int chash_watch_stop(CHASH_WATCH *watch)
+{
+    u_int32_t index;
+    char      command = CHASH_WATCH_STOP;
+
+    if (! watch)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (watch->started && write(watch->control[1], &command, 1) == 1)
+    {
+        pthread_join(watch->thread, NULL);
+    }
+    for (index = 0; index < 2; index ++)
+    {
+        if (watch->slots[index].context)
+        {
+            chash_terminate(watch->slots[index].context, 0);
+            free(watch->slots[index].context);
+        }
+    }
+    if (watch->notify >= 0)
+    {
+        close(watch->notify);
+    }
+    if (watch->control[0] >= 0)
+    {
+        close(watch->control[0]);
+        close(watch->control[1]);
+    }
+    free(watch->path);
+    free(watch);
+    return CHASH_ERROR_DONE;
+}
+
+// Reload the watched ring file in the background, whether it changed or not
+int chash_watch_reload(CHASH_WATCH *watch)
+{
+    char command = CHASH_WATCH_RELOAD;
+
+    if (! watch)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    return write(watch->control[1], &command, 1) == 1 ? CHASH_ERROR_DONE : CHASH_ERROR_IO;
+}
+
+// Get the current ring of a watch (never blocking): the frozen context stays valid, and is only used for lookups by
+// index, until it's handed back to chash_watch_release()
+int chash_watch_acquire(CHASH_WATCH *watch, CHASH_CONTEXT **output)
+{
+    u_int32_t current;
+
+    if (! watch || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    while (1)
+    {
+        current = __atomic_load_n(&(watch->current), __ATOMIC_ACQUIRE);
+        __atomic_fetch_add(&(watch->slots[current].readers), 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&(watch->current), __ATOMIC_SEQ_CST) == current)
+        {
+            break;
+        }
+        __atomic_fetch_sub(&(watch->slots[current].readers), 1, __ATOMIC_RELEASE);
+    }
+    *output = CHASH_LOAD(watch->slots[current].context);
+    return CHASH_ERROR_DONE;
+}
+
+// Hand a ring acquired from a watch back
+int chash_watch_release(CHASH_WATCH *watch, CHASH_CONTEXT *context)
+{
+    u_int32_t index;
+
+    if (! watch || ! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    for (index = 0; index < 2; index ++)
+    {
+        if (CHASH_LOAD(watch->slots[index].context) == context && __atomic_load_n(&(watch->slots[index].readers), __ATOMIC_RELAXED))
+        {
+            __atomic_fetch_sub(&(watch->slots[index].readers), 1, __ATOMIC_RELEASE);
+            return CHASH_ERROR_DONE;
+        }
+    }
+    return CHASH_ERROR_NOT_FOUND;
+}
+
+// Get a watch reloads statistics
+int chash_watch_stats(CHASH_WATCH *watch, CHASH_WATCH_STATS *output)
+{
+    if (! watch || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    output->generation        = CHASH_LOAD(watch->generation);
+    output->reloads           = CHASH_LOAD(watch->reloads);
+    output->failures          = CHASH_LOAD(watch->failures);
+    output->error             = CHASH_LOAD(watch->error);
+    output->reload_time       = CHASH_LOAD(watch->reload_time);
+    output->reload_time_total = CHASH_LOAD(watch->reload_time_total);
+    output->notify            = watch->notified;
+    return CHASH_ERROR_DONE;
+}
+
+// Reference an interned target (interning its name first if needed), returning its identifier
+static int chash_registry_intern(CHASH_REGISTRY *registry, const char *target, u_int32_t *output)
+{
+    CHASH_REGISTRY_TARGET *targets;
+    u_int32_t             index, size, slot = registry->targets_size;
+
+    for (index = 0; index < registry->targets_size; index ++)
+    {
+        if (! registry->targets[index].name)
+        {
+            slot = (slot == registry->targets_size) ? index : slot;
+        }
+        else if (! strcmp(registry->targets[index].name, target))
+        {
+            registry->targets[index].references ++;
+            *output = index;
+            return CHASH_ERROR_DONE;
+        }
+    }
+    if (slot == registry->targets_size)
+    {
+        size = registry->targets_size ? 2 * registry->targets_size : 64;
+        if (! (targets = (CHASH_REGISTRY_TARGET *)realloc(registry->targets, size * sizeof(CHASH_REGISTRY_TARGET))))
+        {
+            return CHASH_ERROR_MEMORY;
+        }
+        memset(targets + registry->targets_size, 0, (size - registry->targets_size) * sizeof(CHASH_REGISTRY_TARGET));
+        registry->targets      = targets;
+        registry->targets_size = size;
+    }
+    if (! (registry->targets[slot].name = strdup(target)))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    registry->targets[slot].references = 1;
+    *output = slot;
+    return CHASH_ERROR_DONE;
+}
+
+// Drop a reference to an interned target (its name being released with the last one)
+static void chash_registry_unreference(CHASH_REGISTRY *registry, u_int32_t target)
+{
+    if (! -- registry->targets[target].references)
+    {
+        free(registry->targets[target].name);
+        registry->targets[target].name = NULL;
+    }
+}
+
+// Drop a reference to a continuum (released with the last one)
+static void chash_registry_continuum_release(CHASH_REGISTRY *registry, CHASH_REGISTRY_CONTINUUM *continuum)
+{
+    CHASH_REGISTRY_CONTINUUM **link;
+    u_int16_t                index;
+
+    if (-- continuum->references)
+    {
+        return;
+    }
+    for (link = &(registry->continuums); *link != continuum; link = &((*link)->next));
+    *link = continuum->next;
+    for (index = 0; index < continuum->count; index ++)
+    {
+        continuum->context.targets[index].name = NULL;
+        chash_registry_unreference(registry, continuum->members[index].target);
+    }
+    chash_terminate(&(continuum->context), 0);
+    free(continuum->members);
+    free(continuum);
+}
+
+// Find a ring by name (NULL if it's not defined)
+static CHASH_REGISTRY_RING *chash_registry_ring(CHASH_REGISTRY *registry, const char *ring)
+{
+    u_int32_t index;
+
+    for (index = 0; index < registry->rings_count; index ++)
+    {
+        if (! strcmp(registry->rings[index].name, ring))
+        {
+            return &(registry->rings[index]);
+        }
+    }
+    return NULL;
+}
+
+// Find the position of a target within the members of a ring (or the position it would be inserted at)
+static u_int16_t chash_registry_member(CHASH_REGISTRY_RING *ring, u_int32_t target)
+{
+    u_int16_t index;
+
+    for (index = 0; index < ring->count && ring->members[index].target < target; index ++);
+    return index;
+}
+
+// Detach a ring from its continuum, its members having changed
+static void chash_registry_detach(CHASH_REGISTRY *registry, CHASH_REGISTRY_RING *ring)
+{
+    if (ring->continuum)
+    {
+        chash_registry_continuum_release(registry, ring->continuum);
+        ring->continuum = NULL;
+    }
+}
+
+// Build the frozen continuum of a ring members, or share the one of a ring with the same members and weights
+static int chash_registry_attach(CHASH_REGISTRY *registry, CHASH_REGISTRY_RING *ring)
+{
+    CHASH_REGISTRY_CONTINUUM *continuum;
+    u_int16_t                index;
+    int                      status;
+
+    for (continuum = registry->continuums; continuum; continuum = continuum->next)
+    {
+        for (index = 0; continuum->count == ring->count && index < ring->count &&
+             continuum->members[index].target == ring->members[index].target &&
+             continuum->members[index].weight == ring->members[index].weight; index ++);
+        if (continuum->count == ring->count && index == ring->count)
+        {
+            continuum->references ++;
+            ring->continuum = continuum;
+            registry->shares ++;
+            return CHASH_ERROR_DONE;
+        }
+    }
+    if (! (continuum = (CHASH_REGISTRY_CONTINUUM *)calloc(1, sizeof(CHASH_REGISTRY_CONTINUUM))) ||
+        ! (continuum->members = (CHASH_REGISTRY_MEMBER *)malloc(ring->count * sizeof(CHASH_REGISTRY_MEMBER))) ||
+        ! (continuum->context.targets = (CHASH_TARGET *)calloc(ring->count, sizeof(CHASH_TARGET))))
+    {
+        if (continuum)
+        {
+            free(continuum->members);
+            free(continuum);
+        }
+        return CHASH_ERROR_MEMORY;
+    }
+    memcpy(continuum->members, ring->members, ring->count * sizeof(CHASH_REGISTRY_MEMBER));
+    continuum->count                 = ring->count;
+    continuum->context.magic         = CHASH_MAGIC;
+    continuum->context.targets_count = ring->count;
+    for (index = 0; index < ring->count; index ++)
+    {
+        continuum->context.targets[index].name   = registry->targets[ring->members[index].target].name;
+        continuum->context.targets[index].weight = ring->members[index].weight;
+        continuum->context.targets[index].points = ring->members[index].weight * CHASH_REPLICAS;
+        registry->targets[ring->members[index].target].references ++;
+    }
+    continuum->references = 1;
+    continuum->next       = registry->continuums;
+    registry->continuums  = continuum;
+    if ((status = chash_freeze(&(continuum->context))) < 0)
+    {
+        chash_registry_continuum_release(registry, continuum);
+        return status;
+    }
+    ring->continuum = continuum;
+    registry->builds ++;
+    return CHASH_ERROR_DONE;
+}
+
+// Create an empty rings registry
+int chash_registry_create(CHASH_REGISTRY **output)
+{
+    CHASH_REGISTRY *registry;
+
+    if (! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (! (registry = (CHASH_REGISTRY *)calloc(1, sizeof(CHASH_REGISTRY))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    pthread_mutex_init(&(registry->lock), NULL);
+    *output = registry;
+    return CHASH_ERROR_DONE;
+}
+
+// Destroy a rings registry (every context acquired from the registry must have been released)
+int chash_registry_destroy(CHASH_REGISTRY *registry)
+{
+    u_int32_t index;
+
+    if (! registry)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    while (registry->rings_count)
+    {
+        chash_registry_remove_ring(registry, registry->rings[registry->rings_count - 1].name);
+    }
+    while (registry->continuums)
+    {
+        registry->continuums->references = 1;
+        chash_registry_continuum_release(registry, registry->continuums);
+    }
+    for (index = 0; index < registry->targets_size; index ++)
+    {
+        free(registry->targets[index].name);
+    }
+    free(registry->targets);
+    free(registry->rings);
+    pthread_mutex_destroy(&(registry->lock));
+    free(registry);
+    return CHASH_ERROR_DONE;
+}
+
+// Add a target to a ring of a registry (defining the ring if needed), or change its weight within the ring
+int chash_registry_add_target(CHASH_REGISTRY *registry, const char *ring, const char *target, u_char weight)
+{
+    CHASH_REGISTRY_RING   *entry, *rings;
+    CHASH_REGISTRY_MEMBER *members;
+    u_int32_t             identifier;
+    u_int16_t             position;
+    int                   status = CHASH_ERROR_DONE;
+
+    if (! registry || ! ring || ! *ring || ! target)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    weight = weight > 100 ? 100 : weight;
+    pthread_mutex_lock(&(registry->lock));
+    if (! (entry = chash_registry_ring(registry, ring)))
+    {
+        if (! (rings = (CHASH_REGISTRY_RING *)realloc(registry->rings, (registry->rings_count + 1) * sizeof(CHASH_REGISTRY_RING))))
+        {
+            pthread_mutex_unlock(&(registry->lock));
+            return CHASH_ERROR_MEMORY;
+        }
+        registry->rings = rings;
+        entry           = &(registry->rings[registry->rings_count]);
+        memset(entry, 0, sizeof(CHASH_REGISTRY_RING));
+        if (! (entry->name = strdup(ring)))
+        {
+            pthread_mutex_unlock(&(registry->lock));
+            return CHASH_ERROR_MEMORY;
+        }
+        registry->rings_count ++;
+    }
+    if ((status = chash_registry_intern(registry, target, &identifier)) < 0)
+    {
+        pthread_mutex_unlock(&(registry->lock));
+        return status;
+    }
+    position = chash_registry_member(entry, identifier);
+    if (position < entry->count && entry->members[position].target == identifier)
+    {
+        chash_registry_unreference(registry, identifier);
+        if (entry->members[position].weight != weight)
+        {
+            entry->members[position].weight = weight;
+            chash_registry_detach(registry, entry);
+        }
+    }
+    else if (entry->count == 65535 ||
+             ! (members = (CHASH_REGISTRY_MEMBER *)realloc(entry->members, (entry->count + 1) * sizeof(CHASH_REGISTRY_MEMBER))))
+    {
+        chash_registry_unreference(registry, identifier);
+        status = entry->count == 65535 ? CHASH_ERROR_INVALID_PARAMETER : CHASH_ERROR_MEMORY;
+    }
+    else
+    {
+        entry->members = members;
+        memmove(entry->members + position + 1, entry->members + position, (entry->count - position) * sizeof(CHASH_REGISTRY_MEMBER));
+        entry->members[position].target = identifier;
+        entry->members[position].weight = weight;
+        entry->count ++;
+        chash_registry_detach(registry, entry);
+    }
+    pthread_mutex_unlock(&(registry->lock));
+    return status;
+}
+
+// Remove a target from a ring of a registry
+int chash_registry_remove_target(CHASH_REGISTRY *registry, const char *ring, const char *target)
+{
+    CHASH_REGISTRY_RING *entry;
+    u_int32_t           identifier;
+    u_int16_t           position;
+
+    if (! registry || ! ring || ! target)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    pthread_mutex_lock(&(registry->lock));
+    for (identifier = 0; identifier < registry->targets_size &&
+         (! registry->targets[identifier].name || strcmp(registry->targets[identifier].name, target)); identifier ++);
+    if (! (entry = chash_registry_ring(registry, ring)) || identifier == registry->targets_size ||
+        (position = chash_registry_member(entry, identifier)) == entry->count || entry->members[position].target != identifier)
+    {
+        pthread_mutex_unlock(&(registry->lock));
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    memmove(entry->members + position, entry->members + position + 1, (entry->count - position - 1) * sizeof(CHASH_REGISTRY_MEMBER));
+    entry->count --;
+    chash_registry_unreference(registry, identifier);
+    chash_registry_detach(registry, entry);
+    pthread_mutex_unlock(&(registry->lock));
+    return CHASH_ERROR_DONE;
+}
+
+// Remove a ring and all its members from a registry (contexts acquired for the ring staying valid until released)
+int chash_registry_remove_ring(CHASH_REGISTRY *registry, const char *ring)
+{
+    CHASH_REGISTRY_RING *entry;
+    u_int16_t           index;
+
+    if (! registry || ! ring)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    pthread_mutex_lock(&(registry->lock));
+    if (! (entry = chash_registry_ring(registry, ring)))
+    {
+        pthread_mutex_unlock(&(registry->lock));
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    chash_registry_detach(registry, entry);
+    for (index = 0; index < entry->count; index ++)
+    {
+        chash_registry_unreference(registry, entry->members[index].target);
+    }
+    free(entry->members);
+    free(entry->name);
+    registry->rings_count --;
+    memmove(entry, entry + 1, (registry->rings_count - (entry - registry->rings)) * sizeof(CHASH_REGISTRY_RING));
+    pthread_mutex_unlock(&(registry->lock));
+    return CHASH_ERROR_DONE;
+}
+
+// Get the frozen context of a ring (built on first acquisition after the ring changed, or shared with the rings having
+// the same members and weights): it stays valid, and is only used for lookups by index, until it's handed back to
+// chash_registry_release()
+int chash_registry_acquire(CHASH_REGISTRY *registry, const char *ring, CHASH_CONTEXT **output)
+{
+    CHASH_REGISTRY_RING *entry;
+    int                 status = CHASH_ERROR_DONE;
+
+    if (! registry || ! ring || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    pthread_mutex_lock(&(registry->lock));
+    if (! (entry = chash_registry_ring(registry, ring)) || ! entry->count)
+    {
+        status = CHASH_ERROR_NOT_FOUND;
+    }
+    else if (entry->continuum || (status = chash_registry_attach(registry, entry)) >= 0)
+    {
+        entry->continuum->references ++;
+        *output = &(entry->continuum->context);
+    }
+    pthread_mutex_unlock(&(registry->lock));
+    return status;
+}
+
+// Hand a ring acquired from a registry back
+int chash_registry_release(CHASH_REGISTRY *registry, CHASH_CONTEXT *context)
+{
+    CHASH_REGISTRY_CONTINUUM *continuum;
+
+    if (! registry || ! context)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    pthread_mutex_lock(&(registry->lock));
+    for (continuum = registry->continuums; continuum && &(continuum->context) != context; continuum = continuum->next);
+    if (continuum)
+    {
+        chash_registry_continuum_release(registry, continuum);
+    }
+    pthread_mutex_unlock(&(registry->lock));
+    return continuum ? CHASH_ERROR_DONE : CHASH_ERROR_NOT_FOUND;
+}
+
+// Get a registry sharing statistics (the unshared size being the continuums size rings would use on their own)
+int chash_registry_stats(CHASH_REGISTRY *registry, CHASH_REGISTRY_STATS *output)
+{
+    CHASH_REGISTRY_CONTINUUM *continuum;
+    u_int32_t                index;
+
+    if (! registry || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    memset(output, 0, sizeof(CHASH_REGISTRY_STATS));
+    pthread_mutex_lock(&(registry->lock));
+    for (index = 0; index < registry->targets_size; index ++)
+    {
+        output->targets += registry->targets[index].name ? 1 : 0;
+    }
+    for (continuum = registry->continuums; continuum; continuum = continuum->next)
+    {
+        output->continuums ++;
+        output->continuums_size += (continuum->context.items_count * sizeof(CHASH_ITEM)) + (continuum->count * sizeof(CHASH_TARGET));
+    }
+    for (index = 0; index < registry->rings_count; index ++)
+    {
+        continuum              = registry->rings[index].continuum;
+        output->unshared_size += continuum ? (continuum->context.items_count * sizeof(CHASH_ITEM)) + (continuum->count * sizeof(CHASH_TARGET)) : 0;
+    }
+    output->rings  = registry->rings_count;
+    output->builds = registry->builds;
+    output->shares = registry->shares;
+    pthread_mutex_unlock(&(registry->lock));
+    return CHASH_ERROR_DONE;
+}
+
+// Move the walk start so that down targets are skipped exactly as if they were removed from the continuum (the walk
+// starting right before the first point >= hash, or on the first point when hash is out of the continuum range)
+static u_int32_t chash_walk_start(CHASH_CONTEXT *context, const u_int64_t *down, u_int32_t hash, u_int32_t start)
+{
+    u_int32_t index;
+
+    if (! down || hash <= context->continuum[0].hash || hash > context->continuum[context->items_count - 1].hash)
+    {
+        return start;
+    }
+    for (index = start + 1; index < context->items_count && CHASH_DOWN(down, context->continuum[index].target); index ++);
+    if (index == context->items_count)
+    {
+        return 0;
+    }
+    for (index = start; index > 0 && CHASH_DOWN(down, context->continuum[index].target); index --);
+    return CHASH_DOWN(down, context->continuum[index].target) ? start : index;
+}
+
+// Walk the continuum from the given position, collecting count distinct targets indexes
+static int chash_walk(CHASH_CONTEXT *context, u_int32_t hash, u_int32_t start, u_int16_t count, u_int16_t *output)
+{
+    u_int64_t seen[(65536 / 64)], *down = __atomic_load_n(&(context->down), __ATOMIC_ACQUIRE);
+    u_int32_t step;
+    u_int16_t rank = 0, target, index;
+
+    start = chash_walk_start(context, down, hash, start);
+
+    if (count > 8)
+    {
+        memset(seen, 0, ((context->targets_count + 63) / 64) * sizeof(u_int64_t));
+    }
+    for (step = 0; rank < count && step < context->items_count; step ++, start ++)
+    {
+        if (start >= context->items_count)
+        {
+            start = 0;
+        }
+        target = context->continuum[start].target;
+        if (CHASH_DOWN(down, target))
+        {
+            continue;
+        }
+        if (count > 8)
+        {
+            if (seen[target / 64] & (1ULL << (target % 64)))
+            {
+                continue;
+            }
+            seen[target / 64] |= 1ULL << (target % 64);
+        }
+        else
+        {
+            for (index = 0; index < rank && output[index] != target; index ++);
+            if (index < rank)
+            {
+                continue;
+            }
+        }
+        output[rank ++] = target;
+    }
+    return rank;
+}
+
+// Walk continuum from start collecting count distinct targets from distinct failure domains, in ring order: targets
+// whose domain was already picked are kept aside (from the end of output) in ring order, and only returned after
+// the picked ones when there are fewer domains than requested targets, so that a single walk is always enough
+static int chash_walk_domains(CHASH_CONTEXT *context, u_int32_t hash, u_int32_t start, u_int16_t count, u_int16_t *output)
+{
+    u_int64_t seen[(65536 / 64)], used[(65536 / 64)], *down = __atomic_load_n(&(context->down), __ATOMIC_ACQUIRE);
+    u_int32_t step;
+    u_int16_t *ids = context->domains->ids, domains = context->domains->count, rank = 0, spares = 0, target, index, swap;
+    u_char    fresh;
+
+    start = chash_walk_start(context, down, hash, start);
+    if (count > 8)
+    {
+        memset(seen, 0, ((context->targets_count + 63) / 64) * sizeof(u_int64_t));
+        memset(used, 0, ((domains + 63) / 64) * sizeof(u_int64_t));
+    }
+    for (step = 0; rank < count && (rank < domains || rank + spares < count) && step < context->items_count; step ++, start ++)
+    {
+        if (start >= context->items_count)
+        {
+            start = 0;
+        }
+        target = context->continuum[start].target;
+        if (CHASH_DOWN(down, target))
+        {
+            continue;
+        }
+        if (count > 8)
+        {
+            if (seen[target / 64] & (1ULL << (target % 64)))
+            {
+                continue;
+            }
+            seen[target / 64] |= 1ULL << (target % 64);
+            fresh = ! (used[ids[target] / 64] & (1ULL << (ids[target] % 64)));
+            used[ids[target] / 64] |= 1ULL << (ids[target] % 64);
+        }
+        else
+        {
+            for (index = 0; index < rank && output[index] != target; index ++);
+            for (swap = count - spares; swap < count && output[swap] != target; swap ++);
+            if (index < rank || swap < count)
+            {
+                continue;
+            }
+            for (index = 0; index < rank && ids[output[index]] != ids[target]; index ++);
+            fresh = (index == rank);
+        }
+        if (fresh)
+        {
+            // a new domain: the latest kept aside target gives its slot up when output is full
+            spares -= (rank + spares == count) ? 1 : 0;
+            output[rank ++] = target;
+        }
+        else if (rank + spares < count)
+        {
+            output[count - (++ spares)] = target;
+        }
+    }
+
+    // move kept aside targets right after the picked ones, back in ring order
+    memmove(output + rank, output + count - spares, spares * sizeof(u_int16_t));
+    for (index = 0; index < spares / 2; index ++)
+    {
+        swap                              = output[rank + index];
+        output[rank + index]              = output[rank + spares - 1 - index];
+        output[rank + spares - 1 - index] = swap;
+    }
+    return rank + spares;
+}
+
+// Collect count distinct targets indexes for the candidate (the walk starts right before the first point >= hash),
+// spread across distinct failure domains if requested, and widened to the hot keys spread for balanced lookups of hot
+// keys (output must then hold that many targets)
+static int chash_lookup_targets(CHASH_CONTEXT *context, const char *candidate, u_int32_t length, u_int16_t count, u_int16_t *output,
+                                u_char flags)
+{
+    u_int64_t start_time;
+    u_int32_t hash, fingerprint = 0, generation = 0, start = 0, end, middle;
+    u_int16_t rank;
+    u_char    cached = 0, domains;
+    int       status;
+
+    if (! context || ! candidate || ! length || ! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_freeze(context)) < 0)
+    {
+        return status;
+    }
+    if (! context->items_count)
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    start_time = CHASH_PROBE_ENABLED(lookup_return) ? chash_now() : 0;
+    CHASH_PROBE4(lookup_entry, candidate, length, count, context->items_count);
+    count = (count < 1) ? 1 : count;
+    count = (count > context->targets_count) ? context->targets_count : count;
+    hash  = chash_mmhash2(candidate, length);
+    domains = (flags & CHASH_LOOKUP_DOMAINS) && context->domains;
+    if (context->cache || context->hotkeys)
+    {
+        fingerprint = chash_fingerprint(candidate, length);
+    }
+    if (context->hotkeys && chash_hotkeys_observe(context->hotkeys, hash, fingerprint, candidate, length) >= context->hotkeys->threshold &&
+        (flags & CHASH_LOOKUP_BALANCE) && count < context->hotkeys->spread && count < context->targets_count)
+    {
+        count = (context->hotkeys->spread > context->targets_count) ? context->targets_count : context->hotkeys->spread;
+        CHASH_STATS_ADD(context->hotkeys->spread_lookups, 1);
+    }
+    if (context->cache && count <= CHASH_CACHE_TARGETS && ! domains)
+    {
+        cached      = 1;
+        generation  = __atomic_load_n(&(context->generation), __ATOMIC_ACQUIRE);
+        if ((rank = chash_cache_get(context, generation, hash, fingerprint, count, output)))
+        {
+            CHASH_PROBE4(lookup_return, length, count, rank, start_time ? chash_now() - start_time : 0);
+            return rank;
+        }
+    }
+    if (hash > context->continuum[0].hash && hash <= context->continuum[context->items_count - 1].hash)
+    {
+        end = context->items_count - 1;
+        while (start < end)
+        {
+            middle = start + ((end - start) / 2);
+            if (context->continuum[middle].hash < hash)
+            {
+                start = middle + 1;
+            }
+            else
+            {
+                end = middle;
+            }
+        }
+        start --;
+    }
+    rank = domains ? chash_walk_domains(context, hash, start, count, output) : chash_walk(context, hash, start, count, output);
+    if (cached)
+    {
+        chash_cache_put(context, generation, hash, fingerprint, count, rank, output);
+    }
+    CHASH_PROBE4(lookup_return, length, count, rank, start_time ? chash_now() - start_time : 0);
+    return rank;
+}
+
+// Perform a lookup returning targets indexes (implicit freeze, reentrant once the context is frozen)
+int chash_lookup_index(CHASH_CONTEXT *context, const char *candidate, u_int32_t length, u_int16_t count, u_int16_t *output)
+{
+    int status;
+
+    if ((status = chash_lookup_targets(context, candidate, length, count, output, 0)) > 0 && context->stats)
+    {
+        chash_stats_lookup(context, output, status, 0, 0);
+    }
+    return status;
+}
+
+// Perform a lookup returning targets indexes spread across distinct failure domains (see chash_target_domain()), in
+// ring order (implicit freeze, reentrant once the context is frozen)
+int chash_lookup_domains(CHASH_CONTEXT *context, const char *candidate, u_int32_t length, u_int16_t count, u_int16_t *output)
+{
+    int status;
+
+    if ((status = chash_lookup_targets(context, candidate, length, count, output, CHASH_LOOKUP_DOMAINS)) > 0 && context->stats)
+    {
+        chash_stats_lookup(context, output, status, 0, 0);
+    }
+    return status;
+}
+
+// Perform lookups for a batch of candidates (implicit freeze, reentrant once the context is frozen): the continuum
+// binary searches of up to CHASH_BATCH candidates are run in lockstep, each step prefetching the next probe of every
+// candidate, so that their cache misses overlap instead of being paid one after the other
+int chash_lookup_batch(CHASH_CONTEXT *context, const char **candidates, const u_int32_t *lengths, u_int32_t size,
+                       u_int16_t count, u_int16_t *output, u_int16_t *ranks)
+{
+    u_int32_t hashes[CHASH_BATCH], fingerprints[CHASH_BATCH], starts[CHASH_BATCH], ends[CHASH_BATCH], base, middle, generation;
+    u_int16_t stride = (count < 1) ? 1 : count, *targets;
+    u_char    states[CHASH_BATCH];
+    int       status, active, block, index, rank;
+
+    if (! context || ! candidates || ! lengths || ! output || ! ranks)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_freeze(context)) < 0)
+    {
+        return status;
+    }
+    if (! context->items_count)
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    count = (stride > context->targets_count) ? context->targets_count : stride;
+    for (base = 0; base < size; base += CHASH_BATCH)
+    {
+        // hash candidates (serving cached ones right away) and start their searches
+        block      = (size - base < CHASH_BATCH) ? size - base : CHASH_BATCH;
+        generation = __atomic_load_n(&(context->generation), __ATOMIC_ACQUIRE);
+        for (active = 0, index = 0; index < block; index ++)
+        {
+            ranks[base + index] = 0;
+            states[index]       = CHASH_BATCH_DONE;
+            if (! candidates[base + index] || ! lengths[base + index])
+            {
+                continue;
+            }
+            hashes[index] = chash_mmhash2(candidates[base + index], lengths[base + index]);
+            if (context->cache || context->hotkeys)
+            {
+                fingerprints[index] = chash_fingerprint(candidates[base + index], lengths[base + index]);
+            }
+            if (context->hotkeys)
+            {
+                chash_hotkeys_observe(context->hotkeys, hashes[index], fingerprints[index], candidates[base + index], lengths[base + index]);
+            }
+            if (context->cache && count <= CHASH_CACHE_TARGETS)
+            {
+                if ((ranks[base + index] = chash_cache_get(context, generation, hashes[index], fingerprints[index], count,
+                                                           output + ((base + index) * stride))))
+                {
+                    continue;
+                }
+            }
+            starts[index] = 0;
+            ends[index]   = 0;
+            states[index] = CHASH_BATCH_WRAP;
+            if (hashes[index] > context->continuum[0].hash && hashes[index] <= context->continuum[context->items_count - 1].hash)
+            {
+                ends[index]   = context->items_count - 1;
+                states[index] = CHASH_BATCH_SEARCH;
+                __builtin_prefetch(&(context->continuum[ends[index] / 2]));
+                active ++;
+            }
+        }
+
+        // lockstep binary searches
+        while (active)
+        {
+            for (active = 0, index = 0; index < block; index ++)
+            {
+                if (states[index] == CHASH_BATCH_SEARCH && starts[index] < ends[index])
+                {
+                    middle = starts[index] + ((ends[index] - starts[index]) / 2);
+                    if (context->continuum[middle].hash < hashes[index])
+                    {
+                        starts[index] = middle + 1;
+                    }
+                    else
+                    {
+                        ends[index] = middle;
+                    }
+                    if (starts[index] < ends[index])
+                    {
+                        __builtin_prefetch(&(context->continuum[starts[index] + ((ends[index] - starts[index]) / 2)]));
+                        active ++;
+                    }
+                }
+            }
+        }
+
+        // walk continuum from each candidate position
+        for (index = 0; index < block; index ++)
+        {
+            targets = output + ((base + index) * stride);
+            if (states[index] != CHASH_BATCH_DONE)
+            {
+                rank = chash_walk(context, hashes[index], starts[index] - (states[index] == CHASH_BATCH_SEARCH ? 1 : 0), count, targets);
+                ranks[base + index] = rank;
+                if (context->cache && count <= CHASH_CACHE_TARGETS)
+                {
+                    chash_cache_put(context, generation, hashes[index], fingerprints[index], count, rank, targets);
+                }
+            }
+            if (context->stats && ranks[base + index])
+            {
+                chash_stats_lookup(context, targets, ranks[base + index], 0, 0);
+            }
+        }
+    }
+    return size;
+}
+
+// Perform a lookup into the context scratch area
+static int chash_lookup_scratch(CHASH_CONTEXT *context, const char *candidate, u_int16_t count, u_char flags)
+{
+    u_int16_t index;
+    int       status;
+
+    if (! context || ! candidate || ! *candidate)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((status = chash_freeze(context)) < 0)
+    {
+        return status;
+    }
+    // single block contexts hold a lookups scratch area already
+    if (! context->arena &&
+        (! (context->lookups = (CHASH_LOOKUP *)chash_realloc(context, context->lookups, context->targets_count * sizeof(CHASH_LOOKUP))) ||
+         ! (context->lookup = (char **)chash_realloc(context, context->lookup, context->targets_count * sizeof(char *)))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    // the lookups scratch area is large enough to hold targets_count indexes
+    if ((status = chash_lookup_targets(context, candidate, strlen(candidate), count, (u_int16_t *)context->lookups, flags)) < 0)
+    {
+        return status;
+    }
+    for (index = 0; index < status; index ++)
+    {
+        context->lookup[index] = context->targets[((u_int16_t *)context->lookups)[index]].name;
+    }
+    return status;
+}
+
+// Perform a lookup (implicit freeze)
+int chash_lookup(CHASH_CONTEXT *context, const char *candidate, u_int16_t count, char ***output)
+{
+    int status;
+
+    if ((status = chash_lookup_scratch(context, candidate, count, 0)) < 0)
+    {
+        return status;
+    }
+    if (context->stats)
+    {
+        chash_stats_lookup(context, (u_int16_t *)context->lookups, status, 0, 0);
+    }
+    if (output)
+    {
+        *output = context->lookup;
+    }
+    return status;
+}
+
+// Balanced lookups weight of a looked up target (its continuum points in weighted mode, 1 otherwise), the primary
+// target weight being scaled by 1 + the balance bias
+static double chash_balance_weight(CHASH_CONTEXT *context, u_int16_t target, u_int16_t primary)
+{
+    double weight = 1;
+
+    if (context->balance == CHASH_BALANCE_WEIGHTED && context->targets[target].points)
+    {
+        weight = context->targets[target].points;
+    }
+    return (target == primary) ? weight * (1 + context->balance_bias) : weight;
+}
+
+// Draw a looked up target rank in [start, count) with a probability proportional to its balance weight
+static u_int16_t chash_balance_draw(CHASH_CONTEXT *context, const u_int16_t *targets, u_int16_t start, u_int16_t count,
+                                    u_int16_t primary, u_int64_t seed)
+{
+    double    total = 0, draw;
+    u_int16_t index;
+
+    for (index = start; index < count; index ++)
+    {
+        total += chash_balance_weight(context, targets[index], primary);
+    }
+    draw = (double)(chash_mix(seed) >> 11) * (total / 9007199254740992.0);
+    for (index = start; index + 1 < count; index ++)
+    {
+        if ((draw -= chash_balance_weight(context, targets[index], primary)) < 0)
+        {
+            break;
+        }
+    }
+    return index;
+}
+
+// Pick the balanced target rank among looked up targets, uniformly at random unless a balance mode or bias is set
+static u_int16_t chash_balance_pick(CHASH_CONTEXT *context, const u_int16_t *targets, u_int16_t count)
+{
+    if (! chash_rand_initialized)
+    {
+        srand(getpid() + time(NULL));
+        chash_rand_initialized = 1;
+    }
+    if (context->balance == CHASH_BALANCE_UNIFORM && context->balance_bias == 0)
+    {
+        return rand() % count;
+    }
+    return chash_balance_draw(context, targets, 0, count, targets[0], ((u_int64_t)rand() << 31) ^ (u_int64_t)rand());
+}
+
+// Perform a lookup and randomly balance among results
+int chash_lookup_balance(CHASH_CONTEXT *context, const char *candidate, u_int16_t count, char **output)
+{
+    int status, index;
+
+    if ((status = chash_lookup_scratch(context, candidate, count, CHASH_LOOKUP_BALANCE)) < 0)
+    {
+        return status;
+    }
+    if (! status)
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    index = chash_balance_pick(context, (u_int16_t *)context->lookups, status);
+    if (context->stats)
+    {
+        chash_stats_lookup(context, ((u_int16_t *)context->lookups) + index, 1, 1, status < (count ? count : 1));
+    }
+    if (output)
+    {
+        *output = context->lookup[index];
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Perform a lookup and randomly balance among results, returning the chosen target index (implicit freeze, reentrant
+// once the context is frozen)
+int chash_lookup_balance_index(CHASH_CONTEXT *context, const char *candidate, u_int32_t length, u_int16_t count, u_int16_t *output)
+{
+    u_int16_t targets[CHASH_BALANCE], *buffer = targets, size = count;
+    int       status, index;
+
+    if (! output)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (context && context->hotkeys && context->hotkeys->spread > size)
+    {
+        size = context->hotkeys->spread;
+    }
+    if (size > CHASH_BALANCE && ! (buffer = (u_int16_t *)chash_malloc(context, size * sizeof(u_int16_t))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    if ((status = chash_lookup_targets(context, candidate, length, count, buffer, CHASH_LOOKUP_BALANCE)) > 0)
+    {
+        index = chash_balance_pick(context, buffer, status);
+        if (context->stats)
+        {
+            chash_stats_lookup(context, buffer + index, 1, 1, status < (count ? count : 1));
+        }
+        *output = buffer[index];
+        status  = CHASH_ERROR_DONE;
+    }
+    else if (! status)
+    {
+        status = CHASH_ERROR_NOT_FOUND;
+    }
+    if (buffer != targets)
+    {
+        chash_free(context, buffer);
+    }
+    return status;
+}
+
+// Perform a lookup and order the results by weighted sampling without replacement (see chash_balance_mode()), the order
+// only depending on the given per-request seed so that retries walking it land on a different target each time
+// (implicit freeze, reentrant once the context is frozen)
+int chash_lookup_balance_order(CHASH_CONTEXT *context, const char *candidate, u_int32_t length, u_int16_t count, u_int64_t seed,
+                               u_int16_t *output)
+{
+    u_int16_t primary, rank, index, target;
+    int       status;
+
+    if ((status = chash_lookup_targets(context, candidate, length, count, output, 0)) <= 0)
+    {
+        return status;
+    }
+    primary = output[0];
+    for (rank = 0; rank + 1 < status; rank ++)
+    {
+        // each rank gets its own draw out of the seed, the drawn target being swapped into place
+        index         = chash_balance_draw(context, output, rank, status, primary, seed + ((u_int64_t)(rank + 1) * 0x9e3779b97f4a7c15ULL));
+        target        = output[rank];
+        output[rank]  = output[index];
+        output[index] = target;
+    }
+    if (context->stats)
     {
-        return CHASH_ERROR_NOT_INITIALIZED;
+        chash_stats_lookup(context, output, 1, 1, status < (count ? count : 1));
     }
-    context->frozen = 0;
-    return CHASH_ERROR_DONE;
+    return status;
 }
 
-// Initialize context
-int chash_initialize(CHASH_CONTEXT *context, u_char force)
+// Set the balanced lookups mode (CHASH_BALANCE_UNIFORM or CHASH_BALANCE_WEIGHTED to pick targets in proportion to their
+// continuum points) and the primary target bias (its weight being scaled by 1 + bias, 0 for no bias)
+int chash_balance_mode(CHASH_CONTEXT *context, u_char mode, double bias)
 {
-    if (! context)
+    if (! context || mode > CHASH_BALANCE_WEIGHTED || ! (bias >= 0))
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if (context->magic == CHASH_MAGIC && ! force)
+    if (context->magic != CHASH_MAGIC)
     {
-        return CHASH_ERROR_ALREADY_INITIALIZED;
+        return CHASH_ERROR_NOT_INITIALIZED;
     }
-    memset(context, 0, sizeof(CHASH_CONTEXT));
-    context->magic = CHASH_MAGIC;
+    context->balance      = mode;
+    context->balance_bias = bias;
     return CHASH_ERROR_DONE;
 }
 
-// Terminate context (free memory)
-int chash_terminate(CHASH_CONTEXT *context, u_char force)
+// Enable (with the given number of per-thread shards) or disable (0 shards) runtime statistics
+int chash_stats_enable(CHASH_CONTEXT *context, u_int16_t shards)
 {
-    u_int16_t index;
+    struct CHASH_STATS_STATE *stats;
 
     if (! context)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if (context->magic != CHASH_MAGIC && ! force)
+    if (context->magic != CHASH_MAGIC)
     {
         return CHASH_ERROR_NOT_INITIALIZED;
     }
-    if (context->targets)
+    if (context->stats)
     {
-        for (index = 0; index < context->targets_count; index ++)
-        {
-            free(context->targets[index].name);
-        }
-        free(context->targets);
+        free(context->stats->selections);
+        free(context->stats->shards);
+        free(context->stats);
+        context->stats = NULL;
     }
-    if (context->continuum)
+    if (! shards)
+    {
+        return CHASH_ERROR_DONE;
+    }
+    if (! (stats = (struct CHASH_STATS_STATE *)calloc(1, sizeof(struct CHASH_STATS_STATE))))
     {
-        free(context->continuum);
+        return CHASH_ERROR_MEMORY;
     }
-    if (context->lookups)
+    if (posix_memalign((void **)&(stats->shards), 64, shards * sizeof(CHASH_STATS_SHARD)))
     {
-        free(context->lookups);
+        free(stats);
+        return CHASH_ERROR_MEMORY;
     }
-    if (context->lookup)
+    memset(stats->shards, 0, shards * sizeof(CHASH_STATS_SHARD));
+    stats->shards_count = shards;
+    context->stats      = stats;
+    if (context->frozen)
     {
-        free(context->lookup);
+        chash_stats_resize(context);
     }
-    memset(context, 0, sizeof(CHASH_CONTEXT));
     return CHASH_ERROR_DONE;
 }
 
-// Add target to context
-int chash_add_target(CHASH_CONTEXT *context, const char *target, u_char weight)
+// Aggregate runtime statistics (output->selections MUST be freed by the caller)
+int chash_stats_get(CHASH_CONTEXT *context, CHASH_STATS *output)
 {
-    u_int16_t index = 0;
-    int       status;
+    struct CHASH_STATS_STATE *stats;
+    u_int16_t                shard, target;
 
-    if (! target)
+    if (! context || ! output)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if ((status = chash_unfreeze(context)) < 0)
+    if (context->magic != CHASH_MAGIC)
     {
-        return status;
+        return CHASH_ERROR_NOT_INITIALIZED;
     }
-    weight = weight > 100 ? 100 : weight;
-    if (context->targets)
+    if (! (stats = context->stats))
     {
-        for (index = 0; index < context->targets_count; index ++)
-        {
-            if (! strcmp(target, context->targets[index].name))
-            {
-                context->targets[index].weight = weight;
-                break;
-            }
-        }
+        return CHASH_ERROR_NOT_FOUND;
     }
-    if (index == context->targets_count)
+    memset(output, 0, sizeof(CHASH_STATS));
+    if (stats->targets_count && ! (output->selections = (u_int64_t *)calloc(stats->targets_count, sizeof(u_int64_t))))
     {
-        if (! (context->targets = (CHASH_TARGET *)realloc(context->targets,
-                                                          (context->targets_count + 1) * sizeof(CHASH_TARGET))))
-        {
-            context->targets_count = 0;
-            return CHASH_ERROR_MEMORY;
-        }
-        if (! (context->targets[context->targets_count].name = strdup(target)))
+        return CHASH_ERROR_MEMORY;
+    }
+    for (shard = 0; shard < stats->shards_count; shard ++)
+    {
+        output->lookups           += __atomic_load_n(&(stats->shards[shard].lookups), __ATOMIC_RELAXED);
+        output->balance_lookups   += __atomic_load_n(&(stats->shards[shard].balance_lookups), __ATOMIC_RELAXED);
+        output->balance_fallbacks += __atomic_load_n(&(stats->shards[shard].balance_fallbacks), __ATOMIC_RELAXED);
+        for (target = 0; output->selections && target < stats->targets_count; target ++)
         {
-            return CHASH_ERROR_MEMORY;
+            output->selections[target] += __atomic_load_n(&(stats->shards[shard].selections[target]), __ATOMIC_RELAXED);
         }
-        context->targets[context->targets_count].weight = weight;
-        context->targets_count ++;
     }
+    output->freezes        = stats->freezes;
+    output->freeze_time    = stats->freeze_time;
+    memcpy(output->freeze_histogram, stats->freeze_histogram, sizeof(output->freeze_histogram));
+    output->continuum_size = context->frozen ? context->items_count * sizeof(CHASH_ITEM) : 0;
+    output->targets_count  = stats->targets_count;
     return CHASH_ERROR_DONE;
 }
 
-// Remove target from context
-int chash_remove_target(CHASH_CONTEXT *context, const char *target)
+// Reset runtime statistics counters
+int chash_stats_reset(CHASH_CONTEXT *context)
 {
-    u_int16_t index;
-    int       status;
+    struct CHASH_STATS_STATE *stats;
+    u_int16_t                shard;
 
-    if (! target)
+    if (! context)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if ((status = chash_unfreeze(context)) < 0)
+    if (context->magic != CHASH_MAGIC)
     {
-        return status;
+        return CHASH_ERROR_NOT_INITIALIZED;
     }
-    if (context->targets)
+    if (! (stats = context->stats))
     {
-        for (index = 0; index < context->targets_count; index ++)
-        {
-            if (! strcmp(target, context->targets[index].name))
-            {
-                memmove(&(context->targets[index]), &(context->targets[index + 1]),
-                        sizeof(CHASH_TARGET) * (context->targets_count - index - 1));
-                context->targets_count --;
-                return CHASH_ERROR_DONE;
-            }
-        }
+        return CHASH_ERROR_NOT_FOUND;
     }
-    return CHASH_ERROR_NOT_FOUND;
-}
-
-// Clear all targets from context
-int chash_clear_targets(CHASH_CONTEXT *context)
-{
-    u_int16_t index;
-    int       status;
-
-    if ((status = chash_unfreeze(context)) < 0)
+    for (shard = 0; shard < stats->shards_count; shard ++)
     {
-        return status;
+        stats->shards[shard].lookups           = 0;
+        stats->shards[shard].balance_lookups   = 0;
+        stats->shards[shard].balance_fallbacks = 0;
     }
-    if (context->targets)
+    stats->freezes     = 0;
+    stats->freeze_time = 0;
+    memset(stats->freeze_histogram, 0, sizeof(stats->freeze_histogram));
+    if (stats->selections)
     {
-        for (index = 0; index < context->targets_count; index ++)
-        {
-            free(context->targets[index].name);
-        }
-        free(context->targets);
-        context->targets       = NULL;
-        context->targets_count = 0;
+        memset(stats->selections, 0, stats->shards_count * ((stats->targets_count + 7) & ~7) * sizeof(u_int64_t));
     }
     return CHASH_ERROR_DONE;
 }
 
-// Return targets count within context
-int chash_targets_count(CHASH_CONTEXT *context)
+// Enable (with room for at least the given number of lookups results) or disable (0 entries) the lookups cache
+int chash_cache_enable(CHASH_CONTEXT *context, u_int32_t entries)
 {
+    struct CHASH_CACHE_STATE *cache;
+    u_int32_t                sets = 1;
+
     if (! context)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
@@ -290,229 +4579,214 @@ int chash_targets_count(CHASH_CONTEXT *context)
     {
         return CHASH_ERROR_NOT_INITIALIZED;
     }
-    return context->targets_count;
-}
-
-// Save context into a memory chunk (implicit freeze)
-int chash_serialize(CHASH_CONTEXT *context, u_char **output)
-{
-    int status, index, size, position = 0, length;
-
-    if (! context || ! output)
+    if (context->cache)
     {
-        return CHASH_ERROR_INVALID_PARAMETER;
+        free(context->cache->entries);
+        free(context->cache);
+        context->cache = NULL;
     }
-    if ((status = chash_freeze(context)) < 0)
+    if (! entries)
     {
-        return status;
+        return CHASH_ERROR_DONE;
     }
-    size = (2 * sizeof(u_int32_t)) + sizeof(u_int16_t);
-    for (index = 0; index < context->targets_count; index ++)
+    while (sets < CHASH_CACHE_SETS && sets * CHASH_CACHE_WAYS < entries)
     {
-        size += strlen(context->targets[index].name) + 2;
+        sets <<= 1;
     }
-    size += sizeof(u_int32_t) + (context->items_count * sizeof(CHASH_ITEM));
-    if (! (*output = calloc(1, size)))
+    if (posix_memalign((void **)&cache, 64, sizeof(struct CHASH_CACHE_STATE)))
     {
         return CHASH_ERROR_MEMORY;
     }
-    *(u_int32_t *)((*output) + position) = size; position += sizeof(u_int32_t);
-    *(u_int32_t *)((*output) + position) = CHASH_MAGIC; position += sizeof(u_int32_t);
-    *(u_int16_t *)((*output) + position) = context->targets_count; position += sizeof(u_int16_t);
-    for (index = 0; index < context->targets_count; index ++)
+    memset(cache, 0, sizeof(struct CHASH_CACHE_STATE));
+    if (posix_memalign((void **)&(cache->entries), 64, sets * CHASH_CACHE_WAYS * sizeof(CHASH_CACHE_ENTRY)))
     {
-        *((*output) + position) = context->targets[index].weight; position += sizeof(u_char);
-        length = strlen(context->targets[index].name) + 1;
-        memcpy((*output) + position, context->targets[index].name, length); position += length;
+        free(cache);
+        return CHASH_ERROR_MEMORY;
     }
-    *(u_int32_t *)((*output) + position) = context->items_count; position += sizeof(u_int32_t);
-    memcpy((*output) + position, context->continuum, context->items_count * sizeof(CHASH_ITEM));
-    return size;
+    memset(cache->entries, 0, sets * CHASH_CACHE_WAYS * sizeof(CHASH_CACHE_ENTRY));
+    cache->sets_count = sets;
+    context->cache    = cache;
+    return CHASH_ERROR_DONE;
 }
 
-// Restore context from a memory chunk (implicit freeze)
-int chash_unserialize(CHASH_CONTEXT *context, const u_char *input, u_int32_t size)
+// Sort hot keys by decreasing lookups count
+static int chash_sort_hotkeys(const void *element1, const void *element2)
 {
-    int index, position = (2 * sizeof(u_int32_t)) + sizeof(u_int16_t);
+    const CHASH_HOTKEY *hotkey1 = (const CHASH_HOTKEY *)element1, *hotkey2 = (const CHASH_HOTKEY *)element2;
 
-    if (! context || ! input || size < (3 * sizeof(u_int32_t)) + sizeof(u_int16_t))
+    return (hotkey1->count < hotkey2->count) ? 1 : (hotkey1->count > hotkey2->count ? -1 : 0);
+}
+
+// Enable (or disable, with a 0 threshold) hot keys detection: keys estimated to have been looked up at least threshold
+// times (within the last one to two windows of lookups) use at least spread targets in balanced lookups
+int chash_hotkeys_enable(CHASH_CONTEXT *context, u_int32_t threshold, u_int32_t window, u_int16_t spread)
+{
+    struct CHASH_HOTKEYS_STATE *hotkeys;
+
+    if (! context)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if (*(u_int32_t *)input != size || *(u_int32_t *)(input + sizeof(u_int32_t)) != CHASH_MAGIC)
+    if (context->magic != CHASH_MAGIC)
+    {
+        return CHASH_ERROR_NOT_INITIALIZED;
+    }
+    if (threshold && ! spread)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    chash_terminate(context, 0);
-    context->targets_count = *(u_int16_t *)(input + (2 * sizeof(u_int32_t)));
-    if (! context->targets_count)
+    if (context->hotkeys)
     {
-        return CHASH_ERROR_NOT_FOUND;
+        free(context->hotkeys->counters);
+        free(context->hotkeys);
+        context->hotkeys = NULL;
     }
-    if (! (context->targets = (CHASH_TARGET *)malloc(context->targets_count * sizeof(CHASH_TARGET))))
+    if (! threshold)
     {
-        context->targets_count = 0;
-        return CHASH_ERROR_MEMORY;
+        return CHASH_ERROR_DONE;
     }
-    for (index = 0; index < context->targets_count; index ++)
+    if (! (hotkeys = (struct CHASH_HOTKEYS_STATE *)calloc(1, sizeof(struct CHASH_HOTKEYS_STATE))))
     {
-        context->targets[index].weight = *(input + position);
-        context->targets[index].name   = strdup((const char *)(input + position + 1));
-        position += sizeof(u_char) + strlen((const char *)(input + position + 1)) + 1;
+        return CHASH_ERROR_MEMORY;
     }
-    context->items_count = *(u_int32_t *)(input + position);
-    if (! (context->continuum = (CHASH_ITEM *)malloc(context->items_count * sizeof(CHASH_ITEM))))
+    if (posix_memalign((void **)&(hotkeys->counters), 64, CHASH_HOTKEYS_DEPTH * CHASH_HOTKEYS_WIDTH * sizeof(u_int32_t)))
     {
-        context->items_count = 0;
+        free(hotkeys);
         return CHASH_ERROR_MEMORY;
     }
-    memcpy(context->continuum, input + position + sizeof(u_int32_t), context->items_count * sizeof(CHASH_ITEM));
-    context->magic  = CHASH_MAGIC;
-    context->frozen = 1;
-    return context->items_count;
+    memset(hotkeys->counters, 0, CHASH_HOTKEYS_DEPTH * CHASH_HOTKEYS_WIDTH * sizeof(u_int32_t));
+    hotkeys->threshold = threshold;
+    hotkeys->window    = window ? window : CHASH_HOTKEYS_WINDOW;
+    hotkeys->decay     = hotkeys->window;
+    hotkeys->spread    = spread;
+    context->hotkeys   = hotkeys;
+    return CHASH_ERROR_DONE;
 }
 
-// Save context into a file (implicit freeze)
-int chash_file_serialize(CHASH_CONTEXT *context, const char *path)
+// Return hot keys detection settings and the currently hot keys (by decreasing estimated lookups count)
+int chash_hotkeys_get(CHASH_CONTEXT *context, CHASH_HOTKEYS *output)
 {
-    u_char *serialized;
-    int    status, output;
+    struct CHASH_HOTKEYS_STATE *hotkeys;
+    u_int32_t                  estimate;
+    u_int16_t                  index;
 
-    if (! context || ! path || ! *path)
+    if (! context || ! output)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if ((status = chash_serialize(context, &serialized)) < 0)
+    if (context->magic != CHASH_MAGIC)
     {
-        return status;
+        return CHASH_ERROR_NOT_INITIALIZED;
     }
-    if ((output = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0755)) < 0)
+    if (! (hotkeys = context->hotkeys))
     {
-        free(serialized);
-        return CHASH_ERROR_IO;
+        return CHASH_ERROR_NOT_FOUND;
     }
-    if (write(output, serialized, status) != status)
+    memset(output, 0, sizeof(CHASH_HOTKEYS));
+    output->threshold      = hotkeys->threshold;
+    output->window         = hotkeys->window;
+    output->spread         = hotkeys->spread;
+    output->observed       = CHASH_LOAD(hotkeys->observed);
+    output->spread_lookups = CHASH_LOAD(hotkeys->spread_lookups);
+    while (__atomic_exchange_n(&(hotkeys->lock), 1, __ATOMIC_ACQUIRE));
+    for (index = 0; index < hotkeys->count; index ++)
     {
-        close(output);
-        free(serialized);
-        return CHASH_ERROR_IO;
+        if ((estimate = chash_hotkeys_estimate(hotkeys, hotkeys->top[index].hash, hotkeys->top[index].fingerprint)) >= hotkeys->threshold)
+        {
+            output->keys[output->count].count  = estimate;
+            output->keys[output->count].length = hotkeys->top[index].length;
+            memcpy(output->keys[output->count].key, hotkeys->top[index].key, hotkeys->top[index].length);
+            output->count ++;
+        }
     }
-    close(output);
-    free(serialized);
-    return status;
+    __atomic_store_n(&(hotkeys->lock), 0, __ATOMIC_RELEASE);
+    qsort(output->keys, output->count, sizeof(CHASH_HOTKEY), chash_sort_hotkeys);
+    return CHASH_ERROR_DONE;
 }
 
-// Restore context from a file (implicit freeze)
-int chash_file_unserialize(CHASH_CONTEXT *context, const char *path)
+// Set the number of threads used to build the continuum (0 or 1 for a single-threaded freeze)
+int chash_freeze_threads(CHASH_CONTEXT *context, u_int16_t threads)
 {
-    struct stat info;
-    u_char      *serialized;
-    int         status, input;
-
-    if (! context || ! path || ! *path)
+    if (! context || threads > CHASH_FREEZE_THREADS)
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if (stat(path, &info) < 0 || (input = open(path, O_RDONLY)) < 0)
-    {
-        return CHASH_ERROR_IO;
-    }
-    if (! (serialized = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, input, 0)))
+    if (context->magic != CHASH_MAGIC)
     {
-        close(input);
-        return CHASH_ERROR_IO;
+        return CHASH_ERROR_NOT_INITIALIZED;
     }
-    status = chash_unserialize(context, serialized, info.st_size);
-    munmap(serialized, info.st_size);
-    close(input);
-    return status;
+    context->freeze_threads = threads;
+    return CHASH_ERROR_DONE;
 }
 
-// Perform a lookup (implicit freeze)
-static int chash_sort16(const void *element1, const void *element2)
-{
-    return (*(u_int16_t *)element1 > *(u_int16_t *)element2) ? 1 : -1;
-}
-int chash_lookup(CHASH_CONTEXT *context, const char *candidate, u_int16_t count, char ***output)
+// Set the continuum pages options (CHASH_PAGES_HUGE and/or CHASH_PAGES_LOCK, 0 for regular heap memory), applied to
+// the continuum of a frozen context right away and on every later freeze or unserialize
+int chash_continuum_pages(CHASH_CONTEXT *context, u_char pages)
 {
-    u_int32_t hash, start = 0, range;
-    u_int16_t rank = 1, index;
-    int       status;
+    CHASH_ITEM *continuum;
+    u_int64_t  mapped;
+    int        status;
 
-    if (! context || ! candidate || ! *candidate)
+    if (! context || (pages & ~(CHASH_PAGES_HUGE | CHASH_PAGES_LOCK)))
     {
         return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if ((status = chash_freeze(context)) < 0)
-    {
-        return status;
-    }
-    if (! (context->lookups = (CHASH_LOOKUP *)realloc(context->lookups, context->targets_count * sizeof(CHASH_LOOKUP))))
-    {
-        return CHASH_ERROR_MEMORY;
-    }
-    if (! (context->lookup = (char **)realloc(context->lookup, context->targets_count * sizeof(char *))))
-    {
-        return CHASH_ERROR_MEMORY;
-    }
-    memset(context->lookups, 0, context->targets_count * sizeof(CHASH_LOOKUP));
-    memset(context->lookup, 0, context->targets_count * sizeof(char *));
-    hash = chash_mmhash2(candidate, -1);
-    if (hash > context->continuum[0].hash && hash <= context->continuum[context->items_count - 1].hash)
+    if (context->magic != CHASH_MAGIC)
     {
-        start = context->items_count / 2;
-        range = start / 2;
-        while (1)
-        {
-            if (hash > context->continuum[start].hash && hash <= context->continuum[start + 1].hash)
-            {
-                break;
-            }
-            start += (hash > context->continuum[start].hash) ? range : -range;
-            range /= 2;
-            range  = range < 1 ? 1 : range;
-        }
+        return CHASH_ERROR_NOT_INITIALIZED;
     }
-    count = (count < 1) ? 1 : count;
-    count = (count > context->targets_count) ? context->targets_count : count;
-    while (rank <= count && start < context->items_count)
+    context->pages = pages;
+    if (! context->frozen || context->shm)
     {
-        if (! context->lookups[context->continuum[start].target].rank)
-        {
-            context->lookups[context->continuum[start].target].rank   = rank ++;
-            context->lookups[context->continuum[start].target].target = context->continuum[start].target;
-        }
-        start ++;
+        return CHASH_ERROR_DONE;
     }
-    qsort(context->lookups, context->targets_count, sizeof(CHASH_LOOKUP), chash_sort16);
-    for (index = context->targets_count - count; index < context->targets_count; index ++)
+    if (context->arena)
     {
-        context->lookup[index - (context->targets_count - count)] = context->targets[context->lookups[index].target].name;
+        return (status = chash_arena_build(context, context)) < 0 ? status : CHASH_ERROR_DONE;
     }
-    if (output)
+    if (! (continuum = (CHASH_ITEM *)chash_pages_allocate(context, context->items_count * sizeof(CHASH_ITEM), &mapped)))
     {
-        *output = context->lookup;
+        return CHASH_ERROR_MEMORY;
     }
-    return count;
+    memcpy(continuum, context->continuum, context->items_count * sizeof(CHASH_ITEM));
+    chash_pages_release(context, context->continuum, context->pages_size);
+    context->continuum  = continuum;
+    context->pages_size = mapped;
+    return CHASH_ERROR_DONE;
 }
 
-// Perform a lookup and randomly balance among results
-int chash_lookup_balance(CHASH_CONTEXT *context, const char *candidate, u_int16_t count, char **output)
+// Aggregate lookups cache counters
+int chash_cache_stats(CHASH_CONTEXT *context, CHASH_CACHE_STATS *output)
 {
-    int status;
+    struct CHASH_CACHE_STATE *cache;
+    u_int32_t                index;
 
-    if ((status = chash_lookup(context, candidate, count, NULL)) < 0)
+    if (! context || ! output)
     {
-        return status;
+        return CHASH_ERROR_INVALID_PARAMETER;
     }
-    if (! chash_rand_initialized)
+    if (context->magic != CHASH_MAGIC)
     {
-        srand(getpid() + time(NULL));
-        chash_rand_initialized = 1;
+        return CHASH_ERROR_NOT_INITIALIZED;
     }
-    if (output)
+    if (! (cache = context->cache))
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    memset(output, 0, sizeof(CHASH_CACHE_STATS));
+    output->entries = cache->sets_count * CHASH_CACHE_WAYS;
+    for (index = 0; index < output->entries; index ++)
+    {
+        if (CHASH_LOAD(cache->entries[index].count) && CHASH_LOAD(cache->entries[index].generation) == context->generation)
+        {
+            output->used ++;
+        }
+    }
+    for (index = 0; index < CHASH_CACHE_SHARDS; index ++)
     {
-        *output = context->lookup[rand() % status];
+        output->hits      += CHASH_LOAD(cache->shards[index].hits);
+        output->misses    += CHASH_LOAD(cache->shards[index].misses);
+        output->evictions += CHASH_LOAD(cache->shards[index].evictions);
     }
     return CHASH_ERROR_DONE;
 }
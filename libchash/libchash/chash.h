@@ -20,12 +20,24 @@ extern "C"{
 #define CHASH_ERROR_NOT_INITIALIZED      (-12)
 #define CHASH_ERROR_NOT_FOUND            (-13)
 
+#define CHASH_STATS_BUCKETS              (24)
+#define CHASH_CACHE_TARGETS              (6)
+#define CHASH_HOTKEYS_TOP                (32)
+#define CHASH_HOTKEYS_KEY                (64)
+#define CHASH_POINTS_MAXIMUM             (100 * 128)
+#define CHASH_PAGES_HUGE                 (0x01)
+#define CHASH_PAGES_LOCK                 (0x02)
+#define CHASH_BALANCE_UNIFORM            (0)
+#define CHASH_BALANCE_WEIGHTED           (1)
+
 #pragma pack(push, 1)
 
 typedef struct
 {
     u_char       weight;
     char         *name;
+    char         *domain;
+    u_int32_t    points;
 } CHASH_TARGET;
 typedef struct
 {
@@ -38,6 +50,18 @@ typedef struct
     u_int16_t    target;
 } CHASH_LOOKUP;
 typedef struct
+{
+    void         *(*allocate)(size_t, void *);
+    void         *(*reallocate)(void *, size_t, void *);
+    void         (*release)(void *, void *);
+    void         *opaque;
+} CHASH_ALLOCATOR;
+
+#pragma pack(pop)
+
+// The context is not packed: its down targets bitmap pointer and generation counter are accessed atomically by
+// concurrent lookups and down marks, and must be naturally aligned wherever the context is embedded
+typedef struct
 {
     u_int32_t    magic;
     u_char       frozen;
@@ -47,23 +71,144 @@ typedef struct
     CHASH_ITEM   *continuum;
     CHASH_LOOKUP *lookups;
     char         **lookup;
+    struct CHASH_STATS_STATE *stats;
+    u_int32_t    generation;
+    struct CHASH_CACHE_STATE *cache;
+    struct CHASH_SHM_STATE   *shm;
+    u_int16_t    freeze_threads;
+    struct CHASH_DOMAINS_STATE *domains;
+    u_int64_t    *down;
+    struct CHASH_HOTKEYS_STATE *hotkeys;
+    CHASH_ALLOCATOR allocator;
+    void         *arena;
+    u_char       pages;
+    u_int64_t    pages_size;
+    u_int64_t    checksum;
+    u_int32_t    checksum_generation;
+    u_char       balance;
+    double       balance_bias;
 } CHASH_CONTEXT;
 
+#pragma pack(push, 1)
+
+typedef struct
+{
+    u_int64_t    lookups;
+    u_int64_t    balance_lookups;
+    u_int64_t    balance_fallbacks;
+    u_int64_t    freezes;
+    u_int64_t    freeze_time;
+    u_int64_t    freeze_histogram[CHASH_STATS_BUCKETS];
+    u_int32_t    continuum_size;
+    u_int16_t    targets_count;
+    u_int64_t    *selections;
+} CHASH_STATS;
+typedef struct
+{
+    u_int32_t    entries;
+    u_int32_t    used;
+    u_int64_t    hits;
+    u_int64_t    misses;
+    u_int64_t    evictions;
+} CHASH_CACHE_STATS;
+typedef struct
+{
+    u_int32_t    count;
+    u_int16_t    length;
+    char         key[CHASH_HOTKEYS_KEY];
+} CHASH_HOTKEY;
+typedef struct
+{
+    u_int32_t    threshold;
+    u_int32_t    window;
+    u_int16_t    spread;
+    u_int64_t    observed;
+    u_int64_t    spread_lookups;
+    u_int16_t    count;
+    CHASH_HOTKEY keys[CHASH_HOTKEYS_TOP];
+} CHASH_HOTKEYS;
+typedef struct CHASH_WATCH_STATE CHASH_WATCH;
+typedef struct
+{
+    u_int32_t    generation;
+    u_int64_t    reloads;
+    u_int64_t    failures;
+    int32_t      error;
+    u_int64_t    reload_time;
+    u_int64_t    reload_time_total;
+    u_char       notify;
+} CHASH_WATCH_STATS;
+typedef struct CHASH_REGISTRY_STATE CHASH_REGISTRY;
+typedef struct
+{
+    u_int32_t    targets;
+    u_int32_t    rings;
+    u_int32_t    continuums;
+    u_int64_t    builds;
+    u_int64_t    shares;
+    u_int64_t    continuums_size;
+    u_int64_t    unshared_size;
+} CHASH_REGISTRY_STATS;
+
 #pragma pack(pop)
 
 // Public API
 int chash_initialize(CHASH_CONTEXT *, u_char);
 int chash_terminate(CHASH_CONTEXT *, u_char);
+int chash_set_allocator(CHASH_CONTEXT *, const CHASH_ALLOCATOR *);
+int chash_compact(CHASH_CONTEXT *);
+int chash_clone(CHASH_CONTEXT *, CHASH_CONTEXT *);
 int chash_add_target(CHASH_CONTEXT *, const char *, u_char);
 int chash_remove_target(CHASH_CONTEXT *, const char *);
+int chash_target_domain(CHASH_CONTEXT *, const char *, const char *);
+int chash_target_down(CHASH_CONTEXT *, const char *, u_char);
+int chash_target_down_index(CHASH_CONTEXT *, u_int16_t, u_char);
+int chash_target_points(CHASH_CONTEXT *, const char *, u_int32_t);
+int chash_rebalance(CHASH_CONTEXT *, const double *, double, double, double);
 int chash_clear_targets(CHASH_CONTEXT *);
 int chash_targets_count(CHASH_CONTEXT *);
 int chash_serialize(CHASH_CONTEXT *, u_char **);
 int chash_unserialize(CHASH_CONTEXT *, const u_char *, u_int32_t);
 int chash_file_serialize(CHASH_CONTEXT *, const char *);
 int chash_file_unserialize(CHASH_CONTEXT *, const char *);
+int chash_checksum(CHASH_CONTEXT *, u_int64_t *);
+int chash_delta(CHASH_CONTEXT *, CHASH_CONTEXT *, u_char **);
+int chash_delta_apply(CHASH_CONTEXT *, const u_char *, u_int32_t);
 int chash_lookup(CHASH_CONTEXT *, const char *, u_int16_t, char ***);
 int chash_lookup_balance(CHASH_CONTEXT *, const char *, u_int16_t, char **);
+int chash_lookup_index(CHASH_CONTEXT *, const char *, u_int32_t, u_int16_t, u_int16_t *);
+int chash_lookup_batch(CHASH_CONTEXT *, const char **, const u_int32_t *, u_int32_t, u_int16_t, u_int16_t *, u_int16_t *);
+int chash_lookup_balance_index(CHASH_CONTEXT *, const char *, u_int32_t, u_int16_t, u_int16_t *);
+int chash_lookup_domains(CHASH_CONTEXT *, const char *, u_int32_t, u_int16_t, u_int16_t *);
+int chash_lookup_balance_order(CHASH_CONTEXT *, const char *, u_int32_t, u_int16_t, u_int64_t, u_int16_t *);
+int chash_balance_mode(CHASH_CONTEXT *, u_char, double);
+int chash_stats_enable(CHASH_CONTEXT *, u_int16_t);
+int chash_stats_get(CHASH_CONTEXT *, CHASH_STATS *);
+int chash_stats_reset(CHASH_CONTEXT *);
+int chash_cache_enable(CHASH_CONTEXT *, u_int32_t);
+int chash_cache_stats(CHASH_CONTEXT *, CHASH_CACHE_STATS *);
+int chash_hotkeys_enable(CHASH_CONTEXT *, u_int32_t, u_int32_t, u_int16_t);
+int chash_hotkeys_get(CHASH_CONTEXT *, CHASH_HOTKEYS *);
+int chash_freeze_threads(CHASH_CONTEXT *, u_int16_t);
+int chash_continuum_pages(CHASH_CONTEXT *, u_char);
+int chash_shm_publish(CHASH_CONTEXT *, const char *);
+int chash_shm_attach(CHASH_CONTEXT *, const char *);
+int chash_shm_refresh(CHASH_CONTEXT *);
+int chash_shm_unlink(const char *);
+int chash_watch_start(CHASH_WATCH **, const char *, u_int32_t, u_char);
+int chash_watch_stop(CHASH_WATCH *);
+int chash_watch_reload(CHASH_WATCH *);
+int chash_watch_acquire(CHASH_WATCH *, CHASH_CONTEXT **);
+int chash_watch_release(CHASH_WATCH *, CHASH_CONTEXT *);
+int chash_watch_stats(CHASH_WATCH *, CHASH_WATCH_STATS *);
+int chash_registry_create(CHASH_REGISTRY **);
+int chash_registry_destroy(CHASH_REGISTRY *);
+int chash_registry_add_target(CHASH_REGISTRY *, const char *, const char *, u_char);
+int chash_registry_remove_target(CHASH_REGISTRY *, const char *, const char *);
+int chash_registry_remove_ring(CHASH_REGISTRY *, const char *);
+int chash_registry_acquire(CHASH_REGISTRY *, const char *, CHASH_CONTEXT **);
+int chash_registry_release(CHASH_REGISTRY *, CHASH_CONTEXT *);
+int chash_registry_stats(CHASH_REGISTRY *, CHASH_REGISTRY_STATS *);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,717 @@
+// Consistent hashing library - C++ wrapper
+// pyke@dailymotion.com - 05/2009
+
+#ifndef __CHASH_HPP_INCLUDE
+#define __CHASH_HPP_INCLUDE
+
+// Mandatory includes
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#if __has_include(<span>)
+#include <span>
+#endif
+#include "chash.h"
+
+namespace chash
+{
+
+// Public constants
+constexpr uint16_t BATCH_SIZE     = 64;
+constexpr uint16_t LOOKUP_MAXIMUM = 64;
+
+// Frozen rings buckets index size (about BUCKETS_LOAD points per bucket, up to 2^BUCKETS_BITS buckets)
+constexpr uint32_t BUCKETS_LOAD    = 4;
+constexpr uint32_t BUCKETS_BITS    = 20;
+
+// Contiguous views used for lookups outputs (std::span when available, an equivalent subset otherwise)
+#if defined(__cpp_lib_span)
+template <typename T> using span = std::span<T>;
+#else
+template <typename T> class span
+{
+public:
+    constexpr span() noexcept : data_(nullptr), size_(0) {}
+    constexpr span(T *data, size_t size) noexcept : data_(data), size_(size) {}
+    template <size_t N> constexpr span(T (&data)[N]) noexcept : data_(data), size_(N) {}
+    template <typename Container, typename = std::enable_if_t<std::is_convertible_v<decltype(std::declval<Container &>().data()), T *>>>
+    constexpr span(Container &container) noexcept : data_(container.data()), size_(container.size()) {}
+    template <typename U, typename = std::enable_if_t<std::is_convertible_v<U (*)[], T (*)[]>>>
+    constexpr span(const span<U> &other) noexcept : data_(other.data()), size_(other.size()) {}
+
+    constexpr T *data() const noexcept { return data_; }
+    constexpr size_t size() const noexcept { return size_; }
+    constexpr bool empty() const noexcept { return ! size_; }
+    constexpr T &operator[](size_t index) const noexcept { return data_[index]; }
+    constexpr T *begin() const noexcept { return data_; }
+    constexpr T *end() const noexcept { return data_ + size_; }
+    constexpr span first(size_t count) const noexcept { return span(data_, count); }
+    constexpr span subspan(size_t offset, size_t count) const noexcept { return span(data_ + offset, count); }
+
+private:
+    T      *data_;
+    size_t size_;
+};
+#endif
+
+// Errors raised by rings construction and modification (lookups never throw and return the C API status instead)
+class Error : public std::runtime_error
+{
+public:
+    explicit Error(int status) : std::runtime_error(message(status)), status_(status) {}
+    int status() const noexcept { return status_; }
+
+    static int check(int status)
+    {
+        if (status < 0)
+        {
+            throw Error(status);
+        }
+        return status;
+    }
+
+private:
+    static const char *message(int status) noexcept
+    {
+        switch (status)
+        {
+            case CHASH_ERROR_MEMORY:              return "Memory allocation error";
+            case CHASH_ERROR_IO:                  return "File I/O error";
+            case CHASH_ERROR_INVALID_PARAMETER:   return "Invalid parameter";
+            case CHASH_ERROR_ALREADY_INITIALIZED: return "Context already initialized";
+            case CHASH_ERROR_NOT_INITIALIZED:     return "Context not initialized";
+            case CHASH_ERROR_NOT_FOUND:           return "No element found";
+            default:                              return "Unknown CHash error";
+        }
+    }
+
+    int status_;
+};
+
+namespace detail
+{
+
+// Owned context (heap allocated so that moving a ring never moves the context itself)
+class Context
+{
+public:
+    Context() : context_(new CHASH_CONTEXT)
+    {
+        chash_initialize(context_, 0);
+    }
+    Context(Context &&other) noexcept : context_(std::exchange(other.context_, nullptr)) {}
+    Context &operator=(Context &&other) noexcept
+    {
+        if (this != &other)
+        {
+            release();
+            context_ = std::exchange(other.context_, nullptr);
+        }
+        return *this;
+    }
+    Context(const Context &) = delete;
+    Context &operator=(const Context &) = delete;
+    ~Context() { release(); }
+
+    CHASH_CONTEXT *get() const noexcept { return context_; }
+
+private:
+    void release() noexcept
+    {
+        if (context_)
+        {
+            chash_terminate(context_, 0);
+            delete context_;
+            context_ = nullptr;
+        }
+    }
+
+    CHASH_CONTEXT *context_;
+};
+
+// NUL-terminated copy of a name, on the stack for usual lengths
+class Name
+{
+public:
+    explicit Name(std::string_view name)
+    {
+        if (name.size() < sizeof(buffer_))
+        {
+            std::memcpy(buffer_, name.data(), name.size());
+            buffer_[name.size()] = 0;
+            name_ = buffer_;
+        }
+        else
+        {
+            string_.assign(name.data(), name.size());
+            name_ = string_.c_str();
+        }
+    }
+    operator const char *() const noexcept { return name_; }
+
+private:
+    char        buffer_[256];
+    std::string string_;
+    const char  *name_;
+};
+
+// MurmurHash2 as computed by the C library for continuum points and lookups keys (the only hash frozen rings may be
+// searched with, other policies would need a continuum built with the same hash)
+struct MurmurHash2
+{
+    static uint32_t hash(const char *key, uint32_t size) noexcept
+    {
+        const uint32_t magic  = 0x5bd1e995;
+        const u_char   *data  = (const u_char *)key;
+        uint32_t       hash   = 0x4d4d4832 ^ 0xffffffff, value;
+
+        while (size >= 4)
+        {
+            std::memcpy(&value, data, sizeof(value));
+            value *= magic;
+            value ^= value >> 24;
+            value *= magic;
+            hash  *= magic;
+            hash  ^= value;
+            data  += 4;
+            size  -= 4;
+        }
+        switch (size)
+        {
+            case 3: hash ^= data[2] << 16; [[fallthrough]];
+            case 2: hash ^= data[1] << 8;  [[fallthrough]];
+            case 1: hash ^= data[0];
+                    hash *= magic;
+        }
+        hash ^= hash >> 13;
+        hash *= magic;
+        hash ^= hash >> 15;
+        return hash;
+    }
+};
+
+// Targets walk variants: a single target, a few distinct targets (deduplicated by scanning the output, as the C
+// library does up to 8 targets) or many (deduplicated with a targets bitmap)
+enum class Walk { ONE, FEW, MANY };
+
+// Frozen continuum as seen by the lookup kernels, with an optional buckets index: buckets[b] is the first continuum
+// position whose hash is not lower than b << shift, so that a key search is narrowed down to its bucket
+struct Continuum
+{
+    const CHASH_ITEM *items;
+    uint32_t         count;
+    uint16_t         targets;
+    uint32_t         shift;
+    const void       *buckets;
+};
+
+// Lookup kernel specialized on the keys hash, the targets walk and the buckets index positions type (void for a plain
+// binary search over the whole continuum), with no configuration left to test in its loops: it matches
+// chash_lookup_index() results on frozen rings without down targets, statistics, cache nor hot keys tracking (the walk
+// starts right before the first point >= hash, or on the first point when hash is out of the continuum range)
+template <typename Hash, Walk W, typename Position> struct Kernel
+{
+    static int lookup(const Continuum &continuum, const char *key, uint32_t length, uint16_t count, uint16_t *output) noexcept
+    {
+        const CHASH_ITEM *items = continuum.items;
+        uint32_t         hash, start = 0, end, middle, step;
+        uint16_t         rank = 0, target;
+
+        if (! key || ! length)
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        hash = Hash::hash(key, length);
+        if (hash > items[0].hash && hash <= items[continuum.count - 1].hash)
+        {
+            if constexpr (std::is_void_v<Position>)
+            {
+                end = continuum.count - 1;
+            }
+            else
+            {
+                start = ((const Position *)continuum.buckets)[hash >> continuum.shift];
+                end   = ((const Position *)continuum.buckets)[(hash >> continuum.shift) + 1];
+            }
+            while (start < end)
+            {
+                middle = start + ((end - start) / 2);
+                if (items[middle].hash < hash)
+                {
+                    start = middle + 1;
+                }
+                else
+                {
+                    end = middle;
+                }
+            }
+            start --;
+        }
+        if constexpr (W == Walk::ONE)
+        {
+            output[0] = items[start].target;
+            return 1;
+        }
+        else
+        {
+            uint64_t seen[W == Walk::MANY ? (65536 / 64) : 1];
+
+            count = (count > continuum.targets) ? continuum.targets : count;
+            if constexpr (W == Walk::MANY)
+            {
+                std::memset(seen, 0, ((continuum.targets + 63) / 64) * sizeof(uint64_t));
+            }
+            for (step = 0; rank < count && step < continuum.count; step ++, start ++)
+            {
+                start  = (start >= continuum.count) ? 0 : start;
+                target = items[start].target;
+                if constexpr (W == Walk::MANY)
+                {
+                    if (seen[target / 64] & (1ULL << (target % 64)))
+                    {
+                        continue;
+                    }
+                    seen[target / 64] |= 1ULL << (target % 64);
+                }
+                else
+                {
+                    uint16_t index;
+
+                    for (index = 0; index < rank && output[index] != target; index ++);
+                    if (index < rank)
+                    {
+                        continue;
+                    }
+                }
+                output[rank ++] = target;
+            }
+            return rank;
+        }
+    }
+};
+
+// Kernels of a search strategy, by targets walk
+using Lookup = int (*)(const Continuum &, const char *, uint32_t, uint16_t, uint16_t *) noexcept;
+template <typename Hash, typename Position> struct Kernels
+{
+    static constexpr Lookup walks[3] =
+    {
+        Kernel<Hash, Walk::ONE, Position>::lookup,
+        Kernel<Hash, Walk::FEW, Position>::lookup,
+        Kernel<Hash, Walk::MANY, Position>::lookup,
+    };
+};
+
+}
+
+// Frozen rings continuum search strategies (see FrozenRing::specialize())
+enum class Search
+{
+    AUTOMATIC,
+    GENERIC,
+    BINARY,
+    BUCKETS,
+};
+
+
+class FrozenRing;
+
+// Mutable ring, targets being added, changed or removed before it's frozen for lookups (see FrozenRing)
+class Ring
+{
+public:
+    Ring() = default;
+    Ring(Ring &&) noexcept = default;
+    Ring &operator=(Ring &&) noexcept = default;
+
+    Ring &add_target(std::string_view name, u_char weight)
+    {
+        Error::check(chash_add_target(context(), detail::Name(name), weight));
+        return *this;
+    }
+    Ring &remove_target(std::string_view name)
+    {
+        Error::check(chash_remove_target(context(), detail::Name(name)));
+        return *this;
+    }
+    Ring &target_domain(std::string_view name, std::string_view domain)
+    {
+        Error::check(chash_target_domain(context(), detail::Name(name), domain.empty() ? nullptr : (const char *)detail::Name(domain)));
+        return *this;
+    }
+    Ring &target_points(std::string_view name, uint32_t points)
+    {
+        Error::check(chash_target_points(context(), detail::Name(name), points));
+        return *this;
+    }
+    Ring &target_down(std::string_view name, bool down)
+    {
+        Error::check(chash_target_down(context(), detail::Name(name), down ? 1 : 0));
+        return *this;
+    }
+    Ring &clear_targets()
+    {
+        Error::check(chash_clear_targets(context()));
+        return *this;
+    }
+    Ring &freeze_threads(uint16_t threads)
+    {
+        Error::check(chash_freeze_threads(context(), threads));
+        return *this;
+    }
+    Ring &continuum_pages(u_char pages)
+    {
+        Error::check(chash_continuum_pages(context(), pages));
+        return *this;
+    }
+    Ring &balance_mode(u_char mode, double bias = 0)
+    {
+        Error::check(chash_balance_mode(context(), mode, bias));
+        return *this;
+    }
+    uint16_t targets_count() const
+    {
+        return Error::check(chash_targets_count(context()));
+    }
+    std::vector<u_char> serialize() const;
+
+    // freeze the ring for lookups (the ring being moved into the returned frozen ring)
+    FrozenRing freeze() &&;
+
+    CHASH_CONTEXT *context() const noexcept { return context_.get(); }
+
+private:
+    friend class FrozenRing;
+
+    detail::Context context_;
+};
+
+// Frozen ring used for lookups, which never allocate and may be run concurrently from multiple threads (targets
+// indexes refer to the ring targets table, see target()); rings built locally are compacted into a single block,
+// shared rings being used in place
+class FrozenRing
+{
+public:
+    explicit FrozenRing(Ring &&ring) : context_(std::move(ring.context_))
+    {
+        if (! context_.get())
+        {
+            throw Error(CHASH_ERROR_NOT_INITIALIZED);
+        }
+        if (! context_.get()->shm)
+        {
+            Error::check(chash_compact(context_.get()));
+        }
+        specialize();
+    }
+    FrozenRing(FrozenRing &&) noexcept = default;
+    FrozenRing &operator=(FrozenRing &&) noexcept = default;
+
+    static FrozenRing unserialize(span<const u_char> input)
+    {
+        Ring ring;
+
+        Error::check(chash_unserialize(ring.context(), input.data(), input.size()));
+        return FrozenRing(std::move(ring));
+    }
+    static FrozenRing load(const std::string &path)
+    {
+        Ring ring;
+
+        Error::check(chash_file_unserialize(ring.context(), path.c_str()));
+        return FrozenRing(std::move(ring));
+    }
+    static FrozenRing attach(const std::string &name)
+    {
+        Ring ring;
+
+        Error::check(chash_shm_attach(ring.context(), name.c_str()));
+        return FrozenRing(std::move(ring));
+    }
+
+    // copy the ring back into a mutable one
+    Ring edit() const
+    {
+        Ring ring;
+
+        Error::check(chash_clone(context(), ring.context()));
+        return ring;
+    }
+    std::vector<u_char> serialize() const;
+
+    // select the lookups kernels of a continuum search strategy (AUTOMATIC being BUCKETS, GENERIC always calling the C
+    // library), building the buckets index if needed; the C library is still called whenever the
+    // ring changes afterwards (see chash_target_down() or chash_shm_refresh()), or for statistics, cached or hot keys
+    // lookups (must not be called concurrently with lookups)
+    void specialize(Search search = Search::AUTOMATIC)
+    {
+        CHASH_CONTEXT *context = this->context();
+        uint32_t      bits = 1;
+
+        kernels_ = nullptr;
+        search_  = Search::GENERIC;
+        std::vector<uint16_t>().swap(buckets16_);
+        std::vector<uint32_t>().swap(buckets32_);
+        if (! context || ! context->frozen || ! context->items_count || search == Search::GENERIC)
+        {
+            return;
+        }
+        search     = (search == Search::AUTOMATIC) ? Search::BUCKETS : search;
+        continuum_ = { context->continuum, context->items_count, context->targets_count, 32, nullptr };
+        if (search == Search::BINARY)
+        {
+            kernels_ = detail::Kernels<detail::MurmurHash2, void>::walks;
+        }
+        else
+        {
+            while (bits < BUCKETS_BITS && ((uint64_t)1 << bits) * BUCKETS_LOAD < context->items_count)
+            {
+                bits ++;
+            }
+            continuum_.shift = 32 - bits;
+            if (context->items_count <= 65535)
+            {
+                continuum_.buckets = index(buckets16_, bits);
+                kernels_           = detail::Kernels<detail::MurmurHash2, uint16_t>::walks;
+            }
+            else
+            {
+                continuum_.buckets = index(buckets32_, bits);
+                kernels_           = detail::Kernels<detail::MurmurHash2, uint32_t>::walks;
+            }
+        }
+        generation_ = __atomic_load_n(&(context->generation), __ATOMIC_ACQUIRE);
+        search_     = search;
+    }
+    Search search() const noexcept { return search_; }
+
+    // lookup the key targets (as many as output holds) by index, returning the count of matching targets
+    int lookup(std::string_view key, span<uint16_t> output) const noexcept
+    {
+        const detail::Lookup *kernels;
+
+        if (output.empty())
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        if ((kernels = specialized()))
+        {
+            return kernels[walk(output.size())](continuum_, key.data(), key.size(), count(output.size()), output.data());
+        }
+        return chash_lookup_index(context(), key.data(), key.size(), count(output.size()), output.data());
+    }
+
+    // lookup the key targets (as many as output holds, up to LOOKUP_MAXIMUM) by name
+    int lookup(std::string_view key, span<std::string_view> output) const noexcept
+    {
+        const detail::Lookup *kernels;
+        uint16_t             indexes[LOOKUP_MAXIMUM], size;
+        int                  status;
+
+        if (output.empty())
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        size = output.size() > LOOKUP_MAXIMUM ? LOOKUP_MAXIMUM : output.size();
+        if ((kernels = specialized()))
+        {
+            status = kernels[walk(size)](continuum_, key.data(), key.size(), size, indexes);
+        }
+        else
+        {
+            status = chash_lookup_index(context(), key.data(), key.size(), size, indexes);
+        }
+        for (int index = 0; index < status; index ++)
+        {
+            output[index] = target(indexes[index]);
+        }
+        return status;
+    }
+
+    // lookup the key targets (as many as output holds) spread over distinct failure domains first
+    int lookup_domains(std::string_view key, span<uint16_t> output) const noexcept
+    {
+        if (output.empty())
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        return chash_lookup_domains(context(), key.data(), key.size(), count(output.size()), output.data());
+    }
+
+    // pick one of the key count first targets (balanced lookup)
+    int lookup_balance(std::string_view key, uint16_t count, uint16_t &output) const noexcept
+    {
+        return chash_lookup_balance_index(context(), key.data(), key.size(), count, &output);
+    }
+
+    // lookup the key targets (as many as output holds) ordered by weighted sampling out of a per-request seed, retries
+    // walking the order to land on a different target each time
+    int lookup_balance_order(std::string_view key, uint64_t seed, span<uint16_t> output) const noexcept
+    {
+        if (output.empty())
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        return chash_lookup_balance_order(context(), key.data(), key.size(), count(output.size()), seed, output.data());
+    }
+
+    // lookup every key of a range (of elements convertible to std::string_view) by blocks of BATCH_SIZE keys, the
+    // targets of the key i being stored from output[i * count] and their count into ranks[i], returning the count of
+    // processed keys
+    template <typename Range> int lookup_batch(const Range &keys, uint16_t count, span<uint16_t> output, span<uint16_t> ranks) const noexcept
+    {
+        const char *candidates[BATCH_SIZE];
+        u_int32_t  lengths[BATCH_SIZE];
+        size_t     stride = count ? count : 1, processed = 0, block = 0;
+        int        status;
+
+        for (const auto &key : keys)
+        {
+            std::string_view view(key);
+
+            candidates[block] = view.data();
+            lengths[block ++] = view.size();
+            if (block == BATCH_SIZE)
+            {
+                if ((status = batch(candidates, lengths, block, count, stride, processed, output, ranks)) < 0)
+                {
+                    return status;
+                }
+                processed += block;
+                block      = 0;
+            }
+        }
+        if (block)
+        {
+            if ((status = batch(candidates, lengths, block, count, stride, processed, output, ranks)) < 0)
+            {
+                return status;
+            }
+            processed += block;
+        }
+        return processed;
+    }
+
+    uint16_t targets_count() const noexcept { return context()->targets_count; }
+    uint32_t points_count() const noexcept { return context()->items_count; }
+    std::string_view target(uint16_t index) const noexcept
+    {
+        return index < context()->targets_count ? std::string_view(context()->targets[index].name) : std::string_view();
+    }
+    std::string_view domain(uint16_t index) const noexcept
+    {
+        return index < context()->targets_count && context()->targets[index].domain ?
+               std::string_view(context()->targets[index].domain) : std::string_view();
+    }
+
+    CHASH_CONTEXT *context() const noexcept { return context_.get(); }
+
+private:
+    static uint16_t count(size_t size) noexcept
+    {
+        return size > 65535 ? 65535 : size;
+    }
+    static int walk(size_t count) noexcept
+    {
+        return count == 1 ? 0 : (count <= 8 ? 1 : 2);
+    }
+
+    // kernels to use if the ring is still the one they were selected for and has no lookups side effects
+    const detail::Lookup *specialized() const noexcept
+    {
+        CHASH_CONTEXT *context = this->context();
+
+        if (! kernels_ || ! context || __atomic_load_n(&(context->down), __ATOMIC_ACQUIRE) || context->stats || context->cache ||
+            context->hotkeys || __atomic_load_n(&(context->generation), __ATOMIC_ACQUIRE) != generation_)
+        {
+            return nullptr;
+        }
+        return kernels_;
+    }
+    template <typename Position> const Position *index(std::vector<Position> &buckets, uint32_t bits)
+    {
+        uint64_t bucket;
+        uint32_t position = 0;
+
+        buckets.resize(((size_t)1 << bits) + 1);
+        for (bucket = 0; bucket <= ((uint64_t)1 << bits); bucket ++)
+        {
+            while (position < continuum_.count && continuum_.items[position].hash < (bucket << continuum_.shift))
+            {
+                position ++;
+            }
+            buckets[bucket] = position;
+        }
+        return buckets.data();
+    }
+    int batch(const char **candidates, const u_int32_t *lengths, size_t block, uint16_t count, size_t stride, size_t processed,
+              span<uint16_t> output, span<uint16_t> ranks) const noexcept
+    {
+        const detail::Lookup *kernels;
+        int                  status;
+
+        if ((processed + block) * stride > output.size() || processed + block > ranks.size())
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+
+        // specialized kernels are run key by key (searches narrowed down to a bucket being too short for the C library
+        // lockstep searches to pay off)
+        if ((kernels = specialized()))
+        {
+            for (size_t index = 0; index < block; index ++)
+            {
+                status = kernels[walk(stride)](continuum_, candidates[index], lengths[index], stride,
+                                               output.data() + ((processed + index) * stride));
+                ranks[processed + index] = status < 0 ? 0 : status;
+            }
+            return block;
+        }
+        return chash_lookup_batch(context(), candidates, lengths, block, count, output.data() + (processed * stride),
+                                  ranks.data() + processed);
+    }
+
+    detail::Context       context_;
+    detail::Continuum     continuum_ = {};
+    const detail::Lookup  *kernels_ = nullptr;
+    std::vector<uint16_t> buckets16_;
+    std::vector<uint32_t> buckets32_;
+    uint32_t              generation_ = 0;
+    Search                search_ = Search::GENERIC;
+};
+
+// Serialized ring (as produced by chash_serialize())
+inline std::vector<u_char> serialize(CHASH_CONTEXT *context)
+{
+    std::vector<u_char> output;
+    u_char              *serialized;
+    int                 size;
+
+    size = Error::check(chash_serialize(context, &serialized));
+    output.assign(serialized, serialized + size);
+    free(serialized);
+    return output;
+}
+inline std::vector<u_char> Ring::serialize() const
+{
+    return chash::serialize(context());
+}
+inline std::vector<u_char> FrozenRing::serialize() const
+{
+    return chash::serialize(context());
+}
+inline FrozenRing Ring::freeze() &&
+{
+    return FrozenRing(std::move(*this));
+}
+
+}
+
+#endif
@@ -0,0 +1,495 @@
+// Consistent hashing library - benchmark suite
+// pyke@dailymotion.com - 05/2009
+
+// Mandatory includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <time.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+#include "chash.h"
+
+// Defines
+#define LIST_MAXIMUM      (16)
+#define KEYS_UNIVERSE     (1000000)
+#define SAMPLE_LOOKUPS    (16)
+#define MOVED_KEYS        (100000)
+#define BATCH_LOOKUPS     (256)
+
+// Benchmark configuration
+static int    targets_list[LIST_MAXIMUM] = { 10, 100, 1000, 10000, 50000 }, targets_size = 5;
+static int    weights_list[LIST_MAXIMUM] = { 1, 10 }, weights_size = 2;
+static int    counts_list[LIST_MAXIMUM]  = { 1, 3 }, counts_size = 2;
+static int    uniform = 1, zipf = 1;
+static int    lookups = 200000;
+static double zipf_exponent = 1.0;
+static double points_maximum = 16000000;
+static int    cache_entries = 0;
+static int    freeze_threads = 0;
+static int    hotkeys_threshold = 0;
+static int    continuum_pages = 0;
+
+// Helper functions
+static double bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double)now.tv_sec * 1e9) + now.tv_nsec;
+}
+static int bench_list(char *value, int *list)
+{
+    char *token, *state;
+    int  size = 0;
+
+    for (token = strtok_r(value, ",", &state); token && size < LIST_MAXIMUM; token = strtok_r(NULL, ",", &state))
+    {
+        if ((list[size] = atoi(token)) > 0)
+        {
+            size ++;
+        }
+    }
+    return size;
+}
+static int bench_compare(const void *element1, const void *element2)
+{
+    return (*(double *)element1 > *(double *)element2) ? 1 : ((*(double *)element1 < *(double *)element2) ? -1 : 0);
+}
+// dTLB load misses counter of the calling thread (-1 when unavailable, e.g. without perf events permissions)
+static int bench_tlb_open(void)
+{
+#ifdef __linux__
+    struct perf_event_attr attributes;
+
+    memset(&attributes, 0, sizeof(attributes));
+    attributes.type           = PERF_TYPE_HW_CACHE;
+    attributes.size           = sizeof(attributes);
+    attributes.config         = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attributes.disabled       = 1;
+    attributes.exclude_kernel = 1;
+    attributes.exclude_hv     = 1;
+    return syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+static void bench_tlb_start(int counter)
+{
+#ifdef __linux__
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+static long long bench_tlb_stop(int counter)
+{
+    long long misses = -1;
+
+#ifdef __linux__
+    if (counter >= 0)
+    {
+        ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+        {
+            misses = -1;
+        }
+    }
+#endif
+    return misses;
+}
+static void bench_target(char *buffer, int index)
+{
+    sprintf(buffer, "10.%d.%d.%d:11211", (index >> 16) & 0xff, (index >> 8) & 0xff, index & 0xff);
+}
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [-t <targets>] [-w <weights>] [-c <counts>] [-d <distributions>] [-n <lookups>] [-s <exponent>] [-p <points>] [-C <entries>] [-F <threads>] [-K <threshold>] [-H <pages>]\n"
+            "  -t <targets>        comma-separated targets counts (default: 10,100,1000,10000,50000)\n"
+            "  -w <weights>        comma-separated targets weights (default: 1,10)\n"
+            "  -c <counts>         comma-separated lookup counts (default: 1,3)\n"
+            "  -d <distributions>  comma-separated keys distributions among uniform,zipf (default: uniform,zipf)\n"
+            "  -n <lookups>        lookups per configuration (default: 200000)\n"
+            "  -s <exponent>       zipf distribution exponent (default: 1.0)\n"
+            "  -p <points>         skip configurations with more continuum points (default: 16000000)\n"
+            "  -C <entries>        enable a lookups cache of the given size (default: disabled)\n"
+            "  -F <threads>        build continuums with the given number of threads (default: single-threaded)\n"
+            "  -K <threshold>      enable hot keys detection with the given threshold (default: disabled)\n"
+            "  -H <pages>          continuum pages options: 1 for huge pages, 2 to prefault and lock, 3 for both (default: 0)\n",
+            program);
+    exit(1);
+}
+
+// Generate lookup keys following the requested distribution
+static char *bench_keys(int distribution)
+{
+    double *cumulative = NULL, total = 0, draw;
+    char   *keys;
+    int    index, rank, start, end;
+
+    if (! (keys = malloc((size_t)lookups * 16)))
+    {
+        return NULL;
+    }
+    if (distribution)
+    {
+        if (! (cumulative = malloc(KEYS_UNIVERSE * sizeof(double))))
+        {
+            free(keys);
+            return NULL;
+        }
+        for (rank = 0; rank < KEYS_UNIVERSE; rank ++)
+        {
+            total += 1.0 / pow(rank + 1, zipf_exponent);
+            cumulative[rank] = total;
+        }
+    }
+    for (index = 0; index < lookups; index ++)
+    {
+        if (distribution)
+        {
+            draw  = ((double)rand() / RAND_MAX) * total;
+            start = 0;
+            end   = KEYS_UNIVERSE - 1;
+            while (start < end)
+            {
+                rank = (start + end) / 2;
+                if (cumulative[rank] < draw)
+                {
+                    start = rank + 1;
+                }
+                else
+                {
+                    end = rank;
+                }
+            }
+            rank = start;
+        }
+        else
+        {
+            rank = rand() % KEYS_UNIVERSE;
+        }
+        snprintf(keys + (index * 16), 16, "video%09d", rank);
+    }
+    free(cumulative);
+    return keys;
+}
+
+// Measure lookups latency and load-balance for a given count and keys distribution
+static int bench_lookups(CHASH_CONTEXT *context, int count, int distribution, char *keys, int first)
+{
+    CHASH_CACHE_STATS before, after;
+    CHASH_HOTKEYS     hotkeys;
+    double    start, *samples, average = 0, batched, mean, deviation, maximum;
+    u_int32_t *hits, lengths[BATCH_LOOKUPS];
+    u_int16_t primary, *output, ranks[BATCH_LOOKUPS];
+    const char *candidates[BATCH_LOOKUPS];
+    char      **lookup, tlb[32];
+    long long misses;
+    int       index, step, samples_count, counter;
+
+    // per-lookup latency is sampled over small batches to amortize the clock cost
+    samples_count = lookups / SAMPLE_LOOKUPS;
+    samples       = calloc(samples_count, sizeof(double));
+    hits          = calloc(context->targets_count, sizeof(u_int32_t));
+    output        = malloc(BATCH_LOOKUPS * count * sizeof(u_int16_t));
+    if (! samples || ! hits || ! output)
+    {
+        free(samples);
+        free(hits);
+        free(output);
+        return CHASH_ERROR_MEMORY;
+    }
+    memset(&before, 0, sizeof(before));
+    memset(&after, 0, sizeof(after));
+    chash_cache_stats(context, &before);
+    counter = bench_tlb_open();
+    bench_tlb_start(counter);
+    for (index = 0; index < samples_count; index ++)
+    {
+        start = bench_now();
+        for (step = 0; step < SAMPLE_LOOKUPS; step ++)
+        {
+            chash_lookup(context, keys + (((index * SAMPLE_LOOKUPS) + step) * 16), count, &lookup);
+        }
+        samples[index] = (bench_now() - start) / SAMPLE_LOOKUPS;
+        average       += samples[index] / samples_count;
+    }
+    misses = bench_tlb_stop(counter);
+    if (counter >= 0)
+    {
+        close(counter);
+    }
+    chash_cache_stats(context, &after);
+    qsort(samples, samples_count, sizeof(double), bench_compare);
+
+    // the same keys again through the batched lookup path
+    start = bench_now();
+    for (index = 0; index < lookups; index += BATCH_LOOKUPS)
+    {
+        for (step = 0; step < BATCH_LOOKUPS && index + step < lookups; step ++)
+        {
+            candidates[step] = keys + ((index + step) * 16);
+            lengths[step]    = strlen(candidates[step]);
+        }
+        chash_lookup_batch(context, candidates, lengths, step, count, output, ranks);
+    }
+    batched = (bench_now() - start) / lookups;
+    if (misses >= 0)
+    {
+        snprintf(tlb, sizeof(tlb), "%.3f", (double)misses / (samples_count * SAMPLE_LOOKUPS));
+    }
+    else
+    {
+        strcpy(tlb, "null");
+    }
+    for (index = 0; index < lookups; index ++)
+    {
+        if (chash_lookup_index(context, keys + (index * 16), strlen(keys + (index * 16)), 1, &primary) == 1)
+        {
+            hits[primary] ++;
+        }
+    }
+    for (mean = 0, maximum = 0, index = 0; index < context->targets_count; index ++)
+    {
+        mean   += hits[index];
+        maximum = hits[index] > maximum ? hits[index] : maximum;
+    }
+    mean /= context->targets_count;
+    for (deviation = 0, index = 0; index < context->targets_count; index ++)
+    {
+        deviation += pow(hits[index] - mean, 2);
+    }
+    deviation = sqrt(deviation / context->targets_count);
+    printf("%s\n     {\"count\": %d, \"distribution\": \"%s\", \"lookups\": %d,\n"
+           "      \"lookup_ns\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f, \"batch\": %.1f},\n"
+           "      \"dtlb_misses_per_lookup\": %s,\n"
+           "      \"balance\": {\"max_mean\": %.4f, \"stddev\": %.2f, \"stddev_mean\": %.4f},\n"
+           "      \"cache\": {\"entries\": %u, \"hit_rate\": %.4f},\n"
+           "      \"hotkeys\": {\"threshold\": %d, \"hot\": %u}}",
+           first ? "" : ",", count, distribution ? "zipf" : "uniform", lookups, average,
+           samples[(samples_count * 50) / 100], samples[(samples_count * 90) / 100], samples[(samples_count * 99) / 100],
+           samples[(samples_count * 999) / 1000], samples[samples_count - 1], batched, tlb,
+           mean ? maximum / mean : 0, deviation, mean ? deviation / mean : 0, after.entries,
+           after.hits + after.misses > before.hits + before.misses ?
+           (double)(after.hits - before.hits) / ((after.hits + after.misses) - (before.hits + before.misses)) : 0,
+           hotkeys_threshold, chash_hotkeys_get(context, &hotkeys) < 0 ? 0 : hotkeys.count);
+    free(samples);
+    free(hits);
+    free(output);
+    return CHASH_ERROR_DONE;
+}
+
+// Measure the fraction of keys whose primary target changes when adding then removing one target
+static int bench_moved(CHASH_CONTEXT *context, int weight, double *added, double *removed)
+{
+    u_int16_t *primaries, primary;
+    char      buffer[32];
+    int       index, moved, targets = context->targets_count;
+
+    if (! (primaries = calloc(MOVED_KEYS, sizeof(u_int16_t))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    for (index = 0; index < MOVED_KEYS; index ++)
+    {
+        snprintf(buffer, sizeof(buffer), "moved%07d", index);
+        chash_lookup_index(context, buffer, strlen(buffer), 1, &(primaries[index]));
+    }
+    bench_target(buffer, targets);
+    chash_add_target(context, buffer, weight);
+    for (moved = 0, index = 0; index < MOVED_KEYS; index ++)
+    {
+        snprintf(buffer, sizeof(buffer), "moved%07d", index);
+        chash_lookup_index(context, buffer, strlen(buffer), 1, &primary);
+        moved += (primary != primaries[index]);
+        primaries[index] = primary;
+    }
+    *added = (double)moved / MOVED_KEYS;
+    bench_target(buffer, 0);
+    chash_remove_target(context, buffer);
+    for (moved = 0, index = 0; index < MOVED_KEYS; index ++)
+    {
+        snprintf(buffer, sizeof(buffer), "moved%07d", index);
+        chash_lookup_index(context, buffer, strlen(buffer), 1, &primary);
+        // targets indexes shift down by one once target 0 is removed
+        moved += (! primaries[index] || primary != primaries[index] - 1);
+    }
+    *removed = (double)moved / MOVED_KEYS;
+    free(primaries);
+    return CHASH_ERROR_DONE;
+}
+
+// Benchmark a single ring configuration, printing a JSON object
+static int bench_run(int targets, int weight, char **keys, int first)
+{
+    CHASH_CONTEXT context, restored, changed;
+    double        start, freeze, serialize, unserialize, apply = 0, added, removed;
+    u_char        *serialized, *delta;
+    char          buffer[32];
+    int           index, count, distribution, size, delta_size = 0, items, status = 0, nested = 1;
+
+    chash_initialize(&context, 0);
+    for (index = 0; index < targets; index ++)
+    {
+        bench_target(buffer, index);
+        chash_add_target(&context, buffer, weight);
+    }
+    chash_freeze_threads(&context, freeze_threads);
+    chash_continuum_pages(&context, continuum_pages);
+
+    // freeze / serialize / unserialize timings (a first lookup implicitly freezes the context)
+    start = bench_now();
+    if ((items = chash_lookup(&context, "warmup", 1, NULL)) < 0)
+    {
+        chash_terminate(&context, 0);
+        return items;
+    }
+    freeze = bench_now() - start;
+    if ((cache_entries && (status = chash_cache_enable(&context, cache_entries)) < 0) ||
+        (hotkeys_threshold && (status = chash_hotkeys_enable(&context, hotkeys_threshold, 0, 3)) < 0))
+    {
+        chash_terminate(&context, 0);
+        return status;
+    }
+    start  = bench_now();
+    if ((size = chash_serialize(&context, &serialized)) < 0)
+    {
+        chash_terminate(&context, 0);
+        return size;
+    }
+    serialize = bench_now() - start;
+    chash_initialize(&restored, 0);
+    chash_continuum_pages(&restored, continuum_pages);
+    start = bench_now();
+    items = chash_unserialize(&restored, serialized, size);
+    unserialize = bench_now() - start;
+    free(serialized);
+
+    // one target addition shipped as a delta and patched into the restored ring
+    chash_initialize(&changed, 0);
+    bench_target(buffer, targets);
+    delta = NULL;
+    if (items >= 0 && (status = chash_clone(&context, &changed)) >= 0 && (status = chash_add_target(&changed, buffer, weight)) >= 0 &&
+        (status = delta_size = chash_delta(&context, &changed, &delta)) >= 0)
+    {
+        start  = bench_now();
+        status = chash_delta_apply(&restored, delta, delta_size);
+        apply  = bench_now() - start;
+    }
+    free(delta);
+    chash_terminate(&changed, 0);
+    chash_terminate(&restored, 0);
+    if (items < 0 || status < 0)
+    {
+        chash_terminate(&context, 0);
+        return items < 0 ? items : status;
+    }
+
+    printf("%s\n  {\"targets\": %d, \"weight\": %d, \"points\": %d, \"continuum_bytes\": %lu, \"serialized_bytes\": %d,\n"
+           "   \"bytes_per_point\": %.2f, \"freeze_ms\": %.3f, \"freeze_threads\": %d, \"pages\": %d, \"serialize_ms\": %.3f, \"unserialize_ms\": %.3f,\n"
+           "   \"delta_bytes\": %d, \"delta_apply_ms\": %.3f, \"lookups\": [",
+           first ? "" : ",", targets, weight, items, (unsigned long)items * sizeof(CHASH_ITEM), size,
+           (double)size / items, freeze / 1e6, freeze_threads, continuum_pages, serialize / 1e6, unserialize / 1e6,
+           delta_size, apply / 1e6);
+    for (count = 0; count < counts_size; count ++)
+    {
+        for (distribution = 0; distribution < 2; distribution ++)
+        {
+            if (keys[distribution])
+            {
+                if ((status = bench_lookups(&context, counts_list[count], distribution, keys[distribution], nested)) < 0)
+                {
+                    chash_terminate(&context, 0);
+                    return status;
+                }
+                nested = 0;
+            }
+        }
+    }
+    if ((status = bench_moved(&context, weight, &added, &removed)) < 0)
+    {
+        chash_terminate(&context, 0);
+        return status;
+    }
+    printf("],\n   \"moved\": {\"add_one\": %.5f, \"remove_one\": %.5f, \"ideal\": %.5f}}",
+           added, removed, 1.0 / (targets + 1));
+    fflush(stdout);
+    chash_terminate(&context, 0);
+    return CHASH_ERROR_DONE;
+}
+
+// Main program
+int main(int argc, char **argv)
+{
+    char *keys[2] = { NULL, NULL }, *token, *state;
+    int  option, targets, weight, status, first = 1;
+
+    while ((option = getopt(argc, argv, "t:w:c:d:n:s:p:C:F:K:H:h")) != -1)
+    {
+        switch (option)
+        {
+            case 't': targets_size = bench_list(optarg, targets_list); break;
+            case 'w': weights_size = bench_list(optarg, weights_list); break;
+            case 'c': counts_size  = bench_list(optarg, counts_list);  break;
+            case 'n': lookups        = atoi(optarg); break;
+            case 's': zipf_exponent  = atof(optarg); break;
+            case 'p': points_maximum = atof(optarg); break;
+            case 'C': cache_entries  = atoi(optarg); break;
+            case 'F': freeze_threads = atoi(optarg); break;
+            case 'K': hotkeys_threshold = atoi(optarg); break;
+            case 'H': continuum_pages = atoi(optarg); break;
+            case 'd':
+                uniform = zipf = 0;
+                for (token = strtok_r(optarg, ",", &state); token; token = strtok_r(NULL, ",", &state))
+                {
+                    uniform |= ! strcmp(token, "uniform");
+                    zipf    |= ! strcmp(token, "zipf");
+                }
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (lookups < SAMPLE_LOOKUPS || freeze_threads < 0 || freeze_threads > 256 || hotkeys_threshold < 0 || continuum_pages < 0 || continuum_pages > 3 || ! targets_size || ! weights_size || ! counts_size || (! uniform && ! zipf))
+    {
+        usage(argv[0]);
+    }
+    srand(42);
+    if ((uniform && ! (keys[0] = bench_keys(0))) || (zipf && ! (keys[1] = bench_keys(1))))
+    {
+        fprintf(stderr, "%s: memory allocation error\n", argv[0]);
+        return 1;
+    }
+
+    printf("{\"benchmark\": \"chash\", \"zipf_exponent\": %.2f, \"results\": [", zipf_exponent);
+    for (targets = 0; targets < targets_size; targets ++)
+    {
+        for (weight = 0; weight < weights_size; weight ++)
+        {
+            if (targets_list[targets] > 65534 ||
+                (double)targets_list[targets] * weights_list[weight] * 128 > points_maximum)
+            {
+                continue;
+            }
+            if ((status = bench_run(targets_list[targets], weights_list[weight], keys, first)) < 0)
+            {
+                fprintf(stderr, "%s: benchmark failed for %d targets (error %d)\n", argv[0], targets_list[targets], status);
+                return 1;
+            }
+            first = 0;
+        }
+    }
+    printf("\n]}\n");
+    free(keys[0]);
+    free(keys[1]);
+    return 0;
+}
@@ -0,0 +1,207 @@
+// Consistent hashing library - C++ wrapper benchmark
+// pyke@dailymotion.com - 05/2009
+
+// Mandatory includes
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <time.h>
+#include "chash.hpp"
+
+// Defines
+#define LIST_MAXIMUM  (16)
+#define KEYS_UNIVERSE (1000000)
+#define ROUNDS        (3)
+
+// Benchmark configuration
+static int targets_list[LIST_MAXIMUM] = { 10, 100, 1000, 10000 }, targets_size = 4;
+static int counts_list[LIST_MAXIMUM]  = { 1, 3, 16 }, counts_size = 3;
+static int weight = 10;
+static int lookups = 200000;
+
+// Helper functions
+static double bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((double)now.tv_sec * 1e9) + now.tv_nsec;
+}
+static int bench_list(char *value, int *list)
+{
+    char *token, *state;
+    int  size = 0;
+
+    for (token = strtok_r(value, ",", &state); token && size < LIST_MAXIMUM; token = strtok_r(NULL, ",", &state))
+    {
+        if ((list[size] = atoi(token)) > 0)
+        {
+            size ++;
+        }
+    }
+    return size;
+}
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [-t <targets>] [-w <weight>] [-c <counts>] [-n <lookups>]\n"
+            "  -t <targets>        comma-separated targets counts (default: 10,100,1000,10000)\n"
+            "  -w <weight>         targets weight (default: 10)\n"
+            "  -c <counts>         comma-separated lookup counts (default: 1,3,16, up to 64)\n"
+            "  -n <lookups>        lookups per configuration (default: 200000)\n",
+            program);
+    exit(1);
+}
+
+// Run a lookups pass over every key ROUNDS times, returning the best mean per-lookup duration in nanoseconds
+template <typename Pass> static double bench_best(const std::vector<std::string> &keys, Pass pass)
+{
+    double start, best = 0;
+
+    for (int round = 0; round < ROUNDS; round ++)
+    {
+        start = bench_now();
+        pass();
+        start = (bench_now() - start) / keys.size();
+        best  = (! round || start < best) ? start : best;
+    }
+    return best;
+}
+template <typename Lookup> static double bench_loop(const std::vector<std::string> &keys, Lookup lookup)
+{
+    return bench_best(keys, [&]()
+    {
+        for (const auto &key : keys)
+        {
+            lookup(key);
+        }
+    });
+}
+
+// Compare the C API and the C++ wrapper lookups on the same ring and keys
+static int bench_run(int targets, int count, const std::vector<std::string> &keys, int first)
+{
+    CHASH_CONTEXT             context;
+    std::vector<uint16_t>     output(keys.size() * count), ranks(keys.size());
+    std::vector<const char *> candidates(keys.size());
+    std::vector<u_int32_t>    lengths(keys.size());
+    std::string_view          names[64];
+    uint16_t                  indexes[64];
+    double                    c_names, c_index, c_batch, cpp_names, cpp_index, cpp_batch, kernels[3];
+    const chash::Search       searches[3] = { chash::Search::GENERIC, chash::Search::BINARY, chash::Search::BUCKETS };
+    const char                *automatic;
+    char                      buffer[32], **lookup;
+    int                       index, status;
+
+    chash_initialize(&context, 0);
+    chash::Ring ring;
+    for (index = 0; index < targets; index ++)
+    {
+        sprintf(buffer, "10.%d.%d.%d:11211", (index >> 16) & 0xff, (index >> 8) & 0xff, index & 0xff);
+        chash_add_target(&context, buffer, weight);
+        ring.add_target(buffer, weight);
+    }
+    if ((status = chash_compact(&context)) < 0)
+    {
+        chash_terminate(&context, 0);
+        return status;
+    }
+    chash::FrozenRing frozen = std::move(ring).freeze();
+
+    // C API: names lookups (NUL-terminated keys), indexes lookups (keys lengths computed), batched lookups
+    c_names = bench_loop(keys, [&](const std::string &key) { chash_lookup(&context, key.c_str(), count, &lookup); });
+    c_index = bench_loop(keys, [&](const std::string &key) { chash_lookup_index(&context, key.c_str(), strlen(key.c_str()), count, indexes); });
+    c_batch = bench_best(keys, [&]()
+    {
+        for (index = 0; index < (int)keys.size(); index ++)
+        {
+            candidates[index] = keys[index].c_str();
+            lengths[index]    = strlen(candidates[index]);
+        }
+        chash_lookup_batch(&context, candidates.data(), lengths.data(), keys.size(), count, output.data(), ranks.data());
+    });
+
+    // C++ wrapper: names views, indexes and batched lookups over the keys range
+    cpp_names = bench_loop(keys, [&](const std::string &key) { frozen.lookup(key, chash::span<std::string_view>(names, count)); });
+    cpp_index = bench_loop(keys, [&](const std::string &key) { frozen.lookup(key, chash::span<uint16_t>(indexes, count)); });
+    cpp_batch = bench_best(keys, [&]() { frozen.lookup_batch(keys, count, output, ranks); });
+    automatic = frozen.search() == chash::Search::BINARY ? "binary" : (frozen.search() == chash::Search::BUCKETS ? "buckets" : "generic");
+
+    // C++ wrapper indexes lookups through each continuum search strategy kernels (GENERIC calling the C library)
+    for (index = 0; index < 3; index ++)
+    {
+        frozen.specialize(searches[index]);
+        kernels[index] = bench_loop(keys, [&](const std::string &key) { frozen.lookup(key, chash::span<uint16_t>(indexes, count)); });
+    }
+
+    printf("%s\n  {\"targets\": %d, \"weight\": %d, \"points\": %u, \"count\": %d, \"lookups\": %d,\n"
+           "   \"c_ns\": {\"names\": %.1f, \"index\": %.1f, \"batch\": %.1f},\n"
+           "   \"cpp_ns\": {\"names\": %.1f, \"index\": %.1f, \"batch\": %.1f},\n"
+           "   \"kernels_ns\": {\"automatic\": \"%s\", \"generic\": %.1f, \"binary\": %.1f, \"buckets\": %.1f}}",
+           first ? "" : ",", targets, weight, frozen.points_count(), count, (int)keys.size(), c_names, c_index, c_batch,
+           cpp_names, cpp_index, cpp_batch, automatic, kernels[0], kernels[1], kernels[2]);
+    fflush(stdout);
+    chash_terminate(&context, 0);
+    return CHASH_ERROR_DONE;
+}
+
+// Main program
+int main(int argc, char **argv)
+{
+    std::vector<std::string> keys;
+    char                     buffer[16];
+    int                      option, targets, count, status, first = 1;
+
+    while ((option = getopt(argc, argv, "t:w:c:n:h")) != -1)
+    {
+        switch (option)
+        {
+            case 't': targets_size = bench_list(optarg, targets_list); break;
+            case 'c': counts_size  = bench_list(optarg, counts_list);  break;
+            case 'w': weight  = atoi(optarg); break;
+            case 'n': lookups = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (lookups < 1 || weight < 1 || weight > 255 || ! targets_size || ! counts_size)
+    {
+        usage(argv[0]);
+    }
+    for (count = 0; count < counts_size; count ++)
+    {
+        if (counts_list[count] > 64)
+        {
+            usage(argv[0]);
+        }
+    }
+    srand(42);
+    for (count = 0; count < lookups; count ++)
+    {
+        snprintf(buffer, sizeof(buffer), "video%09d", rand() % KEYS_UNIVERSE);
+        keys.push_back(buffer);
+    }
+
+    printf("{\"benchmark\": \"chash_hpp\", \"results\": [");
+    for (targets = 0; targets < targets_size; targets ++)
+    {
+        for (count = 0; count < counts_size; count ++)
+        {
+            if (targets_list[targets] > 65534)
+            {
+                continue;
+            }
+            if ((status = bench_run(targets_list[targets], counts_list[count], keys, first)) < 0)
+            {
+                fprintf(stderr, "%s: benchmark failed for %d targets (error %d)\n", argv[0], targets_list[targets], status);
+                return 1;
+            }
+            first = 0;
+        }
+    }
+    printf("\n]}\n");
+    return 0;
+}
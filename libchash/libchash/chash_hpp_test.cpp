@@ -0,0 +1,286 @@
+// Consistent hashing library - C++ wrapper tests
+// pyke@dailymotion.com - 05/2009
+
+// Mandatory includes
+#include <cstdio>
+#include <cstdlib>
+#include <cstdarg>
+#include <cstring>
+#include <array>
+#include <new>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+#include "chash.hpp"
+
+// Defines
+#define TARGETS    (100)
+#define CANDIDATES (10000)
+
+// Global allocations counter (lookups must not allocate)
+static size_t allocations = 0;
+void *operator new(size_t size)
+{
+    void *pointer;
+
+    allocations ++;
+    if (! (pointer = malloc(size ? size : 1)))
+    {
+        throw std::bad_alloc();
+    }
+    return pointer;
+}
+void operator delete(void *pointer) noexcept
+{
+    free(pointer);
+}
+void operator delete(void *pointer, size_t) noexcept
+{
+    free(pointer);
+}
+
+// Helper functions
+static struct timeval time_start;
+static int            test_steps = 0;
+static int            test_status = 0;
+static char           test_message[1024];
+
+static void test_start(const char *title)
+{
+    printf("%s ", title);
+    for (size_t index = strlen(title); index < 50; index++)
+    {
+        printf(".");
+    }
+    printf(" ");
+    fflush(stdout);
+    test_steps    = 0;
+    test_status   = 0;
+    *test_message = 0;
+    gettimeofday(&time_start, NULL);
+}
+static void test_step(int status, const char *format, ...)
+{
+    va_list arguments;
+
+    test_steps ++;
+    if (! test_status && status)
+    {
+        test_status = status;
+        if (format)
+        {
+            va_start(arguments, format);
+            vsnprintf(test_message, sizeof(test_message) - 1, format, arguments);
+            va_end(arguments);
+        }
+    }
+}
+static void test_end(const char *format, ...)
+{
+    struct timeval time_end;
+    va_list        arguments;
+    double         time_spent;
+
+    gettimeofday(&time_end, NULL);
+    time_spent = (((double)(time_end.tv_sec - time_start.tv_sec)) * 1000) +
+                 (((double)(time_end.tv_usec - time_start.tv_usec)) / 1000);
+    if (test_status)
+    {
+        printf("fail (%d", test_status);
+    }
+    else
+    {
+        printf("ok (%.3fms", time_spent);
+        if (test_steps > 1)
+        {
+            printf(" - %.3fms/step", time_spent / test_steps);
+        }
+    }
+    if (! test_status && ! *test_message && format)
+    {
+        va_start(arguments, format);
+        vsnprintf(test_message, sizeof(test_message) - 1, format, arguments);
+        va_end(arguments);
+    }
+    if (*test_message)
+    {
+        printf(" - %s", test_message);
+    }
+    printf(")\n");
+}
+
+// Main program
+int main(int argc, char **argv)
+{
+    CHASH_CONTEXT            context;
+    std::vector<std::string> keys;
+    std::vector<u_char>      serialized;
+    std::vector<uint16_t>    output(CANDIDATES * 3), expected(CANDIDATES * 3);
+    std::vector<uint16_t>    ranks(CANDIDATES);
+    std::string_view         names[3];
+    uint16_t                 indexes[3], cached[3], primary, wide[16], expected_wide[16];
+    const chash::Search      searches[3] = { chash::Search::GENERIC, chash::Search::BINARY, chash::Search::BUCKETS };
+    const uint16_t           counts[3] = { 1, 3, 16 };
+    size_t                   before;
+    char                     buffer[32];
+    int                      index, count, status;
+
+    printf("\n");
+
+    test_start("ring");
+    chash_initialize(&context, 0);
+    chash::Ring ring;
+    for (index = 1; index <= TARGETS; index ++)
+    {
+        sprintf(buffer, "target%03d", index);
+        chash_add_target(&context, buffer, 10);
+        ring.add_target(buffer, 10);
+    }
+    ring.add_target("removed", 10).remove_target("removed").target_domain("target001", "zone1").balance_mode(CHASH_BALANCE_WEIGHTED);
+    test_step(ring.targets_count() != TARGETS ? -1 : 0, "invalid targets count %d", ring.targets_count());
+    try
+    {
+        ring.remove_target("missing");
+        test_step(-1, "missing target removed");
+    }
+    catch (const chash::Error &error)
+    {
+        test_step(error.status() != CHASH_ERROR_NOT_FOUND ? -1 : 0, "invalid error %d (%s)", error.status(), error.what());
+    }
+    chash::Ring moved(std::move(ring));
+    test_step(ring.context() || moved.targets_count() != TARGETS ? -1 : 0, "ring not moved");
+    test_end("%d targets", moved.targets_count());
+
+    test_start("freeze");
+    chash::FrozenRing frozen = std::move(moved).freeze();
+    test_step(moved.context() || ! frozen.context()->frozen || ! frozen.context()->arena ? -1 : 0, "ring not frozen and compacted");
+    test_step(frozen.targets_count() != TARGETS || frozen.points_count() != TARGETS * 10 * 128 ? -1 : 0, "invalid continuum count %u",
+              frozen.points_count());
+    test_step(frozen.target(0) != "target001" || frozen.domain(0) != "zone1" || ! frozen.domain(1).empty() ||
+              ! frozen.target(TARGETS).empty() ? -1 : 0, "invalid targets views");
+    try
+    {
+        chash::Ring empty;
+        std::move(empty).freeze();
+        test_step(-1, "empty ring frozen");
+    }
+    catch (const chash::Error &error)
+    {
+        test_step(error.status() != CHASH_ERROR_NOT_FOUND ? -1 : 0, "invalid error %d", error.status());
+    }
+    test_end(NULL);
+
+    test_start("lookup");
+    for (index = 0; index < CANDIDATES; index ++)
+    {
+        keys.push_back("candidate" + std::to_string(index));
+    }
+    before = allocations;
+    for (index = 0; index < CANDIDATES; index ++)
+    {
+        test_step(frozen.lookup(keys[index], indexes) != 3 ||
+                  chash_lookup_index(&context, keys[index].c_str(), keys[index].size(), 3, cached) != 3 ||
+                  memcmp(indexes, cached, sizeof(indexes)) ? -1 : 0, "lookup mismatch for %s", keys[index].c_str());
+        test_step(frozen.lookup(keys[index], names) != 3 || names[0] != frozen.target(indexes[0]) || names[2] != frozen.target(indexes[2]) ? -1 : 0,
+                  "names lookup mismatch for %s", keys[index].c_str());
+        test_step(frozen.lookup_balance(keys[index], 3, primary) != CHASH_ERROR_DONE ||
+                  (primary != indexes[0] && primary != indexes[1] && primary != indexes[2]) ? -1 : 0, "balanced lookup mismatch");
+        test_step(frozen.lookup_balance_order(keys[index], index, cached) != 3 || (cached[0] != indexes[0] && cached[0] != indexes[1] &&
+                  cached[0] != indexes[2]) || cached[0] == cached[1] || cached[1] == cached[2] ? -1 : 0, "balanced order mismatch");
+    }
+    test_step(frozen.lookup(std::string_view(keys[0]).substr(0, 9), chash::span<uint16_t>(indexes, 1)) != 1 ||
+              chash_lookup_index(&context, "candidate", 9, 1, cached) != 1 || indexes[0] != cached[0] ? -1 : 0, "substring lookup mismatch");
+    test_step(frozen.lookup(keys[0], chash::span<uint16_t>()) != CHASH_ERROR_INVALID_PARAMETER ? -1 : 0, "empty output filled");
+    test_step(allocations != before ? -1 : 0, "%d allocations during lookups", (int)(allocations - before));
+    test_end(NULL);
+
+    test_start("lookup_batch");
+    before = allocations;
+    count = frozen.lookup_batch(keys, 3, output, ranks);
+    test_step(count != CANDIDATES ? -1 : 0, "invalid processed count %d", count);
+    for (index = 0; index < CANDIDATES; index ++)
+    {
+        chash_lookup_index(&context, keys[index].c_str(), keys[index].size(), 3, &(expected[index * 3]));
+    }
+    test_step(output != expected || ranks[0] != 3 || ranks[CANDIDATES - 1] != 3 ? -1 : 0, "batch lookup mismatch");
+    std::array<std::string_view, 3> views = { keys[7], keys[8], keys[9] };
+    test_step(frozen.lookup_batch(views, 1, output, ranks) != 3 || output[1] != expected[8 * 3] ? -1 : 0, "views batch mismatch");
+    test_step(frozen.lookup_batch(keys, 3, chash::span<uint16_t>(output.data(), 100), ranks) != CHASH_ERROR_INVALID_PARAMETER ? -1 : 0,
+              "short output accepted");
+    test_step(allocations != before ? -1 : 0, "%d allocations during batch lookups", (int)(allocations - before));
+    test_end(NULL);
+
+    test_start("kernels");
+    chash::Ring building;
+    building.add_target("small1", 1).add_target("small2", 1).add_target("small3", 2);
+    chash::FrozenRing small = std::move(building).freeze();
+    test_step(frozen.search() != chash::Search::BUCKETS || small.search() != chash::Search::BUCKETS ? -1 : 0, "invalid automatic search");
+    for (chash::FrozenRing *ring : { &frozen, &small })
+    {
+        for (index = 0; index < 3; index ++)
+        {
+            ring->specialize(searches[index]);
+            before = allocations;
+            for (count = 0; count < 3; count ++)
+            {
+                for (int key = 0; key < CANDIDATES; key += 7)
+                {
+                    status = ring->lookup(keys[key], chash::span<uint16_t>(wide, counts[count]));
+                    test_step(status != chash_lookup_index(ring->context(), keys[key].c_str(), keys[key].size(), counts[count], expected_wide) ||
+                              memcmp(wide, expected_wide, status * sizeof(uint16_t)) ? -1 : 0, "kernel mismatch for %s (search %d, count %d)",
+                              keys[key].c_str(), index, counts[count]);
+                }
+            }
+            test_step(allocations != before ? -1 : 0, "%d allocations during kernels lookups", (int)(allocations - before));
+            test_step(ring->lookup("", chash::span<uint16_t>(wide, 1)) != CHASH_ERROR_INVALID_PARAMETER ? -1 : 0, "empty key looked up");
+        }
+        ring->specialize();
+    }
+    chash_target_down_index(frozen.context(), 0, 1);
+    for (index = 0; index < CANDIDATES; index += 7)
+    {
+        status = frozen.lookup(keys[index], chash::span<uint16_t>(wide, 3));
+        test_step(status != 3 || chash_lookup_index(frozen.context(), keys[index].c_str(), keys[index].size(), 3, expected_wide) != 3 ||
+                  memcmp(wide, expected_wide, 3 * sizeof(uint16_t)) || ! wide[0] || ! wide[1] || ! wide[2] ? -1 : 0,
+                  "down target returned for %s", keys[index].c_str());
+    }
+    chash_target_down_index(frozen.context(), 0, 0);
+    test_end("%u and %u points", frozen.points_count(), small.points_count());
+
+    test_start("serialize");
+    serialized = frozen.serialize();
+    chash::FrozenRing restored = chash::FrozenRing::unserialize(serialized);
+    test_step(restored.points_count() != frozen.points_count() || restored.serialize() != serialized ? -1 : 0, "restored ring mismatch");
+    test_step(restored.lookup(keys[42], indexes) != 3 || frozen.lookup(keys[42], cached) != 3 || memcmp(indexes, cached, sizeof(indexes)) ?
+              -1 : 0, "restored lookup mismatch");
+    chash::Ring edited = restored.edit();
+    edited.add_target("target101", 10);
+    restored = std::move(edited).freeze();
+    test_step(restored.targets_count() != TARGETS + 1 || frozen.targets_count() != TARGETS ? -1 : 0, "edited ring mismatch");
+    try
+    {
+        serialized.resize(10);
+        chash::FrozenRing::unserialize(serialized);
+        test_step(-1, "truncated ring restored");
+    }
+    catch (const chash::Error &error)
+    {
+        test_step(error.status() >= 0 ? -1 : 0, NULL);
+    }
+    status = 0;
+    try
+    {
+        chash::FrozenRing::load("/tmp/chash.missing");
+    }
+    catch (const chash::Error &error)
+    {
+        status = error.status();
+    }
+    test_step(status != CHASH_ERROR_IO ? -1 : 0, "missing file loaded");
+    test_end("%d bytes", (int)frozen.serialize().size());
+
+    chash_terminate(&context, 0);
+    printf("\n");
+
+    return 0;
+}
@@ -0,0 +1,31 @@
+#!/bin/sh
+# Consistent hashing library - check that USDT probes are emitted into the shared library
+# pyke@dailymotion.com - 05/2009
+
+LIBRARY=.libs/libchash.so
+PROBES="lookup_entry lookup_return freeze_start freeze_done unserialize_start unserialize_done file_unserialize_start file_unserialize_done"
+
+if ! which readelf > /dev/null 2>&1; then
+    echo "readelf not found, skipping"
+    exit 77
+fi
+if [ ! -f "$LIBRARY" ]; then
+    echo "$LIBRARY not found (static-only build?), skipping"
+    exit 77
+fi
+
+NOTES=$(readelf -n "$LIBRARY")
+STATUS=0
+for PROBE in $PROBES; do
+    if echo "$NOTES" | grep -A 2 "stapsdt" | grep -q "Name: $PROBE\$"; then
+        echo "probe libchash:$PROBE ... ok"
+    else
+        echo "probe libchash:$PROBE ... missing"
+        STATUS=1
+    fi
+done
+if ! readelf -S "$LIBRARY" | grep -q "\.probes"; then
+    echo "probes semaphores section ... missing"
+    STATUS=1
+fi
+exit $STATUS
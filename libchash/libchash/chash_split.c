@@ -0,0 +1,326 @@
+// Consistent hashing library - bulk keys partitioner
+// pyke@dailymotion.com - 05/2009
+
+// Mandatory includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "chash.h"
+
+// Defines
+#define BUFFERS_BUDGET (64 * 1024 * 1024)
+#define BUFFER_MINIMUM (4 * 1024)
+#define BUFFER_MAXIMUM (256 * 1024)
+#define THREADS_MAXIMUM (256)
+
+// Types
+typedef struct
+{
+    u_int32_t size;
+    u_int32_t used;
+    char      *data;
+} SPLIT_BUFFER;
+typedef struct
+{
+    pthread_t    thread;
+    const char   *start, *end;
+    u_int64_t    *counts;
+    SPLIT_BUFFER *buffers;
+    int          status;
+} SPLIT_WORKER;
+
+// Static variables
+static CHASH_CONTEXT context;
+static u_int16_t     replicas = 1;
+static int           *outputs = NULL;
+
+// Helper functions
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [-t <threads>] [-r <replicas>] [-o <prefix>] <ring> <keys>\n"
+            "  -t <threads>   worker threads count (default: online CPUs count)\n"
+            "  -r <replicas>  number of distinct targets each key is routed to (default: 1)\n"
+            "  -o <prefix>    write keys into <prefix><target> files instead of printing per-target counts\n"
+            "  <ring>         serialized context (as produced by chash_file_serialize())\n"
+            "  <keys>         newline-delimited keys file\n",
+            program);
+    exit(1);
+}
+static int split_flush(SPLIT_BUFFER *buffer, int output)
+{
+    u_int32_t position = 0;
+    ssize_t   written;
+
+    while (position < buffer->used)
+    {
+        if ((written = write(output, buffer->data + position, buffer->used - position)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return CHASH_ERROR_IO;
+        }
+        position += written;
+    }
+    buffer->used = 0;
+    return CHASH_ERROR_DONE;
+}
+
+// Worker thread: route every key in [start, end[ to its target(s)
+static void *split_worker(void *argument)
+{
+    SPLIT_WORKER *worker = (SPLIT_WORKER *)argument;
+    SPLIT_BUFFER *buffer;
+    struct iovec vector[2];
+    const char   *key = worker->start, *eol;
+    u_int16_t    *lookup;
+    u_int32_t    length;
+    int          status, index;
+
+    if (! (lookup = malloc(replicas * sizeof(u_int16_t))))
+    {
+        worker->status = CHASH_ERROR_MEMORY;
+        return NULL;
+    }
+
+    while (key < worker->end)
+    {
+        if (! (eol = memchr(key, '\n', worker->end - key)))
+        {
+            eol = worker->end;
+        }
+        length = eol - key;
+        if (length && key[length - 1] == '\r')
+        {
+            length --;
+        }
+        if (length)
+        {
+            if ((status = chash_lookup_index(&context, key, length, replicas, lookup)) < 0)
+            {
+                worker->status = status;
+                break;
+            }
+            for (index = 0; index < status; index ++)
+            {
+                worker->counts[lookup[index]] ++;
+                if (worker->buffers)
+                {
+                    buffer = &(worker->buffers[lookup[index]]);
+                    if (buffer->used + length + 1 > buffer->size && (worker->status = split_flush(buffer, outputs[lookup[index]])) < 0)
+                    {
+                        break;
+                    }
+                    if (length + 1 > buffer->size)
+                    {
+                        // oversized key: bypass the buffer (a single writev() keeps the line whole with O_APPEND)
+                        vector[0].iov_base = (void *)key;
+                        vector[0].iov_len  = length;
+                        vector[1].iov_base = "\n";
+                        vector[1].iov_len  = 1;
+                        if (writev(outputs[lookup[index]], vector, 2) != length + 1)
+                        {
+                            worker->status = CHASH_ERROR_IO;
+                            break;
+                        }
+                        continue;
+                    }
+                    memcpy(buffer->data + buffer->used, key, length);
+                    buffer->data[buffer->used + length] = '\n';
+                    buffer->used += length + 1;
+                }
+            }
+            if (worker->status < 0)
+            {
+                break;
+            }
+        }
+        key = eol + 1;
+    }
+    if (worker->buffers)
+    {
+        for (index = 0; index < context.targets_count && worker->status >= 0; index ++)
+        {
+            worker->status = split_flush(&(worker->buffers[index]), outputs[index]);
+        }
+    }
+    free(lookup);
+    return NULL;
+}
+
+// Main program
+int main(int argc, char **argv)
+{
+    SPLIT_WORKER *workers;
+    struct stat  info;
+    const char   *prefix = NULL, *keys, *boundary;
+    char         path[4096], *name;
+    u_int64_t    total;
+    u_int32_t    buffer_size = 0;
+    int          option, threads, input, status, index, target;
+
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((option = getopt(argc, argv, "t:r:o:h")) != -1)
+    {
+        switch (option)
+        {
+            case 't': threads  = atoi(optarg); break;
+            case 'r': replicas = atoi(optarg); break;
+            case 'o': prefix   = optarg;       break;
+            default:  usage(argv[0]);
+        }
+    }
+    if (argc - optind != 2 || threads < 1 || replicas < 1)
+    {
+        usage(argv[0]);
+    }
+    threads = threads > THREADS_MAXIMUM ? THREADS_MAXIMUM : threads;
+
+    // load and freeze ring once, lookups are then reentrant
+    chash_initialize(&context, 0);
+    if ((status = chash_file_unserialize(&context, argv[optind])) < 0)
+    {
+        fprintf(stderr, "%s: cannot load ring from %s (error %d)\n", argv[0], argv[optind], status);
+        return 1;
+    }
+    replicas = replicas > context.targets_count ? context.targets_count : replicas;
+
+    // map keys file
+    if ((input = open(argv[optind + 1], O_RDONLY)) < 0 || fstat(input, &info) < 0)
+    {
+        fprintf(stderr, "%s: cannot open keys file %s: %s\n", argv[0], argv[optind + 1], strerror(errno));
+        return 1;
+    }
+    keys = NULL;
+    if (info.st_size && (keys = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, input, 0)) == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: cannot map keys file %s: %s\n", argv[0], argv[optind + 1], strerror(errno));
+        return 1;
+    }
+    if (keys)
+    {
+        madvise((void *)keys, info.st_size, MADV_SEQUENTIAL);
+        madvise((void *)keys, info.st_size, MADV_WILLNEED);
+    }
+
+    // open per-target outputs
+    if (prefix)
+    {
+        if (! (outputs = calloc(context.targets_count, sizeof(int))))
+        {
+            fprintf(stderr, "%s: memory allocation error\n", argv[0]);
+            return 1;
+        }
+        for (index = 0; index < context.targets_count; index ++)
+        {
+            snprintf(path, sizeof(path), "%s%s", prefix, context.targets[index].name);
+            for (name = path + strlen(prefix); *name; name ++)
+            {
+                *name = (*name == '/') ? '_' : *name;
+            }
+            if ((outputs[index] = open(path, O_CREAT | O_TRUNC | O_WRONLY | O_APPEND, 0644)) < 0)
+            {
+                fprintf(stderr, "%s: cannot create %s: %s\n", argv[0], path, strerror(errno));
+                return 1;
+            }
+        }
+        buffer_size = BUFFERS_BUDGET / (threads * context.targets_count);
+        buffer_size = buffer_size < BUFFER_MINIMUM ? BUFFER_MINIMUM : (buffer_size > BUFFER_MAXIMUM ? BUFFER_MAXIMUM : buffer_size);
+    }
+
+    // split keys file in newline-aligned chunks and start workers
+    if (! (workers = calloc(threads, sizeof(SPLIT_WORKER))))
+    {
+        fprintf(stderr, "%s: memory allocation error\n", argv[0]);
+        return 1;
+    }
+    boundary = keys;
+    for (index = 0; index < threads; index ++)
+    {
+        workers[index].start = boundary;
+        if (index == threads - 1)
+        {
+            boundary = keys + info.st_size;
+        }
+        else
+        {
+            boundary = keys + ((info.st_size * (index + 1)) / threads);
+            boundary = boundary < workers[index].start ? workers[index].start : boundary;
+            while (boundary < keys + info.st_size && boundary > keys && boundary[-1] != '\n')
+            {
+                boundary ++;
+            }
+        }
+        workers[index].end = boundary;
+        if (! (workers[index].counts = calloc(context.targets_count, sizeof(u_int64_t))))
+        {
+            fprintf(stderr, "%s: memory allocation error\n", argv[0]);
+            return 1;
+        }
+        if (prefix)
+        {
+            if (! (workers[index].buffers = calloc(context.targets_count, sizeof(SPLIT_BUFFER))))
+            {
+                fprintf(stderr, "%s: memory allocation error\n", argv[0]);
+                return 1;
+            }
+            for (target = 0; target < context.targets_count; target ++)
+            {
+                workers[index].buffers[target].size = buffer_size;
+                if (! (workers[index].buffers[target].data = malloc(buffer_size)))
+                {
+                    fprintf(stderr, "%s: memory allocation error\n", argv[0]);
+                    return 1;
+                }
+            }
+        }
+        if (pthread_create(&(workers[index].thread), NULL, split_worker, &(workers[index])) != 0)
+        {
+            fprintf(stderr, "%s: cannot start worker thread\n", argv[0]);
+            return 1;
+        }
+    }
+
+    // wait for workers and report
+    status = 0;
+    for (index = 0; index < threads; index ++)
+    {
+        pthread_join(workers[index].thread, NULL);
+        if (workers[index].status < 0)
+        {
+            fprintf(stderr, "%s: worker %d failed (error %d)\n", argv[0], index, workers[index].status);
+            status = 1;
+        }
+    }
+    for (target = 0; target < context.targets_count; target ++)
+    {
+        for (total = 0, index = 0; index < threads; index ++)
+        {
+            total += workers[index].counts[target];
+        }
+        if (! prefix)
+        {
+            printf("%s\t%llu\n", context.targets[target].name, (unsigned long long)total);
+        }
+        else
+        {
+            close(outputs[target]);
+        }
+    }
+    if (keys)
+    {
+        munmap((void *)keys, info.st_size);
+    }
+    close(input);
+    chash_terminate(&context, 0);
+    return status;
+}
@@ -3,17 +3,23 @@
 
 // Mandatory includes
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
 #include <sys/time.h>
 #include "chash.h"
 
 // Defines
 #define TARGETS       (100)
 #define CANDIDATES    (200000)
+#define BATCH         (1000)
 #define SERIALIZEPATH "/tmp/chash.serialize"
+#define WATCHPATH     "/tmp/chash.watch"
+#define RINGS         (40)
 
 // Helper functions
 static struct timeval time_start;
@@ -87,14 +93,105 @@ static void test_end(char *format, ...)
     printf(")\n");
 }
 
+// Allocator hooks counting live blocks
+static void *test_allocate(size_t size, void *opaque)
+{
+    (*(int *)opaque) ++;
+    return malloc(size);
+}
+static void *test_reallocate(void *pointer, size_t size, void *opaque)
+{
+    (*(int *)opaque) += pointer ? 0 : 1;
+    return realloc(pointer, size);
+}
+static void test_release(void *pointer, void *opaque)
+{
+    (*(int *)opaque) --;
+    free(pointer);
+}
+
+// Watched ring reader (counting lookups made on rings that didn't hold exactly the expected targets)
+static int watch_stopping = 0;
+static void *watch_reader(void *argument)
+{
+    CHASH_WATCH   *watch = (CHASH_WATCH *)argument;
+    CHASH_CONTEXT *context;
+    u_int16_t     indexes[3];
+    long          errors = 0;
+
+    while (! __atomic_load_n(&watch_stopping, __ATOMIC_RELAXED))
+    {
+        if (chash_watch_acquire(watch, &context))
+        {
+            errors ++;
+            continue;
+        }
+        if ((context->targets_count != TARGETS && context->targets_count != TARGETS + 1) ||
+            chash_lookup_index(context, "candidate", 9, 3, indexes) != 3)
+        {
+            errors ++;
+        }
+        errors += chash_watch_release(watch, context) ? 1 : 0;
+        usleep(10);
+    }
+    return (void *)errors;
+}
+
+// Replace the watched ring file (with a broken one when context is NULL) so that it's never seen partially written
+static int watch_replace(CHASH_CONTEXT *context)
+{
+    FILE *output;
+
+    if (context ? chash_file_serialize(context, WATCHPATH ".new") < 0 :
+        (! (output = fopen(WATCHPATH ".new", "w")) || fputs("broken ring", output) < 0 || fclose(output)))
+    {
+        return -1;
+    }
+    return rename(WATCHPATH ".new", WATCHPATH);
+}
+
+// Wait for a watch to publish a ring generation or report a failure (up to 5 seconds)
+static int watch_wait(CHASH_WATCH *watch, u_int32_t generation, u_int64_t failures)
+{
+    CHASH_WATCH_STATS stats;
+    int               index;
+
+    for (index = 0; index < 5000; index ++)
+    {
+        chash_watch_stats(watch, &stats);
+        if (stats.generation >= generation || stats.failures >= failures)
+        {
+            return 0;
+        }
+        usleep(1000);
+    }
+    return -1;
+}
+
 // Main program
 int main(int argc, char **argv)
 {
-    CHASH_CONTEXT context;
-    double        mean, deviation;
-    int           index, status, count, size1, size2, target, lookups[TARGETS];
-    u_char        *serialized1, *serialized2;
-    char          buffer[32], **lookup, *balance;
+    CHASH_CONTEXT context, shared, restored, cloned, weighted;
+    CHASH_ALLOCATOR allocator = { test_allocate, test_reallocate, test_release, NULL };
+    CHASH_STATS   stats;
+    CHASH_CACHE_STATS cache;
+    CHASH_HOTKEYS hotkeys;
+    CHASH_WATCH   *watch;
+    CHASH_WATCH_STATS watched;
+    CHASH_CONTEXT *current;
+    CHASH_REGISTRY *registry;
+    CHASH_REGISTRY_STATS registered;
+    CHASH_CONTEXT *rings[RINGS];
+    pthread_t     reader;
+    void          *errors;
+    double        mean, deviation, loads[TARGETS];
+    int           index, status, count, size1, size2, target, blocks = 0, lookups[TARGETS];
+    u_int16_t     indexes[TARGETS], cached[TARGETS], batch[BATCH * 3], ranks[BATCH];
+    u_int32_t     lengths[BATCH];
+    u_int64_t     checksums[2];
+    u_char        *serialized1, *serialized2, *serialized3;
+    char          buffer[32], **lookup, *balance, names[BATCH][32];
+    const char    *candidates[BATCH];
 
     printf("\n");
 
@@ -182,6 +279,38 @@ int main(int argc, char **argv)
     }
     test_end("deviation is %.2f", sqrt(deviation / TARGETS));
 
+    test_start("lookup_index");
+    for (index = 0; index < CANDIDATES; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        count = chash_lookup_index(&context, buffer, strlen(buffer), 3, indexes);
+        test_step(count != 3 ? -1 : 0, "invalid lookup count %d", count);
+        test_step(chash_lookup(&context, buffer, 3, &lookup) != 3 ||
+                  strcmp(lookup[0], context.targets[indexes[0]].name) || strcmp(lookup[1], context.targets[indexes[1]].name) ||
+                  strcmp(lookup[2], context.targets[indexes[2]].name) || indexes[0] == indexes[1] ||
+                  indexes[0] == indexes[2] || indexes[1] == indexes[2] ? -1 : 0, "lookup mismatch for %s", buffer);
+    }
+    test_end(NULL);
+
+    test_start("lookup_batch");
+    for (index = 0; index < BATCH; index ++)
+    {
+        sprintf(names[index], "candidate%07d", index);
+        candidates[index] = names[index];
+        lengths[index]    = strlen(names[index]);
+    }
+    lengths[BATCH - 1] = 0;
+    count = chash_lookup_batch(&context, candidates, lengths, BATCH, 3, batch, ranks);
+    test_step(count != BATCH ? -1 : 0, "invalid batch count %d", count);
+    for (index = 0; index < BATCH - 1; index ++)
+    {
+        test_step(ranks[index] != 3 || chash_lookup_index(&context, candidates[index], lengths[index], 3, indexes) != 3 ||
+                  memcmp(indexes, batch + (index * 3), 3 * sizeof(u_int16_t)) ? -1 : 0, "batch lookup mismatch for %s", candidates[index]);
+    }
+    test_step(ranks[BATCH - 1] ? -1 : 0, "empty candidate found");
+    test_step(chash_lookup_batch(&context, candidates, lengths, 0, 3, batch, ranks), NULL);
+    test_end(NULL);
+
     test_start("lookup_balance");
     memset(lookups, 0, sizeof(lookups));
     for (index = 0; index < CANDIDATES; index ++)
@@ -207,6 +336,773 @@ int main(int argc, char **argv)
     }
     test_end("deviation is %.2f", sqrt(deviation / 10));
 
+    test_start("lookup_balance_index");
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(&context, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_balance_index(&context, buffer, strlen(buffer), 3, cached) ? -1 : 0, NULL);
+        test_step(cached[0] != indexes[0] && cached[0] != indexes[1] && cached[0] != indexes[2] ? -1 : 0,
+                  "balanced target %d not among %s targets", cached[0], buffer);
+    }
+    test_step(chash_lookup_balance_index(&context, buffer, strlen(buffer), 100, cached), NULL);
+    test_end(NULL);
+
+    test_start("lookup_balance_order");
+    chash_initialize(&weighted, 0);
+    chash_add_target(&weighted, "heavy", 100);
+    chash_add_target(&weighted, "light1", 10);
+    chash_add_target(&weighted, "light2", 10);
+    test_step(chash_balance_mode(&weighted, 2, 0) == CHASH_ERROR_INVALID_PARAMETER &&
+              chash_balance_mode(&weighted, CHASH_BALANCE_WEIGHTED, -1) == CHASH_ERROR_INVALID_PARAMETER ? 0 : -1, "invalid mode accepted");
+    test_step(chash_balance_mode(&weighted, CHASH_BALANCE_WEIGHTED, 0), NULL);
+    memset(lookups, 0, sizeof(lookups));
+    for (index = 0; index < 12000; index ++)
+    {
+        test_step(chash_lookup_balance_order(&weighted, "candidate", 9, 3, index, indexes) != 3 ||
+                  chash_lookup_balance_order(&weighted, "candidate", 9, 3, index, cached) != 3 || memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ||
+                  indexes[0] == indexes[1] || indexes[0] == indexes[2] || indexes[1] == indexes[2] ? -1 : 0, "invalid order for seed %d", index);
+        lookups[indexes[0]] ++;
+        test_step(chash_lookup_balance(&weighted, "candidate", 3, &balance), NULL);
+        lookups[3] += strcmp(balance, "heavy") ? 0 : 1;
+    }
+    test_step(lookups[0] < 9400 || lookups[0] > 10600 || lookups[3] < 9400 || lookups[3] > 10600 ? -1 : 0,
+              "heavy target picked %d/%d times out of 12000", lookups[0], lookups[3]);
+    test_step(chash_balance_mode(&weighted, CHASH_BALANCE_UNIFORM, 3), NULL);
+    chash_lookup_index(&weighted, "candidate", 9, 1, cached);
+    for (count = 0, index = 0; index < 12000; index ++)
+    {
+        chash_lookup_balance_order(&weighted, "candidate", 9, 3, index, indexes);
+        count += indexes[0] == cached[0] ? 1 : 0;
+    }
+    test_step(count < 7400 || count > 8600 ? -1 : 0, "biased primary picked %d times out of 12000", count);
+    chash_terminate(&weighted, 0);
+    test_end("heavy target picked %d times out of 12000", lookups[0]);
+
+    test_start("stats");
+    test_step(chash_stats_get(&context, &stats) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "statistics enabled by default");
+    test_step(chash_stats_enable(&context, 4), NULL);
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        chash_lookup(&context, buffer, 2, &lookup);
+        chash_lookup_balance(&context, buffer, 3, &balance);
+    }
+    chash_add_target(&context, "target999", 10);
+    chash_lookup(&context, "candidate", 1, &lookup);
+    test_step(chash_stats_get(&context, &stats), NULL);
+    test_step(stats.lookups != 2001 || stats.balance_lookups != 1000 || stats.balance_fallbacks ? -1 : 0,
+              "invalid lookups counters %llu/%llu/%llu", (unsigned long long)stats.lookups,
+              (unsigned long long)stats.balance_lookups, (unsigned long long)stats.balance_fallbacks);
+    test_step(stats.freezes != 1 || stats.targets_count != TARGETS + 1 || ! stats.selections ||
+              stats.continuum_size != ((TARGETS * 50) + 10) * 128 * sizeof(CHASH_ITEM) ? -1 : 0,
+              "invalid freeze counters %llu/%d/%u", (unsigned long long)stats.freezes, stats.targets_count, stats.continuum_size);
+    for (count = 0, index = 0; stats.selections && index < stats.targets_count; index ++)
+    {
+        count += stats.selections[index];
+    }
+    test_step(count != 1 ? -1 : 0, "invalid selections count %d", count);
+    size1 = stats.freeze_time;
+    free(stats.selections);
+    test_step(chash_stats_reset(&context), NULL);
+    test_step(chash_stats_get(&context, &stats) || stats.lookups || stats.freezes ? -1 : 0, "statistics not reset");
+    free(stats.selections);
+    test_end("freeze took %dus", size1);
+
+    test_start("cache");
+    test_step(chash_cache_stats(&context, &cache) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "cache enabled by default");
+    test_step(chash_cache_enable(&context, 4096), NULL);
+    for (index = 0; index < 2000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        chash_lookup_index(&context, buffer, strlen(buffer), 3, indexes);
+        test_step(chash_lookup_index(&context, buffer, strlen(buffer), 3, cached) != 3 ||
+                  memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0, "cached lookup mismatch for %s", buffer);
+        test_step(chash_lookup_index(&context, buffer, strlen(buffer), 2, cached) != 2 ||
+                  memcmp(indexes, cached, 2 * sizeof(u_int16_t)) ? -1 : 0, "cached lookup mismatch for %s", buffer);
+        test_step(chash_lookup_index(&context, buffer, strlen(buffer), 5, cached) != 5 ||
+                  memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0, "cached lookup mismatch for %s", buffer);
+    }
+    test_step(chash_cache_stats(&context, &cache), NULL);
+    test_step(cache.entries != 4096 || cache.hits != 4000 || cache.misses != 4000 || ! cache.used ? -1 : 0,
+              "invalid cache counters %llu/%llu/%u", (unsigned long long)cache.hits, (unsigned long long)cache.misses, cache.used);
+    size1 = (100 * cache.hits) / (cache.hits + cache.misses);
+    chash_add_target(&context, "target998", 10);
+    chash_lookup_index(&context, "candidate", 9, 1, cached);
+    test_step(chash_cache_stats(&context, &cache) || cache.used != 1 ? -1 : 0, "cache not invalidated by freeze (%u entries)", cache.used);
+    for (index = 0; index < 2000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        chash_lookup_index(&context, buffer, strlen(buffer), 3, indexes);
+    }
+    test_step(chash_cache_stats(&context, &cache) || cache.hits != 4000 ? -1 : 0, "stale cache hits %llu", (unsigned long long)cache.hits);
+    test_step(chash_cache_enable(&context, 0), NULL);
+    test_end("hit rate is %d%%", size1);
+
+    test_start("shm");
+    sprintf(buffer, "chash_test.%d", (int)getpid());
+    chash_initialize(&shared, 0);
+    test_step(chash_shm_attach(&shared, buffer) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "unpublished ring attached");
+    test_step((size1 = chash_shm_publish(&context, buffer)) < 0 ? size1 : 0, NULL);
+    count = chash_shm_attach(&shared, buffer);
+    test_step(count != (int)context.items_count ? -1 : 0, "invalid continuum count %d", count);
+    test_step((size1 = chash_serialize(&context, &serialized1)) < 0 || (size2 = chash_serialize(&shared, &serialized2)) != size1 ||
+              memcmp(serialized1, serialized2, size1) ? -1 : 0, "shared ring mismatch");
+    free(serialized1);
+    free(serialized2);
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(&context, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_index(&shared, buffer, strlen(buffer), 3, cached) != 3 ||
+                  memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0, "shared lookup mismatch for %s", buffer);
+    }
+    sprintf(buffer, "chash_test.%d", (int)getpid());
+    test_step(chash_shm_refresh(&shared) != CHASH_ERROR_DONE ? -1 : 0, "unexpected shared ring refresh");
+    chash_add_target(&context, "target997", 10);
+    test_step((status = chash_shm_publish(&context, buffer)) < 0 ? status : 0, NULL);
+    count = chash_shm_refresh(&shared);
+    test_step(count != (int)context.items_count || shared.targets_count != context.targets_count ? -1 : 0,
+              "shared ring not refreshed (%d)", count);
+    test_step(chash_add_target(&shared, "target996", 10) || chash_targets_count(&shared) != context.targets_count + 1 ||
+              chash_lookup(&shared, "candidate", 2, &lookup) != 2 ? -1 : 0, "shared ring not detached");
+    test_step(chash_shm_refresh(&shared) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "detached ring still refreshed");
+    test_step(chash_shm_unlink(buffer), NULL);
+    test_step(chash_shm_attach(&shared, buffer) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "unlinked ring attached");
+    chash_terminate(&shared, 0);
+    test_end("shared ring is %d bytes", size1);
+
+    test_start("freeze_threads");
+    chash_initialize(&shared, 0);
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "10.0.%d.%d:11211", index / 256, index % 256);
+        chash_add_target(&shared, buffer, 1 + (index % 10));
+    }
+    test_step((size1 = chash_serialize(&shared, &serialized1)) < 0 ? size1 : 0, NULL);
+    test_step(chash_freeze_threads(&shared, 257) == CHASH_ERROR_INVALID_PARAMETER ? 0 : -1, "invalid threads count accepted");
+    for (target = 2; target <= 17; target += 5)
+    {
+        test_step(chash_freeze_threads(&shared, target), NULL);
+        chash_add_target(&shared, "target998", 1);
+        chash_remove_target(&shared, "target998");
+        test_step((size2 = chash_serialize(&shared, &serialized2)) != size1 || memcmp(serialized1, serialized2, size1) ? -1 : 0,
+                  "continuum mismatch with %d threads", target);
+        free(serialized2);
+    }
+    count = shared.items_count;
+    free(serialized1);
+    chash_terminate(&shared, 0);
+    test_end("continuum count is %d", count);
+
+    test_start("lookup_domains");
+    chash_initialize(&shared, 0);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        chash_add_target(&shared, buffer, 10);
+    }
+    for (index = 0; index < 100; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_domains(&shared, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_index(&shared, buffer, strlen(buffer), 3, cached) != 3 ||
+                  memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0, "unlabelled lookup mismatch for %s", buffer);
+    }
+    test_step(chash_target_domain(&shared, "10.0.1.0:11211", "zone0") == CHASH_ERROR_NOT_FOUND ? 0 : -1, "unknown target labelled");
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        sprintf(names[0], "zone%d", index % 5);
+        test_step(chash_target_domain(&shared, buffer, index < 25 ? names[0] : NULL), NULL);
+    }
+    test_step((size1 = chash_serialize(&shared, &serialized1)) < 0 ? size1 : 0, NULL);
+    chash_initialize(&restored, 0);
+    test_step(chash_unserialize(&restored, serialized1, size1) < 0 || ! restored.targets[0].domain ||
+              strcmp(restored.targets[0].domain, "zone0") || restored.targets[29].domain ? -1 : 0, "domains not unserialized");
+    free(serialized1);
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        count  = 3 + (index % 10);
+        status = chash_lookup_index(&shared, buffer, strlen(buffer), 30, cached);
+
+        // reference: first target of every domain in ring order (unlabelled targets being their own domain), then
+        // the remaining ones in ring order
+        for (size1 = 0, target = 0; target < status; target ++)
+        {
+            for (size2 = 0; size2 < size1 && ! (cached[target] < 25 && indexes[size2] < 25 &&
+                 ! strcmp(shared.targets[cached[target]].domain, shared.targets[indexes[size2]].domain)); size2 ++);
+            if (size2 == size1)
+            {
+                indexes[size1 ++] = cached[target];
+            }
+        }
+        for (target = 0; target < status; target ++)
+        {
+            for (size2 = 0; size2 < size1 && indexes[size2] != cached[target]; size2 ++);
+            if (size2 == size1)
+            {
+                indexes[size1 ++] = cached[target];
+            }
+        }
+        test_step(chash_lookup_domains(&shared, buffer, strlen(buffer), count, cached) != count ||
+                  memcmp(indexes, cached, count * sizeof(u_int16_t)) ? -1 : 0, "placement mismatch for %s (%d targets)", buffer, count);
+        test_step(chash_lookup_domains(&restored, buffer, strlen(buffer), count, indexes) != count ||
+                  memcmp(indexes, cached, count * sizeof(u_int16_t)) ? -1 : 0, "unserialized placement mismatch for %s", buffer);
+    }
+    chash_terminate(&restored, 0);
+    sprintf(buffer, "chash_test.%d", (int)getpid());
+    chash_initialize(&restored, 0);
+    test_step(chash_shm_publish(&shared, buffer) < 0 || chash_shm_attach(&restored, buffer) < 0 || ! restored.targets[0].domain ||
+              chash_lookup_domains(&restored, "candidate", 9, 12, indexes) != 12 ||
+              chash_lookup_domains(&shared, "candidate", 9, 12, cached) != 12 ||
+              memcmp(indexes, cached, 12 * sizeof(u_int16_t)) ? -1 : 0, "shared placement mismatch");
+    chash_shm_unlink(buffer);
+    chash_terminate(&restored, 0);
+    chash_terminate(&shared, 0);
+    test_end(NULL);
+
+    test_start("target_down");
+    test_step(offsetof(CHASH_CONTEXT, down) % sizeof(u_int64_t *) || offsetof(CHASH_CONTEXT, generation) % sizeof(u_int32_t) ? -1 : 0,
+              "atomically updated context fields are not aligned");
+    chash_initialize(&shared, 0);
+    chash_initialize(&restored, 0);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        chash_add_target(&shared, buffer, 10);
+        if (index != 7)
+        {
+            chash_add_target(&restored, buffer, 10);
+        }
+    }
+    chash_cache_enable(&shared, 1024);
+    test_step(chash_lookup_index(&shared, "candidate", 9, 3, indexes) != 3 ? -1 : 0, NULL);
+    test_step(chash_target_down(&shared, "10.0.1.0:11211", 1) == CHASH_ERROR_NOT_FOUND &&
+              chash_target_down_index(&shared, 30, 1) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "unknown target marked down");
+    test_step(chash_target_down(&shared, "10.0.0.7:11211", 1) || ! shared.frozen ? -1 : 0, "down target not marked in place");
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(names[index], "candidate%07d", index);
+        candidates[index] = names[index];
+        lengths[index]    = strlen(names[index]);
+        test_step(chash_lookup_index(&shared, names[index], lengths[index], 3, indexes) != 3 ||
+                  chash_lookup_index(&restored, names[index], lengths[index], 3, cached) != 3 ? -1 : 0, NULL);
+        for (target = 0; target < 3; target ++)
+        {
+            test_step(strcmp(shared.targets[indexes[target]].name, restored.targets[cached[target]].name) ? -1 : 0,
+                      "down lookup mismatch for %s", names[index]);
+        }
+        test_step(chash_lookup_balance_index(&shared, names[index], lengths[index], 3, cached) || cached[0] == 7 ? -1 : 0,
+                  "balanced to down target for %s", names[index]);
+    }
+    test_step(chash_lookup_batch(&shared, candidates, lengths, 1000, 3, batch, ranks) != 1000 ? -1 : 0, NULL);
+    for (index = 0; index < 1000; index ++)
+    {
+        test_step(ranks[index] != 3 || chash_lookup_index(&shared, candidates[index], lengths[index], 3, indexes) != 3 ||
+                  memcmp(indexes, batch + (index * 3), 3 * sizeof(u_int16_t)) ? -1 : 0, "down batch mismatch for %s", candidates[index]);
+    }
+    for (index = 0; index < 30; index ++)
+    {
+        chash_target_down_index(&shared, index, 1);
+    }
+    test_step(chash_lookup_index(&shared, "candidate", 9, 3, indexes) == 0 &&
+              chash_lookup_balance(&shared, "candidate", 3, &balance) == CHASH_ERROR_NOT_FOUND &&
+              chash_lookup_balance_index(&shared, "candidate", 9, 3, indexes) == CHASH_ERROR_NOT_FOUND ? 0 : -1,
+              "target found with all targets down");
+    for (index = 0; index < 30; index ++)
+    {
+        chash_target_down_index(&shared, index, index == 7);
+    }
+
+    // marks follow their targets when indexes shift, and across shared ring publications and refreshes
+    sprintf(buffer, "chash_test.%d", (int)getpid());
+    chash_terminate(&restored, 0);
+    chash_initialize(&restored, 0);
+    test_step(chash_shm_publish(&shared, buffer) < 0 || chash_shm_attach(&restored, buffer) < 0 ||
+              chash_target_down(&restored, "10.0.0.7:11211", 1) || ! restored.shm ? -1 : 0, "shared ring target not marked down");
+    chash_remove_target(&shared, "10.0.0.3:11211");
+    test_step(chash_shm_publish(&shared, buffer) < 0 || chash_shm_refresh(&restored) < 0 || restored.targets_count != 29 ? -1 : 0,
+              "shared ring not refreshed");
+    for (count = 0, index = 0; index < 1000; index ++)
+    {
+        test_step(chash_lookup_index(&shared, names[index], lengths[index], 3, indexes) != 3 ||
+                  chash_lookup_index(&restored, names[index], lengths[index], 3, cached) != 3 ||
+                  memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0, "shared down lookup mismatch for %s", names[index]);
+        for (target = 0; target < 3; target ++)
+        {
+            test_step(strcmp(shared.targets[indexes[target]].name, "10.0.0.7:11211") ? 0 : -1, "down target found for %s", names[index]);
+        }
+    }
+    test_step(chash_target_down(&shared, "10.0.0.7:11211", 0), NULL);
+    for (index = 0; index < 1000; index ++)
+    {
+        chash_lookup_index(&shared, names[index], lengths[index], 1, indexes);
+        count += ! strcmp(shared.targets[indexes[0]].name, "10.0.0.7:11211");
+    }
+    test_step(count ? 0 : -1, "target not marked back up");
+    chash_shm_unlink(buffer);
+    chash_terminate(&restored, 0);
+    chash_terminate(&shared, 0);
+    test_end("%d lookups back on the target", count);
+
+    test_start("hotkeys");
+    chash_initialize(&shared, 0);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        chash_add_target(&shared, buffer, 10);
+    }
+    test_step(chash_hotkeys_get(&shared, &hotkeys) == CHASH_ERROR_NOT_FOUND &&
+              chash_hotkeys_enable(&shared, 100, 0, 0) == CHASH_ERROR_INVALID_PARAMETER ? 0 : -1, "invalid hot keys settings");
+    test_step(chash_hotkeys_enable(&shared, 100, 0, 6), NULL);
+    test_step(chash_lookup_index(&shared, "video:x7hot", 11, 6, indexes) != 6 ? -1 : 0, NULL);
+    memset(lookups, 0, sizeof(lookups));
+    for (index = 0; index < 1000; index ++)
+    {
+        test_step(chash_lookup_balance_index(&shared, "video:x7hot", 11, 2, cached), NULL);
+        for (target = 0; target < 6 && indexes[target] != cached[0]; target ++);
+        test_step(target == 6 || (index < 98 && target >= 2) ? -1 : 0, "unexpected target %d for lookup %d", cached[0], index);
+        lookups[target] ++;
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(&shared, buffer, strlen(buffer), 2, indexes + 6) != 2 ||
+                  chash_lookup_balance_index(&shared, buffer, strlen(buffer), 2, cached) ||
+                  (cached[0] != indexes[6] && cached[0] != indexes[7]) ? -1 : 0, "cold key %s spread", buffer);
+    }
+    for (count = 0, target = 0; target < 6; target ++)
+    {
+        count += lookups[target] ? 1 : 0;
+    }
+    test_step(count != 6 ? -1 : 0, "hot key spread over %d targets", count);
+    test_step(chash_hotkeys_get(&shared, &hotkeys) || hotkeys.count != 1 || hotkeys.keys[0].length != 11 ||
+              memcmp(hotkeys.keys[0].key, "video:x7hot", 11) || hotkeys.keys[0].count < 1000 || hotkeys.spread != 6 ||
+              hotkeys.spread_lookups != 1000 - 98 || hotkeys.observed != 3001 ? -1 : 0, "invalid hot keys");
+    test_step(chash_hotkeys_enable(&shared, 100, 1000, 6), NULL);
+    for (index = 0; index < 200; index ++)
+    {
+        chash_lookup_index(&shared, "video:x7hot", 11, 1, indexes);
+    }
+    for (index = 0; index < 5000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        chash_lookup_index(&shared, buffer, strlen(buffer), 1, indexes);
+    }
+    test_step(chash_hotkeys_get(&shared, &hotkeys) || hotkeys.count ? -1 : 0, "hot key not cooled down");
+    chash_terminate(&shared, 0);
+    test_end("spread over %d targets", count);
+
+    test_start("rebalance");
+    chash_initialize(&shared, 0);
+    chash_initialize(&restored, 0);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        chash_add_target(&shared, buffer, 10);
+        chash_add_target(&restored, buffer, 10);
+    }
+    test_step(chash_lookup_index(&shared, "candidate", 9, 3, indexes) != 3 ? -1 : 0, NULL);
+    test_step(chash_target_points(&shared, "10.0.0.3:11211", CHASH_POINTS_MAXIMUM + 1) == CHASH_ERROR_INVALID_PARAMETER &&
+              chash_target_points(&shared, "10.0.1.0:11211", 1000) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "invalid points accepted");
+    test_step(chash_target_points(&shared, "10.0.0.3:11211", 1000) || chash_target_points(&shared, "10.0.0.5:11211", 1500) ||
+              ! shared.frozen || shared.items_count != (30 * 1280) - 280 + 220 || shared.targets[5].weight != 12 ? -1 : 0,
+              "continuum not patched in place");
+    test_step(chash_target_points(&restored, "10.0.0.3:11211", 1000) || chash_target_points(&restored, "10.0.0.5:11211", 1500), NULL);
+    test_step((size1 = chash_serialize(&shared, &serialized1)) < 0 || (size2 = chash_serialize(&restored, &serialized2)) < 0 ||
+              size1 != size2 || memcmp(serialized1, serialized2, size1) ? -1 : 0, "patched continuum differs from a rebuilt one");
+    free(serialized2);
+    chash_terminate(&restored, 0);
+    chash_initialize(&restored, 0);
+    test_step(chash_unserialize(&restored, serialized1, size1) != (int)shared.items_count || restored.targets[3].points != 1000 ||
+              restored.targets[5].points != 1500 ? -1 : 0, "points not restored");
+    free(serialized1);
+
+    // shared rings are patched into a private continuum
+    sprintf(buffer, "chash_test.%d", (int)getpid());
+    chash_terminate(&restored, 0);
+    chash_initialize(&restored, 0);
+    test_step(chash_shm_publish(&shared, buffer) < 0 || chash_shm_attach(&restored, buffer) < 0 ||
+              chash_target_points(&restored, "10.0.0.9:11211", 2000) || restored.shm || ! restored.frozen ? -1 : 0,
+              "shared ring not patched");
+    chash_shm_unlink(buffer);
+    test_step(chash_target_points(&shared, "10.0.0.9:11211", 2000), NULL);
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(&shared, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_index(&restored, buffer, strlen(buffer), 3, cached) != 3 ||
+                  memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0, "patched lookup mismatch for %s", buffer);
+    }
+    chash_terminate(&restored, 0);
+    chash_terminate(&shared, 0);
+
+    // targets disabled by the operator (no points) stay out of the continuum whatever their reported load
+    chash_initialize(&shared, 0);
+    chash_add_target(&shared, "a", 1);
+    chash_add_target(&shared, "b", 1);
+    chash_add_target(&shared, "z", 1);
+    chash_target_points(&shared, "z", 0);
+    count     = shared.items_count;
+    loads[0]  = 10;
+    loads[1]  = 20;
+    loads[2]  = 5;
+    status    = chash_rebalance(&shared, loads, 0.5, 0.2, 0.01);
+    test_step(status < 0 || shared.targets[2].points || shared.items_count != (u_int32_t)count ? -1 : 0,
+              "disabled target rebalanced to %u points", shared.targets[2].points);
+    chash_terminate(&shared, 0);
+
+    // target 0 has twice the capacity of the other ones: utilizations converge, key movement staying bounded per step
+    chash_initialize(&shared, 0);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        chash_add_target(&shared, buffer, 10);
+    }
+    test_step(chash_rebalance(&shared, loads, 0, 0.1, 0.01) == CHASH_ERROR_INVALID_PARAMETER &&
+              chash_rebalance(&shared, loads, 0.5, 0.1, 1.5) == CHASH_ERROR_INVALID_PARAMETER ? 0 : -1, "invalid rebalance settings");
+    for (count = 0; count <= 40; count ++)
+    {
+        memset(lookups, 0, sizeof(lookups));
+        for (index = 0; index < 30000; index ++)
+        {
+            sprintf(buffer, "candidate%07d", index);
+            chash_lookup_index(&shared, buffer, strlen(buffer), 1, indexes);
+            lookups[indexes[0]] ++;
+        }
+        for (mean = 0, deviation = 0, target = 0; target < 30; target ++)
+        {
+            loads[target] = (double)lookups[target] / (target ? 1000 : 2000);
+            mean         += loads[target] / 30;
+        }
+        for (target = 0; target < 30; target ++)
+        {
+            deviation = fabs(loads[target] - mean) > deviation ? fabs(loads[target] - mean) : deviation;
+        }
+        if (! count)
+        {
+            test_step(deviation < 0.4 ? -1 : 0, "unexpected initial imbalance %.2f", deviation);
+        }
+        if (count < 40)
+        {
+            status = chash_rebalance(&shared, loads, 0.5, 0.2, 0.01);
+            test_step(status < 0 || status > (30 * 1280) / 100 ? -1 : 0, "%d points moved", status);
+        }
+    }
+    test_step(deviation > 0.15 || shared.targets[0].points < 2000 ? -1 : 0, "utilization deviation still %.2f", deviation);
+    test_end("utilization deviation %.2f (target points %u)", deviation, shared.targets[0].points);
+    chash_terminate(&shared, 0);
+
+    test_start("arena");
+    allocator.opaque = &blocks;
+    chash_initialize(&shared, 0);
+    chash_initialize(&restored, 0);
+    chash_initialize(&cloned, 0);
+    test_step(chash_set_allocator(&shared, &allocator) || chash_set_allocator(&cloned, &allocator), NULL);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        sprintf(names[0], "zone%d", index % 3);
+        chash_add_target(&shared, buffer, 10);
+        chash_add_target(&restored, buffer, 10);
+        chash_target_domain(&shared, buffer, names[0]);
+        chash_target_domain(&restored, buffer, names[0]);
+    }
+    chash_target_points(&shared, "10.0.0.4:11211", 1000);
+    chash_target_points(&restored, "10.0.0.4:11211", 1000);
+    test_step(chash_set_allocator(&shared, NULL) == CHASH_ERROR_ALREADY_INITIALIZED ? 0 : -1, "allocator changed on a populated context");
+    test_step(blocks < 60 ? -1 : 0, "allocator hooks not used (%d blocks)", blocks);
+    count = blocks;
+    test_step(chash_compact(&shared) != chash_compact(&restored) || ! shared.arena || blocks > 3 ? -1 : 0,
+              "context not compacted (%d blocks)", blocks);
+    test_step(chash_clone(&shared, &cloned) != (int)shared.items_count || ! cloned.arena || ! cloned.targets[3].domain ||
+              cloned.targets[4].points != 1000 ? -1 : 0, "context not cloned");
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_domains(&restored, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_domains(&shared, buffer, strlen(buffer), 3, cached) != 3 || memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ||
+                  chash_lookup_domains(&cloned, buffer, strlen(buffer), 3, cached) != 3 || memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ||
+                  chash_lookup(&cloned, buffer, 3, &lookup) != 3 || chash_lookup_index(&restored, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  strcmp(lookup[2], restored.targets[indexes[2]].name) ? -1 : 0, "compacted lookup mismatch for %s", buffer);
+    }
+
+    // modifications move contexts back to separate blocks
+    test_step(chash_add_target(&shared, "10.0.1.0:11211", 10) || chash_add_target(&restored, "10.0.1.0:11211", 10) ||
+              chash_target_points(&cloned, "10.0.0.4:11211", 1200) || shared.arena || cloned.arena || ! cloned.frozen ? -1 : 0,
+              "context still compacted");
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(&restored, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_index(&shared, buffer, strlen(buffer), 3, cached) != 3 || memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ?
+                  -1 : 0, "modified lookup mismatch for %s", buffer);
+    }
+    chash_terminate(&shared, 0);
+    chash_terminate(&cloned, 0);
+    chash_terminate(&restored, 0);
+    test_step(blocks ? -1 : 0, "%d blocks leaked", blocks);
+    test_end("%d blocks compacted", count);
+
+    test_start("continuum_pages");
+    chash_initialize(&shared, 0);
+    chash_initialize(&restored, 0);
+    chash_initialize(&cloned, 0);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        chash_add_target(&shared, buffer, 10);
+        chash_add_target(&restored, buffer, 10);
+    }
+    test_step(chash_continuum_pages(&shared, 0x80) == CHASH_ERROR_INVALID_PARAMETER ? 0 : -1, "invalid pages options accepted");
+    test_step(chash_continuum_pages(&shared, CHASH_PAGES_HUGE | CHASH_PAGES_LOCK) || chash_continuum_pages(&cloned, CHASH_PAGES_HUGE) ||
+              chash_lookup_index(&shared, "candidate", 9, 1, indexes) != 1 || ! shared.pages_size || shared.pages_size % (2 * 1024 * 1024) ?
+              -1 : 0, "continuum not mapped");
+    test_step((size1 = chash_serialize(&shared, &serialized1)) < 0 || chash_unserialize(&cloned, serialized1, size1) < 0 ||
+              ! cloned.pages_size ? -1 : 0, "unserialized continuum not mapped");
+    free(serialized1);
+    test_step(chash_target_points(&shared, "10.0.0.3:11211", 1000) || chash_target_points(&restored, "10.0.0.3:11211", 1000) ||
+              ! shared.pages_size || chash_compact(&cloned) < 0 || ! cloned.arena || ! cloned.pages_size ? -1 : 0,
+              "patched or compacted continuum not mapped");
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(&restored, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_index(&shared, buffer, strlen(buffer), 3, cached) != 3 || memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ?
+                  -1 : 0, "mapped lookup mismatch for %s", buffer);
+    }
+    test_step(chash_continuum_pages(&shared, 0) || shared.pages_size || chash_continuum_pages(&cloned, 0) || cloned.pages_size ||
+              ! cloned.arena ? -1 : 0, "continuum still mapped");
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(&restored, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_index(&shared, buffer, strlen(buffer), 3, cached) != 3 || memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ?
+                  -1 : 0, "unmapped lookup mismatch for %s", buffer);
+    }
+    chash_terminate(&shared, 0);
+    chash_terminate(&cloned, 0);
+    chash_terminate(&restored, 0);
+    test_end(NULL);
+
+    test_start("delta");
+    chash_initialize(&shared, 0);
+    chash_initialize(&restored, 0);
+    chash_initialize(&cloned, 0);
+    for (index = 0; index < 30; index ++)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        sprintf(names[0], "zone%d", index % 3);
+        chash_add_target(&shared, buffer, 10);
+        chash_add_target(&restored, buffer, 10);
+        chash_add_target(&cloned, buffer, 10);
+        chash_target_domain(&shared, buffer, names[0]);
+        chash_target_domain(&restored, buffer, names[0]);
+        chash_target_domain(&cloned, buffer, names[0]);
+    }
+    test_step(chash_checksum(&shared, &checksums[0]) || chash_checksum(&restored, &checksums[1]) || checksums[0] != checksums[1] ?
+              -1 : 0, "identical rings checksums differ");
+    chash_remove_target(&cloned, "10.0.0.7:11211");
+    chash_add_target(&cloned, "10.0.1.0:11211", 5);
+    chash_add_target(&cloned, "10.0.0.2:11211", 12);
+    chash_target_domain(&cloned, "10.0.0.4:11211", "zone9");
+    chash_target_points(&cloned, "10.0.0.3:11211", 1000);
+    test_step(chash_checksum(&cloned, &checksums[1]) || checksums[0] == checksums[1], "changed ring checksum unchanged");
+    size1 = chash_delta(&shared, &cloned, &serialized1);
+    size2 = chash_serialize(&cloned, &serialized2);
+    test_step(size1 < 0 || size2 < 0 || size1 > size2 / 10 ? -1 : 0, "delta not smaller than the ring (%d bytes vs %d bytes)", size1, size2);
+    count = size1;
+
+    // down marks follow their targets across the patched targets table
+    chash_target_down(&restored, "10.0.0.9:11211", 1);
+    test_step(chash_delta_apply(&restored, serialized1, size1) != (int)cloned.items_count || ! restored.frozen ||
+              ! (restored.down[0] & (1 << 8)) || (restored.down[0] & (1 << 9)) ? -1 : 0, "delta not applied");
+    chash_target_down(&restored, "10.0.0.9:11211", 0);
+    test_step(chash_checksum(&restored, &checksums[0]) || checksums[0] != checksums[1], "patched ring checksum differs");
+    free(serialized2);
+    test_step((size2 = chash_serialize(&restored, &serialized2)) < 0 || chash_serialize(&cloned, &serialized3) != size2 ||
+              memcmp(serialized2, serialized3, size2) ? -1 : 0, "patched ring differs from the changed one");
+    free(serialized2);
+    free(serialized3);
+    test_step(chash_delta_apply(&restored, serialized1, size1) == CHASH_ERROR_INVALID_PARAMETER &&
+              restored.items_count == cloned.items_count ? 0 : -1, "delta applied twice");
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_domains(&cloned, buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_domains(&restored, buffer, strlen(buffer), 3, cached) != 3 ||
+                  memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0, "patched lookup mismatch for %s", buffer);
+    }
+
+    // corrupted deltas leave the context untouched
+    chash_terminate(&restored, 0);
+    chash_initialize(&restored, 0);
+    test_step((size2 = chash_serialize(&shared, &serialized2)) < 0 || chash_unserialize(&restored, serialized2, size2) < 0, NULL);
+    free(serialized2);
+    serialized1[size1 - 1] ^= 0x01;
+    test_step(chash_delta_apply(&restored, serialized1, size1) == CHASH_ERROR_INVALID_PARAMETER &&
+              chash_delta_apply(&restored, serialized1, size1 - 1) == CHASH_ERROR_INVALID_PARAMETER &&
+              restored.items_count == shared.items_count ? 0 : -1, "corrupted delta applied");
+    serialized1[size1 - 1] ^= 0x01;
+
+    // shared rings are patched into a private continuum
+    sprintf(buffer, "chash_test.%d", (int)getpid());
+    chash_terminate(&restored, 0);
+    chash_initialize(&restored, 0);
+    test_step(chash_shm_publish(&shared, buffer) < 0 || chash_shm_attach(&restored, buffer) < 0 ||
+              chash_delta_apply(&restored, serialized1, size1) != (int)cloned.items_count || restored.shm ? -1 : 0,
+              "shared ring not patched");
+    chash_shm_unlink(buffer);
+    test_step(chash_checksum(&restored, &checksums[0]) || checksums[0] != checksums[1], "patched shared ring checksum differs");
+    free(serialized1);
+
+    // reordered targets tables (keeping the points sharing a hash in order)
+    chash_terminate(&cloned, 0);
+    chash_initialize(&cloned, 0);
+    for (index = 29; index >= 0; index --)
+    {
+        sprintf(buffer, "10.0.0.%d:11211", index);
+        sprintf(names[0], "zone%d", index % 3);
+        chash_add_target(&cloned, buffer, index == 11 ? 0 : 10);
+        chash_target_domain(&cloned, buffer, names[0]);
+    }
+    chash_terminate(&restored, 0);
+    chash_initialize(&restored, 0);
+    test_step((size2 = chash_serialize(&shared, &serialized2)) < 0 || chash_unserialize(&restored, serialized2, size2) < 0, NULL);
+    free(serialized2);
+    test_step((size1 = chash_delta(&shared, &cloned, &serialized1)) < 0 ||
+              chash_delta_apply(&restored, serialized1, size1) != (int)cloned.items_count ? -1 : 0, "reordered delta not applied");
+    free(serialized1);
+    test_step((size2 = chash_serialize(&restored, &serialized2)) < 0 || chash_serialize(&cloned, &serialized3) != size2 ||
+              memcmp(serialized2, serialized3, size2) ? -1 : 0, "reordered ring differs from the changed one");
+    free(serialized2);
+    free(serialized3);
+    chash_terminate(&shared, 0);
+    chash_terminate(&cloned, 0);
+    chash_terminate(&restored, 0);
+    test_end("%d bytes delta", count);
+
+    test_start("watch");
+    chash_initialize(&cloned, 0);
+    for (index = 1; index <= TARGETS; index ++)
+    {
+        sprintf(buffer, "target%03d", index);
+        chash_add_target(&cloned, buffer, 1);
+    }
+    for (target = 0; target < 2; target ++)
+    {
+        test_step(chash_file_serialize(&cloned, WATCHPATH) < 0 ? -1 : 0, NULL);
+        test_step(chash_watch_start(&watch, "/tmp/chash.missing", target ? 10 : 0, 0) == CHASH_ERROR_IO ? 0 : -1,
+                  "missing ring watched");
+        count = chash_watch_start(&watch, WATCHPATH, target ? 10 : 0, 0);
+        test_step(count != (int)cloned.items_count ? -1 : 0, "invalid continuum count %d", count);
+        test_step(chash_watch_acquire(watch, &current), NULL);
+        test_step(current->targets_count != TARGETS || chash_lookup_index(current, "candidate", 9, 3, indexes) != 3 ||
+                  chash_lookup_index(&cloned, "candidate", 9, 3, cached) != 3 || memcmp(indexes, cached, 3 * sizeof(u_int16_t)) ? -1 : 0,
+                  "watched ring mismatch");
+        test_step(chash_watch_release(watch, current), NULL);
+        test_step(chash_watch_release(watch, current) == CHASH_ERROR_NOT_FOUND ? 0 : -1, "ring released twice");
+        watch_stopping = 0;
+        pthread_create(&reader, NULL, watch_reader, watch);
+
+        // rings changes are published while being read, broken rings being reported and skipped
+        for (index = 0; index < 4; index ++)
+        {
+            chash_add_target(&cloned, "target997", 10);
+            if (index & 1)
+            {
+                chash_remove_target(&cloned, "target997");
+            }
+            test_step(watch_replace(&cloned) || watch_wait(watch, index + 2, 1), "ring change %d not loaded", index);
+        }
+        test_step(chash_watch_acquire(watch, &current), NULL);
+        test_step(current->targets_count != TARGETS ? -1 : 0, "stale watched ring");
+        test_step(chash_watch_release(watch, current), NULL);
+        test_step(watch_replace(NULL) || watch_wait(watch, 100, 1), "broken ring not reported");
+        test_step(chash_watch_stats(watch, &watched) || watched.failures != 1 || watched.error >= 0 || watched.generation != 5 ||
+                  watched.reloads != 5 || ! watched.reload_time || watched.notify != ! target ? -1 : 0, "invalid watch statistics");
+        test_step(chash_watch_acquire(watch, &current), NULL);
+        test_step(current->targets_count != TARGETS ? -1 : 0, "broken ring published");
+        test_step(chash_watch_release(watch, current), NULL);
+        test_step(watch_replace(&cloned) || watch_wait(watch, 6, 2), "ring not reloaded after a failure");
+        test_step(chash_watch_reload(watch) || watch_wait(watch, 7, 2), "forced reload not done");
+        __atomic_store_n(&watch_stopping, 1, __ATOMIC_RELAXED);
+        pthread_join(reader, &errors);
+        test_step(errors ? -1 : 0, "%ld inconsistent lookups", (long)errors);
+        test_step(chash_watch_stats(watch, &watched) || watched.failures != 1 ? -1 : 0, "unexpected reload failures");
+        test_step(chash_watch_stop(watch), NULL);
+    }
+    unlink(WATCHPATH);
+    chash_terminate(&cloned, 0);
+    test_end("%.3fms per reload", (double)watched.reload_time_total / watched.reloads / 1000000);
+
+    test_start("registry");
+    test_step(chash_registry_create(&registry), NULL);
+
+    // rings over the same targets share a continuum, every eighth ring having an extra target of its own
+    for (index = 0; index < RINGS; index ++)
+    {
+        sprintf(buffer, "pool%02d", index);
+        for (target = 1; target <= TARGETS; target ++)
+        {
+            sprintf(names[0], "target%03d", target);
+            test_step(chash_registry_add_target(registry, buffer, names[0], 1), NULL);
+        }
+        if (index % 8 == 7)
+        {
+            sprintf(names[0], "extra%03d", index);
+            test_step(chash_registry_add_target(registry, buffer, names[0], 1), NULL);
+        }
+    }
+    for (index = 0; index < RINGS; index ++)
+    {
+        sprintf(buffer, "pool%02d", index);
+        test_step(chash_registry_acquire(registry, buffer, &(rings[index])), NULL);
+    }
+    test_step(chash_registry_stats(registry, &registered) || registered.targets != TARGETS + RINGS / 8 || registered.rings != RINGS ||
+              registered.continuums != 1 + RINGS / 8 || registered.builds != 1 + RINGS / 8 || registered.shares != RINGS - 1 - RINGS / 8 ||
+              registered.unshared_size < 6 * registered.continuums_size ? -1 : 0, "invalid registry statistics");
+    test_step(rings[0] != rings[1] || rings[0] == rings[7] || rings[7] == rings[15] || rings[7]->targets_count != TARGETS + 1 ? -1 : 0,
+              "continuums not shared");
+
+    // shared continuums match standalone rings
+    chash_initialize(&cloned, 0);
+    for (target = 1; target <= TARGETS; target ++)
+    {
+        sprintf(buffer, "target%03d", target);
+        chash_add_target(&cloned, buffer, 1);
+    }
+    for (index = 0; index < 1000; index ++)
+    {
+        sprintf(buffer, "candidate%07d", index);
+        test_step(chash_lookup_index(rings[1], buffer, strlen(buffer), 3, indexes) != 3 ||
+                  chash_lookup_index(&cloned, buffer, strlen(buffer), 3, cached) != 3 ||
+                  strcmp(rings[1]->targets[indexes[0]].name, cloned.targets[cached[0]].name) ||
+                  strcmp(rings[1]->targets[indexes[2]].name, cloned.targets[cached[2]].name) ? -1 : 0, "registry lookup mismatch for %s", buffer);
+    }
+    chash_terminate(&cloned, 0);
+
+    // a changed ring gets its own continuum, the previous one staying valid until released
+    test_step(chash_registry_remove_target(registry, "pool00", "target050"), NULL);
+    test_step(chash_registry_remove_target(registry, "pool00", "target050") != CHASH_ERROR_NOT_FOUND ? -1 : 0, "missing target removed");
+    test_step(chash_registry_acquire(registry, "pool00", &current) || current == rings[0] || current->targets_count != TARGETS - 1 ||
+              rings[0]->targets_count != TARGETS ? -1 : 0, "changed ring not rebuilt");
+    test_step(chash_lookup_index(rings[0], "candidate", 9, 1, indexes) != 1, "previous continuum released");
+    test_step(chash_registry_release(registry, current), NULL);
+    test_step(chash_registry_add_target(registry, "pool00", "target050", 1) || chash_registry_acquire(registry, "pool00", &current) ||
+              current != rings[1] ? -1 : 0, "restored ring not shared");
+    test_step(chash_registry_release(registry, current), NULL);
+    test_step(chash_registry_acquire(registry, "pool99", &current) != CHASH_ERROR_NOT_FOUND ? -1 : 0, "unknown ring acquired");
+    test_step(chash_registry_remove_ring(registry, "pool07"), NULL);
+    for (index = 0; index < RINGS; index ++)
+    {
+        test_step(chash_registry_release(registry, rings[index]), NULL);
+    }
+    test_step(chash_registry_release(registry, rings[7]) != CHASH_ERROR_NOT_FOUND ? -1 : 0, "removed ring released again");
+    test_step(chash_registry_stats(registry, &registered) || registered.rings != RINGS - 1 || registered.continuums != RINGS / 8 ||
+              registered.targets != TARGETS + RINGS / 8 - 1 ? -1 : 0, "invalid registry statistics after release");
+    test_step(chash_registry_destroy(registry), NULL);
+    test_end("%d rings, %u continuums", RINGS - 1, registered.continuums);
+
     test_start("terminate");
     test_step(chash_terminate(&context, 0), NULL);
     test_end(NULL);
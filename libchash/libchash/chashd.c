@@ -0,0 +1,710 @@
+// Consistent hashing library - lookup daemon
+// pyke@dailymotion.com - 05/2009
+
+// Mandatory includes
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "chash.h"
+#include "chashd.h"
+
+// Defines
+#define RINGS_MAXIMUM    (64)
+#define THREADS_MAXIMUM  (256)
+#define EVENTS_MAXIMUM   (64)
+#define READ_MINIMUM     (64 * 1024)
+#define OUTPUT_MAXIMUM   (64 * 1024 * 1024)
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE   (1u << 28)
+#endif
+
+// Types
+typedef struct
+{
+    char             *name, *path;
+    CHASH_CONTEXT    *context;
+    pthread_rwlock_t lock;
+    u_int32_t        generation;
+    dev_t            device;
+    ino_t            inode;
+    struct timespec  mtime;
+    off_t            size;
+} CHASHD_RING;
+typedef struct
+{
+    int       fd, received;
+    char      *input, *output;
+    u_int32_t input_size, input_used, output_size, output_used, output_sent;
+    u_char    *segment;
+    size_t    segment_size;
+    u_char    writing;
+} CHASHD_CONNECTION;
+typedef struct
+{
+    pthread_t  thread;
+    int        epoll;
+    const char **keys;
+    u_int32_t  *lengths;
+    u_int16_t  *ranks;
+} CHASHD_WORKER;
+
+// Static variables
+static const char   *program;
+static CHASHD_RING  rings[RINGS_MAXIMUM];
+static int          rings_count = 0, listener = -1, stopper = -1, pages = 0;
+static volatile int stopping = 0;
+
+// Helper functions
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: %s -s <socket> -r <name>=<ring> [-r <name>=<ring> ...] [-t <threads>] [-i <interval>] [-H <pages>]\n"
+            "  -s <socket>         UNIX domain socket path to listen on\n"
+            "  -r <name>=<ring>    serve the serialized context <ring> (as produced by chash_file_serialize()) as <name>\n"
+            "  -t <threads>        worker threads count (default: online CPUs count)\n"
+            "  -i <interval>       rings files check interval in seconds, SIGHUP forcing a reload (default: 1)\n"
+            "  -H <pages>          rings placement flags (1: huge pages, 2: locked in memory, 3: both, default: 0)\n",
+            program);
+    exit(1);
+}
+
+// Load a ring, or reload it if its file changed (the current context is kept if the new file can't be loaded, as
+// it may be incomplete while being written)
+static int chashd_reload(CHASHD_RING *ring, int force)
+{
+    CHASH_CONTEXT *context, *previous;
+    struct stat   info;
+    int           status;
+
+    if (stat(ring->path, &info) < 0)
+    {
+        return CHASH_ERROR_IO;
+    }
+    if (! force && ring->context && info.st_dev == ring->device && info.st_ino == ring->inode && info.st_size == ring->size &&
+        info.st_mtim.tv_sec == ring->mtime.tv_sec && info.st_mtim.tv_nsec == ring->mtime.tv_nsec)
+    {
+        return CHASH_ERROR_DONE;
+    }
+    if (! (context = malloc(sizeof(CHASH_CONTEXT))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    chash_initialize(context, 0);
+    if ((status = chash_file_unserialize(context, ring->path)) < 0)
+    {
+        fprintf(stderr, "%s: cannot load ring %s from %s (error %d)%s\n", program, ring->name, ring->path, status,
+                ring->context ? ", keeping the current one" : "");
+        chash_terminate(context, 0);
+        free(context);
+        return status;
+    }
+    chash_compact(context);
+    if (pages)
+    {
+        chash_continuum_pages(context, pages);
+    }
+
+    // lookups in progress complete on the previous context before it's released
+    pthread_rwlock_wrlock(&(ring->lock));
+    previous      = ring->context;
+    ring->context = context;
+    ring->generation ++;
+    pthread_rwlock_unlock(&(ring->lock));
+    if (previous)
+    {
+        chash_terminate(previous, 0);
+        free(previous);
+    }
+    ring->device = info.st_dev;
+    ring->inode  = info.st_ino;
+    ring->mtime  = info.st_mtim;
+    ring->size   = info.st_size;
+    fprintf(stderr, "%s: loaded ring %s from %s (%d targets, %d points, generation %u)\n", program, ring->name,
+            ring->path, context->targets_count, context->items_count, ring->generation);
+    return CHASH_ERROR_DONE;
+}
+
+// Find a ring by name from a request body
+static CHASHD_RING *chashd_ring(const u_char *body, u_int32_t size, u_int32_t *position)
+{
+    int index;
+
+    if (size < 1 || size < 1 + (u_int32_t)body[0])
+    {
+        return NULL;
+    }
+    *position = 1 + body[0];
+    for (index = 0; index < rings_count; index ++)
+    {
+        if (strlen(rings[index].name) == body[0] && ! memcmp(rings[index].name, body + 1, body[0]))
+        {
+            return &(rings[index]);
+        }
+    }
+    return NULL;
+}
+
+// Reserve room at the end of a connection output buffer
+static char *chashd_reserve(CHASHD_CONNECTION *connection, u_int32_t size)
+{
+    char *output;
+
+    if (connection->output_used + size > connection->output_size)
+    {
+        if (connection->output_used + size > OUTPUT_MAXIMUM ||
+            ! (output = realloc(connection->output, connection->output_used + size + READ_MINIMUM)))
+        {
+            return NULL;
+        }
+        connection->output      = output;
+        connection->output_size = connection->output_used + size + READ_MINIMUM;
+    }
+    connection->output_used += size;
+    return connection->output + connection->output_used - size;
+}
+
+// Resolve a lookup request into the response body
+static int chashd_lookup(CHASHD_WORKER *worker, CHASHD_REQUEST *request, const u_char *body, u_char *results,
+                         u_int32_t capacity, u_int32_t *generation)
+{
+    CHASHD_RING *ring;
+    u_int32_t   position, keys = 0, index, rank;
+    u_int16_t   length;
+    int         status;
+
+    if (! (ring = chashd_ring(body, request->size, &position)))
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    while (position + sizeof(u_int16_t) <= request->size)
+    {
+        memcpy(&length, body + position, sizeof(u_int16_t));
+        position += sizeof(u_int16_t);
+        if (keys >= CHASHD_KEYS_MAXIMUM || position + length > request->size)
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        worker->keys[keys]    = (const char *)body + position;
+        worker->lengths[keys] = length;
+        position += length;
+        keys ++;
+    }
+    if (position != request->size || ! request->count || keys * request->count * sizeof(u_int16_t) > capacity)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+
+    pthread_rwlock_rdlock(&(ring->lock));
+    *generation = ring->generation;
+    if ((status = chash_lookup_batch(ring->context, worker->keys, worker->lengths, keys, request->count,
+                                     (u_int16_t *)results, worker->ranks)) >= 0)
+    {
+        for (index = 0; index < keys; index ++)
+        {
+            for (rank = worker->ranks[index]; rank < request->count; rank ++)
+            {
+                ((u_int16_t *)results)[(index * request->count) + rank] = CHASHD_NO_TARGET;
+            }
+        }
+    }
+    pthread_rwlock_unlock(&(ring->lock));
+    return status;
+}
+
+// List a ring targets names into the response body (or just compute their size without any output)
+static int chashd_targets(CHASHD_REQUEST *request, const u_char *body, u_char *output, u_int32_t *size,
+                          u_int32_t *generation)
+{
+    CHASHD_RING *ring;
+    u_int32_t   position;
+    u_int16_t   length;
+    int         index, status;
+
+    if (! (ring = chashd_ring(body, request->size, &position)))
+    {
+        return CHASH_ERROR_NOT_FOUND;
+    }
+    pthread_rwlock_rdlock(&(ring->lock));
+    *generation = ring->generation;
+    for (position = 0, index = 0; index < ring->context->targets_count; index ++)
+    {
+        length = strlen(ring->context->targets[index].name);
+        if (output && position + sizeof(u_int16_t) + length <= *size)
+        {
+            memcpy(output + position, &length, sizeof(u_int16_t));
+            memcpy(output + position + sizeof(u_int16_t), ring->context->targets[index].name, length);
+        }
+        position += sizeof(u_int16_t) + length;
+    }
+    status = (output && position > *size) ? CHASH_ERROR_INVALID_PARAMETER : ring->context->targets_count;
+    pthread_rwlock_unlock(&(ring->lock));
+    *size = position;
+    return status;
+}
+
+// Map the shared segment passed along an attach request (only sealed segments are accepted, as a client shrinking
+// its segment would make the daemon fault on its next access)
+static int chashd_attach(CHASHD_CONNECTION *connection)
+{
+    struct stat info;
+    void        *segment;
+    int         seals;
+
+    if (connection->received < 0)
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if ((seals = fcntl(connection->received, F_GET_SEALS)) < 0 || ! (seals & F_SEAL_SHRINK))
+    {
+        close(connection->received);
+        connection->received = -1;
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (fstat(connection->received, &info) < 0 || info.st_size <= 0 ||
+        (segment = mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, connection->received, 0)) == MAP_FAILED)
+    {
+        close(connection->received);
+        connection->received = -1;
+        return CHASH_ERROR_IO;
+    }
+    close(connection->received);
+    connection->received = -1;
+    if (connection->segment)
+    {
+        munmap(connection->segment, connection->segment_size);
+    }
+    connection->segment      = segment;
+    connection->segment_size = info.st_size;
+    return CHASH_ERROR_DONE;
+}
+
+// Process a complete request, appending its response to the connection output buffer
+static int chashd_process(CHASHD_WORKER *worker, CHASHD_CONNECTION *connection, CHASHD_REQUEST *request, const u_char *body)
+{
+    CHASHD_RESPONSE *response;
+    u_char          *output = NULL;
+    u_int32_t       capacity = 0, size = 0, generation = 0;
+    int             status = CHASH_ERROR_INVALID_PARAMETER;
+    u_char          shared = request->flags & CHASHD_FLAG_SHM;
+
+    if (shared)
+    {
+        // bodies live in the attached segment (requests and responses must fit within it)
+        if (! connection->segment || (u_int64_t)request->offset + request->size > connection->segment_size ||
+            request->output > connection->segment_size)
+        {
+            body = NULL;
+        }
+        else
+        {
+            body     = connection->segment + request->offset;
+            output   = connection->segment + request->output;
+            capacity = connection->segment_size - request->output;
+        }
+    }
+
+    switch (body || request->op == CHASHD_OP_ATTACH ? request->op : 0)
+    {
+        case CHASHD_OP_LOOKUP:
+            if (! shared)
+            {
+                // results are written right after the response header (trimmed back on error)
+                if ((u_int64_t)(request->size / sizeof(u_int16_t)) * request->count * sizeof(u_int16_t) > OUTPUT_MAXIMUM)
+                {
+                    break;
+                }
+                capacity = (request->size / sizeof(u_int16_t)) * request->count * sizeof(u_int16_t);
+                if (! (response = (CHASHD_RESPONSE *)chashd_reserve(connection, sizeof(CHASHD_RESPONSE) + capacity)))
+                {
+                    return CHASH_ERROR_MEMORY;
+                }
+                output = (u_char *)(response + 1);
+            }
+            if ((status = chashd_lookup(worker, request, body, output, capacity, &generation)) >= 0)
+            {
+                size = status * request->count * sizeof(u_int16_t);
+            }
+            if (! shared)
+            {
+                connection->output_used -= sizeof(CHASHD_RESPONSE) + capacity;
+            }
+            break;
+
+        case CHASHD_OP_TARGETS:
+            if (! shared)
+            {
+                if ((status = chashd_targets(request, body, NULL, &capacity, &generation)) < 0 ||
+                    ! (output = (u_char *)chashd_reserve(connection, sizeof(CHASHD_RESPONSE) + capacity)))
+                {
+                    status = status < 0 ? status : CHASH_ERROR_MEMORY;
+                    break;
+                }
+                output += sizeof(CHASHD_RESPONSE);
+                connection->output_used -= sizeof(CHASHD_RESPONSE) + capacity;
+            }
+            size   = capacity;
+            status = chashd_targets(request, body, output, &size, &generation);
+            break;
+
+        case CHASHD_OP_ATTACH:
+            status = chashd_attach(connection);
+            break;
+    }
+
+    size = status < 0 ? 0 : size;
+    if (! (response = (CHASHD_RESPONSE *)chashd_reserve(connection, sizeof(CHASHD_RESPONSE) + (shared ? 0 : size))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    response->magic      = CHASHD_MAGIC;
+    response->status     = status;
+    response->id         = request->id;
+    response->generation = generation;
+    response->size       = size;
+    response->offset     = shared ? request->output : 0;
+    return CHASH_ERROR_DONE;
+}
+
+// Send as much pending output as possible, watching for writability until it's all sent
+static int chashd_flush(CHASHD_WORKER *worker, CHASHD_CONNECTION *connection)
+{
+    struct epoll_event event;
+    ssize_t            sent;
+
+    while (connection->output_sent < connection->output_used)
+    {
+        if ((sent = send(connection->fd, connection->output + connection->output_sent,
+                         connection->output_used - connection->output_sent, MSG_NOSIGNAL | MSG_DONTWAIT)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return CHASH_ERROR_IO;
+            }
+            break;
+        }
+        connection->output_sent += sent;
+    }
+    if (connection->output_sent == connection->output_used)
+    {
+        connection->output_sent = connection->output_used = 0;
+    }
+    if ((connection->output_used != 0) != connection->writing)
+    {
+        connection->writing = (connection->output_used != 0);
+        event.events        = EPOLLIN | EPOLLRDHUP | (connection->writing ? EPOLLOUT : 0);
+        event.data.ptr      = connection;
+        epoll_ctl(worker->epoll, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Read available data from a connection (along with any passed file descriptor) and process complete requests
+static int chashd_read(CHASHD_WORKER *worker, CHASHD_CONNECTION *connection)
+{
+    CHASHD_REQUEST request;
+    struct msghdr  message;
+    struct cmsghdr *control;
+    struct iovec   vector;
+    char           buffer[CMSG_SPACE(sizeof(int))], *input;
+    u_int32_t      position = 0, needed;
+    ssize_t        received;
+    int            status;
+
+    if (connection->input_size - connection->input_used < READ_MINIMUM)
+    {
+        if (! (input = realloc(connection->input, connection->input_size + READ_MINIMUM)))
+        {
+            return CHASH_ERROR_MEMORY;
+        }
+        connection->input       = input;
+        connection->input_size += READ_MINIMUM;
+    }
+    memset(&message, 0, sizeof(message));
+    vector.iov_base        = connection->input + connection->input_used;
+    vector.iov_len         = connection->input_size - connection->input_used;
+    message.msg_iov        = &vector;
+    message.msg_iovlen     = 1;
+    message.msg_control    = buffer;
+    message.msg_controllen = sizeof(buffer);
+    if ((received = recvmsg(connection->fd, &message, MSG_DONTWAIT | MSG_CMSG_CLOEXEC)) <= 0)
+    {
+        return (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) ? CHASH_ERROR_DONE : CHASH_ERROR_IO;
+    }
+    for (control = CMSG_FIRSTHDR(&message); control; control = CMSG_NXTHDR(&message, control))
+    {
+        if (control->cmsg_level == SOL_SOCKET && control->cmsg_type == SCM_RIGHTS)
+        {
+            if (connection->received >= 0)
+            {
+                close(connection->received);
+            }
+            memcpy(&(connection->received), CMSG_DATA(control), sizeof(int));
+        }
+    }
+    connection->input_used += received;
+
+    while (connection->input_used - position >= sizeof(CHASHD_REQUEST))
+    {
+        memcpy(&request, connection->input + position, sizeof(CHASHD_REQUEST));
+        if (request.magic != CHASHD_MAGIC || request.size > CHASHD_BODY_MAXIMUM)
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        needed = sizeof(CHASHD_REQUEST) + ((request.flags & CHASHD_FLAG_SHM) ? 0 : request.size);
+        if (connection->input_used - position < needed)
+        {
+            // make room for the whole request body
+            if (needed > connection->input_size)
+            {
+                if (! (input = realloc(connection->input, needed + READ_MINIMUM)))
+                {
+                    return CHASH_ERROR_MEMORY;
+                }
+                connection->input      = input;
+                connection->input_size = needed + READ_MINIMUM;
+            }
+            break;
+        }
+        if ((status = chashd_process(worker, connection, &request,
+                                     (u_char *)connection->input + position + sizeof(CHASHD_REQUEST))) < 0)
+        {
+            return status;
+        }
+        position += needed;
+    }
+    if (position)
+    {
+        memmove(connection->input, connection->input + position, connection->input_used - position);
+        connection->input_used -= position;
+    }
+    return chashd_flush(worker, connection);
+}
+
+static void chashd_close(CHASHD_WORKER *worker, CHASHD_CONNECTION *connection)
+{
+    epoll_ctl(worker->epoll, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    if (connection->received >= 0)
+    {
+        close(connection->received);
+    }
+    if (connection->segment)
+    {
+        munmap(connection->segment, connection->segment_size);
+    }
+    free(connection->input);
+    free(connection->output);
+    free(connection);
+}
+
+// Worker thread: accept connections (the listening socket is shared among workers with EPOLLEXCLUSIVE, so that
+// each new connection only wakes one of them) and serve requests on the ones it accepted
+static void *chashd_worker(void *argument)
+{
+    CHASHD_WORKER      *worker = (CHASHD_WORKER *)argument;
+    CHASHD_CONNECTION  *connection;
+    struct epoll_event events[EVENTS_MAXIMUM], event;
+    int                count, index, fd;
+
+    while (! stopping)
+    {
+        if ((count = epoll_wait(worker->epoll, events, EVENTS_MAXIMUM, -1)) < 0)
+        {
+            continue;
+        }
+        for (index = 0; index < count; index ++)
+        {
+            if (events[index].data.ptr == &listener)
+            {
+                while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    if (! (connection = calloc(1, sizeof(CHASHD_CONNECTION))))
+                    {
+                        close(fd);
+                        continue;
+                    }
+                    connection->fd       = fd;
+                    connection->received = -1;
+                    event.events         = EPOLLIN | EPOLLRDHUP;
+                    event.data.ptr       = connection;
+                    if (epoll_ctl(worker->epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+                    {
+                        close(fd);
+                        free(connection);
+                    }
+                }
+                continue;
+            }
+            if (events[index].data.ptr == &stopper)
+            {
+                break;
+            }
+            connection = (CHASHD_CONNECTION *)events[index].data.ptr;
+            if ((events[index].events & (EPOLLERR | EPOLLHUP)) ||
+                ((events[index].events & EPOLLOUT) && chashd_flush(worker, connection) < 0) ||
+                ((events[index].events & (EPOLLIN | EPOLLRDHUP)) && chashd_read(worker, connection) < 0) ||
+                ((events[index].events & EPOLLRDHUP) && ! (events[index].events & EPOLLIN)))
+            {
+                chashd_close(worker, connection);
+            }
+        }
+    }
+    return NULL;
+}
+
+// Main program
+int main(int argc, char **argv)
+{
+    CHASHD_WORKER      *workers;
+    struct sockaddr_un address;
+    struct epoll_event event;
+    struct timespec    interval = { 1, 0 };
+    sigset_t           signals;
+    const char         *path = NULL;
+    char               *separator;
+    int                option, threads, received, index;
+
+    program = argv[0];
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+    while ((option = getopt(argc, argv, "s:r:t:i:H:h")) != -1)
+    {
+        switch (option)
+        {
+            case 's': path    = optarg;       break;
+            case 't': threads = atoi(optarg); break;
+            case 'i': interval.tv_sec = atoi(optarg); break;
+            case 'H': pages   = atoi(optarg); break;
+            case 'r':
+                if (rings_count >= RINGS_MAXIMUM || ! (separator = strchr(optarg, '=')) || separator == optarg ||
+                    separator - optarg > 255 || ! separator[1])
+                {
+                    usage();
+                }
+                *separator                = 0;
+                rings[rings_count].name   = optarg;
+                rings[rings_count ++].path = separator + 1;
+                break;
+            default: usage();
+        }
+    }
+    if (! path || ! rings_count || threads < 1 || interval.tv_sec < 1 || strlen(path) >= sizeof(address.sun_path) ||
+        pages < 0 || pages > (CHASH_PAGES_HUGE | CHASH_PAGES_LOCK))
+    {
+        usage();
+    }
+    threads = threads > THREADS_MAXIMUM ? THREADS_MAXIMUM : threads;
+
+    // load rings (they're all required to start)
+    for (index = 0; index < rings_count; index ++)
+    {
+        pthread_rwlock_init(&(rings[index].lock), NULL);
+        if (chashd_reload(&(rings[index]), 1) < 0)
+        {
+            fprintf(stderr, "%s: cannot load ring %s from %s\n", program, rings[index].name, rings[index].path);
+            return 1;
+        }
+    }
+
+    // listen on the UNIX socket (signals are handled synchronously by the main thread only)
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if ((listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0 ||
+        (stopper = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+    {
+        fprintf(stderr, "%s: cannot listen on %s: %s\n", program, path, strerror(errno));
+        return 1;
+    }
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // start workers
+    if (! (workers = calloc(threads, sizeof(CHASHD_WORKER))))
+    {
+        fprintf(stderr, "%s: memory allocation error\n", program);
+        return 1;
+    }
+    for (index = 0; index < threads; index ++)
+    {
+        workers[index].keys    = malloc(CHASHD_KEYS_MAXIMUM * sizeof(char *));
+        workers[index].lengths = malloc(CHASHD_KEYS_MAXIMUM * sizeof(u_int32_t));
+        workers[index].ranks   = malloc(CHASHD_KEYS_MAXIMUM * sizeof(u_int16_t));
+        if (! workers[index].keys || ! workers[index].lengths || ! workers[index].ranks ||
+            (workers[index].epoll = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        {
+            fprintf(stderr, "%s: cannot initialize worker %d\n", program, index);
+            return 1;
+        }
+        event.events   = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = &listener;
+        if (epoll_ctl(workers[index].epoll, EPOLL_CTL_ADD, listener, &event) < 0)
+        {
+            // kernels older than 4.5 don't know about EPOLLEXCLUSIVE
+            event.events = EPOLLIN;
+            epoll_ctl(workers[index].epoll, EPOLL_CTL_ADD, listener, &event);
+        }
+        event.events   = EPOLLIN;
+        event.data.ptr = &stopper;
+        epoll_ctl(workers[index].epoll, EPOLL_CTL_ADD, stopper, &event);
+        if (pthread_create(&(workers[index].thread), NULL, chashd_worker, &(workers[index])) != 0)
+        {
+            fprintf(stderr, "%s: cannot start worker thread\n", program);
+            return 1;
+        }
+    }
+    fprintf(stderr, "%s: listening on %s with %d worker threads\n", program, path, threads);
+
+    // watch rings files until asked to stop (SIGHUP forces a reload)
+    while ((received = sigtimedwait(&signals, NULL, &interval)) != SIGINT && received != SIGTERM)
+    {
+        for (index = 0; index < rings_count; index ++)
+        {
+            chashd_reload(&(rings[index]), received == SIGHUP);
+        }
+    }
+
+    // stop workers (the stopper event stays readable, waking them all)
+    stopping = 1;
+    eventfd_write(stopper, 1);
+    for (index = 0; index < threads; index ++)
+    {
+        pthread_join(workers[index].thread, NULL);
+        close(workers[index].epoll);
+        free(workers[index].keys);
+        free(workers[index].lengths);
+        free(workers[index].ranks);
+    }
+    free(workers);
+    close(listener);
+    close(stopper);
+    unlink(path);
+    for (index = 0; index < rings_count; index ++)
+    {
+        chash_terminate(rings[index].context, 0);
+        free(rings[index].context);
+    }
+    fprintf(stderr, "%s: stopped\n", program);
+    return 0;
+}
@@ -0,0 +1,59 @@
+// Consistent hashing library - lookup daemon protocol
+// pyke@dailymotion.com - 05/2009
+
+#ifndef __CHASHD_INCLUDE
+#define __CHASHD_INCLUDE
+
+// Mandatory includes
+#include <sys/types.h>
+
+// Every request is a CHASHD_REQUEST header followed by <size> body bytes (or, with CHASHD_FLAG_SHM, with its body
+// stored at <offset> in the connection shared segment), every response a CHASHD_RESPONSE header followed by <size>
+// body bytes (or stored at <offset> in the shared segment). Integers are in host byte order.
+//
+// CHASHD_OP_LOOKUP  body: <ring name length (u_int8_t)> <ring name> then <key length (u_int16_t)> <key> for each key
+//                   response: <count> u_int16_t targets indexes per key (CHASHD_NO_TARGET when missing), status
+//                   being the keys count
+// CHASHD_OP_TARGETS body: <ring name length (u_int8_t)> <ring name>
+//                   response: <name length (u_int16_t)> <name> for each target, status being the targets count
+// CHASHD_OP_ATTACH  no body, a shared segment file descriptor being passed along (SCM_RIGHTS), which must be a memfd
+//                   sealed with at least F_SEAL_SHRINK (CHASH_ERROR_INVALID_PARAMETER otherwise)
+//
+// Targets indexes refer to the targets table of the response generation, which changes whenever a ring is reloaded.
+
+// Public defines
+#define CHASHD_MAGIC        (0x44485343)
+#define CHASHD_OP_LOOKUP    (1)
+#define CHASHD_OP_TARGETS   (2)
+#define CHASHD_OP_ATTACH    (3)
+#define CHASHD_FLAG_SHM     (0x01)
+#define CHASHD_NO_TARGET    (65535)
+#define CHASHD_BODY_MAXIMUM (16 * 1024 * 1024)
+#define CHASHD_KEYS_MAXIMUM (65536)
+
+// Public structures
+#pragma pack(1)
+typedef struct
+{
+    u_int32_t magic;
+    u_int8_t  op;
+    u_int8_t  flags;
+    u_int16_t count;
+    u_int32_t id;
+    u_int32_t size;
+    u_int32_t offset;
+    u_int32_t output;
+} CHASHD_REQUEST;
+
+typedef struct
+{
+    u_int32_t magic;
+    int32_t   status;
+    u_int32_t id;
+    u_int32_t generation;
+    u_int32_t size;
+    u_int32_t offset;
+} CHASHD_RESPONSE;
+#pragma pack()
+
+#endif
@@ -0,0 +1,483 @@
+// Consistent hashing library - lookup daemon load generator
+// pyke@dailymotion.com - 05/2009
+
+// Mandatory includes
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "chash.h"
+#include "chashd.h"
+
+// Defines
+#define KEY_SIZE        (16)
+#define THREADS_MAXIMUM (256)
+
+// Types
+typedef struct
+{
+    pthread_t thread;
+    int       index, fd, status;
+    u_char    *buffer, *segment;
+    size_t    segment_size;
+    char      **names;
+    u_int32_t names_count, generation;
+    double    *samples;
+    u_int64_t verified, mismatches;
+} LOAD_WORKER;
+
+// Static variables
+static const char    *program, *path = NULL, *ring = NULL;
+static int           connections = 4, requests = 10000, batch = 64, count = 1, shared = 0;
+static CHASH_CONTEXT *reference = NULL;
+
+// Helper functions
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: %s -s <socket> -r <name> [-c <connections>] [-n <requests>] [-b <keys>] [-k <count>] [-m] [-V <ring>]\n"
+            "       %s -T <targets> -w <ring>\n"
+            "  -s <socket>       chashd UNIX domain socket path\n"
+            "  -r <name>         ring name to look keys up into\n"
+            "  -c <connections>  concurrent connections count, one thread each (default: 4)\n"
+            "  -n <requests>     requests per connection (default: 10000)\n"
+            "  -b <keys>         keys per request (default: 64)\n"
+            "  -k <count>        targets per key (default: 1)\n"
+            "  -m                pass requests and responses through a shared memory segment\n"
+            "  -V <ring>         verify every result against a local lookup into the serialized context <ring>\n"
+            "  -T <targets>      write a synthetic ring with <targets> targets into -w <ring> and exit\n",
+            program, program);
+    exit(1);
+}
+static double load_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec * 1000000000.0) + now.tv_nsec;
+}
+static int load_compare(const void *element1, const void *element2)
+{
+    return (*(double *)element1 > *(double *)element2) ? 1 : ((*(double *)element1 < *(double *)element2) ? -1 : 0);
+}
+static int load_send(int fd, const void *data, size_t size, int descriptor)
+{
+    struct msghdr  message;
+    struct cmsghdr *control;
+    struct iovec   vector;
+    char           buffer[CMSG_SPACE(sizeof(int))];
+    ssize_t        sent;
+
+    while (size)
+    {
+        memset(&message, 0, sizeof(message));
+        vector.iov_base    = (void *)data;
+        vector.iov_len     = size;
+        message.msg_iov    = &vector;
+        message.msg_iovlen = 1;
+        if (descriptor >= 0)
+        {
+            // pass the file descriptor along the first byte
+            message.msg_control    = buffer;
+            message.msg_controllen = sizeof(buffer);
+            control                = CMSG_FIRSTHDR(&message);
+            control->cmsg_level    = SOL_SOCKET;
+            control->cmsg_type     = SCM_RIGHTS;
+            control->cmsg_len      = CMSG_LEN(sizeof(int));
+            memcpy(CMSG_DATA(control), &descriptor, sizeof(int));
+        }
+        if ((sent = sendmsg(fd, &message, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return CHASH_ERROR_IO;
+        }
+        data        = (const u_char *)data + sent;
+        size       -= sent;
+        descriptor  = -1;
+    }
+    return CHASH_ERROR_DONE;
+}
+static int load_receive(int fd, void *data, size_t size)
+{
+    ssize_t received;
+
+    while (size)
+    {
+        if ((received = recv(fd, data, size, 0)) <= 0)
+        {
+            if (received < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            return CHASH_ERROR_IO;
+        }
+        data  = (u_char *)data + received;
+        size -= received;
+    }
+    return CHASH_ERROR_DONE;
+}
+
+// Send a request and wait for its response (<body> being in the worker buffer or the shared segment, the response
+// body being returned in the worker buffer or at <output> in the shared segment)
+static int load_request(LOAD_WORKER *worker, u_char op, u_int32_t size, u_int32_t output, int descriptor,
+                        CHASHD_RESPONSE *response, u_char **body)
+{
+    CHASHD_REQUEST request;
+    int            status;
+
+    request.magic  = CHASHD_MAGIC;
+    request.op     = op;
+    request.flags  = (shared && op != CHASHD_OP_ATTACH) ? CHASHD_FLAG_SHM : 0;
+    request.count  = count;
+    request.id     = worker->index;
+    request.size   = size;
+    request.offset = 0;
+    request.output = output;
+    if ((status = load_send(worker->fd, &request, sizeof(request), descriptor)) < 0 ||
+        (! request.flags && size && (status = load_send(worker->fd, worker->buffer, size, -1)) < 0) ||
+        (status = load_receive(worker->fd, response, sizeof(CHASHD_RESPONSE))) < 0)
+    {
+        return status;
+    }
+    if (response->magic != CHASHD_MAGIC || response->id != request.id ||
+        (request.flags && (u_int64_t)response->offset + response->size > worker->segment_size) ||
+        (! request.flags && response->size > CHASHD_BODY_MAXIMUM))
+    {
+        return CHASH_ERROR_INVALID_PARAMETER;
+    }
+    if (request.flags)
+    {
+        *body = worker->segment + response->offset;
+    }
+    else
+    {
+        if (response->size && ((status = load_receive(worker->fd, worker->buffer + CHASHD_BODY_MAXIMUM, response->size)) < 0))
+        {
+            return status;
+        }
+        *body = worker->buffer + CHASHD_BODY_MAXIMUM;
+    }
+    return response->status;
+}
+
+// Write the ring name at the start of a request body
+static u_int32_t load_ring(u_char *body)
+{
+    body[0] = strlen(ring);
+    memcpy(body + 1, ring, body[0]);
+    return 1 + body[0];
+}
+
+// Fetch the ring targets names (used to check results by name, as indexes may differ between contexts)
+static int load_targets(LOAD_WORKER *worker)
+{
+    CHASHD_RESPONSE response;
+    u_char          *body;
+    u_int32_t       position = 0, size, index;
+    u_int16_t       length;
+    int             status;
+
+    for (index = 0; index < worker->names_count; index ++)
+    {
+        free(worker->names[index]);
+    }
+    free(worker->names);
+    worker->names       = NULL;
+    worker->names_count = 0;
+    size = load_ring(shared ? worker->segment : worker->buffer);
+    if ((status = load_request(worker, CHASHD_OP_TARGETS, size, 256, -1, &response, &body)) < 0)
+    {
+        return status;
+    }
+    if (! (worker->names = calloc(status + 1, sizeof(char *))))
+    {
+        return CHASH_ERROR_MEMORY;
+    }
+    for (index = 0; index < (u_int32_t)status && position + sizeof(u_int16_t) <= response.size; index ++)
+    {
+        memcpy(&length, body + position, sizeof(u_int16_t));
+        if (position + sizeof(u_int16_t) + length > response.size || ! (worker->names[index] = malloc(length + 1)))
+        {
+            return CHASH_ERROR_INVALID_PARAMETER;
+        }
+        memcpy(worker->names[index], body + position + sizeof(u_int16_t), length);
+        worker->names[index][length] = 0;
+        position += sizeof(u_int16_t) + length;
+        worker->names_count ++;
+    }
+    worker->generation = response.generation;
+    return (worker->names_count == (u_int32_t)status) ? CHASH_ERROR_DONE : CHASH_ERROR_INVALID_PARAMETER;
+}
+
+// Attach a shared segment large enough for the largest request and response (sealed against resizing, as the daemon
+// requires, and mapped by the daemon from the passed file descriptor)
+static int load_attach(LOAD_WORKER *worker)
+{
+    CHASHD_RESPONSE response;
+    u_char          *body;
+    char            name[64];
+    int             fd, status;
+
+    snprintf(name, sizeof(name), "chashd-load-%d", worker->index);
+    worker->segment_size = CHASHD_BODY_MAXIMUM + ((size_t)batch * count * sizeof(u_int16_t));
+    if ((fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0)
+    {
+        return CHASH_ERROR_IO;
+    }
+    if (ftruncate(fd, worker->segment_size) < 0 || fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0 ||
+        (worker->segment = mmap(NULL, worker->segment_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        worker->segment = NULL;
+        close(fd);
+        return CHASH_ERROR_IO;
+    }
+    status = load_request(worker, CHASHD_OP_ATTACH, 0, 0, fd, &response, &body);
+    close(fd);
+    return status;
+}
+
+// Check a lookup response against the local reference context
+static void load_verify(LOAD_WORKER *worker, const char *keys, const u_int16_t *results)
+{
+    u_int16_t targets[256];
+    int       index, rank, found, expected = count < 256 ? count : 256;
+
+    for (index = 0; index < batch; index ++)
+    {
+        found = chash_lookup_index(reference, keys + (index * KEY_SIZE), strlen(keys + (index * KEY_SIZE)), expected, targets);
+        for (rank = 0; rank < expected; rank ++)
+        {
+            if (rank < found ?
+                (results[(index * count) + rank] >= worker->names_count ||
+                 strcmp(worker->names[results[(index * count) + rank]], reference->targets[targets[rank]].name)) :
+                results[(index * count) + rank] != CHASHD_NO_TARGET)
+            {
+                worker->mismatches ++;
+                break;
+            }
+        }
+        worker->verified ++;
+    }
+}
+
+// Worker thread: one connection sending batches of random keys
+static void *load_worker(void *argument)
+{
+    LOAD_WORKER        *worker = (LOAD_WORKER *)argument;
+    CHASHD_RESPONSE    response;
+    struct sockaddr_un address;
+    unsigned int       seed = worker->index;
+    u_char             *body, *results;
+    char               *keys;
+    u_int32_t          size, output;
+    u_int16_t          length;
+    double             start;
+    int                request, index;
+
+    if (! (keys = malloc(batch * KEY_SIZE)) || ! (worker->samples = malloc(requests * sizeof(double))) ||
+        ! (worker->buffer = malloc(2 * CHASHD_BODY_MAXIMUM)))
+    {
+        worker->status = CHASH_ERROR_MEMORY;
+        free(keys);
+        return NULL;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    if ((worker->fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(worker->fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        (shared && (worker->status = load_attach(worker)) < 0) || (reference && (worker->status = load_targets(worker)) < 0))
+    {
+        worker->status = worker->status < 0 ? worker->status : CHASH_ERROR_IO;
+        free(keys);
+        return NULL;
+    }
+
+    for (request = 0; request < requests; request ++)
+    {
+        body = shared ? worker->segment : worker->buffer;
+        size = load_ring(body);
+        for (index = 0; index < batch; index ++)
+        {
+            length = snprintf(keys + (index * KEY_SIZE), KEY_SIZE, "video%09d", rand_r(&seed) % 1000000000);
+            memcpy(body + size, &length, sizeof(u_int16_t));
+            memcpy(body + size + sizeof(u_int16_t), keys + (index * KEY_SIZE), length);
+            size += sizeof(u_int16_t) + length;
+        }
+        output = (size + 7) & ~7;
+        start  = load_now();
+        if ((worker->status = load_request(worker, CHASHD_OP_LOOKUP, size, output, -1, &response, &results)) < 0)
+        {
+            break;
+        }
+        worker->samples[request] = load_now() - start;
+        if (reference)
+        {
+            // the ring was reloaded since targets names were fetched
+            if (response.generation != worker->generation && (worker->status = load_targets(worker)) < 0)
+            {
+                break;
+            }
+            if (response.generation == worker->generation)
+            {
+                load_verify(worker, keys, (u_int16_t *)results);
+            }
+        }
+    }
+    worker->status = worker->status < 0 ? worker->status : CHASH_ERROR_DONE;
+    free(keys);
+    return NULL;
+}
+
+// Write a synthetic ring
+static int load_write(const char *output, int targets)
+{
+    CHASH_CONTEXT context;
+    char          name[32];
+    int           index, status;
+
+    chash_initialize(&context, 0);
+    for (index = 0; index < targets; index ++)
+    {
+        sprintf(name, "10.%d.%d.%d:11211", (index >> 16) & 0xff, (index >> 8) & 0xff, index & 0xff);
+        if ((status = chash_add_target(&context, name, 1)) < 0)
+        {
+            chash_terminate(&context, 0);
+            return status;
+        }
+    }
+    status = chash_file_serialize(&context, output);
+    chash_terminate(&context, 0);
+    return status;
+}
+
+// Main program
+int main(int argc, char **argv)
+{
+    LOAD_WORKER *workers;
+    const char  *verify = NULL, *output = NULL;
+    double      start, elapsed, *samples, mean = 0;
+    u_int64_t   verified = 0, mismatches = 0;
+    int         option, targets = 0, index, position, samples_count = 0, status, failed = 0;
+
+    program = argv[0];
+    while ((option = getopt(argc, argv, "s:r:c:n:b:k:mV:T:w:h")) != -1)
+    {
+        switch (option)
+        {
+            case 's': path        = optarg;       break;
+            case 'r': ring        = optarg;       break;
+            case 'c': connections = atoi(optarg); break;
+            case 'n': requests    = atoi(optarg); break;
+            case 'b': batch       = atoi(optarg); break;
+            case 'k': count       = atoi(optarg); break;
+            case 'm': shared      = 1;            break;
+            case 'V': verify      = optarg;       break;
+            case 'T': targets     = atoi(optarg); break;
+            case 'w': output      = optarg;       break;
+            default: usage();
+        }
+    }
+    if (targets > 0 && output)
+    {
+        if ((status = load_write(output, targets)) < 0)
+        {
+            fprintf(stderr, "%s: cannot write ring to %s (error %d)\n", program, output, status);
+            return 1;
+        }
+        return 0;
+    }
+    if (! path || ! ring || strlen(ring) > 255 || connections < 1 || connections > THREADS_MAXIMUM || requests < 1 ||
+        batch < 1 || (u_int64_t)batch * (KEY_SIZE + sizeof(u_int16_t)) + 256 > CHASHD_BODY_MAXIMUM ||
+        (u_int64_t)batch * count * sizeof(u_int16_t) > CHASHD_BODY_MAXIMUM || count < 1 || count > 65535)
+    {
+        usage();
+    }
+    if (verify)
+    {
+        if (! (reference = malloc(sizeof(CHASH_CONTEXT))))
+        {
+            fprintf(stderr, "%s: memory allocation error\n", program);
+            return 1;
+        }
+        chash_initialize(reference, 0);
+        if ((status = chash_file_unserialize(reference, verify)) < 0)
+        {
+            fprintf(stderr, "%s: cannot load ring from %s (error %d)\n", program, verify, status);
+            return 1;
+        }
+    }
+
+    // run connections
+    if (! (workers = calloc(connections, sizeof(LOAD_WORKER))))
+    {
+        fprintf(stderr, "%s: memory allocation error\n", program);
+        return 1;
+    }
+    start = load_now();
+    for (index = 0; index < connections; index ++)
+    {
+        workers[index].index = index + 1;
+        workers[index].fd    = -1;
+        if (pthread_create(&(workers[index].thread), NULL, load_worker, &(workers[index])) != 0)
+        {
+            fprintf(stderr, "%s: cannot start worker thread\n", program);
+            return 1;
+        }
+    }
+    for (index = 0; index < connections; index ++)
+    {
+        pthread_join(workers[index].thread, NULL);
+    }
+    elapsed = load_now() - start;
+
+    // aggregate latencies
+    if (! (samples = malloc((size_t)connections * requests * sizeof(double))))
+    {
+        fprintf(stderr, "%s: memory allocation error\n", program);
+        return 1;
+    }
+    for (index = 0; index < connections; index ++)
+    {
+        if (workers[index].status < 0)
+        {
+            fprintf(stderr, "%s: connection %d failed (error %d)\n", program, index + 1, workers[index].status);
+            failed = 1;
+            continue;
+        }
+        for (position = 0; position < requests; position ++)
+        {
+            mean += workers[index].samples[position];
+            samples[samples_count ++] = workers[index].samples[position];
+        }
+        verified   += workers[index].verified;
+        mismatches += workers[index].mismatches;
+    }
+    if (! samples_count)
+    {
+        return 1;
+    }
+    qsort(samples, samples_count, sizeof(double), load_compare);
+    printf("{\"benchmark\": \"chashd\", \"mode\": \"%s\", \"connections\": %d, \"requests\": %d, \"keys\": %d, \"count\": %d,\n"
+           " \"requests_per_s\": %.0f, \"keys_per_s\": %.0f,\n"
+           " \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f},\n"
+           " \"verified\": %llu, \"mismatches\": %llu}\n",
+           shared ? "shm" : "socket", connections, requests, batch, count,
+           samples_count / (elapsed / 1000000000.0), ((double)samples_count * batch) / (elapsed / 1000000000.0),
+           mean / samples_count / 1000.0, samples[(samples_count * 50) / 100] / 1000.0,
+           samples[(samples_count * 90) / 100] / 1000.0, samples[(samples_count * 99) / 100] / 1000.0,
+           samples[(samples_count * 999) / 1000] / 1000.0, samples[samples_count - 1] / 1000.0,
+           (unsigned long long)verified, (unsigned long long)mismatches);
+    return (failed || mismatches) ? 1 : 0;
+}
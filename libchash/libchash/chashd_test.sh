@@ -0,0 +1,58 @@
+#!/bin/sh
+# Consistent hashing library - check chashd results over the socket and shared memory, across a ring reload
+# pyke@dailymotion.com - 05/2009
+
+DIRECTORY=$(mktemp -d /tmp/chashd_test.XXXXXX) || exit 1
+SOCKET=$DIRECTORY/chashd.sock
+RING=$DIRECTORY/ring
+PID=
+
+cleanup() {
+    [ -n "$PID" ] && kill $PID 2> /dev/null && wait $PID 2> /dev/null
+    rm -rf "$DIRECTORY"
+}
+trap cleanup EXIT
+
+check() {
+    if ./chashd-load -s "$SOCKET" -r main -c 2 -n 200 -b 32 -k 3 -V "$RING" $1 > "$DIRECTORY/output"; then
+        echo "$2 ... ok"
+    else
+        cat "$DIRECTORY/output"
+        echo "$2 ... failed"
+        exit 1
+    fi
+}
+
+./chashd-load -T 50 -w "$RING" || exit 1
+./chashd -s "$SOCKET" -r main="$RING" -t 2 -i 1 2> "$DIRECTORY/log" &
+PID=$!
+for WAIT in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$SOCKET" ] && break
+    sleep 1
+done
+if [ ! -S "$SOCKET" ]; then
+    cat "$DIRECTORY/log"
+    echo "chashd startup ... failed"
+    exit 1
+fi
+
+check "" "socket lookups"
+check "-m" "shared memory lookups"
+
+# atomically replace the ring, the reload being forced instead of waiting for the next check
+./chashd-load -T 80 -w "$RING.new" || exit 1
+mv "$RING.new" "$RING"
+kill -HUP $PID
+for WAIT in 1 2 3 4 5 6 7 8 9 10; do
+    grep -q "generation 2" "$DIRECTORY/log" && break
+    sleep 1
+done
+if ! grep -q "generation 2" "$DIRECTORY/log"; then
+    cat "$DIRECTORY/log"
+    echo "ring reload ... failed"
+    exit 1
+fi
+echo "ring reload ... ok"
+check "" "socket lookups after reload"
+check "-m" "shared memory lookups after reload"
+exit 0
@@ -4,18 +4,50 @@
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
+#include <sys/stat.h>
 #include "php.h"
+#include "php_ini.h"
 #include "zend_exceptions.h"
 #include "chash.h"
 
+// Persistent ring definition (named context living across requests within a worker)
+typedef struct
+{
+    CHASH_CONTEXT context;
+    char          *path;
+    dev_t         device;
+    ino_t         inode;
+    time_t        mtime;
+    time_t        checked;
+} chash_ring;
+
 // CHash composite object definition
 typedef struct
 {
     zend_object   zo;
     u_char        use_exceptions;
     CHASH_CONTEXT context;
+    chash_ring    *ring;
+    CHASH_CONTEXT *names_context;
+    u_int32_t     names_generation;
+    u_int16_t     names_count;
+    zend_string   **names;
 } chash_object;
 
+// CHash module globals and INI directives
+ZEND_BEGIN_MODULE_GLOBALS(chash)
+    HashTable rings;
+    char      *preload;
+    zend_long check_interval;
+ZEND_END_MODULE_GLOBALS(chash)
+ZEND_DECLARE_MODULE_GLOBALS(chash)
+#define CHASH_G(v) ZEND_MODULE_GLOBALS_ACCESSOR(chash, v)
+
+PHP_INI_BEGIN()
+    STD_PHP_INI_ENTRY("chash.preload", "", PHP_INI_SYSTEM, OnUpdateString, preload, zend_chash_globals, chash_globals)
+    STD_PHP_INI_ENTRY("chash.check_interval", "1", PHP_INI_ALL, OnUpdateLong, check_interval, zend_chash_globals, chash_globals)
+PHP_INI_END()
+
 // CHash class entry
 zend_class_entry *chash_ce;
 
@@ -61,6 +93,207 @@ static int chash_return(chash_object *instance, int status)
     return status;
 }
 
+// Return the context the object currently works on (its own or a shared persistent ring)
+static inline CHASH_CONTEXT *chash_context(chash_object *instance)
+{
+    return instance->ring ? &(instance->ring->context) : &(instance->context);
+}
+
+// Zend memory manager allocator hooks (request memory for objects contexts, persistent memory for rings)
+static void *chash_memory_allocate(size_t size, void *persistent)
+{
+    return pemalloc(size, persistent != NULL);
+}
+static void *chash_memory_reallocate(void *pointer, size_t size, void *persistent)
+{
+    return perealloc(pointer, size, persistent != NULL);
+}
+static void chash_memory_release(void *pointer, void *persistent)
+{
+    pefree(pointer, persistent != NULL);
+}
+static const CHASH_ALLOCATOR chash_request_allocator    = { chash_memory_allocate, chash_memory_reallocate, chash_memory_release, NULL };
+static const CHASH_ALLOCATOR chash_persistent_allocator = { chash_memory_allocate, chash_memory_reallocate, chash_memory_release, (void *)1 };
+
+// Stop sharing a persistent ring before a modification (its content is cloned into the object own context if needed)
+static int chash_detach(chash_object *instance, u_char copy)
+{
+    int status = CHASH_ERROR_DONE;
+
+    if (instance->ring)
+    {
+        if (copy)
+        {
+            status = chash_clone(&(instance->ring->context), &(instance->context));
+        }
+        instance->ring = NULL;
+    }
+    return status < 0 ? status : CHASH_ERROR_DONE;
+}
+
+// Drop the object targets names strings if the context they were created from changed since (or unconditionally)
+static void chash_names_reset(chash_object *instance, CHASH_CONTEXT *context)
+{
+    u_int16_t index;
+
+    if (instance->names && context && instance->names_context == context && instance->names_generation == context->generation &&
+        instance->names_count == context->targets_count)
+    {
+        return;
+    }
+    for (index = 0; instance->names && index < instance->names_count; index ++)
+    {
+        if (instance->names[index])
+        {
+            zend_string_release(instance->names[index]);
+        }
+    }
+    if (instance->names)
+    {
+        efree(instance->names);
+    }
+    instance->names = NULL;
+    if (context && context->targets_count)
+    {
+        instance->names            = ecalloc(context->targets_count, sizeof(zend_string *));
+        instance->names_context    = context;
+        instance->names_generation = context->generation;
+        instance->names_count      = context->targets_count;
+    }
+}
+
+// Return a target name as a zend string, created on first use and shared by all the results of the same generation
+static zend_string *chash_name(chash_object *instance, CHASH_CONTEXT *context, u_int16_t target)
+{
+    if (! instance->names[target])
+    {
+        instance->names[target] = zend_string_init(context->targets[target].name, strlen(context->targets[target].name), 0);
+    }
+    return zend_string_copy(instance->names[target]);
+}
+
+// Find a ring path within the chash.preload directive ("<name>=<path>[;<name>=<path>...]")
+static int chash_preload_path(const char *name, size_t length, char *path, size_t size)
+{
+    const char *entry = CHASH_G(preload), *separator, *end;
+
+    while (entry && *entry)
+    {
+        end = entry + strcspn(entry, ";");
+        if ((separator = memchr(entry, '=', end - entry)) && separator - entry == length && ! memcmp(entry, name, length) &&
+            end - separator - 1 > 0 && end - separator - 1 < size)
+        {
+            memcpy(path, separator + 1, end - separator - 1);
+            path[end - separator - 1] = 0;
+            return 1;
+        }
+        entry = *end ? end + 1 : end;
+    }
+    return 0;
+}
+
+// Load a persistent ring, or reload it if its file changed (inode or mtime) since it was last loaded ("shm:<name>"
+// paths attach to a shared memory ring instead, following its generations)
+static int chash_ring_refresh(chash_ring *ring, u_char force)
+{
+    struct stat info;
+    time_t      now = time(NULL);
+    int         status;
+
+    if (! strncmp(ring->path, "shm:", 4))
+    {
+        if ((status = ring->context.shm ? chash_shm_refresh(&(ring->context)) : chash_shm_attach(&(ring->context), ring->path + 4)) < 0)
+        {
+            php_error_docref(NULL TSRMLS_CC, E_WARNING, "cannot attach shared ring %s (error %d)", ring->path + 4, status);
+        }
+        return ring->context.frozen ? ring->context.items_count : (status < 0 ? status : CHASH_ERROR_NOT_FOUND);
+    }
+    if (! force && ring->context.frozen && now - ring->checked < CHASH_G(check_interval))
+    {
+        return ring->context.items_count;
+    }
+    ring->checked = now;
+    if (stat(ring->path, &info) < 0)
+    {
+        return ring->context.frozen ? ring->context.items_count : CHASH_ERROR_IO;
+    }
+    if (ring->context.frozen && info.st_dev == ring->device && info.st_ino == ring->inode && info.st_mtime == ring->mtime)
+    {
+        return ring->context.items_count;
+    }
+    // the current ring is kept as long as the new file is missing or incomplete (size or magic mismatch)
+    if ((status = chash_file_unserialize(&(ring->context), ring->path)) < 0)
+    {
+        php_error_docref(NULL TSRMLS_CC, E_WARNING, "cannot load ring from %s (error %d)", ring->path, status);
+        return ring->context.frozen ? ring->context.items_count : status;
+    }
+    // rings living as long as the worker are laid out in a single block, limiting the heap fragmentation across reloads
+    chash_compact(&(ring->context));
+    ring->device = info.st_dev;
+    ring->inode  = info.st_ino;
+    ring->mtime  = info.st_mtime;
+    return status;
+}
+
+// Return the named persistent ring, registering it (from the given path or the chash.preload directive) if needed
+static chash_ring *chash_ring_get(const char *name, size_t length, const char *path)
+{
+    chash_ring *ring;
+    char       preload[MAXPATHLEN];
+
+    if ((ring = zend_hash_str_find_ptr(&CHASH_G(rings), name, length)))
+    {
+        if (path && strcmp(path, ring->path))
+        {
+            pefree(ring->path, 1);
+            ring->path    = pestrdup(path, 1);
+            ring->mtime   = 0;
+            ring->checked = 0;
+            if (ring->context.shm)
+            {
+                chash_clear_targets(&(ring->context));
+            }
+        }
+        return ring;
+    }
+    if (! path && ! chash_preload_path(name, length, preload, sizeof(preload)))
+    {
+        return NULL;
+    }
+    ring       = pecalloc(1, sizeof(chash_ring), 1);
+    ring->path = pestrdup(path ? path : preload, 1);
+    chash_initialize(&(ring->context), 0);
+    chash_set_allocator(&(ring->context), &chash_persistent_allocator);
+    return zend_hash_str_update_ptr(&CHASH_G(rings), name, length, ring);
+}
+
+static void chash_ring_free(zval *value)
+{
+    chash_ring *ring = Z_PTR_P(value);
+
+    chash_terminate(&(ring->context), 0);
+    pefree(ring->path, 1);
+    pefree(ring, 1);
+}
+
+// Load all the rings listed in the chash.preload directive
+static void chash_preload(void)
+{
+    const char *entry = CHASH_G(preload), *separator, *end;
+    chash_ring *ring;
+
+    while (entry && *entry)
+    {
+        end = entry + strcspn(entry, ";");
+        if ((separator = memchr(entry, '=', end - entry)) && separator > entry &&
+            (ring = chash_ring_get(entry, separator - entry, NULL)))
+        {
+            chash_ring_refresh(ring, 1);
+        }
+        entry = *end ? end + 1 : end;
+    }
+}
+
 // CHash method useExceptions(bool) -> bool
 PHP_METHOD(CHash, useExceptions)
 {
@@ -81,25 +314,128 @@ PHP_METHOD(CHash, addTarget)
     char         *target;
     size_t       length;
     long         weight = 1;
+    int          status;
 
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|l", &target, &length, &weight) != SUCCESS || length == 0)
     {
         RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
     }
+    if ((status = chash_detach(instance, 1)) < 0)
+    {
+        RETURN_LONG(chash_return(instance, status));
+    }
     RETVAL_LONG(chash_return(instance, chash_add_target(&(instance->context), target, weight)));
 }
 
+// CHash method setTargetDomain(<target>[, <domain>]) -> long
+PHP_METHOD(CHash, setTargetDomain)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    char         *target, *domain = NULL;
+    size_t       length, domain_length = 0;
+    int          status;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s!", &target, &length, &domain, &domain_length) != SUCCESS || length == 0)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    if ((status = chash_detach(instance, 1)) < 0)
+    {
+        RETURN_LONG(chash_return(instance, status));
+    }
+    RETURN_LONG(chash_return(instance, chash_target_domain(&(instance->context), target, domain)));
+}
+
+// CHash method setTargetDown(<target>[, <down>]) -> long (applied in place, persistent rings included)
+PHP_METHOD(CHash, setTargetDown)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    char         *target;
+    size_t       length;
+    zend_bool    down = 1;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|b", &target, &length, &down) != SUCCESS || length == 0)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    RETURN_LONG(chash_return(instance, chash_target_down(chash_context(instance), target, down)));
+}
+
+// CHash method setTargetPoints(<target>, <points>) -> long (patching the continuum in place)
+PHP_METHOD(CHash, setTargetPoints)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    char         *target;
+    size_t       length;
+    long         points;
+    int          status;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sl", &target, &length, &points) != SUCCESS || length == 0 ||
+        points < 0 || points > CHASH_POINTS_MAXIMUM)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    if ((status = chash_detach(instance, 1)) < 0)
+    {
+        RETURN_LONG(chash_return(instance, status));
+    }
+    RETURN_LONG(chash_return(instance, chash_target_points(&(instance->context), target, points)));
+}
+
+// CHash method rebalance(<loads>[, <gain>[, <step>[, <movement>]]]) -> long (number of continuum points changed)
+PHP_METHOD(CHash, rebalance)
+{
+    chash_object *instance = Z_CHASH_OBJ_P();
+    zval         *samples, *load;
+    zend_string  *target;
+    double       gain = 0.5, step = 0.1, movement = 0.01, *loads;
+    u_int16_t    index;
+    int          status;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|ddd", &samples, &gain, &step, &movement) != SUCCESS)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    if ((status = chash_detach(instance, 1)) < 0)
+    {
+        RETURN_LONG(chash_return(instance, status));
+    }
+    if (! (loads = (double *)emalloc((instance->context.targets_count + 1) * sizeof(double))))
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_MEMORY));
+    }
+    for (index = 0; index < instance->context.targets_count; index ++)
+    {
+        loads[index] = -1;
+    }
+    ZEND_HASH_FOREACH_STR_KEY_VAL(Z_ARRVAL_P(samples), target, load) {
+        for (index = 0; target && index < instance->context.targets_count && strcmp(instance->context.targets[index].name, target->val); index ++);
+        if (target && index < instance->context.targets_count)
+        {
+            loads[index] = zval_get_double(load);
+        }
+    } ZEND_HASH_FOREACH_END();
+    status = chash_rebalance(&(instance->context), loads, gain, step, movement);
+    efree(loads);
+    RETURN_LONG(chash_return(instance, status));
+}
+
 // CHash method removeTarget(<target>) -> long
 PHP_METHOD(CHash, removeTarget)
 {
     chash_object* instance = Z_CHASH_OBJ_P();
     char  *target;
     size_t  length;
+    int     status;
 
     if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &target, &length) != SUCCESS || length == 0)
     {
         RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
     }
+    if ((status = chash_detach(instance, 1)) < 0)
+    {
+        RETURN_LONG(chash_return(instance, status));
+    }
     RETURN_LONG(chash_return(instance, chash_remove_target(&(instance->context), target)));
 }
 
@@ -118,6 +454,7 @@ PHP_METHOD(CHash, setTargets)
     {
         RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
     }
+    chash_detach(instance, 0);
     if ((status = chash_clear_targets(&(instance->context))) < 0)
     {
         RETURN_LONG(chash_return(instance, status));
@@ -138,6 +475,7 @@ PHP_METHOD(CHash, setTargets)
 PHP_METHOD(CHash, clearTargets)
 {
     chash_object* instance = Z_CHASH_OBJ_P();
+    chash_detach(instance, 0);
     RETURN_LONG(chash_return(instance, chash_clear_targets(&(instance->context))));
 }
 
@@ -145,7 +483,7 @@ PHP_METHOD(CHash, clearTargets)
 PHP_METHOD(CHash, getTargetsCount)
 {
     chash_object* instance = Z_CHASH_OBJ_P();
-    RETURN_LONG(chash_return(instance, chash_targets_count(&(instance->context))));
+    RETURN_LONG(chash_return(instance, chash_targets_count(chash_context(instance))));
 }
 
 // CHash method serialize() -> string
@@ -155,7 +493,7 @@ PHP_METHOD(CHash, serialize)
     u_char       *serialized;
     int          size;
 
-    if ((size = chash_serialize(&(instance->context), &serialized)) < 0)
+    if ((size = chash_serialize(chash_context(instance), &serialized)) < 0)
     {
         chash_return(instance, size);
         RETURN_STRING("");
@@ -175,6 +513,7 @@ PHP_METHOD(CHash, unserialize)
     {
         RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
     }
+    chash_detach(instance, 0);
     RETURN_LONG(chash_return(instance, chash_unserialize(&(instance->context), serialized, length)));
 }
 
@@ -189,7 +528,7 @@ PHP_METHOD(CHash, serializeToFile)
     {
         RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
     }
-    RETURN_LONG(chash_return(instance, chash_file_serialize(&(instance->context), path)));
+    RETURN_LONG(chash_return(instance, chash_file_serialize(chash_context(instance), path)));
 }
 
 // CHash method unserializeFromFile(<path>) -> long
@@ -203,9 +542,68 @@ PHP_METHOD(CHash, unserializeFromFile)
     {
         RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
     }
+    chash_detach(instance, 0);
     RETURN_LONG(chash_return(instance, chash_file_unserialize(&(instance->context), path)));
 }
 
+// CHash method getChecksum() -> string (hexadecimal ring checksum, the base of deltas)
+PHP_METHOD(CHash, getChecksum)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    u_int64_t    checksum;
+    char         output[17];
+    int          status;
+
+    if ((status = chash_checksum(chash_context(instance), &checksum)) < 0)
+    {
+        chash_return(instance, status);
+        RETURN_STRING("");
+    }
+    snprintf(output, sizeof(output), "%016llx", (unsigned long long)checksum);
+    RETURN_STRING(output);
+}
+
+// CHash method delta(<base>) -> string (turning the <base> CHash object ring into this one)
+PHP_METHOD(CHash, delta)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    zval         *base;
+    u_char       *delta;
+    int          size;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "O", &base, chash_ce) != SUCCESS)
+    {
+        chash_return(instance, CHASH_ERROR_INVALID_PARAMETER);
+        RETURN_STRING("");
+    }
+    if ((size = chash_delta(chash_context(php_chash_fetch_object(Z_OBJ_P(base))), chash_context(instance), &delta)) < 0)
+    {
+        chash_return(instance, size);
+        RETURN_STRING("");
+    }
+    RETVAL_STRINGL((char *)delta, size);
+    free(delta);
+}
+
+// CHash method applyDelta(<delta>) -> long (patching the continuum in place)
+PHP_METHOD(CHash, applyDelta)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    u_char       *delta;
+    size_t       length;
+    int          status;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &delta, &length) != SUCCESS || length == 0)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    if ((status = chash_detach(instance, 1)) < 0)
+    {
+        RETURN_LONG(chash_return(instance, status));
+    }
+    RETURN_LONG(chash_return(instance, chash_delta_apply(&(instance->context), delta, length)));
+}
+
 // CHash method lookupList(<candidate>[, <count>]) -> array
 PHP_METHOD(CHash, lookupList)
 {
@@ -222,7 +620,7 @@ PHP_METHOD(CHash, lookupList)
         chash_return(instance, CHASH_ERROR_INVALID_PARAMETER);
         return;
     }
-    if ((status = chash_lookup(&(instance->context), candidate, count, &targets)) < 0)
+    if ((status = chash_lookup(chash_context(instance), candidate, count, &targets)) < 0)
     {
         chash_return(instance, status);
         return;
@@ -233,6 +631,40 @@ PHP_METHOD(CHash, lookupList)
     }
 }
 
+// CHash method lookupListDomains(<candidate>[, <count>]) -> array
+PHP_METHOD(CHash, lookupListDomains)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    CHASH_CONTEXT *context = chash_context(instance);
+    char          *candidate;
+    size_t        length;
+    u_int16_t     *output;
+    int           index, status;
+    long          count = 1;
+
+    array_init(return_value);
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|l", &candidate, &length, &count) != SUCCESS || length == 0 ||
+        count < 1 || count > 65535)
+    {
+        chash_return(instance, CHASH_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    output = emalloc(count * sizeof(u_int16_t));
+    if ((status = chash_lookup_domains(context, candidate, length, count, output)) < 0)
+    {
+        chash_return(instance, status);
+    }
+    else
+    {
+        chash_names_reset(instance, context);
+        for (index = 0; index < status; index ++)
+        {
+            add_next_index_str(return_value, chash_name(instance, context, output[index]));
+        }
+    }
+    efree(output);
+}
+
 // CHash method lookupBalance(<name>[, <count>]) -> string
 PHP_METHOD(CHash, lookupBalance)
 {
@@ -247,7 +679,7 @@ PHP_METHOD(CHash, lookupBalance)
         chash_return(instance, CHASH_ERROR_INVALID_PARAMETER);
         RETURN_STRING("");
     }
-    if ((status = chash_lookup_balance(&(instance->context), candidate, count, &target)) < 0)
+    if ((status = chash_lookup_balance(chash_context(instance), candidate, count, &target)) < 0)
     {
         chash_return(instance, status);
         RETURN_STRING("");
@@ -255,11 +687,329 @@ PHP_METHOD(CHash, lookupBalance)
     RETURN_STRING(target);
 }
 
+// CHash method lookupBalanceOrder(<candidate>, <count>, <seed>) -> array
+PHP_METHOD(CHash, lookupBalanceOrder)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    CHASH_CONTEXT *context = chash_context(instance);
+    char          *candidate;
+    size_t        length;
+    u_int16_t     *output;
+    int           index, status;
+    long          count, seed;
+
+    array_init(return_value);
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "sll", &candidate, &length, &count, &seed) != SUCCESS || length == 0 ||
+        count < 1 || count > 65535)
+    {
+        chash_return(instance, CHASH_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    output = emalloc(count * sizeof(u_int16_t));
+    if ((status = chash_lookup_balance_order(context, candidate, length, count, (u_int64_t)seed, output)) < 0)
+    {
+        chash_return(instance, status);
+    }
+    else
+    {
+        chash_names_reset(instance, context);
+        for (index = 0; index < status; index ++)
+        {
+            add_next_index_str(return_value, chash_name(instance, context, output[index]));
+        }
+    }
+    efree(output);
+}
+
+// Perform a batched lookup for all the candidates of an array, returning results keyed by candidate (either the
+// targets lists or a target picked at random among them)
+static void chash_lookup_multi(INTERNAL_FUNCTION_PARAMETERS, u_char balance)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    CHASH_CONTEXT *context = chash_context(instance);
+    zval          *candidates, *candidate, targets;
+    zend_string   **strings;
+    const char    **keys;
+    u_int32_t     *lengths, size, index = 0;
+    u_int16_t     *output, *ranks, rank;
+    long          count = 1;
+    int           status;
+
+    array_init(return_value);
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|l", &candidates, &count) != SUCCESS || count < 1 || count > 65535)
+    {
+        chash_return(instance, CHASH_ERROR_INVALID_PARAMETER);
+        return;
+    }
+    if (! (size = zend_hash_num_elements(Z_ARRVAL_P(candidates))))
+    {
+        return;
+    }
+    strings = emalloc(size * sizeof(zend_string *));
+    keys    = emalloc(size * sizeof(char *));
+    lengths = emalloc(size * sizeof(u_int32_t));
+    ranks   = emalloc(size * sizeof(u_int16_t));
+    output  = safe_emalloc(size, count * sizeof(u_int16_t), 0);
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(candidates), candidate) {
+        strings[index] = zval_get_string(candidate);
+        keys[index]    = ZSTR_VAL(strings[index]);
+        lengths[index] = ZSTR_LEN(strings[index]);
+        index ++;
+    } ZEND_HASH_FOREACH_END();
+    if (balance && (context->balance != CHASH_BALANCE_UNIFORM || context->balance_bias != 0 || context->hotkeys || context->stats))
+    {
+        // weighted balancing, hot keys spreading and balance statistics need each target to be picked along its own
+        // lookup, stored as the single rank of the candidate
+        for (status = 0, index = 0; status >= 0 && index < size; index ++)
+        {
+            status       = chash_lookup_balance_index(context, keys[index], lengths[index], count, output + (index * count));
+            ranks[index] = status < 0 ? 0 : 1;
+            status       = (status == CHASH_ERROR_NOT_FOUND || status == CHASH_ERROR_INVALID_PARAMETER) ? 0 : status;
+        }
+    }
+    else
+    {
+        status = chash_lookup_batch(context, keys, lengths, size, count, output, ranks);
+    }
+    if (status < 0)
+    {
+        chash_return(instance, status);
+    }
+    else
+    {
+        chash_names_reset(instance, context);
+        for (index = 0; index < size; index ++)
+        {
+            if (balance)
+            {
+                if (ranks[index])
+                {
+                    ZVAL_STR(&targets, chash_name(instance, context, output[(index * count) + (rand() % ranks[index])]));
+                }
+                else
+                {
+                    ZVAL_EMPTY_STRING(&targets);
+                }
+            }
+            else
+            {
+                array_init_size(&targets, ranks[index]);
+                for (rank = 0; rank < ranks[index]; rank ++)
+                {
+                    add_next_index_str(&targets, chash_name(instance, context, output[(index * count) + rank]));
+                }
+            }
+            zend_symtable_update(Z_ARRVAL_P(return_value), strings[index], &targets);
+        }
+    }
+    for (index = 0; index < size; index ++)
+    {
+        zend_string_release(strings[index]);
+    }
+    efree(strings);
+    efree(keys);
+    efree(lengths);
+    efree(ranks);
+    efree(output);
+}
+
+// CHash method lookupListMulti(array(<candidate>, ...)[, <count>]) -> array(<candidate> => array(<target>, ...), ...)
+PHP_METHOD(CHash, lookupListMulti)
+{
+    chash_lookup_multi(INTERNAL_FUNCTION_PARAM_PASSTHRU, 0);
+}
+
+// CHash method lookupBalanceMulti(array(<candidate>, ...)[, <count>]) -> array(<candidate> => <target>, ...)
+PHP_METHOD(CHash, lookupBalanceMulti)
+{
+    chash_lookup_multi(INTERNAL_FUNCTION_PARAM_PASSTHRU, 1);
+}
+
+// CHash method enableStats([<shards>]) -> long
+PHP_METHOD(CHash, enableStats)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    long         shards = 1;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|l", &shards) != SUCCESS || shards < 0 || shards > 65535)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    RETURN_LONG(chash_return(instance, chash_stats_enable(chash_context(instance), shards)));
+}
+
+// CHash method getStats() -> array
+PHP_METHOD(CHash, getStats)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    CHASH_STATS  stats;
+    zval         histogram, selections;
+    int          index, status;
+
+    array_init(return_value);
+    if ((status = chash_stats_get(chash_context(instance), &stats)) < 0)
+    {
+        chash_return(instance, status);
+        return;
+    }
+    add_assoc_long(return_value, "lookups", stats.lookups);
+    add_assoc_long(return_value, "balance_lookups", stats.balance_lookups);
+    add_assoc_long(return_value, "balance_fallbacks", stats.balance_fallbacks);
+    add_assoc_long(return_value, "freezes", stats.freezes);
+    add_assoc_long(return_value, "freeze_time", stats.freeze_time);
+    array_init(&histogram);
+    for (index = 0; index < CHASH_STATS_BUCKETS; index ++)
+    {
+        add_next_index_long(&histogram, stats.freeze_histogram[index]);
+    }
+    add_assoc_zval(return_value, "freeze_histogram", &histogram);
+    add_assoc_long(return_value, "continuum_size", stats.continuum_size);
+    array_init(&selections);
+    for (index = 0; index < stats.targets_count && index < chash_context(instance)->targets_count; index ++)
+    {
+        add_assoc_long(&selections, chash_context(instance)->targets[index].name, stats.selections[index]);
+    }
+    add_assoc_zval(return_value, "selections", &selections);
+    free(stats.selections);
+}
+
+// CHash method enableCache(<entries>) -> long
+PHP_METHOD(CHash, enableCache)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    long         entries;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l", &entries) != SUCCESS || entries < 0 || entries > 0xffffffffL)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    RETURN_LONG(chash_return(instance, chash_cache_enable(chash_context(instance), entries)));
+}
+
+// CHash method setBalanceMode(<mode>[, <bias>]) -> long
+PHP_METHOD(CHash, setBalanceMode)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    long         mode;
+    double       bias = 0;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|d", &mode, &bias) != SUCCESS || mode < 0 || mode > 255)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    RETURN_LONG(chash_return(instance, chash_balance_mode(chash_context(instance), mode, bias)));
+}
+
+// CHash method getCacheStats() -> array
+PHP_METHOD(CHash, getCacheStats)
+{
+    chash_object*     instance = Z_CHASH_OBJ_P();
+    CHASH_CACHE_STATS stats;
+    int               status;
+
+    array_init(return_value);
+    if ((status = chash_cache_stats(chash_context(instance), &stats)) < 0)
+    {
+        chash_return(instance, status);
+        return;
+    }
+    add_assoc_long(return_value, "entries", stats.entries);
+    add_assoc_long(return_value, "used", stats.used);
+    add_assoc_long(return_value, "hits", stats.hits);
+    add_assoc_long(return_value, "misses", stats.misses);
+    add_assoc_long(return_value, "evictions", stats.evictions);
+}
+
+// CHash method enableHotKeys(<threshold>[, <spread>[, <window>]]) -> long
+PHP_METHOD(CHash, enableHotKeys)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    long         threshold, spread = 3, window = 0;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "l|ll", &threshold, &spread, &window) != SUCCESS ||
+        threshold < 0 || threshold > 0xffffffffL || spread < 0 || spread > 65535 || window < 0 || window > 0xffffffffL)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    RETURN_LONG(chash_return(instance, chash_hotkeys_enable(chash_context(instance), threshold, window, spread)));
+}
+
+// CHash method getHotKeys() -> array
+PHP_METHOD(CHash, getHotKeys)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    CHASH_HOTKEYS hotkeys;
+    zval          keys;
+    int           status, index;
+
+    array_init(return_value);
+    if ((status = chash_hotkeys_get(chash_context(instance), &hotkeys)) < 0)
+    {
+        chash_return(instance, status);
+        return;
+    }
+    array_init(&keys);
+    for (index = 0; index < hotkeys.count; index ++)
+    {
+        add_assoc_long_ex(&keys, hotkeys.keys[index].key, hotkeys.keys[index].length, hotkeys.keys[index].count);
+    }
+    add_assoc_long(return_value, "threshold", hotkeys.threshold);
+    add_assoc_long(return_value, "window", hotkeys.window);
+    add_assoc_long(return_value, "spread", hotkeys.spread);
+    add_assoc_long(return_value, "observed", hotkeys.observed);
+    add_assoc_long(return_value, "spread_lookups", hotkeys.spread_lookups);
+    add_assoc_zval(return_value, "keys", &keys);
+}
+
+// CHash method publishShared(<name>) -> long
+PHP_METHOD(CHash, publishShared)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    char         *name;
+    size_t       length;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &name, &length) != SUCCESS || length == 0)
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    RETURN_LONG(chash_return(instance, chash_shm_publish(chash_context(instance), name)));
+}
+
+// CHash method usePersistent(<name>[, <path>]) -> long
+PHP_METHOD(CHash, usePersistent)
+{
+    chash_object* instance = Z_CHASH_OBJ_P();
+    chash_ring   *ring;
+    char         *name, *path = NULL;
+    size_t       length, path_length = 0;
+    int          status;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|s", &name, &length, &path, &path_length) != SUCCESS ||
+        length == 0 || (path && path_length == 0))
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_INVALID_PARAMETER));
+    }
+    if (! (ring = chash_ring_get(name, length, path)))
+    {
+        RETURN_LONG(chash_return(instance, CHASH_ERROR_NOT_FOUND));
+    }
+    if ((status = chash_ring_refresh(ring, 0)) < 0)
+    {
+        RETURN_LONG(chash_return(instance, status));
+    }
+    instance->ring = ring;
+    RETURN_LONG(status);
+}
+
 // CHash module v-table
 static zend_function_entry chash_class_methods[] =
 {
     PHP_ME(CHash, useExceptions, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, addTarget, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, setTargetDomain, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, setTargetDown, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, setTargetPoints, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, rebalance, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, removeTarget, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, setTargets, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, clearTargets, NULL, ZEND_ACC_PUBLIC)
@@ -268,8 +1018,24 @@ static zend_function_entry chash_class_methods[] =
     PHP_ME(CHash, unserialize, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, serializeToFile, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, unserializeFromFile, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, getChecksum, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, delta, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, applyDelta, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, lookupList, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, lookupListDomains, NULL, ZEND_ACC_PUBLIC)
     PHP_ME(CHash, lookupBalance, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, lookupListMulti, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, lookupBalanceMulti, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, lookupBalanceOrder, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, enableStats, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, getStats, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, enableCache, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, getCacheStats, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, setBalanceMode, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, enableHotKeys, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, getHotKeys, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, usePersistent, NULL, ZEND_ACC_PUBLIC)
+    PHP_ME(CHash, publishShared, NULL, ZEND_ACC_PUBLIC)
     {NULL, NULL, NULL}
 };
 
@@ -278,6 +1044,7 @@ static void chash_free(zend_object *obj)
 {
     chash_object *i_obj = php_chash_fetch_object(obj);
     zend_object_std_dtor(&(i_obj->zo));
+    chash_names_reset(i_obj, NULL);
     chash_terminate(&(i_obj->context), 0);
     i_obj = NULL;
     obj = NULL;
@@ -291,17 +1058,33 @@ static zend_object *chash_allocate(zend_class_entry *ce)
 
     zend_object_std_init(&(instance->zo), ce);
     chash_initialize(&(instance->context), 0);
+    chash_set_allocator(&(instance->context), &chash_request_allocator);
     instance->use_exceptions = 1;
     instance->zo.handlers = &chash_object_handlers;
 
     return &instance->zo;
 }
 
+// CHash module globals (persistent rings registry) initialization and destruction
+static PHP_GINIT_FUNCTION(chash)
+{
+    chash_globals->preload        = NULL;
+    chash_globals->check_interval = 1;
+    zend_hash_init(&(chash_globals->rings), 8, NULL, chash_ring_free, 1);
+}
+
+static PHP_GSHUTDOWN_FUNCTION(chash)
+{
+    zend_hash_destroy(&(chash_globals->rings));
+}
+
 // CHash module global initialization
 PHP_MINIT_FUNCTION(chash)
 {
     zend_class_entry ce;
 
+    REGISTER_INI_ENTRIES();
+
     memcpy(&chash_object_handlers, zend_get_std_object_handlers(), sizeof(zend_object_handlers));
 
     INIT_CLASS_ENTRY(ce, "CHash", chash_class_methods);
@@ -318,6 +1101,8 @@ PHP_MINIT_FUNCTION(chash)
     REGISTER_LONG_CONSTANT("CHASH_ERROR_IO", CHASH_ERROR_IO, CONST_CS | CONST_PERSISTENT);
     REGISTER_LONG_CONSTANT("CHASH_ERROR_INVALID_PARAMETER", CHASH_ERROR_INVALID_PARAMETER, CONST_CS | CONST_PERSISTENT);
     REGISTER_LONG_CONSTANT("CHASH_ERROR_NOT_FOUND", CHASH_ERROR_NOT_FOUND, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("CHASH_BALANCE_UNIFORM", CHASH_BALANCE_UNIFORM, CONST_CS | CONST_PERSISTENT);
+    REGISTER_LONG_CONSTANT("CHASH_BALANCE_WEIGHTED", CHASH_BALANCE_WEIGHTED, CONST_CS | CONST_PERSISTENT);
 
     INIT_CLASS_ENTRY(ce, "CHashMemoryException", NULL);
     chash_memory_exception = zend_register_internal_class_ex(&ce, zend_exception_get_default());
@@ -328,6 +1113,16 @@ PHP_MINIT_FUNCTION(chash)
     INIT_CLASS_ENTRY(ce, "CHashNotFoundException", NULL);
     chash_not_found_exception = zend_register_internal_class_ex(&ce, zend_exception_get_default());
 
+    // rings loaded before workers are forked are shared (copy-on-write) among them
+    chash_preload();
+
+    return SUCCESS;
+}
+
+// CHash module global shutdown
+PHP_MSHUTDOWN_FUNCTION(chash)
+{
+    UNREGISTER_INI_ENTRIES();
     return SUCCESS;
 }
 
@@ -338,12 +1133,16 @@ zend_module_entry chash_module_entry =
     "chash",
     NULL,
     PHP_MINIT(chash),
-    NULL,
+    PHP_MSHUTDOWN(chash),
     NULL,
     NULL,
     NULL,
     "1.0",
-    STANDARD_MODULE_PROPERTIES
+    PHP_MODULE_GLOBALS(chash),
+    PHP_GINIT(chash),
+    PHP_GSHUTDOWN(chash),
+    NULL,
+    STANDARD_MODULE_PROPERTIES_EX
 };
 #ifdef COMPILE_DL_CHASH
 ZEND_GET_MODULE(chash)
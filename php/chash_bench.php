@@ -0,0 +1,129 @@
+<?php
+// Consistent hashing library PHP extension - binding overhead benchmark
+// usage: php chash_bench.php [<targets>] [<counts>] [<lookups>] [<chash_bench path>]
+
+// Defines
+define('SAMPLE_CALLS', 16);
+define('MULTI_KEYS',   100);
+
+// Helper functions
+function bench_now()
+{
+    return function_exists('hrtime') ? hrtime(true) : microtime(true) * 1e9;
+}
+function bench_target($index)
+{
+    return sprintf('10.%d.%d.%d:11211', ($index >> 16) & 0xff, ($index >> 8) & 0xff, $index & 0xff);
+}
+function bench_percentile($samples, $value)
+{
+    return $samples[min(count($samples) - 1, intval((count($samples) * $value) / 100))];
+}
+function bench_measure($callback, $keys)
+{
+    // per-call latency is sampled over small batches to amortize the clock cost
+    $samples   = array();
+    $start_all = bench_now();
+    for ($index = 0; $index + SAMPLE_CALLS <= count($keys); $index += SAMPLE_CALLS)
+    {
+        $start = bench_now();
+        for ($step = 0; $step < SAMPLE_CALLS; $step ++)
+        {
+            $callback($keys[$index + $step]);
+        }
+        $samples[] = (bench_now() - $start) / SAMPLE_CALLS;
+    }
+    $elapsed = bench_now() - $start_all;
+    sort($samples);
+    return array
+    (
+        'mean'             => array_sum($samples) / count($samples),
+        'p50'              => bench_percentile($samples, 50),
+        'p90'              => bench_percentile($samples, 90),
+        'p99'              => bench_percentile($samples, 99),
+        'calls_per_second' => (count($samples) * SAMPLE_CALLS) / ($elapsed / 1e9),
+    );
+}
+function bench_measure_multi($callback, $keys)
+{
+    // batched calls are timed as a whole and reported per key
+    $start = bench_now();
+    foreach (array_chunk($keys, MULTI_KEYS) as $chunk)
+    {
+        $callback($chunk);
+    }
+    return (bench_now() - $start) / count($keys);
+}
+function bench_baseline($path, $targets, $counts, $lookups)
+{
+    // run the raw C benchmark on the same ring configuration (weight 1, uniform keys)
+    $baseline = array();
+    if ($path == '' || ! is_executable($path))
+    {
+        return $baseline;
+    }
+    $output = json_decode(shell_exec(sprintf('%s -t %d -w 1 -c %s -d uniform -n %d', escapeshellarg($path), $targets,
+                                             escapeshellarg(implode(',', $counts)), $lookups)), true);
+    if (isset($output['results'][0]['lookups']))
+    {
+        foreach ($output['results'][0]['lookups'] as $lookup)
+        {
+            $baseline[$lookup['count']] = $lookup['lookup_ns']['mean'];
+        }
+    }
+    return $baseline;
+}
+
+$targets_list = explode(',', isset($argv[1]) ? $argv[1] : '10,100,1000');
+$counts       = array_map('intval', explode(',', isset($argv[2]) ? $argv[2] : '1,2,3'));
+$lookups      = isset($argv[3]) ? intval($argv[3]) : 100000;
+$bench_path   = isset($argv[4]) ? $argv[4] : dirname(__FILE__) . '/../libchash/libchash/chash_bench';
+
+mt_srand(42);
+$keys = array();
+for ($index = 0; $index < $lookups; $index ++)
+{
+    $keys[] = sprintf('video%09d', mt_rand(0, 999999));
+}
+
+$results = array();
+foreach ($targets_list as $targets)
+{
+    $targets = intval($targets);
+    $chash   = new CHash();
+    for ($index = 0; $index < $targets; $index ++)
+    {
+        $chash->addTarget(bench_target($index));
+    }
+    $chash->lookupList('warmup');
+    $baseline = bench_baseline($bench_path, $targets, $counts, $lookups);
+
+    // call floor: a trivial method call without any argument nor lookup
+    $floor = bench_measure(function ($key) use ($chash) { $chash->getTargetsCount(); }, $keys);
+    foreach ($counts as $count)
+    {
+        $result = array
+        (
+            'targets'           => $targets,
+            'count'             => $count,
+            'lookups'           => $lookups,
+            'call_floor_ns'     => $floor,
+            'lookup_list_ns'    => bench_measure(function ($key) use ($chash, $count) { $chash->lookupList($key, $count); }, $keys),
+            'lookup_balance_ns' => bench_measure(function ($key) use ($chash, $count) { $chash->lookupBalance($key, $count); }, $keys),
+            'lookup_list_multi_ns'    => bench_measure_multi(function ($chunk) use ($chash, $count) { $chash->lookupListMulti($chunk, $count); }, $keys),
+            'lookup_balance_multi_ns' => bench_measure_multi(function ($chunk) use ($chash, $count) { $chash->lookupBalanceMulti($chunk, $count); }, $keys),
+        );
+        if (isset($baseline[$count]))
+        {
+            $result['c_lookup_ns']                = $baseline[$count];
+            $result['lookup_list_overhead_ns']    = $result['lookup_list_ns']['mean'] - $baseline[$count];
+            $result['lookup_balance_overhead_ns'] = $result['lookup_balance_ns']['mean'] - $baseline[$count];
+        }
+        $results[] = $result;
+        fprintf(STDERR, "targets=%d count=%d lookupList=%.1fns lookupBalance=%.1fns lookupListMulti=%.1fns/key c=%s\n", $targets, $count,
+                $result['lookup_list_ns']['mean'], $result['lookup_balance_ns']['mean'], $result['lookup_list_multi_ns'],
+                isset($baseline[$count]) ? sprintf('%.1fns', $baseline[$count]) : 'n/a');
+    }
+}
+
+print json_encode(array('benchmark' => 'chash-php', 'php' => PHP_VERSION, 'results' => $results)) . "\n";
@@ -126,6 +126,14 @@ test_step(($serialized2 = $chash->serialize()) == '' ? -1 : 0);
 test_step($serialized1 != $serialized2 ? -1 : 0);
 test_end('');
 
+test_start('enableStats');
+test_step($chash->enableStats());
+test_end('');
+
+test_start('enableCache');
+test_step($chash->enableCache(4096));
+test_end('');
+
 test_start('lookupList');
 $lookups = array();
 for ($index = 0; $index < CANDIDATES; $index ++)
@@ -166,4 +174,197 @@ foreach ($lookups as $value)
 }
 test_end('deviation is ' . sprintf('%.2f', sqrt($deviation / count($lookups))));
 
+test_start('getStats');
+$stats = $chash->getStats();
+test_step($stats['lookups'] != 2 * CANDIDATES ? -1 : 0, 'invalid lookups count ' . $stats['lookups']);
+test_step($stats['balance_lookups'] != CANDIDATES ? -1 : 0, 'invalid balance lookups count ' . $stats['balance_lookups']);
+test_step(array_sum($stats['selections']) != 2 * CANDIDATES ? -1 : 0, 'invalid selections count ' . array_sum($stats['selections']));
+test_end('continuum size is ' . $stats['continuum_size'] . ' bytes');
+
+test_start('getCacheStats');
+for ($index = 0; $index < 1000; $index ++)
+{
+    $targets = $chash->lookupList(sprintf('candidate%07d', $index), 2);
+    test_step($chash->lookupList(sprintf('candidate%07d', $index), 2) != $targets ? -1 : 0);
+}
+$stats = $chash->getCacheStats();
+test_step($stats['hits'] < 1000 ? -1 : 0, 'invalid cache hits count ' . $stats['hits']);
+test_step($stats['hits'] + $stats['misses'] != CANDIDATES + 2000 ? -1 : 0, 'invalid cache lookups count ' . ($stats['hits'] + $stats['misses']));
+test_end('hit rate is ' . sprintf('%.2f', $stats['hits'] / ($stats['hits'] + $stats['misses'])));
+
+test_start('lookupListMulti');
+$candidates = array();
+for ($index = 0; $index < 1000; $index ++)
+{
+    $candidates[] = sprintf('candidate%07d', $index);
+}
+$lookups = $chash->lookupListMulti($candidates, 3);
+test_step(count($lookups) != count($candidates) ? -1 : 0, 'invalid results count ' . count($lookups));
+foreach ($candidates as $candidate)
+{
+    test_step(@$lookups[$candidate] != $chash->lookupList($candidate, 3) ? -1 : 0, 'lookup mismatch for ' . $candidate);
+}
+test_end('');
+
+test_start('lookupBalanceMulti');
+$stats   = $chash->getStats();
+$lookups = $chash->lookupBalanceMulti($candidates, 3);
+test_step(count($lookups) != count($candidates) ? -1 : 0, 'invalid results count ' . count($lookups));
+foreach ($candidates as $candidate)
+{
+    test_step(! in_array(@$lookups[$candidate], $chash->lookupList($candidate, 3)) ? -1 : 0, 'lookup mismatch for ' . $candidate);
+}
+$balanced = $chash->getStats();
+test_step($balanced['balance_lookups'] != $stats['balance_lookups'] + count($candidates) ? -1 : 0,
+          'invalid balance lookups count ' . $balanced['balance_lookups']);
+$hot = new CHash();
+$hot->useExceptions(false);
+for ($index = 0; $index < 10; $index ++)
+{
+    test_step($hot->addTarget(sprintf('target%03d', $index)));
+}
+test_step($hot->enableHotKeys(10, 6));
+$replicas = $hot->lookupList('video:x7hot', 6);
+$targets  = array();
+for ($index = 0; $index < 1000; $index ++)
+{
+    $lookups = $hot->lookupBalanceMulti(array('video:x7hot'), 2);
+    $targets[$lookups['video:x7hot']] = 1;
+}
+test_step(count($targets) <= 2 || array_diff(array_keys($targets), $replicas) ? -1 : 0, 'hot key not spread among its replicas');
+test_end('hot key spread over ' . count($targets) . ' targets');
+
+test_start('lookupBalanceOrder');
+$weighted = new CHash();
+$weighted->useExceptions(false);
+$weighted->addTarget('heavy', 100);
+$weighted->addTarget('light', 10);
+test_step($weighted->setBalanceMode(2) == CHASH_ERROR_INVALID_PARAMETER ? 0 : -1, 'invalid mode accepted');
+test_step($weighted->setBalanceMode(CHASH_BALANCE_WEIGHTED));
+$heavy = 0;
+for ($index = 0; $index < 1000; $index ++)
+{
+    $order = $weighted->lookupBalanceOrder('candidate', 2, $index);
+    test_step(count($order) != 2 || $order[0] == $order[1] || $order != $weighted->lookupBalanceOrder('candidate', 2, $index) ? -1 : 0,
+              'invalid order for seed ' . $index);
+    $heavy += $order[0] == 'heavy' ? 1 : 0;
+}
+test_step($heavy < 850 || $heavy > 960 ? -1 : 0, 'heavy target picked ' . $heavy . ' times out of 1000');
+$lookups = $weighted->lookupBalanceMulti(array('candidate1', 'candidate2', ''), 2);
+test_step(! in_array($lookups['candidate1'], array('heavy', 'light')) || $lookups[''] !== '' ? -1 : 0, 'invalid weighted multi lookups');
+test_end('heavy target picked ' . $heavy . ' times out of 1000');
+
+test_start('lookupListDomains');
+$placed = new CHash();
+$placed->useExceptions(false);
+for ($index = 0; $index < 30; $index ++)
+{
+    $placed->addTarget(sprintf('10.0.0.%d:11211', $index), 10);
+    test_step($placed->setTargetDomain(sprintf('10.0.0.%d:11211', $index), 'zone' . ($index % 5)));
+}
+for ($index = 0; $index < 1000; $index ++)
+{
+    $targets = $placed->lookupListDomains(sprintf('candidate%07d', $index), 3);
+    $zones   = array();
+    foreach ($targets as $target)
+    {
+        $zones[explode('.', $target)[3] % 5] = 1;
+    }
+    test_step(count($targets) != 3 || count($zones) != 3 ? -1 : 0, 'replicas not spread for candidate' . $index);
+    test_step(count($placed->lookupListDomains(sprintf('candidate%07d', $index), 7)) != 7 ? -1 : 0, 'invalid replicas count');
+}
+test_end('');
+
+test_start('setTargetDown');
+test_step($placed->setTargetDown('10.0.1.0:11211') == CHASH_ERROR_NOT_FOUND ? 0 : -1, 'unknown target marked down');
+test_step($placed->setTargetDown('10.0.0.7:11211'));
+for ($index = 0; $index < 1000; $index ++)
+{
+    test_step(in_array('10.0.0.7:11211', $placed->lookupList(sprintf('candidate%07d', $index), 3)) ? -1 : 0, 'down target found for candidate' . $index);
+}
+test_step($placed->setTargetDown('10.0.0.7:11211', false));
+for ($count = 0, $index = 0; $index < 1000; $index ++)
+{
+    $count += in_array('10.0.0.7:11211', $placed->lookupList(sprintf('candidate%07d', $index), 3)) ? 1 : 0;
+}
+test_step($count ? 0 : -1, 'target not marked back up');
+test_end('');
+
+test_start('rebalance');
+test_step($placed->setTargetPoints('10.0.1.0:11211', 1000) == CHASH_ERROR_NOT_FOUND ? 0 : -1, 'unknown target points set');
+test_step($placed->setTargetPoints('10.0.0.3:11211', 1000));
+$before = array();
+for ($index = 0; $index < 1000; $index ++)
+{
+    $before[] = $placed->lookupList(sprintf('candidate%07d', $index))[0];
+}
+test_step(($count = $placed->rebalance(array('10.0.0.1:11211' => 2.0, '10.0.0.2:11211' => 1.0, '10.0.0.4:11211' => 1.0), 0.5, 0.2, 0.01)) <= 0 ? -1 : 0,
+          'nothing rebalanced');
+for ($moved = 0, $index = 0; $index < 1000; $index ++)
+{
+    $moved += $placed->lookupList(sprintf('candidate%07d', $index))[0] != $before[$index] ? 1 : 0;
+}
+test_step($moved > 50 ? -1 : 0, $moved . ' keys moved');
+test_end($count . ' points changed, ' . $moved . ' keys moved');
+
+test_start('applyDelta');
+$base = new CHash();
+test_step(($count = $base->unserialize($placed->serialize())) < 0 ? $count : 0);
+test_step($base->getChecksum() != $placed->getChecksum() ? -1 : 0, 'identical rings checksums differ');
+test_step($placed->removeTarget('10.0.0.5:11211'));
+test_step($placed->addTarget('10.0.1.0:11211', 5));
+test_step(strlen($delta = $placed->delta($base)) * 5 > strlen($placed->serialize()) ? -1 : 0, 'delta not smaller than the ring');
+test_step(($count = $base->applyDelta($delta)) < 0 ? $count : 0);
+test_step($base->getChecksum() != $placed->getChecksum() ? -1 : 0, 'patched ring checksum differs');
+for ($index = 0; $index < 1000; $index ++)
+{
+    test_step($base->lookupList(sprintf('candidate%07d', $index), 3) != $placed->lookupList(sprintf('candidate%07d', $index), 3) ? -1 : 0,
+              'patched lookup mismatch for candidate' . $index);
+}
+test_step($base->applyDelta($delta) == CHASH_ERROR_INVALID_PARAMETER ? 0 : -1, 'delta applied twice');
+test_end(strlen($delta) . ' bytes delta');
+
+test_start('getHotKeys');
+test_step($placed->enableHotKeys(100, 6));
+$replicas = $placed->lookupList('video:x7hot', 6);
+$targets  = array();
+for ($index = 0; $index < 1000; $index ++)
+{
+    $targets[$placed->lookupBalance('video:x7hot')] = 1;
+    $placed->lookupList(sprintf('candidate%07d', $index));
+}
+test_step(count($targets) < 2 || array_diff(array_keys($targets), $replicas) ? -1 : 0, 'hot key not spread among its replicas');
+$hotkeys = $placed->getHotKeys();
+test_step(array_keys($hotkeys['keys']) != array('video:x7hot') ? -1 : 0, 'invalid hot keys');
+test_step($hotkeys['spread_lookups'] != 1000 - 98 ? -1 : 0, 'invalid spread lookups count ' . $hotkeys['spread_lookups']);
+test_end('spread over ' . count($targets) . ' targets');
+
+test_start('usePersistent');
+$persistent = new CHash();
+test_step(($count = $persistent->usePersistent('test', SERIALIZEPATH)) < 0 ? $count : 0);
+test_step($persistent->getTargetsCount() != $chash->getTargetsCount() ? -1 : 0, 'invalid targets count ' . $persistent->getTargetsCount());
+for ($index = 0; $index < 1000; $index ++)
+{
+    test_step($persistent->lookupList(sprintf('candidate%07d', $index), 3) != $chash->lookupList(sprintf('candidate%07d', $index), 3) ? -1 : 0);
+}
+$shared = new CHash();
+$shared->useExceptions(false);
+test_step($shared->usePersistent('test') != $count ? -1 : 0, 'persistent ring not registered');
+test_step($shared->addTarget('target999'));
+test_step($shared->getTargetsCount() != $persistent->getTargetsCount() + 1 ? -1 : 0, 'persistent ring modified');
+test_step($shared->usePersistent('unknown') != CHASH_ERROR_NOT_FOUND ? -1 : 0, 'unknown persistent ring found');
+test_end('continuum count is ' . $count);
+
+test_start('publishShared');
+$name = 'chash_test.' . getmypid();
+test_step(($size = $chash->publishShared($name)) < 0 ? $size : 0);
+$shared = new CHash();
+test_step($shared->usePersistent('shared', 'shm:' . $name) != $count ? -1 : 0, 'invalid shared continuum count');
+for ($index = 0; $index < 1000; $index ++)
+{
+    test_step($shared->lookupList(sprintf('candidate%07d', $index), 3) != $chash->lookupList(sprintf('candidate%07d', $index), 3) ? -1 : 0);
+}
+array_map('unlink', glob('/dev/shm/' . $name . '*'));
+test_end('shared ring is ' . $size . ' bytes');
+
 print "\n";
@@ -3,6 +3,10 @@
  <<__NativeData("ZendCompat")>> class CHash {
   <<__Native("ZendCompat")>> public function useExceptions(bool $b): bool;
   <<__Native("ZendCompat")>> public function addTarget(string $target, int $weight = 1): int;
+  <<__Native("ZendCompat")>> public function setTargetDomain(string $target, ?string $domain = null): int;
+  <<__Native("ZendCompat")>> public function setTargetDown(string $target, bool $down = true): int;
+  <<__Native("ZendCompat")>> public function setTargetPoints(string $target, int $points): int;
+  <<__Native("ZendCompat")>> public function rebalance(array $loads, float $gain = 0.5, float $step = 0.1, float $movement = 0.01): int;
   <<__Native("ZendCompat")>> public function removeTarget(string $target): int;
   <<__Native("ZendCompat")>> public function setTargets(array $targets): int;
   <<__Native("ZendCompat")>> public function clearTargets(): int;
@@ -11,8 +15,24 @@
   <<__Native("ZendCompat")>> public function unserialize(string $serialized): int;
   <<__Native("ZendCompat")>> public function serializeToFile(string $path): int;
   <<__Native("ZendCompat")>> public function unserializeFromFile(string $path): int;
+  <<__Native("ZendCompat")>> public function getChecksum(): string;
+  <<__Native("ZendCompat")>> public function delta(CHash $base): string;
+  <<__Native("ZendCompat")>> public function applyDelta(string $delta): int;
   <<__Native("ZendCompat")>> public function lookupList(string $candidate, int $count = 1): array;
+  <<__Native("ZendCompat")>> public function lookupListDomains(string $candidate, int $count = 1): array;
   <<__Native("ZendCompat")>> public function lookupBalance(string $name, int $count = 1): string;
+  <<__Native("ZendCompat")>> public function lookupListMulti(array $candidates, int $count = 1): array;
+  <<__Native("ZendCompat")>> public function lookupBalanceMulti(array $candidates, int $count = 1): array;
+  <<__Native("ZendCompat")>> public function lookupBalanceOrder(string $candidate, int $count, int $seed): array;
+  <<__Native("ZendCompat")>> public function enableStats(int $shards = 1): int;
+  <<__Native("ZendCompat")>> public function getStats(): array;
+  <<__Native("ZendCompat")>> public function enableCache(int $entries): int;
+  <<__Native("ZendCompat")>> public function getCacheStats(): array;
+  <<__Native("ZendCompat")>> public function setBalanceMode(int $mode, float $bias = 0.0): int;
+  <<__Native("ZendCompat")>> public function enableHotKeys(int $threshold, int $spread = 3, int $window = 0): int;
+  <<__Native("ZendCompat")>> public function getHotKeys(): array;
+  <<__Native("ZendCompat")>> public function usePersistent(string $name, ?string $path = null): int;
+  <<__Native("ZendCompat")>> public function publishShared(string $name): int;
 }
 
 <<__NativeData("ZendCompat")>> class CHashException extends Exception {}
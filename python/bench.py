@@ -0,0 +1,112 @@
+#!/usr/bin/python
+# Consistent hashing library Python extension - binding overhead benchmark
+
+import chash
+import json
+import optparse
+import os
+import random
+import subprocess
+import sys
+import time
+
+SAMPLE_CALLS = 16
+clock = getattr(time, "perf_counter", time.time)
+
+
+def target_name(index):
+    return "10.%d.%d.%d:11211" % ((index >> 16) & 0xff, (index >> 8) & 0xff, index & 0xff)
+
+
+def percentile(samples, value):
+    return samples[min(len(samples) - 1, (len(samples) * value) // 100)]
+
+
+def measure(function, keys, *args):
+    # per-call latency is sampled over small batches to amortize the clock cost
+    samples = []
+    start_all = clock()
+    for index in range(0, len(keys) - SAMPLE_CALLS + 1, SAMPLE_CALLS):
+        start = clock()
+        for key in keys[index:index + SAMPLE_CALLS]:
+            function(key, *args)
+        samples.append((clock() - start) * 1e9 / SAMPLE_CALLS)
+    elapsed = clock() - start_all
+    samples.sort()
+    return {
+        "mean": sum(samples) / len(samples),
+        "p50": percentile(samples, 50),
+        "p90": percentile(samples, 90),
+        "p99": percentile(samples, 99),
+        "calls_per_second": (len(samples) * SAMPLE_CALLS) / elapsed,
+    }
+
+
+def measure_batch(c, keys, count):
+    # the whole keys list is resolved in a single call, reported per key
+    start = clock()
+    c.lookup_batch(keys, count)
+    return (clock() - start) * 1e9 / len(keys)
+
+
+def c_baseline(path, targets, counts, lookups):
+    # run the raw C benchmark on the same ring configuration (weight 1, uniform keys)
+    if not path or not os.path.exists(path):
+        return {}
+    output = subprocess.check_output([path, "-t", str(targets), "-w", "1", "-c", ",".join(map(str, counts)),
+                                      "-d", "uniform", "-n", str(lookups)])
+    results = json.loads(output.decode("utf-8"))["results"]
+    if not results:
+        return {}
+    return dict((lookup["count"], lookup["lookup_ns"]["mean"]) for lookup in results[0]["lookups"])
+
+
+def main():
+    parser = optparse.OptionParser()
+    parser.add_option("-t", "--targets", default="10,100,1000", help="comma-separated targets counts")
+    parser.add_option("-c", "--counts", default="1,2,3", help="comma-separated lookup counts")
+    parser.add_option("-n", "--lookups", type="int", default=100000, help="lookups per configuration")
+    parser.add_option("-b", "--chash-bench", default=os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                                                  "..", "libchash", "libchash", "chash_bench"),
+                      help="path to the raw C chash_bench program")
+    options, arguments = parser.parse_args()
+    counts = [int(count) for count in options.counts.split(",")]
+
+    random.seed(42)
+    keys = ["video%09d" % random.randrange(1000000) for index in range(options.lookups)]
+    results = []
+    for targets in [int(value) for value in options.targets.split(",")]:
+        c = chash.CHash()
+        for index in range(targets):
+            c.add_target(target_name(index))
+        c.lookup_list("warmup")
+        baseline = c_baseline(options.chash_bench, targets, counts, options.lookups)
+
+        # call floor: a trivial method call without any argument nor lookup
+        floor = measure(lambda key: c.count_targets(), keys)
+        for count in counts:
+            result = {
+                "targets": targets,
+                "count": count,
+                "lookups": options.lookups,
+                "call_floor_ns": floor,
+                "lookup_list_ns": measure(c.lookup_list, keys, count),
+                "lookup_balance_ns": measure(c.lookup_balance, keys, count),
+                "lookup_batch_ns": measure_batch(c, keys, count),
+            }
+            if count in baseline:
+                result["c_lookup_ns"] = baseline[count]
+                result["lookup_list_overhead_ns"] = result["lookup_list_ns"]["mean"] - baseline[count]
+                result["lookup_balance_overhead_ns"] = result["lookup_balance_ns"]["mean"] - baseline[count]
+            results.append(result)
+            sys.stderr.write("targets=%d count=%d lookup_list=%.1fns lookup_balance=%.1fns lookup_batch=%.1fns/key c=%s\n" % (
+                targets, count, result["lookup_list_ns"]["mean"], result["lookup_balance_ns"]["mean"], result["lookup_batch_ns"],
+                "%.1fns" % baseline[count] if count in baseline else "n/a"))
+
+    json.dump({"benchmark": "chash-python", "python": sys.version.split()[0], "results": results},
+              sys.stdout, indent=2, sort_keys=True)
+    sys.stdout.write("\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,15 +1,67 @@
+#define PY_SSIZE_T_CLEAN
 #include <Python.h>
+#include <pthread.h>
 #include "chash.h"
 
+/*** Python 2/3 compatibility ***/
+
+#if PY_MAJOR_VERSION >= 3
+#define CHASH_NAME_FROM_STRING(name, length) PyUnicode_DecodeUTF8((name), (length), "surrogateescape")
+#define CHASH_BYTES_FORMAT                   "y#"
+#else
+#define CHASH_NAME_FROM_STRING(name, length) PyString_FromStringAndSize((name), (length))
+#define CHASH_BYTES_FORMAT                   "s#"
+#endif
+
+// lookups use the vectorcall-friendly fast calling convention when available
+#if PY_VERSION_HEX >= 0x03070000
+#define CHASH_LOOKUP_FLAGS      METH_FASTCALL
+#define CHASH_LOOKUP_PARAMETERS PyObject *pyself, PyObject *const *args, Py_ssize_t nargs
+#define CHASH_LOOKUP_ARGS(candidate, count) chash_lookup_args(args, nargs, (candidate), (count))
+#else
+#define CHASH_LOOKUP_FLAGS      METH_VARARGS
+#define CHASH_LOOKUP_PARAMETERS PyObject *pyself, PyObject *args
+#define CHASH_LOOKUP_ARGS(candidate, count) PyArg_ParseTuple(args, "O|l", (candidate), (count))
+#endif
+
+// lookups results on the stack up to this count
+#define CHASH_LOOKUP_TARGETS (64)
+
+// status for errors already raised as Python exceptions
+#define CHASH_ERROR_PYTHON   (-100)
+
+// batched lookups keys are resolved by chunks of this size, missing targets being reported with this index
+#define CHASH_BATCH_CHUNK    (1024)
+#define CHASH_NO_TARGET      (65535)
+
 /*** Types ***/
 
+// Modifications hold the context write lock along with the GIL, while lookups on a frozen context share its read
+// lock with the GIL released: as a lock holder never waits for the GIL, they can't deadlock each other
 typedef struct
 {
   PyObject_HEAD
-  CHASH_CONTEXT context;
+  CHASH_CONTEXT    context;
+  pthread_rwlock_t lock;
+  PyObject**       names;
+  u_int16_t        names_count;
+  u_int32_t        names_generation;
 } CHashObject;
 
+// Batched lookups input (either keys gathered from a sequence, fixed-width keys or 64 bits integers from a buffer)
+typedef struct
+{
+  const char** keys;
+  u_int32_t*   lengths;
+  const char*  buffer;
+  Py_ssize_t   width;
+  char         integers;
+  Py_ssize_t   size;
+} CHASH_BATCH;
+
 static PyObject *CHashError;
+static PyObject *chash_numpy = NULL;
+static PyTypeObject chash_CHashType;
 
 static PyObject *
 chash_return(int status, int zero_is_none)
@@ -19,7 +71,7 @@ chash_return(int status, int zero_is_none)
       Py_INCREF(Py_None);
       return  Py_None;
     }
-  
+
   if (status >= 0)
     return Py_BuildValue("l", status);
 
@@ -28,31 +80,252 @@ chash_return(int status, int zero_is_none)
     case CHASH_ERROR_MEMORY:
       PyErr_NoMemory();
       break;
-      
+
     case CHASH_ERROR_NOT_FOUND:
       PyErr_SetString(CHashError, "No element found");
       break;
-      
+
+    case CHASH_ERROR_PYTHON:
+      break;
+
     default:
       PyErr_SetString(CHashError, "Unknown exception");
     }
     return NULL;
 }
 
+//----------------------------------------------------------------------------------------
+// Get the buffer of a candidate or target name (bytes, or str encoded as UTF-8)
+static int
+chash_key(PyObject *object, const char **key, Py_ssize_t *length)
+{
+#if PY_MAJOR_VERSION >= 3
+  if (PyUnicode_Check(object))
+    return (*key = PyUnicode_AsUTF8AndSize(object, length)) ? 0 : -1;
+#endif
+  if (PyBytes_Check(object))
+    {
+      *key    = PyBytes_AS_STRING(object);
+      *length = PyBytes_GET_SIZE(object);
+      return 0;
+    }
+
+  PyErr_BadArgument();
+  return -1;
+}
+
+//----------------------------------------------------------------------------------------
+// Return a new reference to a target name object, created once per continuum generation
+static PyObject *
+chash_name(CHashObject *self, u_int16_t target)
+{
+  const char* name;
+  u_int16_t   index;
+
+  if (!self->names || self->names_generation != self->context.generation ||
+      self->names_count != self->context.targets_count)
+    {
+      for (index = 0; self->names && index < self->names_count; index ++)
+        Py_XDECREF(self->names[index]);
+      PyMem_Free(self->names);
+      self->names_count      = self->context.targets_count;
+      self->names_generation = self->context.generation;
+      if (!(self->names = PyMem_Malloc(self->names_count * sizeof(PyObject *))))
+        return PyErr_NoMemory();
+      memset(self->names, 0, self->names_count * sizeof(PyObject *));
+    }
+
+  if (!self->names[target])
+    {
+      name = self->context.targets[target].name;
+      if (!(self->names[target] = CHASH_NAME_FROM_STRING(name, strlen(name))))
+        return NULL;
+    }
+
+  Py_INCREF(self->names[target]);
+  return self->names[target];
+}
+
+//----------------------------------------------------------------------------------------
+// Perform a lookup for the candidate, plain (balance 0), balanced (1) or ordered by weighted sampling out of the
+// seed (2)
+static int
+chash_lookup_call(CHashObject *self, const char *candidate, Py_ssize_t length, long count, int balance, u_int64_t seed,
+                  u_int16_t *output)
+{
+  if (balance == 2)
+    return chash_lookup_balance_order(&(self->context), candidate, length, count, seed, output);
+  if (balance)
+    return chash_lookup_balance_index(&(self->context), candidate, length, count, output);
+  return chash_lookup_index(&(self->context), candidate, length, count, output);
+}
+
+//----------------------------------------------------------------------------------------
+// Perform a lookup (see chash_lookup_call()) for the candidate. On a frozen context the GIL is released during the
+// core lookup, otherwise the first lookup freezes the continuum under the write lock. The continuum generation is
+// checked once the GIL is back, so that the returned indexes always match the current targets table.
+static int
+chash_lookup_targets(CHashObject *self, PyObject *object, long count, int balance, u_int64_t seed, u_int16_t *output)
+{
+  const char* candidate;
+  Py_ssize_t  length;
+  u_int32_t   generation;
+  int         frozen, status = CHASH_ERROR_NOT_FOUND;
+
+  if (chash_key(object, &candidate, &length) < 0)
+    return CHASH_ERROR_PYTHON;
+
+  do
+    {
+      if ((frozen = self->context.frozen))
+        {
+          Py_BEGIN_ALLOW_THREADS
+          pthread_rwlock_rdlock(&(self->lock));
+          if ((frozen = self->context.frozen))
+            status = chash_lookup_call(self, candidate, length, count, balance, seed, output);
+          generation = self->context.generation;
+          pthread_rwlock_unlock(&(self->lock));
+          Py_END_ALLOW_THREADS
+        }
+      if (!frozen)
+        {
+          pthread_rwlock_wrlock(&(self->lock));
+          status = chash_lookup_call(self, candidate, length, count, balance, seed, output);
+          generation = self->context.generation;
+          pthread_rwlock_unlock(&(self->lock));
+        }
+    }
+  while (status >= 0 && generation != self->context.generation);
+
+  return status;
+}
+
+//----------------------------------------------------------------------------------------
+// Format a 64 bits integer key as its decimal representation (signed or not), returning its length
+static u_int32_t
+chash_integer_key(const char *value, char signedness, char *output)
+{
+  u_int64_t integer;
+  char      digits[24];
+  u_int32_t length = 0, index = 0;
+
+  memcpy(&integer, value, sizeof(integer));
+  if (signedness == 'S' && (int64_t)integer < 0)
+    {
+      output[index ++] = '-';
+      integer = -integer;
+    }
+  do
+    {
+      digits[length ++] = '0' + (integer % 10);
+      integer /= 10;
+    }
+  while (integer);
+  while (length)
+    output[index ++] = digits[-- length];
+
+  return index;
+}
+
+//----------------------------------------------------------------------------------------
+// Resolve all the batch keys by chunks (called with the GIL released and the context read lock held)
+static int
+chash_batch_lookup(CHASH_CONTEXT *context, CHASH_BATCH *batch, u_int16_t count, u_int16_t *output)
+{
+  const char* keys[CHASH_BATCH_CHUNK];
+  u_int32_t   lengths[CHASH_BATCH_CHUNK];
+  u_int16_t   ranks[CHASH_BATCH_CHUNK];
+  char        digits[CHASH_BATCH_CHUNK][24];
+  const char* key;
+  Py_ssize_t  base, block, index;
+  int         status, rank;
+
+  for (base = 0; base < batch->size; base += CHASH_BATCH_CHUNK)
+    {
+      block = batch->size - base < CHASH_BATCH_CHUNK ? batch->size - base : CHASH_BATCH_CHUNK;
+      for (index = 0; index < block; index ++)
+        {
+          if (batch->keys)
+            {
+              keys[index]    = batch->keys[base + index];
+              lengths[index] = batch->lengths[base + index];
+            }
+          else
+            {
+              key = batch->buffer + ((base + index) * batch->width);
+              if (batch->integers)
+                {
+                  keys[index]    = digits[index];
+                  lengths[index] = chash_integer_key(key, batch->integers, digits[index]);
+                }
+              else
+                {
+                  // fixed-width keys are NUL-padded (like numpy bytes arrays)
+                  keys[index] = key;
+                  for (lengths[index] = batch->width; lengths[index] && !key[lengths[index] - 1]; lengths[index] --);
+                }
+            }
+        }
+
+      if ((status = chash_lookup_batch(context, keys, lengths, block, count, output + (base * count), ranks)) < 0)
+        return status;
+
+      for (index = 0; index < block; index ++)
+        for (rank = ranks[index]; rank < count; rank ++)
+          output[((base + index) * count) + rank] = CHASH_NO_TARGET;
+    }
+
+  return CHASH_ERROR_DONE;
+}
+
+#if PY_VERSION_HEX >= 0x03070000
+//----------------------------------------------------------------------------------------
+// Parse (candidate[, count]) fast call arguments
+static int
+chash_lookup_args(PyObject *const *args, Py_ssize_t nargs, PyObject **candidate, long *count)
+{
+  if (nargs < 1 || nargs > 2)
+    {
+      PyErr_SetString(PyExc_TypeError, "expected (candidate[, count]) arguments");
+      return 0;
+    }
+
+  *candidate = args[0];
+  if (nargs > 1 && (*count = PyLong_AsLong(args[1])) == -1 && PyErr_Occurred())
+    return 0;
+
+  return 1;
+}
+#endif
+
 //----------------------------------------------------------------------------------------
 //
 static void
 chash_dealloc(CHashObject* self)
 {
+  u_int16_t index;
+
+  for (index = 0; self->names && index < self->names_count; index ++)
+    Py_XDECREF(self->names[index]);
+  PyMem_Free(self->names);
   chash_terminate(&(self->context), 0);
+  pthread_rwlock_destroy(&(self->lock));
+  Py_TYPE(self)->tp_free((PyObject *)self);
 }
 
 //----------------------------------------------------------------------------------------
 //
-static void
-chash_init(CHashObject* self, PyObject* args, PyObject* kwds)
+static PyObject *
+chash_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
+  CHashObject* self;
+
+  if (!(self = (CHashObject *)type->tp_alloc(type, 0)))
+    return NULL;
+
   chash_initialize(&(self->context), 0);
+  pthread_rwlock_init(&(self->lock), NULL);
+  return (PyObject *)self;
 }
 
 //----------------------------------------------------------------------------------------
@@ -63,11 +336,16 @@ do_add_target(PyObject *pyself, PyObject *args)
   const char*	target;
   CHashObject*	self = (CHashObject*)pyself;
   long	        weight = 1;
+  int           status;
 
   if (!PyArg_ParseTuple(args, "s|l", &target, &weight))
     return NULL;
 
-  return chash_return(chash_add_target(&(self->context), target, weight), 1);
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_add_target(&(self->context), target, weight);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
 }
 
 //----------------------------------------------------------------------------------------
@@ -76,9 +354,12 @@ static PyObject *
 do_set_targets(PyObject *pyself, PyObject *args)
 {
   CHashObject*	self = (CHashObject*)pyself;
-  PyObject*     status;
   PyObject*     dict = 0;
-  int           i;
+  PyObject*     key;
+  PyObject*     value;
+  Py_ssize_t    position = 0, length;
+  const char*   target;
+  int           status = CHASH_ERROR_DONE;
 
   if (!PyArg_ParseTuple(args, "O", &dict) || !PyDict_Check(dict))
     {
@@ -86,32 +367,21 @@ do_set_targets(PyObject *pyself, PyObject *args)
       return NULL;
     }
 
-  PyObject * key_list = PyDict_Keys(dict);
-  int list_size = PyList_Size(key_list);
-
-  for(i=0; i<list_size; i++)
+  pthread_rwlock_wrlock(&(self->lock));
+  while (status >= 0 && PyDict_Next(dict, &position, &key, &value))
     {
-      PyObject * pystring = 0;
-      pystring = PyList_GetItem(key_list, i);
-
-      if(!PyString_Check(pystring))
-	{
-	  PyErr_BadArgument();
-	  return NULL;
-	}
+      if (chash_key(key, &target, &length) < 0)
+        {
+          pthread_rwlock_unlock(&(self->lock));
+          return NULL;
+        }
 
-      char * target = PyString_AsString(pystring);
-
-      //Get the value for the key
-      PyObject *pydub = 0;
-      pydub = PyDict_GetItem(dict, pystring);
-      u_int32_t weight = PyLong_AsLong(pydub);
-
-      if ((status = chash_return(chash_add_target(&(self->context), target, weight), 0)) < 0)
-	{
-	  return status;
-	}
+      status = chash_add_target(&(self->context), target, PyLong_AsLong(value));
     }
+  pthread_rwlock_unlock(&(self->lock));
+
+  if (status < 0)
+    return chash_return(status, 0);
 
   return chash_return(chash_targets_count(&(self->context)), 0);
 }
@@ -124,11 +394,16 @@ do_remove_target(PyObject *pyself, PyObject *args)
 {
   const char*	target;
   CHashObject*	self = (CHashObject*)pyself;
+  int           status;
 
   if (!PyArg_ParseTuple(args, "s", &target))
     return NULL;
 
-  return  chash_return(chash_remove_target(&(self->context), target), 1);
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_remove_target(&(self->context), target);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return  chash_return(status, 1);
 }
 
 //----------------------------------------------------------------------------------------
@@ -147,8 +422,13 @@ static PyObject *
 do_clear_targets(PyObject *pyself, PyObject *args)
 {
   CHashObject* self = (CHashObject*)pyself;
+  int          status;
 
-  return chash_return(chash_clear_targets(&(self->context)), 1);
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_clear_targets(&(self->context));
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
 }
 
 //----------------------------------------------------------------------------------------
@@ -161,14 +441,16 @@ do_serialize(PyObject *pyself, PyObject *args)
   int          size;
   PyObject*    retval;
 
+  pthread_rwlock_wrlock(&(self->lock));
   size = chash_serialize(&(self->context), &serialized);
+  pthread_rwlock_unlock(&(self->lock));
 
   if (size < 0)
   {
     return chash_return(size, 1);
-  } 
+  }
 
-  retval = PyString_FromStringAndSize((char *)serialized, size);
+  retval = PyBytes_FromStringAndSize((char *)serialized, size);
 
   if (serialized)
     free(serialized);
@@ -183,12 +465,17 @@ do_unserialize(PyObject *pyself, PyObject *args)
 {
   CHashObject* self = (CHashObject*)pyself;
   u_char*      serialized;
-  u_int32_t    length;
+  Py_ssize_t   length;
+  int          status;
 
-  if (!PyArg_ParseTuple(args, "s#", &serialized, &length))
+  if (!PyArg_ParseTuple(args, CHASH_BYTES_FORMAT, &serialized, &length))
     return NULL;
 
-  return chash_return(chash_unserialize(&(self->context), serialized, length), 1);
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_unserialize(&(self->context), serialized, length);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
 }
 
 //----------------------------------------------------------------------------------------
@@ -198,11 +485,16 @@ do_serialize_to_file(PyObject *pyself, PyObject *args)
 {
   CHashObject* self = (CHashObject*)pyself;
   char*        path;
+  int          status;
 
   if (!PyArg_ParseTuple(args, "s", &path))
     return NULL;
 
-  return chash_return(chash_file_serialize(&(self->context), path), 1);
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_file_serialize(&(self->context), path);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
 }
 
 //----------------------------------------------------------------------------------------
@@ -212,75 +504,695 @@ do_unserialize_from_file(PyObject *pyself, PyObject *args)
 {
   CHashObject* self = (CHashObject*)pyself;
   char*        path;
+  int          status;
 
   if (!PyArg_ParseTuple(args, "s", &path))
     return NULL;
 
-  return chash_return(chash_file_unserialize(&(self->context), path), 1);
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_file_unserialize(&(self->context), path);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject *
-do_lookup_list(PyObject *pyself, PyObject *args)
+do_checksum(PyObject *pyself, PyObject *args)
 {
   CHashObject* self = (CHashObject*)pyself;
-  char*        candidate;
+  u_int64_t    checksum;
+  int          status;
+
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_checksum(&(self->context), &checksum);
+  pthread_rwlock_unlock(&(self->lock));
+
+  if (status < 0)
+    return chash_return(status, 1);
+
+  return PyLong_FromUnsignedLongLong(checksum);
+}
+
+//----------------------------------------------------------------------------------------
+// Both contexts get frozen: their write locks are taken in a fixed (address) order
+static PyObject *
+do_delta(PyObject *pyself, PyObject *args)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  CHashObject* base;
+  u_char*      delta;
+  int          size;
+  PyObject*    retval;
+
+  if (!PyArg_ParseTuple(args, "O!", &chash_CHashType, &base))
+    return NULL;
+
+  pthread_rwlock_wrlock(base < self ? &(base->lock) : &(self->lock));
+  if (base != self)
+    pthread_rwlock_wrlock(base < self ? &(self->lock) : &(base->lock));
+  size = chash_delta(&(base->context), &(self->context), &delta);
+  if (base != self)
+    pthread_rwlock_unlock(&(base->lock));
+  pthread_rwlock_unlock(&(self->lock));
+
+  if (size < 0)
+    return chash_return(size, 1);
+
+  retval = PyBytes_FromStringAndSize((char *)delta, size);
+  free(delta);
+
+  return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_apply_delta(PyObject *pyself, PyObject *args)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  u_char*      delta;
+  Py_ssize_t   length;
+  int          status;
+
+  if (!PyArg_ParseTuple(args, CHASH_BYTES_FORMAT, &delta, &length))
+    return NULL;
+
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_delta_apply(&(self->context), delta, length);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_lookup_list(CHASH_LOOKUP_PARAMETERS)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  PyObject*    candidate;
+  PyObject*    retval;
+  PyObject*    name;
   long         count = 1;
+  int          status, index;
+  u_int16_t    stack[CHASH_LOOKUP_TARGETS];
+  u_int16_t*   targets = stack;
+
+  if (!CHASH_LOOKUP_ARGS(&candidate, &count))
+    return NULL;
+
+  if (count > 65535)
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+  count = count < 1 ? 1 : count;
+
+  if (count > CHASH_LOOKUP_TARGETS && !(targets = PyMem_Malloc(count * sizeof(u_int16_t))))
+    return PyErr_NoMemory();
+
+  status = chash_lookup_targets(self, candidate, count, 0, 0, targets);
+  if (status <= 0)
+    {
+      if (targets != stack)
+        PyMem_Free(targets);
+      return chash_return(status, 1);
+    }
+
+  retval = PyList_New(status);
+  for (index = 0; retval && index < status; index ++)
+    {
+      if (!(name = chash_name(self, targets[index])))
+        {
+          Py_CLEAR(retval);
+          break;
+        }
+      PyList_SET_ITEM(retval, index, name);
+    }
+
+  if (targets != stack)
+    PyMem_Free(targets);
+
+  return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_lookup_balance(CHASH_LOOKUP_PARAMETERS)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  PyObject*    candidate;
   int          status;
-  uint         index;
-  char**       targets;
-  PyObject*    retval = PyList_New(0);
+  u_int16_t    target;
+  long         count = 1;
+
+  if (!CHASH_LOOKUP_ARGS(&candidate, &count))
+    return NULL;
+
+  if (count > 65535)
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+  count = count < 1 ? 1 : count;
+
+  status = chash_lookup_targets(self, candidate, count, 1, 0, &target);
+  if (status < 0)
+    return chash_return(status, 1);
+
+  return chash_name(self, target);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_lookup_balance_order(PyObject *pyself, PyObject *args)
+{
+  CHashObject*       self = (CHashObject*)pyself;
+  PyObject*          candidate;
+  PyObject*          retval;
+  PyObject*          name;
+  long               count;
+  unsigned long long seed;
+  int                status, index;
+  u_int16_t          stack[CHASH_LOOKUP_TARGETS];
+  u_int16_t*         targets = stack;
 
-  if (!PyArg_ParseTuple(args, "s|l", &candidate, &count))
+  if (!PyArg_ParseTuple(args, "OlK", &candidate, &count, &seed))
     return NULL;
 
-  status = chash_lookup(&(self->context), candidate, count, &targets);
+  if (count > 65535)
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+  count = count < 1 ? 1 : count;
+
+  if (count > CHASH_LOOKUP_TARGETS && !(targets = PyMem_Malloc(count * sizeof(u_int16_t))))
+    return PyErr_NoMemory();
+
+  status = chash_lookup_targets(self, candidate, count, 2, seed, targets);
   if (status <= 0)
+    {
+      if (targets != stack)
+        PyMem_Free(targets);
+      return chash_return(status, 1);
+    }
+
+  retval = PyList_New(status);
+  for (index = 0; retval && index < status; index ++)
+    {
+      if (!(name = chash_name(self, targets[index])))
+        {
+          Py_CLEAR(retval);
+          break;
+        }
+      PyList_SET_ITEM(retval, index, name);
+    }
+
+  if (targets != stack)
+    PyMem_Free(targets);
+
+  return retval;
+}
+
+//----------------------------------------------------------------------------------------
+// Wrap batched lookups results into a numpy (size, count) uint16 array when numpy is available, or into a flat
+// array('H') otherwise
+static PyObject *
+chash_batch_indexes(PyObject *backing, Py_ssize_t size, long count)
+{
+  PyObject* module;
+  PyObject* array;
+  PyObject* retval;
+  PyObject* bytes;
+
+  if (!chash_numpy)
+    {
+      if (!(chash_numpy = PyImport_ImportModule("numpy")))
+        {
+          PyErr_Clear();
+          chash_numpy = Py_None;
+        }
+    }
+
+  if (chash_numpy != Py_None)
+    {
+      if (!(array = PyObject_CallMethod(chash_numpy, "frombuffer", "Os", backing, "uint16")))
+        return NULL;
+      retval = PyObject_CallMethod(array, "reshape", "(nl)", size, count);
+      Py_DECREF(array);
+      return retval;
+    }
+
+  if (!(module = PyImport_ImportModule("array")))
+    return NULL;
+  bytes  = PyBytes_FromStringAndSize(PyByteArray_AS_STRING(backing), PyByteArray_GET_SIZE(backing));
+  retval = bytes ? PyObject_CallMethod(module, "array", "sO", "H", bytes) : NULL;
+  Py_XDECREF(bytes);
+  Py_DECREF(module);
+  return retval;
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_lookup_batch(PyObject *pyself, PyObject *args, PyObject *kwds)
+{
+  static char* keywords[] = { "keys", "count", "width", NULL };
+  CHashObject* self = (CHashObject*)pyself;
+  CHASH_BATCH  batch;
+  Py_buffer    view;
+  PyObject*    keys;
+  PyObject*    sequence = NULL;
+  PyObject*    backing = NULL;
+  PyObject*    indexes = NULL;
+  PyObject*    names = NULL;
+  PyObject*    name;
+  Py_ssize_t   width = 0, index;
+  const char*  format;
+  long         count = 1;
+  u_int32_t    generation;
+  u_int32_t    zero = 0;
+  u_int16_t*   output;
+  u_int16_t    target;
+  const char*  empty = NULL;
+  int          status, buffer = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|ln", keywords, &keys, &count, &width))
+    return NULL;
+
+  if (count < 1 || count > 65535 || width < 0 || PyUnicode_Check(keys))
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+
+  memset(&batch, 0, sizeof(batch));
+  if (PyObject_CheckBuffer(keys))
+    {
+      // fixed-width keys (numpy bytes arrays or flat buffers along with a width) or 64 bits integers
+      if (PyObject_GetBuffer(keys, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0)
+        return NULL;
+      buffer = 1;
+      format = view.format ? view.format : "B";
+      format += strspn(format, "@=<>!");
+      batch.buffer = view.buf;
+      if (view.itemsize == 8 && strchr("QLN", *format))
+        batch.integers = 'U';
+      else if (view.itemsize == 8 && strchr("qln", *format))
+        batch.integers = 'S';
+      else if (view.itemsize > 1 && format[strspn(format, "0123456789")] == 's')
+        width = view.itemsize;
+      else if (!width || view.itemsize != 1)
+        {
+          PyBuffer_Release(&view);
+          PyErr_SetString(PyExc_TypeError, "expected 64 bits integers, fixed-width bytes or a width");
+          return NULL;
+        }
+      batch.width = batch.integers ? 8 : width;
+      batch.size  = view.len / batch.width;
+    }
+  else
+    {
+      // sequence of str/bytes keys (gathered while holding the GIL, kept alive by the sequence)
+      if (!(sequence = PySequence_Fast(keys, "expected a sequence of keys")))
+        return NULL;
+      batch.size    = PySequence_Fast_GET_SIZE(sequence);
+      batch.keys    = PyMem_Malloc((batch.size ? batch.size : 1) * sizeof(char *));
+      batch.lengths = PyMem_Malloc((batch.size ? batch.size : 1) * sizeof(u_int32_t));
+      if (!batch.keys || !batch.lengths)
+        {
+          PyErr_NoMemory();
+          goto exit;
+        }
+      for (index = 0; index < batch.size; index ++)
+        {
+          Py_ssize_t length;
+
+          if (chash_key(PySequence_Fast_GET_ITEM(sequence, index), &(batch.keys[index]), &length) < 0)
+            goto exit;
+          batch.lengths[index] = length;
+        }
+    }
+
+  if (!(backing = PyByteArray_FromStringAndSize(NULL, batch.size * count * sizeof(u_int16_t))))
+    goto exit;
+  output = (u_int16_t *)PyByteArray_AS_STRING(backing);
+
+  // the continuum is frozen first (under the write lock), then all keys are resolved without the GIL
+  do
+    {
+      if (!self->context.frozen)
+        {
+          // an empty batch only freezes the context
+          pthread_rwlock_wrlock(&(self->lock));
+          status = chash_lookup_batch(&(self->context), &empty, &zero, 0, count, &target, &target);
+          pthread_rwlock_unlock(&(self->lock));
+          if (status < 0)
+            break;
+        }
+      Py_BEGIN_ALLOW_THREADS
+      pthread_rwlock_rdlock(&(self->lock));
+      status     = self->context.frozen ? chash_batch_lookup(&(self->context), &batch, count, output) : CHASH_ERROR_NOT_INITIALIZED;
+      generation = self->context.generation;
+      pthread_rwlock_unlock(&(self->lock));
+      Py_END_ALLOW_THREADS
+    }
+  while (status == CHASH_ERROR_NOT_INITIALIZED || (status >= 0 && generation != self->context.generation));
+
+  if (status < 0)
+    {
+      chash_return(status, 0);
+      goto exit;
+    }
+
+  if (!(names = PyList_New(self->context.targets_count)))
+    goto exit;
+  for (index = 0; index < self->context.targets_count; index ++)
+    {
+      if (!(name = chash_name(self, index)))
+        {
+          Py_CLEAR(names);
+          goto exit;
+        }
+      PyList_SET_ITEM(names, index, name);
+    }
+  indexes = chash_batch_indexes(backing, batch.size, count);
+
+exit:
+  if (buffer)
+    PyBuffer_Release(&view);
+  Py_XDECREF(sequence);
+  Py_XDECREF(backing);
+  PyMem_Free(batch.keys);
+  PyMem_Free(batch.lengths);
+  if (!indexes)
+    {
+      Py_XDECREF(names);
+      return NULL;
+    }
+
+  return Py_BuildValue("(NN)", indexes, names);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_enable_stats(PyObject *pyself, PyObject *args)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  long         shards = 1;
+  int          status;
+
+  if (!PyArg_ParseTuple(args, "|l", &shards))
+    return NULL;
+
+  if (shards < 0 || shards > 65535)
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_stats_enable(&(self->context), shards);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_get_stats(PyObject *pyself, PyObject *args)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  CHASH_STATS  stats;
+  PyObject*    retval;
+  PyObject*    histogram;
+  PyObject*    selections;
+  PyObject*    value;
+  int          status;
+  uint         index;
+
+  status = chash_stats_get(&(self->context), &stats);
+  if (status < 0)
     return chash_return(status, 1);
-  
-  for (index = 0; index < status; index ++)
-  {
-    PyList_Append(retval, PyString_FromString(targets[index]));
-  }
 
+  histogram = PyList_New(CHASH_STATS_BUCKETS);
+  for (index = 0; index < CHASH_STATS_BUCKETS; index ++)
+    PyList_SET_ITEM(histogram, index, PyLong_FromUnsignedLongLong(stats.freeze_histogram[index]));
+
+  selections = PyDict_New();
+  for (index = 0; index < stats.targets_count && index < self->context.targets_count; index ++)
+    {
+      value = PyLong_FromUnsignedLongLong(stats.selections[index]);
+      PyDict_SetItemString(selections, self->context.targets[index].name, value);
+      Py_DECREF(value);
+    }
+  free(stats.selections);
+
+  retval = Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:N,s:k,s:N}",
+                         "lookups", (unsigned long long)stats.lookups,
+                         "balance_lookups", (unsigned long long)stats.balance_lookups,
+                         "balance_fallbacks", (unsigned long long)stats.balance_fallbacks,
+                         "freezes", (unsigned long long)stats.freezes,
+                         "freeze_time", (unsigned long long)stats.freeze_time,
+                         "freeze_histogram", histogram,
+                         "continuum_size", (unsigned long)stats.continuum_size,
+                         "selections", selections);
   return retval;
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyObject *
-do_lookup_balance(PyObject *pyself, PyObject *args)
+do_enable_cache(PyObject *pyself, PyObject *args)
 {
   CHashObject* self = (CHashObject*)pyself;
-  char*        candidate;
+  unsigned long entries;
+  int          status;
+
+  if (!PyArg_ParseTuple(args, "k", &entries))
+    return NULL;
+
+  if (entries > 0xffffffffUL)
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_cache_enable(&(self->context), entries);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_get_cache_stats(PyObject *pyself, PyObject *args)
+{
+  CHashObject*      self = (CHashObject*)pyself;
+  CHASH_CACHE_STATS stats;
+  int               status;
+
+  status = chash_cache_stats(&(self->context), &stats);
+  if (status < 0)
+    return chash_return(status, 1);
+
+  return Py_BuildValue("{s:k,s:k,s:K,s:K,s:K}",
+                       "entries", (unsigned long)stats.entries,
+                       "used", (unsigned long)stats.used,
+                       "hits", (unsigned long long)stats.hits,
+                       "misses", (unsigned long long)stats.misses,
+                       "evictions", (unsigned long long)stats.evictions);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_enable_hotkeys(PyObject *pyself, PyObject *args)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  unsigned long threshold, window = 0;
+  int          spread = 3;
   int          status;
-  char*        target;
-  long         count = 1;
 
-  if (!PyArg_ParseTuple(args, "s|l", &candidate, &count))
+  if (!PyArg_ParseTuple(args, "k|ik", &threshold, &spread, &window))
     return NULL;
-  
-  status = chash_lookup_balance(&(self->context), candidate, count, &target);
+
+  if (threshold > 0xffffffffUL || window > 0xffffffffUL || spread < 0 || spread > 65535)
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_hotkeys_enable(&(self->context), threshold, window, spread);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_set_balance_mode(PyObject *pyself, PyObject *args)
+{
+  CHashObject* self = (CHashObject*)pyself;
+  int          mode;
+  double       bias = 0;
+  int          status;
+
+  if (!PyArg_ParseTuple(args, "i|d", &mode, &bias))
+    return NULL;
+
+  if (mode < CHASH_BALANCE_UNIFORM || mode > CHASH_BALANCE_WEIGHTED || !(bias >= 0))
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_balance_mode(&(self->context), mode, bias);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_get_hotkeys(PyObject *pyself, PyObject *args)
+{
+  CHashObject*  self = (CHashObject*)pyself;
+  CHASH_HOTKEYS hotkeys;
+  PyObject*     keys;
+  PyObject*     key;
+  PyObject*     value;
+  int           status;
+  uint          index;
+
+  pthread_rwlock_rdlock(&(self->lock));
+  status = chash_hotkeys_get(&(self->context), &hotkeys);
+  pthread_rwlock_unlock(&(self->lock));
   if (status < 0)
     return chash_return(status, 1);
 
-  return PyString_FromString(target);
+  keys = PyDict_New();
+  for (index = 0; index < hotkeys.count; index ++)
+    {
+      key   = CHASH_NAME_FROM_STRING(hotkeys.keys[index].key, hotkeys.keys[index].length);
+      value = PyLong_FromUnsignedLong(hotkeys.keys[index].count);
+      if (key && value)
+        PyDict_SetItem(keys, key, value);
+      Py_XDECREF(key);
+      Py_XDECREF(value);
+    }
+  PyErr_Clear();
+
+  return Py_BuildValue("{s:k,s:k,s:i,s:K,s:K,s:N}",
+                       "threshold", (unsigned long)hotkeys.threshold,
+                       "window", (unsigned long)hotkeys.window,
+                       "spread", (int)hotkeys.spread,
+                       "observed", (unsigned long long)hotkeys.observed,
+                       "spread_lookups", (unsigned long long)hotkeys.spread_lookups,
+                       "keys", keys);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_set_target_points(PyObject *pyself, PyObject *args)
+{
+  const char*	target;
+  CHashObject*	self = (CHashObject*)pyself;
+  unsigned long points;
+  int           status;
+
+  if (!PyArg_ParseTuple(args, "sk", &target, &points))
+    return NULL;
+
+  if (points > CHASH_POINTS_MAXIMUM)
+    {
+      PyErr_BadArgument();
+      return NULL;
+    }
+
+  pthread_rwlock_wrlock(&(self->lock));
+  status = chash_target_points(&(self->context), target, points);
+  pthread_rwlock_unlock(&(self->lock));
+
+  return chash_return(status, 1);
+}
+
+//----------------------------------------------------------------------------------------
+//
+static PyObject *
+do_rebalance(PyObject *pyself, PyObject *args)
+{
+  CHashObject*  self = (CHashObject*)pyself;
+  PyObject*     dict = 0;
+  PyObject*     key;
+  PyObject*     value;
+  Py_ssize_t    position = 0, length;
+  const char*   target;
+  double        gain = 0.5, step = 0.1, movement = 0.01, *loads;
+  int           status;
+  uint          index;
+
+  if (!PyArg_ParseTuple(args, "O|ddd", &dict, &gain, &step, &movement) || !PyDict_Check(dict))
+    {
+      if (!PyErr_Occurred())
+        PyErr_BadArgument();
+      return NULL;
+    }
+
+  pthread_rwlock_wrlock(&(self->lock));
+  if (!(loads = malloc((self->context.targets_count + 1) * sizeof(double))))
+    {
+      pthread_rwlock_unlock(&(self->lock));
+      return PyErr_NoMemory();
+    }
+  for (index = 0; index < self->context.targets_count; index ++)
+    loads[index] = -1;
+  while (PyDict_Next(dict, &position, &key, &value))
+    {
+      if (chash_key(key, &target, &length) < 0)
+        {
+          pthread_rwlock_unlock(&(self->lock));
+          free(loads);
+          return NULL;
+        }
+      for (index = 0; index < self->context.targets_count && strcmp(self->context.targets[index].name, target); index ++);
+      if (index < self->context.targets_count)
+        loads[index] = PyFloat_AsDouble(value);
+    }
+  status = PyErr_Occurred() ? CHASH_ERROR_PYTHON : chash_rebalance(&(self->context), loads, gain, step, movement);
+  pthread_rwlock_unlock(&(self->lock));
+  free(loads);
+
+  return chash_return(status, 0);
 }
 
 //----------------------------------------------------------------------------------------
 //
 static PyMethodDef chash_methods[] = {
     {
-      "add_target",  do_add_target, METH_VARARGS, 
+      "add_target",  do_add_target, METH_VARARGS,
       "add_target(target, weight=1) -- FIXME"
     },
     {
-      "set_targets",  do_set_targets, METH_VARARGS, 
+      "set_targets",  do_set_targets, METH_VARARGS,
       "set_targets({target: weight}) -- FIXME"
     },
     {
-      "remove_target",  do_remove_target, METH_VARARGS, 
+      "remove_target",  do_remove_target, METH_VARARGS,
       "remove_target(target)"
     },
     {
@@ -309,21 +1221,89 @@ static PyMethodDef chash_methods[] = {
       "unserialize_from_file(path)"
     },
     {
-      "lookup_list", do_lookup_list, METH_VARARGS,
+      "checksum", do_checksum, METH_NOARGS,
+      "checksum() -- checksum identifying the ring (targets and continuum), used as the base of deltas"
+      "@return: Ring checksum.\n@rtype: int\n"
+    },
+    {
+      "delta", do_delta, METH_VARARGS,
+      "delta(base) -- build the delta turning the base ring into this one"
+      "@return: Delta, to be passed to apply_delta() on a copy of the base ring.\n@rtype: bytes\n"
+    },
+    {
+      "apply_delta", do_apply_delta, METH_VARARGS,
+      "apply_delta(delta) -- patch the ring in place with a delta built against it"
+    },
+    {
+      "lookup_list", (PyCFunction)(void (*)(void))do_lookup_list, CHASH_LOOKUP_FLAGS,
       "lookup_list(candidate, count=1)"
       "@return: List of targets.\n@rtype: list\n"
     },
     {
-      "lookup_balance", do_lookup_balance, METH_VARARGS,
+      "lookup_balance", (PyCFunction)(void (*)(void))do_lookup_balance, CHASH_LOOKUP_FLAGS,
       "lookup_balance(name, count=1)"
       "@return: A target.\n@rtype: string\n"
     },
+    {
+      "lookup_balance_order", do_lookup_balance_order, METH_VARARGS,
+      "lookup_balance_order(candidate, count, seed) -- targets ordered by weighted sampling (see set_balance_mode()),\n"
+      "the same seed always giving the same order so that retries can walk it\n"
+      "@return: List of targets.\n@rtype: list\n"
+    },
+    {
+      "lookup_batch", (PyCFunction)(void (*)(void))do_lookup_batch, METH_VARARGS | METH_KEYWORDS,
+      "lookup_batch(keys, count=1, width=0) -- resolve many keys at once, keys being a sequence of str/bytes, a\n"
+      "buffer of fixed-width keys (numpy bytes array, or flat buffer along with a width) or an array of 64 bits\n"
+      "integers (looked up by their decimal representation)\n"
+      "@return: (indexes, names) where indexes[key][rank] is an index into names (NO_TARGET if missing).\n"
+      "@rtype: tuple\n"
+    },
+    {
+      "enable_stats", do_enable_stats, METH_VARARGS,
+      "enable_stats(shards=1) -- enable runtime statistics (0 shards disables them)"
+    },
+    {
+      "get_stats", do_get_stats, METH_NOARGS,
+      "get_stats()"
+      "@return: Runtime statistics.\n@rtype: dict\n"
+    },
+    {
+      "enable_cache", do_enable_cache, METH_VARARGS,
+      "enable_cache(entries) -- enable the lookups results cache (0 entries disables it)"
+    },
+    {
+      "get_cache_stats", do_get_cache_stats, METH_NOARGS,
+      "get_cache_stats()"
+      "@return: Lookups cache counters.\n@rtype: dict\n"
+    },
+    {
+      "enable_hotkeys", do_enable_hotkeys, METH_VARARGS,
+      "enable_hotkeys(threshold, spread=3, window=0) -- enable hot keys detection (a 0 threshold disables it)"
+    },
+    {
+      "set_balance_mode", do_set_balance_mode, METH_VARARGS,
+      "set_balance_mode(mode, bias=0.0) -- pick balanced targets uniformly (BALANCE_UNIFORM) or in proportion to\n"
+      "their points (BALANCE_WEIGHTED), the primary target weight being scaled by 1 + bias"
+    },
+    {
+      "get_hotkeys", do_get_hotkeys, METH_NOARGS,
+      "get_hotkeys()"
+      "@return: Hot keys detection settings, counters and currently hot keys.\n@rtype: dict\n"
+    },
+    {
+      "set_target_points", do_set_target_points, METH_VARARGS,
+      "set_target_points(target, points) -- set the exact number of continuum points of a target"
+    },
+    {
+      "rebalance", do_rebalance, METH_VARARGS,
+      "rebalance({target: load}, gain=0.5, step=0.1, movement=0.01) -- adjust targets points toward equal utilization"
+      "@return: Number of continuum points added or removed.\n@rtype: int\n"
+    },
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
 static PyTypeObject chash_CHashType = {
-  PyObject_HEAD_INIT(NULL)
-  0,                         /*ob_size*/
+  PyVarObject_HEAD_INIT(NULL, 0)
   "CHash",                   /*tp_name*/
   sizeof(CHashObject),       /*tp_basicsize*/
   0,                         /*tp_itemsize*/
@@ -358,31 +1338,52 @@ static PyTypeObject chash_CHashType = {
   0,                         /* tp_descr_get */
   0,                         /* tp_descr_set */
   0,                         /* tp_dictoffset */
-  (initproc)chash_init,      /* tp_init */
+  0,                         /* tp_init */
   0,                         /* tp_alloc */
-  PyType_GenericNew,         /* tp_new */
+  chash_new,                 /* tp_new */
 };
 
 static PyMethodDef chash_module_methods[] = {
   {NULL}  /* Sentinel */
 };
 
+#if PY_MAJOR_VERSION >= 3
+static struct PyModuleDef chash_module = {
+  PyModuleDef_HEAD_INIT,
+  "chash",
+  "Extension to chash using libchash.",
+  -1,
+  chash_module_methods
+};
+
+#define CHASH_INIT_RETURN(module) return (module)
+#else
+#define CHASH_INIT_RETURN(module) return
+#endif
+
 #ifndef PyMODINIT_FUNC  /* declarations for DLL import/export */
 #define PyMODINIT_FUNC void
 #endif
 PyMODINIT_FUNC
+#if PY_MAJOR_VERSION >= 3
+PyInit_chash(void)
+#else
 initchash(void)
+#endif
 {
   PyObject *m;
 
-  chash_CHashType.tp_new = PyType_GenericNew;
   if (PyType_Ready(&chash_CHashType) < 0)
-    return;
+    CHASH_INIT_RETURN(NULL);
 
+#if PY_MAJOR_VERSION >= 3
+  m = PyModule_Create(&chash_module);
+#else
   m = Py_InitModule3("chash", chash_module_methods,
 		     "Extension to chash using libchash.");
+#endif
   if (m == NULL)
-    return;
+    CHASH_INIT_RETURN(NULL);
 
   CHashError = PyErr_NewException("chash.CHashError", NULL, NULL);
   Py_INCREF(CHashError);
@@ -390,4 +1391,10 @@ initchash(void)
 
   Py_INCREF(&chash_CHashType);
   PyModule_AddObject(m, "CHash", (PyObject *)&chash_CHashType);
+
+  PyModule_AddIntConstant(m, "NO_TARGET", CHASH_NO_TARGET);
+  PyModule_AddIntConstant(m, "BALANCE_UNIFORM", CHASH_BALANCE_UNIFORM);
+  PyModule_AddIntConstant(m, "BALANCE_WEIGHTED", CHASH_BALANCE_WEIGHTED);
+
+  CHASH_INIT_RETURN(m);
 }
@@ -1,10 +1,12 @@
 from ctypes import *
-libchash = CDLL("libchash.so.1")
+libchash = CDLL("libchash.so.2")
 
 class CHASH_TARGET(Structure):
     _fields_ = [
         ('weight', c_ubyte),
-        ('name', c_char_p)]
+        ('name', c_char_p),
+        ('domain', c_char_p),
+        ('points', c_uint)]
 
 class CHASH_ITEM(Structure):
     _fields_ = [
@@ -16,20 +18,44 @@ class CHASH_LOOKUP(Structure):
         ('rank', c_uint, 16),
         ('target', c_uint, 16)]
 
+class CHASH_ALLOCATOR(Structure):
+    _fields_ = [
+        ('allocate', c_void_p),
+        ('reallocate', c_void_p),
+        ('release', c_void_p),
+        ('opaque', c_void_p)]
+
 class CHASH_CONTEXT(Structure):
     _fields_ = [
-        ('magic', c_uint, 32),
+        ('magic', c_uint),
         ('frozen', c_ubyte),
-        ('targets_count', c_uint, 16),
+        ('targets_count', c_ushort),
         ('targets', POINTER(CHASH_TARGET)),
-        ('items_count', c_uint, 32),
+        ('items_count', c_uint),
         ('continuum', POINTER(CHASH_ITEM)),
         ('lookups', POINTER(CHASH_LOOKUP)),
-        ('lookup', POINTER(c_char_p))]
+        ('lookup', POINTER(c_char_p)),
+        ('stats', c_void_p),
+        ('generation', c_uint),
+        ('cache', c_void_p),
+        ('shm', c_void_p),
+        ('freeze_threads', c_ushort),
+        ('domains', c_void_p),
+        ('down', c_void_p),
+        ('hotkeys', c_void_p),
+        ('allocator', CHASH_ALLOCATOR),
+        ('arena', c_void_p),
+        ('pages', c_ubyte),
+        ('pages_size', c_ulonglong),
+        ('checksum', c_ulonglong),
+        ('checksum_generation', c_uint),
+        ('balance', c_ubyte),
+        ('balance_bias', c_double)]
     
 libchash.chash_add_target.argtypes = [POINTER(CHASH_CONTEXT), c_char_p, c_ubyte]
 libchash.chash_unserialize.argtypes = [POINTER(CHASH_CONTEXT), c_char_p, c_uint]
 libchash.chash_remove_target.argtypes = [POINTER(CHASH_CONTEXT), c_char_p]
+libchash.chash_delta_apply.argtypes = [POINTER(CHASH_CONTEXT), c_char_p, c_uint]
 #libchash.chash_lookup.argtypes = [POINTER(CHASH_CONTEXT), c_char_p, c_uint, pointer(c_char_p)]
 #libchash.chash_lookup_balance.argtypes = [POINTER(CHASH_CONTEXT), c_char_p, c_uint, LP_LP_c_char_p]
 
@@ -43,6 +69,17 @@ CHASH_ERROR_NOT_FOUND = -13
 
 class CHashError(Exception): pass
 
+def chash_bytes(value):
+    # C strings are passed as bytes (str values are encoded as UTF-8 under Python 3)
+    if isinstance(value, bytes):
+        return value
+    return value.encode('utf-8')
+
+def chash_name(value):
+    if str is bytes:
+        return value
+    return value.decode('utf-8', 'surrogateescape')
+
 def chash_return(status, zero_is_none):
     if status == 0 and zero_is_none:
         return None
@@ -73,7 +110,7 @@ class CHash(object):
         libchash.chash_terminate(byref(self._ctx))
 
     def add_target(self, target, weight=1):
-        res = libchash.chash_add_target(byref(self._ctx), target, weight)
+        res = libchash.chash_add_target(byref(self._ctx), chash_bytes(target), weight)
         return chash_return(res, True)
 
     def set_targets(self, targets):
@@ -82,15 +119,15 @@ class CHash(object):
         i = 0
         for target, weight in targets.items():
             try:
-                status = libchash.chash_add_target(byref(self._ctx), target, weight)
-            except ArgumentError, e:
+                status = libchash.chash_add_target(byref(self._ctx), chash_bytes(target), weight)
+            except (ArgumentError, AttributeError):
                 raise TypeError()
             chash_return(status, False)
             i += 1
         return chash_return(self.count_targets(), False)
 
     def remove_target(self, target):
-        status = libchash.chash_remove_target(byref(self._ctx), target)
+        status = libchash.chash_remove_target(byref(self._ctx), chash_bytes(target))
         return chash_return(status, True)
 
     def count_targets(self):
@@ -103,17 +140,17 @@ class CHash(object):
         
     def lookup_balance(self, candidate, count=1):
         target = c_char_p()
-        status = libchash.chash_lookup_balance(byref(self._ctx), candidate, count, byref(target))
+        status = libchash.chash_lookup_balance(byref(self._ctx), chash_bytes(candidate), count, byref(target))
         if status < 0:
             return chash_return(status, True)
-        return target.value
+        return chash_name(target.value)
 
     def lookup_list(self, candidate, count=1):
         targets = pointer(c_char_p())
-        status = libchash.chash_lookup(byref(self._ctx), candidate, count, byref(targets))
+        status = libchash.chash_lookup(byref(self._ctx), chash_bytes(candidate), count, byref(targets))
         if status <= 0:
             return chash_return(status, True)
-        return [targets[i] for i in range(status)]
+        return [chash_name(targets[i]) for i in range(status)]
 
     def serialize(self):
         serialized = pointer(c_char())
@@ -126,10 +163,28 @@ class CHash(object):
         status = libchash.chash_unserialize(byref(self._ctx), serialized, len(serialized))
         return chash_return(status, True)
 
+    def checksum(self):
+        checksum = c_ulonglong()
+        status = libchash.chash_checksum(byref(self._ctx), byref(checksum))
+        if status < 0:
+            return chash_return(status, True)
+        return checksum.value
+
+    def delta(self, base):
+        delta = pointer(c_char())
+        status = libchash.chash_delta(byref(base._ctx), byref(self._ctx), byref(delta))
+        if status < 0:
+            return chash_return(status, True)
+        return delta[:status]
+
+    def apply_delta(self, delta):
+        status = libchash.chash_delta_apply(byref(self._ctx), delta, len(delta))
+        return chash_return(status, True)
+
     def serialize_to_file(self, path):
-        status = libchash.chash_file_serialize(byref(self._ctx), path)
+        status = libchash.chash_file_serialize(byref(self._ctx), chash_bytes(path))
         return chash_return(status, True)
 
     def unserialize_from_file(self, path):
-        status = libchash.chash_file_unserialize(byref(self._ctx), path)
+        status = libchash.chash_file_unserialize(byref(self._ctx), chash_bytes(path))
         return chash_return(status, True)
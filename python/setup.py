@@ -2,7 +2,6 @@
 # -*- coding: utf-8 -*-
 
 from setuptools import setup, Extension
-import commands
 
 chash_ext = Extension(
     name = 'chash',
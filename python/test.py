@@ -2,7 +2,10 @@
 
 import unittest
 import chash
+import array
 import os
+import struct
+import threading
 
 from hashlib import md5
 
@@ -11,51 +14,51 @@ class TestCHash(unittest.TestCase):
 
     def test_add_target(self):
         c = chash.CHash()
-        self.failUnlessEqual(c.add_target("192.168.0.1"), None)
-        self.failUnlessEqual(c.count_targets(), 1)
+        self.assertEqual(c.add_target("192.168.0.1"), None)
+        self.assertEqual(c.count_targets(), 1)
 
     def test_set_targets(self):
         c = chash.CHash()
-        self.failUnlessEqual(c.set_targets({"192.168.0.1" : 2, "192.168.0.2" : 2, "192.168.0.3" : 2,} ), 3)
-        self.failUnlessEqual(c.count_targets(), 3)
+        self.assertEqual(c.set_targets({"192.168.0.1" : 2, "192.168.0.2" : 2, "192.168.0.3" : 2,} ), 3)
+        self.assertEqual(c.count_targets(), 3)
 
-        self.failUnlessRaises(TypeError, c.set_targets, "9")
+        self.assertRaises(TypeError, c.set_targets, "9")
 
-        self.failUnlessRaises(TypeError, c.set_targets, {3 : 2, "192.168.0.2" : 2, "192.168.0.3" : 2,})
+        self.assertRaises(TypeError, c.set_targets, {3 : 2, "192.168.0.2" : 2, "192.168.0.3" : 2,})
 
     def test_clear_targets(self):
         c = chash.CHash()
         c.add_target("192.168.0.1")
         c.add_target("192.168.0.2")
         c.add_target("192.168.0.3")
-        self.failUnlessEqual(c.count_targets(), 3)
-        self.failUnlessEqual(c.clear_targets(), None)
-        self.failUnlessEqual(c.count_targets(), 0)
+        self.assertEqual(c.count_targets(), 3)
+        self.assertEqual(c.clear_targets(), None)
+        self.assertEqual(c.count_targets(), 0)
 
     def test_remove_target(self):
         c = chash.CHash()
         c.add_target("192.168.0.1")
         c.add_target("192.168.0.2")
         c.add_target("192.168.0.3")
-        self.failUnlessEqual(c.count_targets(), 3)
-        self.failUnlessEqual(c.remove_target("192.168.0.1"), None)
-        self.failUnlessEqual(c.count_targets(), 2)
-        self.failUnlessRaises(chash.CHashError, c.remove_target, "192.168.0.1")
-        self.failUnlessEqual(c.count_targets(), 2)
-        self.failUnlessEqual(c.remove_target("192.168.0.2"), None)
-        self.failUnlessEqual(c.count_targets(), 1)
-        self.failUnlessRaises(chash.CHashError, c.remove_target, "192.168.0.2")
-        self.failUnlessEqual(c.count_targets(), 1)
-        self.failUnlessEqual(c.remove_target("192.168.0.3"), None)
-        self.failUnlessEqual(c.count_targets(), 0)
+        self.assertEqual(c.count_targets(), 3)
+        self.assertEqual(c.remove_target("192.168.0.1"), None)
+        self.assertEqual(c.count_targets(), 2)
+        self.assertRaises(chash.CHashError, c.remove_target, "192.168.0.1")
+        self.assertEqual(c.count_targets(), 2)
+        self.assertEqual(c.remove_target("192.168.0.2"), None)
+        self.assertEqual(c.count_targets(), 1)
+        self.assertRaises(chash.CHashError, c.remove_target, "192.168.0.2")
+        self.assertEqual(c.count_targets(), 1)
+        self.assertEqual(c.remove_target("192.168.0.3"), None)
+        self.assertEqual(c.count_targets(), 0)
 
     def test_count_targets(self):
         c = chash.CHash()
-        self.failUnlessEqual(c.count_targets(), 0)
-        self.failUnlessEqual(c.add_target("192.168.0.1"), None)
-        self.failUnlessEqual(c.count_targets(), 1)
-        self.failUnlessEqual(c.add_target("192.168.0.2"), None)
-        self.failUnlessEqual(c.count_targets(), 2)
+        self.assertEqual(c.count_targets(), 0)
+        self.assertEqual(c.add_target("192.168.0.1"), None)
+        self.assertEqual(c.count_targets(), 1)
+        self.assertEqual(c.add_target("192.168.0.2"), None)
+        self.assertEqual(c.count_targets(), 2)
 
     def test_lookup_list(self):
         c = chash.CHash()
@@ -64,13 +67,13 @@ class TestCHash(unittest.TestCase):
         c.add_target("192.168.0.3")
         c.add_target("192.168.0.4")
 
-        self.failUnlessEqual(c.lookup_list("1"), ["192.168.0.1"])
-        self.failUnlessEqual(c.lookup_list("1", 1), ["192.168.0.1"])
-        self.failUnlessEqual(c.lookup_list("1", 2), ["192.168.0.1", "192.168.0.3"])
-        self.failUnlessEqual(c.lookup_list("1", 3), ["192.168.0.1", "192.168.0.3", "192.168.0.2"])
-        self.failUnlessEqual(c.lookup_list("2"), ["192.168.0.1"])
-        self.failUnlessEqual(c.lookup_list("3"), ["192.168.0.4"])
-        self.failUnlessEqual(c.lookup_list("4"), ["192.168.0.4"])
+        self.assertEqual(c.lookup_list("1"), ["192.168.0.1"])
+        self.assertEqual(c.lookup_list("1", 1), ["192.168.0.1"])
+        self.assertEqual(c.lookup_list("1", 2), ["192.168.0.1", "192.168.0.3"])
+        self.assertEqual(c.lookup_list("1", 3), ["192.168.0.1", "192.168.0.3", "192.168.0.2"])
+        self.assertEqual(c.lookup_list("2"), ["192.168.0.1"])
+        self.assertEqual(c.lookup_list("3"), ["192.168.0.4"])
+        self.assertEqual(c.lookup_list("4"), ["192.168.0.4"])
 
     def test_lookup_balance(self):
         c = chash.CHash()
@@ -79,14 +82,14 @@ class TestCHash(unittest.TestCase):
         c.add_target("192.168.0.3")
         c.add_target("192.168.0.4")
 
-        self.failUnlessEqual(c.lookup_balance("1"), "192.168.0.1")
+        self.assertEqual(c.lookup_balance("1"), "192.168.0.1")
 # FIXME
-#        self.failUnlessEqual(c.lookup_balance("1", 1), "192.168.0.1")
-#        self.failUnlessEqual(c.lookup_balance("1", 2), "192.168.0.3")
-#        self.failUnlessEqual(c.lookup_balance("1", 3), "192.168.0.2")
-        self.failUnlessEqual(c.lookup_balance("2"), "192.168.0.1")
-        self.failUnlessEqual(c.lookup_balance("3"), "192.168.0.4")
-        self.failUnlessEqual(c.lookup_balance("4"), "192.168.0.4")
+#        self.assertEqual(c.lookup_balance("1", 1), "192.168.0.1")
+#        self.assertEqual(c.lookup_balance("1", 2), "192.168.0.3")
+#        self.assertEqual(c.lookup_balance("1", 3), "192.168.0.2")
+        self.assertEqual(c.lookup_balance("2"), "192.168.0.1")
+        self.assertEqual(c.lookup_balance("3"), "192.168.0.4")
+        self.assertEqual(c.lookup_balance("4"), "192.168.0.4")
 
     def test_serialize(self):
         c = chash.CHash()
@@ -101,11 +104,11 @@ class TestCHash(unittest.TestCase):
 
         c2 = chash.CHash()
         c2.unserialize(cs)
-        self.failUnlessEqual(c2.count_targets(), 4)
-        self.failUnlessEqual(c2.lookup_balance("1"), "192.168.0.1")
-        self.failUnlessEqual(c2.lookup_balance("2"), "192.168.0.1")
-        self.failUnlessEqual(c2.lookup_balance("3"), "192.168.0.4")
-        self.failUnlessEqual(c2.lookup_balance("4"), "192.168.0.4")
+        self.assertEqual(c2.count_targets(), 4)
+        self.assertEqual(c2.lookup_balance("1"), "192.168.0.1")
+        self.assertEqual(c2.lookup_balance("2"), "192.168.0.1")
+        self.assertEqual(c2.lookup_balance("3"), "192.168.0.4")
+        self.assertEqual(c2.lookup_balance("4"), "192.168.0.4")
 
     def test_serialize_file(self):
         csf = "test.cs"
@@ -116,39 +119,214 @@ class TestCHash(unittest.TestCase):
         c.add_target("192.168.0.3")
         c.add_target("192.168.0.4")
         cs = c.serialize_to_file(csf)
-        self.failUnlessEqual(os.path.exists(csf), True)
+        self.assertEqual(os.path.exists(csf), True)
 
         c2 = chash.CHash()
         c2.unserialize_from_file(csf)
         os.remove(csf)
-        self.failUnlessEqual(c2.count_targets(), 4)
-        self.failUnlessEqual(c2.lookup_balance("1"), "192.168.0.1")
-        self.failUnlessEqual(c2.lookup_balance("2"), "192.168.0.1")
-        self.failUnlessEqual(c2.lookup_balance("3"), "192.168.0.4")
-        self.failUnlessEqual(c2.lookup_balance("4"), "192.168.0.4")
+        self.assertEqual(c2.count_targets(), 4)
+        self.assertEqual(c2.lookup_balance("1"), "192.168.0.1")
+        self.assertEqual(c2.lookup_balance("2"), "192.168.0.1")
+        self.assertEqual(c2.lookup_balance("3"), "192.168.0.4")
+        self.assertEqual(c2.lookup_balance("4"), "192.168.0.4")
 
     def test_usage(self):
         c = chash.CHash()
         c.add_target("192.168.0.1")
         c.add_target("192.168.0.2")
-        self.failUnlessEqual(c.lookup_balance("1"), "192.168.0.1")
+        self.assertEqual(c.lookup_balance("1"), "192.168.0.1")
 
         c.add_target("192.168.0.3")
-        self.failUnlessEqual(c.lookup_balance("9"), "192.168.0.3")
+        self.assertEqual(c.lookup_balance("9"), "192.168.0.3")
 
         c.remove_target("192.168.0.3")
-        self.failUnlessEqual(c.lookup_balance("9"), "192.168.0.1")
+        self.assertEqual(c.lookup_balance("9"), "192.168.0.1")
 
         c.remove_target("192.168.0.1")
-        self.failUnlessEqual(c.lookup_balance("9"), "192.168.0.2")
+        self.assertEqual(c.lookup_balance("9"), "192.168.0.2")
 
         c.remove_target("192.168.0.2")
-        self.failUnlessRaises(chash.CHashError, c.lookup_balance, "9")
+        self.assertRaises(chash.CHashError, c.lookup_balance, "9")
 
         c.add_target("192.168.0.2")
         c.add_target("192.168.0.1")
-        self.failUnlessEqual(c.lookup_balance("9"), "192.168.0.1")
+        self.assertEqual(c.lookup_balance("9"), "192.168.0.1")
 
+    def test_stats(self):
+        c = chash.CHash()
+        c.add_target("192.168.0.1")
+        c.add_target("192.168.0.2")
+        self.assertRaises(chash.CHashError, c.get_stats)
+        self.assertEqual(c.enable_stats(2), None)
+        c.lookup_list("1", 2)
+        c.lookup_balance("2")
+        stats = c.get_stats()
+        self.assertEqual(stats["lookups"], 2)
+        self.assertEqual(stats["balance_lookups"], 1)
+        self.assertEqual(stats["freezes"], 1)
+        self.assertEqual(stats["continuum_size"], 2 * 128 * 6)
+        self.assertEqual(sum(stats["selections"].values()), 3)
+        self.assertEqual(len(stats["freeze_histogram"]), 24)
+
+    def test_cache(self):
+        c = chash.CHash()
+        c.add_target("192.168.0.1")
+        c.add_target("192.168.0.2")
+        self.assertRaises(chash.CHashError, c.get_cache_stats)
+        self.assertEqual(c.enable_cache(64), None)
+        targets = c.lookup_list("1", 2)
+        self.assertEqual(c.lookup_list("1", 2), targets)
+        self.assertEqual(c.lookup_list("1", 1), targets[:1])
+        stats = c.get_cache_stats()
+        self.assertEqual(stats["entries"], 64)
+        self.assertEqual(stats["used"], 1)
+        self.assertEqual(stats["hits"], 2)
+        self.assertEqual(stats["misses"], 1)
+        c.add_target("192.168.0.3")
+        c.lookup_list("1", 2)
+        self.assertEqual(c.get_cache_stats()["misses"], 2)
+
+    def test_hotkeys(self):
+        c = chash.CHash()
+        for index in range(10):
+            c.add_target("192.168.0.%d" % index)
+        self.assertRaises(chash.CHashError, c.get_hotkeys)
+        self.assertEqual(c.enable_hotkeys(50, 4), None)
+        replicas = c.lookup_list("video:x7hot", 4)
+        targets = set()
+        for index in range(500):
+            targets.add(c.lookup_balance("video:x7hot", 1))
+            c.lookup_list("candidate%d" % index)
+        self.assertTrue(len(targets) > 1 and targets <= set(replicas))
+        hotkeys = c.get_hotkeys()
+        self.assertEqual(list(hotkeys["keys"].keys()), ["video:x7hot"])
+        self.assertEqual(hotkeys["spread"], 4)
+        self.assertEqual(hotkeys["observed"], 1001)
+        self.assertEqual(hotkeys["spread_lookups"], 500 - 48)
+        self.assertEqual(c.enable_hotkeys(0), None)
+        self.assertRaises(chash.CHashError, c.get_hotkeys)
+
+    def test_balance_order(self):
+        c = chash.CHash()
+        c.add_target("heavy", 100)
+        c.add_target("light", 10)
+        self.assertRaises(TypeError, c.set_balance_mode, 2)
+        self.assertRaises(TypeError, c.set_balance_mode, chash.BALANCE_WEIGHTED, -1.0)
+        self.assertEqual(c.set_balance_mode(chash.BALANCE_WEIGHTED), None)
+        heavy = 0
+        for seed in range(1000):
+            order = c.lookup_balance_order("candidate", 2, seed)
+            self.assertEqual(sorted(order), ["heavy", "light"])
+            self.assertEqual(order, c.lookup_balance_order("candidate", 2, seed))
+            heavy += order[0] == "heavy"
+        self.assertTrue(850 < heavy < 960)
+
+    def test_rebalance(self):
+        c = chash.CHash()
+        for index in range(10):
+            c.add_target("192.168.0.%d" % index, 10)
+        keys = ["candidate%d" % index for index in range(10000)]
+        self.assertEqual(c.set_target_points("192.168.0.0", 1000), None)
+        self.assertRaises(chash.CHashError, c.set_target_points, "192.168.1.0", 1000)
+        before = [c.lookup_list(key)[0] for key in keys]
+        loads = dict(("192.168.0.%d" % index, 1.0) for index in range(10))
+        loads["192.168.0.1"] = 2.0
+        moved = c.rebalance(loads, 0.5, 0.2, 0.01)
+        self.assertTrue(0 < moved <= 12800 // 100)
+        after = [c.lookup_list(key)[0] for key in keys]
+        changed = sum(1 for index in range(len(keys)) if before[index] != after[index])
+        self.assertTrue(0 < changed < len(keys) * 0.05)
+        self.assertTrue(after.count("192.168.0.1") < before.count("192.168.0.1"))
+        self.assertRaises(chash.CHashError, c.rebalance, loads, 0.5, 0.2, 2.0)
+
+    def test_delta(self):
+        base, changed, copy = chash.CHash(), chash.CHash(), chash.CHash()
+        for index in range(10):
+            base.add_target("192.168.0.%d" % index, 10)
+            changed.add_target("192.168.0.%d" % index, 10)
+        copy.unserialize(base.serialize())
+        self.assertEqual(copy.checksum(), base.checksum())
+        changed.remove_target("192.168.0.3")
+        changed.add_target("192.168.1.0", 5)
+        changed.set_target_points("192.168.0.5", 1000)
+        delta = changed.delta(base)
+        self.assertTrue(len(delta) < len(changed.serialize()) // 5)
+        self.assertRaises(TypeError, changed.delta, "base")
+        self.assertEqual(copy.apply_delta(delta), 9 * 1280 + 640 - 280)
+        self.assertEqual(copy.checksum(), changed.checksum())
+        self.assertEqual(copy.serialize(), changed.serialize())
+        keys = ["candidate%d" % index for index in range(1000)]
+        self.assertEqual([copy.lookup_list(key, 2) for key in keys], [changed.lookup_list(key, 2) for key in keys])
+        self.assertRaises(chash.CHashError, copy.apply_delta, delta)
+
+    def test_names(self):
+        c = chash.CHash()
+        c.add_target("192.168.0.1")
+        c.add_target("192.168.0.2")
+        self.assertTrue(c.lookup_list("1")[0] is c.lookup_balance("1"))
+        self.assertEqual(c.lookup_list(b"1"), c.lookup_list("1"))
+        self.assertRaises(TypeError, c.lookup_list, 1)
+        self.assertRaises(TypeError, c.lookup_list)
+        self.assertEqual(c.lookup_list("1", 0), c.lookup_list("1"))
+        self.assertEqual(len(c.lookup_list("1", 100)), 2)
+
+    def test_lookup_batch(self):
+        c = chash.CHash()
+        for index in range(100):
+            c.add_target("192.168.0.%d" % index)
+        keys = ["candidate%d" % index for index in range(3000)]
+        indexes, names = c.lookup_batch(keys, 3)
+        self.assertEqual(len(indexes), len(keys) * 3)
+        for index, key in enumerate(keys):
+            self.assertEqual([names[target] for target in indexes[index * 3:index * 3 + 3]], c.lookup_list(key, 3))
+
+        indexes, names = c.lookup_batch(b"".join(key.encode("ascii").ljust(16, b"\0") for key in keys), 2, width=16)
+        self.assertEqual([names[target] for target in indexes[:2]], c.lookup_list(keys[0], 2))
+        self.assertEqual([names[target] for target in indexes[-2:]], c.lookup_list(keys[-1], 2))
+
+        indexes, names = c.lookup_batch(bytearray(b"12"), width=1)
+        self.assertEqual([names[target] for target in indexes], c.lookup_list("1") + c.lookup_list("2"))
+
+        if hasattr(memoryview, "cast"):
+            integers = [0, 1, 12345, 2 ** 64 - 1]
+            indexes, names = c.lookup_batch(memoryview(struct.pack("=4Q", *integers)).cast("Q"))
+            self.assertEqual([names[target] for target in indexes], [c.lookup_list(str(key))[0] for key in integers])
+            indexes, names = c.lookup_batch(memoryview(struct.pack("=2q", -1, 5)).cast("q"))
+            self.assertEqual([names[target] for target in indexes], c.lookup_list("-1") + c.lookup_list("5"))
+
+        indexes, names = c.lookup_batch([b"", "candidate1"], 2)
+        self.assertEqual(list(indexes[:2]), [chash.NO_TARGET, chash.NO_TARGET])
+        self.assertEqual(len(c.lookup_batch([], 1)[0]), 0)
+        self.assertRaises(TypeError, c.lookup_batch, [1, 2])
+        self.assertRaises(TypeError, c.lookup_batch, "candidate")
+        self.assertRaises(TypeError, c.lookup_batch, b"candidate")
+
+    def test_threads(self):
+        c = chash.CHash()
+        for index in range(100):
+            c.add_target("192.168.0.%d" % index)
+        names = set("192.168.%d.%d" % (network, index) for network in range(2) for index in range(100))
+        errors = []
+
+        def lookups():
+            for index in range(2000):
+                targets = c.lookup_list("candidate%d" % index, 3)
+                if len(set(targets)) != 3 or not names.issuperset(targets):
+                    errors.append(targets)
+                if c.lookup_balance("candidate%d" % index, 3) not in names:
+                    errors.append(index)
+
+        expected = [c.lookup_list("candidate%d" % index, 3) for index in range(2000)]
+        threads = [threading.Thread(target=lookups) for index in range(4)]
+        for thread in threads:
+            thread.start()
+        for index in range(20):
+            c.add_target("192.168.1.%d" % index)
+            c.remove_target("192.168.1.%d" % index)
+        for thread in threads:
+            thread.join()
+        self.assertEqual(errors, [])
+        self.assertEqual([c.lookup_list("candidate%d" % index, 3) for index in range(2000)], expected)
 
 if __name__ == '__main__':
     unittest.main()